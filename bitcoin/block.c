@@ -1,7 +1,9 @@
 #include "bitcoin/block.h"
 #include "bitcoin/pullpush.h"
 #include "bitcoin/tx.h"
+#include <ccan/cast/cast.h>
 #include <ccan/str/hex/hex.h>
+#include <string.h>
 
 /* Encoding is <blockhdr> <varint-num-txs> <tx>... */
 struct bitcoin_block *bitcoin_block_from_hex(const tal_t *ctx,
@@ -38,6 +40,52 @@ struct bitcoin_block *bitcoin_block_from_hex(const tal_t *ctx,
 	return b;
 }
 
+struct bitcoin_rawblock *bitcoin_rawblock_from_bytes(const tal_t *ctx,
+						     const u8 *bytes TAKES,
+						     size_t len)
+{
+	struct bitcoin_rawblock *b = tal(ctx, struct bitcoin_rawblock);
+	const u8 *p = bytes;
+	u8 *txs;
+
+	b->filter = NULL;
+	pull(&p, &len, &b->hdr, sizeof(b->hdr));
+	b->num_txs = pull_varint(&p, &len);
+	if (!p) {
+		if (taken(bytes))
+			tal_free(bytes);
+		return tal_free(b);
+	}
+
+	/* If we own it, slide txs down over the header rather than copy. */
+	if (taken(bytes)) {
+		txs = tal_steal(b, cast_const(u8 *, bytes));
+		memmove(txs, p, len);
+		tal_resize(&txs, len);
+	} else
+		txs = tal_dup_arr(b, u8, p, len, 0);
+	b->txs = txs;
+	return b;
+}
+
+struct bitcoin_rawblock *bitcoin_rawblock_from_hex(const tal_t *ctx,
+						   const char *hex,
+						   size_t hexlen)
+{
+	u8 *linear;
+	size_t len;
+
+	if (hexlen && hex[hexlen-1] == '\n')
+		hexlen--;
+
+	len = hex_data_size(hexlen);
+	linear = tal_arr(ctx, u8, len);
+	if (!hex_decode(hex, hexlen, linear, len))
+		return tal_free(linear);
+
+	return bitcoin_rawblock_from_bytes(ctx, take(linear), len);
+}
+
 bool bitcoin_blkid_from_hex(const char *hexstr, size_t hexstr_len,
 			    struct sha256_double *blockid)
 {
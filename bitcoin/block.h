@@ -4,6 +4,7 @@
 #include "bitcoin/shadouble.h"
 #include <ccan/endian/endian.h>
 #include <ccan/short_types/short_types.h>
+#include <ccan/take/take.h>
 #include <ccan/tal/tal.h>
 #include <stdbool.h>
 
@@ -25,6 +26,27 @@ struct bitcoin_block {
 struct bitcoin_block *bitcoin_block_from_hex(const tal_t *ctx,
 					     const char *hex, size_t hexlen);
 
+/* A block whose transactions we haven't parsed: walk them with
+ * pull_bitcoin_txid, and only pull_bitcoin_tx the ones you want. */
+struct bitcoin_rawblock {
+	struct bitcoin_block_hdr hdr;
+	u64 num_txs;
+	/* Linearized transactions, back to back (tal_count is length). */
+	const u8 *txs;
+	/* If we only fetched the header (num_txs is 0), the BIP158 filter
+	 * which said we could. */
+	const u8 *filter;
+};
+
+struct bitcoin_rawblock *bitcoin_rawblock_from_hex(const tal_t *ctx,
+						   const char *hex,
+						   size_t hexlen);
+
+/* Same, from the binary block (eg. from bitcoind's REST interface). */
+struct bitcoin_rawblock *bitcoin_rawblock_from_bytes(const tal_t *ctx,
+						     const u8 *bytes TAKES,
+						     size_t len);
+
 /* Parse hex string to get blockid (reversed, a-la bitcoind). */
 bool bitcoin_blkid_from_hex(const char *hexstr, size_t hexstr_len,
 			    struct sha256_double *blockid);
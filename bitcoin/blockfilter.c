@@ -0,0 +1,212 @@
+#include "bitcoin/blockfilter.h"
+#include "bitcoin/pullpush.h"
+#include <ccan/asort/asort.h>
+#include <ccan/crypto/siphash24/siphash24.h>
+#include <ccan/endian/endian.h>
+#include <ccan/mem/mem.h>
+#include <string.h>
+
+/* BIP158 basic filter Golomb-Rice parameters. */
+#define BASIC_FILTER_P 19
+#define BASIC_FILTER_M 784931
+
+#define OP_RETURN 0x6a
+
+/* The SipHash key is the first 16 bytes of the block hash. */
+static void filter_key(struct siphash_seed *seed,
+		       const struct sha256_double *blkid)
+{
+	le64 k[2];
+
+	memcpy(k, blkid, sizeof(k));
+	seed->u.u64[0] = le64_to_cpu(k[0]);
+	seed->u.u64[1] = le64_to_cpu(k[1]);
+}
+
+/* (a * b) >> 64, without needing 128-bit types. */
+static u64 mul_hi64(u64 a, u64 b)
+{
+	u64 a_lo = (u32)a, a_hi = a >> 32, b_lo = (u32)b, b_hi = b >> 32;
+	u64 lo_lo = a_lo * b_lo, hi_lo = a_hi * b_lo;
+	u64 lo_hi = a_lo * b_hi, hi_hi = a_hi * b_hi;
+	u64 cross = (lo_lo >> 32) + (u32)hi_lo + lo_hi;
+
+	return (hi_lo >> 32) + (cross >> 32) + hi_hi;
+}
+
+/* Map the siphash uniformly into [0, f). */
+static u64 hash_to_range(const struct siphash_seed *seed, const u8 *item,
+			 u64 f)
+{
+	return mul_hi64(siphash24(seed, item, tal_len(item)), f);
+}
+
+static int cmp_u64(const u64 *a, const u64 *b, void *unused)
+{
+	if (*a < *b)
+		return -1;
+	return *a > *b;
+}
+
+static u64 *hashed_set(const tal_t *ctx, const struct siphash_seed *seed,
+		       const u8 **items, size_t n, u64 f)
+{
+	u64 *hashes = tal_arr(ctx, u64, n);
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		hashes[i] = hash_to_range(seed, items[i], f);
+	asort(hashes, n, cmp_u64, NULL);
+	return hashes;
+}
+
+static void push_bit(u8 **filter, size_t *nbits, bool bit)
+{
+	size_t len = tal_count(*filter);
+
+	if (*nbits % 8 == 0) {
+		tal_resize(filter, len + 1);
+		(*filter)[len++] = 0;
+	}
+	if (bit)
+		(*filter)[len - 1] |= 0x80 >> (*nbits % 8);
+	(*nbits)++;
+}
+
+/* Quotient in unary, then the remainder in P bits, MSB first. */
+static void push_golomb(u8 **filter, size_t *nbits, u64 delta)
+{
+	u64 q;
+	int i;
+
+	for (q = delta >> BASIC_FILTER_P; q; q--)
+		push_bit(filter, nbits, true);
+	push_bit(filter, nbits, false);
+	for (i = BASIC_FILTER_P - 1; i >= 0; i--)
+		push_bit(filter, nbits, (delta >> i) & 1);
+}
+
+struct bitreader {
+	const u8 *p;
+	size_t len, bit;
+};
+
+static bool pull_bit(struct bitreader *r, bool *bit)
+{
+	if (r->bit == r->len * 8)
+		return false;
+	*bit = r->p[r->bit / 8] & (0x80 >> (r->bit % 8));
+	r->bit++;
+	return true;
+}
+
+static bool pull_golomb(struct bitreader *r, u64 *delta)
+{
+	u64 q = 0, rem = 0;
+	bool bit;
+	int i;
+
+	for (;;) {
+		if (!pull_bit(r, &bit))
+			return false;
+		if (!bit)
+			break;
+		q++;
+	}
+	for (i = 0; i < BASIC_FILTER_P; i++) {
+		if (!pull_bit(r, &bit))
+			return false;
+		rem = (rem << 1) | bit;
+	}
+	*delta = (q << BASIC_FILTER_P) + rem;
+	return true;
+}
+
+/* Empty scripts and OP_RETURN outputs are left out. */
+bool blockfilter_has_script(const u8 *script)
+{
+	return tal_len(script) != 0 && script[0] != OP_RETURN;
+}
+
+static bool item_eq(const u8 *a, const u8 *b)
+{
+	return memeq(a, tal_len(a), b, tal_len(b));
+}
+
+u8 *blockfilter_build(const tal_t *ctx, const struct sha256_double *blkid,
+		      const u8 **items)
+{
+	struct siphash_seed seed;
+	const u8 **set = tal_arr(ctx, const u8 *, 0);
+	u8 *filter = tal_arr(ctx, u8, 0);
+	size_t i, j, n = 0, nbits;
+	u64 *hashes, last = 0;
+
+	/* It's a set: no duplicates. */
+	for (i = 0; i < tal_count(items); i++) {
+		for (j = 0; j < n; j++)
+			if (item_eq(set[j], items[i]))
+				break;
+		if (j == n) {
+			tal_resize(&set, n + 1);
+			set[n++] = items[i];
+		}
+	}
+
+	filter_key(&seed, blkid);
+	hashes = hashed_set(ctx, &seed, set, n, (u64)n * BASIC_FILTER_M);
+
+	push_varint(n, push, &filter);
+	nbits = tal_count(filter) * 8;
+	for (i = 0; i < n; i++) {
+		push_golomb(&filter, &nbits, hashes[i] - last);
+		last = hashes[i];
+	}
+
+	tal_free(hashes);
+	tal_free(set);
+	return filter;
+}
+
+bool blockfilter_match_any(const u8 *filter, size_t len,
+			   const struct sha256_double *blkid,
+			   const u8 **items)
+{
+	struct siphash_seed seed;
+	struct bitreader r;
+	u64 n, i, value = 0, delta, *query;
+	size_t j = 0, nq = tal_count(items);
+	bool match = false;
+
+	r.p = filter;
+	r.len = len;
+	n = pull_varint(&r.p, &r.len);
+	/* Each one takes at least P+1 bits. */
+	if (!r.p || n > r.len * 8 / (BASIC_FILTER_P + 1))
+		return true;
+	if (n == 0 || nq == 0)
+		return false;
+	r.bit = 0;
+
+	filter_key(&seed, blkid);
+	query = hashed_set(NULL, &seed, items, nq, n * BASIC_FILTER_M);
+
+	/* Both are sorted, so walk them together. */
+	for (i = 0; i < n; i++) {
+		if (!pull_golomb(&r, &delta)) {
+			match = true;
+			break;
+		}
+		value += delta;
+		while (j < nq && query[j] < value)
+			j++;
+		if (j == nq)
+			break;
+		if (query[j] == value) {
+			match = true;
+			break;
+		}
+	}
+	tal_free(query);
+	return match;
+}
@@ -0,0 +1,26 @@
+#ifndef LIGHTNING_BITCOIN_BLOCKFILTER_H
+#define LIGHTNING_BITCOIN_BLOCKFILTER_H
+#include "config.h"
+#include "bitcoin/shadouble.h"
+#include <ccan/short_types/short_types.h>
+#include <ccan/tal/tal.h>
+#include <stdbool.h>
+
+/* BIP158 basic filters: a Golomb-coded set of the (non-empty, non
+ * OP_RETURN) scriptPubKeys a block creates, and those it spends. */
+
+/* Does a basic filter include this output script? */
+bool blockfilter_has_script(const u8 *script);
+
+/* Make a filter from these (tal) items, for this block.  bitcoind makes
+ * the real ones; this is for testing. */
+u8 *blockfilter_build(const tal_t *ctx, const struct sha256_double *blkid,
+		      const u8 **items);
+
+/* Could any of these (tal) items be in this block?  False positives happen
+ * (about 1 in 784931 per item), false negatives don't.  A malformed filter
+ * matches everything. */
+bool blockfilter_match_any(const u8 *filter, size_t len,
+			   const struct sha256_double *blkid,
+			   const u8 **items);
+#endif /* LIGHTNING_BITCOIN_BLOCKFILTER_H */
@@ -0,0 +1,182 @@
+#include "bitcoin/block.c"
+#include "bitcoin/pullpush.c"
+#include "bitcoin/shadouble.c"
+#include "bitcoin/tx.c"
+#include "bitcoin/varint.c"
+#include "utils.c"
+#include <assert.h>
+#include <ccan/err/err.h>
+#include <ccan/str/hex/hex.h>
+#include <ccan/structeq/structeq.h>
+#include <ccan/tal/grab_file/grab_file.h>
+#include <ccan/tal/str/str.h>
+#include <ccan/time/time.h>
+#include <stdio.h>
+
+/* From run-tx-encode.c: one segwit input, one output. */
+static const char extended_tx[] = "02000000000101b5bef485c41d0d1f58d1e8a561924ece5c476d86cff063ea10c8df06136eb31d00000000171600144aa38e396e1394fb45cbf83f48d1464fbc9f498fffffffff0140330f000000000017a9140580ba016669d3efaf09a0b2ec3954469ea2bf038702483045022100f2abf9e9cf238c66533af93f23937eae8ac01fb6f105a00ab71dbefb9637dc9502205c1ac745829b3f6889607961f5d817dfa0c8f52bdda12e837c4f7b162f6db8a701210204096eb817f7efb414ef4d3d8be39dd04374256d3b054a322d4a6ee22736d03b00000000";
+
+/* Header, 3 txs: segwit, the same without witness, and segwit again. */
+static char *block_hex(const tal_t *ctx, const char *legacy_tx)
+{
+	return tal_fmt(ctx, "%0160x" "03" "%s%s%s",
+		       0, extended_tx, legacy_tx, extended_tx);
+}
+
+static void scan_block(const struct bitcoin_rawblock *raw)
+{
+	const u8 *p = raw->txs;
+	size_t i, len = tal_count(raw->txs);
+	struct sha256_double txid;
+
+	for (i = 0; i < raw->num_txs; i++)
+		assert(pull_bitcoin_txid(&p, &len, &txid, NULL));
+	assert(len == 0);
+}
+
+static double msec_since(struct timeabs start)
+{
+	return time_to_nsec(time_between(time_now(), start)) / 1000000.0;
+}
+
+/* Give it saved blocks to benchmark, as bitcoind's REST interface gives
+ * them, eg. "run-block_scan block.bin..." after
+ * "curl -o block.bin http://127.0.0.1:8332/rest/block/<hash>.bin" */
+static void benchmark(const char *file)
+{
+	tal_t *tmpctx = tal_tmpctx(NULL);
+	u8 *bin;
+	char *hex;
+	struct timeabs start;
+	struct bitcoin_block *full;
+	struct bitcoin_rawblock *raw;
+	double full_hex, scan_hex, scan_bin;
+	struct sha256_double txid;
+	size_t i;
+
+	bin = (u8 *)grab_file(tmpctx, file);
+	if (!bin)
+		err(1, "Reading %s", file);
+	/* grab_file adds a nul terminator. */
+	tal_resize(&bin, tal_count(bin) - 1);
+	hex = tal_hex(tmpctx, bin);
+
+	/* What we used to do: parse every tx out of the hex, and hash it. */
+	start = time_now();
+	full = bitcoin_block_from_hex(tmpctx, hex, strlen(hex));
+	if (!full)
+		errx(1, "Bad block %s", file);
+	for (i = 0; i < tal_count(full->tx); i++)
+		bitcoin_txid(full->tx[i], &txid);
+	full_hex = msec_since(start);
+
+	start = time_now();
+	raw = bitcoin_rawblock_from_hex(tmpctx, hex, strlen(hex));
+	scan_block(raw);
+	scan_hex = msec_since(start);
+
+	start = time_now();
+	raw = bitcoin_rawblock_from_bytes(tmpctx, take(bin), tal_count(bin));
+	scan_block(raw);
+	scan_bin = msec_since(start);
+
+	printf("%s: %zu txs, %zu bytes: parse hex %.2fms,"
+	       " scan hex %.2fms, scan binary %.2fms\n",
+	       file, tal_count(full->tx), tal_count(raw->txs),
+	       full_hex, scan_hex, scan_bin);
+	tal_free(tmpctx);
+}
+
+int main(int argc, char *argv[])
+{
+	tal_t *ctx = tal_tmpctx(NULL);
+	struct bitcoin_tx *tx, *txs[3];
+	struct bitcoin_block *full;
+	struct bitcoin_rawblock *raw;
+	struct bitcoin_outpoint *spends = tal_arr(ctx, struct bitcoin_outpoint, 0);
+	struct sha256_double txid, expect;
+	char *hex;
+	const u8 *p;
+	size_t i, j, len;
+
+	/* Strip the witness for a pre-segwit encoding. */
+	tx = bitcoin_tx_from_hex(ctx, extended_tx, strlen(extended_tx));
+	assert(tx);
+	for (i = 0; i < tal_count(tx->input); i++)
+		tx->input[i].witness = NULL;
+	hex = block_hex(ctx, tal_hex(ctx, linearize_tx(ctx, tx)));
+
+	full = bitcoin_block_from_hex(ctx, hex, strlen(hex));
+	assert(full);
+	assert(tal_count(full->tx) == 3);
+	raw = bitcoin_rawblock_from_hex(ctx, hex, strlen(hex));
+	assert(raw);
+	assert(raw->num_txs == 3);
+	assert(structeq(&raw->hdr, &full->hdr));
+
+	/* Scanning gives the same txids and spends as parsing. */
+	p = raw->txs;
+	len = tal_count(raw->txs);
+	for (i = 0; i < raw->num_txs; i++) {
+		const u8 *start = p;
+		size_t txlen;
+
+		assert(pull_bitcoin_txid(&p, &len, &txid, &spends));
+		bitcoin_txid(full->tx[i], &expect);
+		assert(structeq(&txid, &expect));
+		assert(tal_count(spends) == tal_count(full->tx[i]->input));
+		for (j = 0; j < tal_count(spends); j++) {
+			assert(structeq(&spends[j].txid,
+					&full->tx[i]->input[j].txid));
+			assert(spends[j].index == full->tx[i]->input[j].index);
+		}
+
+		/* We can pull out just the one we want. */
+		txlen = p - start;
+		txs[i] = pull_bitcoin_tx(ctx, &start, &txlen);
+		assert(txs[i] && txlen == 0 && start == p);
+		bitcoin_txid(txs[i], &expect);
+		assert(structeq(&txid, &expect));
+	}
+	assert(len == 0);
+
+	/* Segwit or not, same txid. */
+	bitcoin_txid(txs[0], &expect);
+	bitcoin_txid(txs[1], &txid);
+	assert(structeq(&txid, &expect));
+
+	/* Don't need to know spends. */
+	p = raw->txs;
+	len = tal_count(raw->txs);
+	assert(pull_bitcoin_txid(&p, &len, &txid, NULL));
+	assert(structeq(&txid, &expect));
+
+	/* Truncated anywhere fails. */
+	p = raw->txs;
+	len = tal_count(raw->txs);
+	assert(pull_bitcoin_txid(&p, &len, &txid, NULL));
+	for (i = 0; i < tal_count(raw->txs) - len; i++) {
+		size_t max = i;
+
+		p = raw->txs;
+		assert(!pull_bitcoin_txid(&p, &max, &txid, &spends));
+	}
+
+	/* Binary is the same as hex. */
+	raw = bitcoin_rawblock_from_bytes(ctx,
+					  tal_hexdata(ctx, hex, strlen(hex)),
+					  strlen(hex) / 2);
+	assert(raw);
+	assert(raw->num_txs == 3);
+	assert(structeq(&raw->hdr, &full->hdr));
+	p = bitcoin_rawblock_from_hex(ctx, hex, strlen(hex))->txs;
+	assert(memeq(raw->txs, tal_count(raw->txs), p, tal_count(p)));
+	assert(!bitcoin_rawblock_from_bytes(ctx, take(tal_arr(NULL, u8, 80)),
+					    80));
+
+	for (i = 1; i < argc; i++)
+		benchmark(argv[i]);
+
+	tal_free(ctx);
+	return 0;
+}
@@ -0,0 +1,116 @@
+#include "bitcoin/block.c"
+#include "bitcoin/blockfilter.c"
+#include "bitcoin/pullpush.c"
+#include "bitcoin/shadouble.c"
+#include "bitcoin/tx.c"
+#include "bitcoin/varint.c"
+#include "utils.c"
+#include <assert.h>
+#include <ccan/str/hex/hex.h>
+
+/* From run-tx-encode.c: a P2SH-P2WPKH spend, paying to P2SH. */
+static const char extended_tx[] = "02000000000101b5bef485c41d0d1f58d1e8a561924ece5c476d86cff063ea10c8df06136eb31d00000000171600144aa38e396e1394fb45cbf83f48d1464fbc9f498fffffffff0140330f000000000017a9140580ba016669d3efaf09a0b2ec3954469ea2bf038702483045022100f2abf9e9cf238c66533af93f23937eae8ac01fb6f105a00ab71dbefb9637dc9502205c1ac745829b3f6889607961f5d817dfa0c8f52bdda12e837c4f7b162f6db8a701210204096eb817f7efb414ef4d3d8be39dd04374256d3b054a322d4a6ee22736d03b00000000";
+
+/* A P2WPKH-looking script, different for each n. */
+static u8 *script(const tal_t *ctx, u8 n)
+{
+	u8 *s = tal_arr(ctx, u8, 22);
+
+	s[0] = 0x00;
+	s[1] = 0x14;
+	memset(s + 2, n, 20);
+	return s;
+}
+
+static const u8 **scripts(const tal_t *ctx, u8 from, u8 to)
+{
+	const u8 **s = tal_arr(ctx, const u8 *, 0);
+	size_t n = 0;
+
+	while (from < to) {
+		tal_resize(&s, n + 1);
+		s[n++] = script(s, from++);
+	}
+	return s;
+}
+
+int main(void)
+{
+	tal_t *ctx = tal_tmpctx(NULL);
+	struct sha256_double blkid;
+	const u8 **items, **none;
+	struct bitcoin_tx *tx;
+	u8 *filter;
+	size_t i;
+
+	/* BIP158 test vector: testnet genesis block, whose only script is
+	 * the coinbase output. */
+	assert(bitcoin_blkid_from_hex("000000000933ea01ad0ee984209779baaec3ced90fa3f408719526f8d77f4943", 64, &blkid));
+	items = tal_arr(ctx, const u8 *, 1);
+	items[0] = tal_hexdata(items, "4104678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5fac", 134);
+	filter = blockfilter_build(ctx, &blkid, items);
+	assert(streq(tal_hex(ctx, filter), "019dfca8"));
+	assert(blockfilter_match_any(filter, tal_len(filter), &blkid, items));
+
+	/* Duplicates only count once. */
+	for (i = 0; i < 32; i++)
+		blkid.sha.u.u8[i] = i;
+	items = scripts(ctx, 0, 10);
+	tal_resize(&items, 11);
+	items[10] = script(items, 3);
+	filter = blockfilter_build(ctx, &blkid, items);
+	assert(streq(tal_hex(ctx, filter),
+		     "0a551a2a805235fc11974c875a8cc05d327f3e1954707f9dead456"));
+
+	/* Each one matches, as does a set including one. */
+	for (i = 0; i < 10; i++)
+		assert(blockfilter_match_any(filter, tal_len(filter), &blkid,
+					     scripts(ctx, i, i + 1)));
+	assert(blockfilter_match_any(filter, tal_len(filter), &blkid,
+				     scripts(ctx, 9, 200)));
+	/* Those not in it don't (for these, anyway). */
+	none = scripts(ctx, 10, 200);
+	assert(!blockfilter_match_any(filter, tal_len(filter), &blkid, none));
+	/* Nor does anything for a different block. */
+	blkid.sha.u.u8[0]++;
+	assert(!blockfilter_match_any(filter, tal_len(filter), &blkid,
+				      scripts(ctx, 0, 1)));
+
+	/* Empty filter, or empty query, never match. */
+	filter = blockfilter_build(ctx, &blkid, scripts(ctx, 0, 0));
+	assert(tal_len(filter) == 1);
+	assert(!blockfilter_match_any(filter, tal_len(filter), &blkid, none));
+	filter = blockfilter_build(ctx, &blkid, none);
+	assert(!blockfilter_match_any(filter, tal_len(filter), &blkid,
+				      scripts(ctx, 0, 0)));
+
+	/* A block with that tx: its filter has its output, and the one
+	 * it spends (which we pretend was a P2WPKH). */
+	tx = bitcoin_tx_from_hex(ctx, extended_tx, strlen(extended_tx));
+	items = tal_arr(ctx, const u8 *, 3);
+	items[0] = tx->output[0].script;
+	items[1] = script(items, 77);
+	/* OP_RETURN outputs don't go in. */
+	items[2] = tal_hexdata(items, "6a0100", 6);
+	assert(blockfilter_has_script(items[0]));
+	assert(!blockfilter_has_script(items[2]));
+	assert(!blockfilter_has_script(tal_arr(items, u8, 0)));
+	tal_resize(&items, 2);
+	filter = blockfilter_build(ctx, &blkid, items);
+
+	/* Watching the tx (by its outputs) or the spent one: match. */
+	assert(blockfilter_match_any(filter, tal_len(filter), &blkid,
+				     tal_dup_arr(ctx, const u8 *, items, 1, 0)));
+	assert(blockfilter_match_any(filter, tal_len(filter), &blkid,
+				     scripts(ctx, 77, 78)));
+	assert(!blockfilter_match_any(filter, tal_len(filter), &blkid,
+				      scripts(ctx, 78, 200)));
+
+	/* Truncated ones match everything: we'll look at the block. */
+	assert(blockfilter_match_any(filter, 0, &blkid, none));
+	assert(blockfilter_match_any(filter, tal_len(filter) / 2, &blkid,
+				     scripts(ctx, 0, 1)));
+
+	tal_free(ctx);
+	return 0;
+}
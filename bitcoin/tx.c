@@ -425,6 +425,78 @@ struct bitcoin_tx *pull_bitcoin_tx(const tal_t *ctx,
 	return tx;
 }
 
+/* Skips over a varint-length-prefixed blob (script or witness item). */
+static void skip_length_blob(const u8 **cursor, size_t *max)
+{
+	pull(cursor, max, NULL, pull_length(cursor, max));
+}
+
+bool pull_bitcoin_txid(const u8 **cursor, size_t *max,
+		       struct sha256_double *txid,
+		       struct bitcoin_outpoint **spends)
+{
+	struct sha256_ctx ctx = SHA256_INIT;
+	const u8 *start = *cursor;
+	u64 i, j, count, num_inputs;
+	u8 flag = 0;
+
+	pull_le32(cursor, max);
+	if (!*cursor)
+		return false;
+	/* Version goes into the txid. */
+	sha256_update(&ctx, start, *cursor - start);
+
+	start = *cursor;
+	num_inputs = pull_length(cursor, max);
+	/* BIP 144 marker and flag aren't part of the txid. */
+	if (num_inputs == 0) {
+		pull(cursor, max, &flag, 1);
+		if (flag != SEGREGATED_WITNESS_FLAG)
+			return false;
+		start = *cursor;
+		num_inputs = pull_length(cursor, max);
+	}
+
+	if (spends)
+		tal_resize(spends, num_inputs);
+	for (i = 0; i < num_inputs && *cursor; i++) {
+		struct bitcoin_outpoint unused, *out;
+
+		out = spends ? &(*spends)[i] : &unused;
+		pull_sha256_double(cursor, max, &out->txid);
+		out->index = pull_le32(cursor, max);
+		skip_length_blob(cursor, max);
+		pull_le32(cursor, max);
+	}
+
+	count = pull_length(cursor, max);
+	for (i = 0; i < count && *cursor; i++) {
+		pull_value(cursor, max);
+		skip_length_blob(cursor, max);
+	}
+	if (!*cursor)
+		return false;
+	/* Inputs and outputs, as one span. */
+	sha256_update(&ctx, start, *cursor - start);
+
+	if (flag & SEGREGATED_WITNESS_FLAG) {
+		for (i = 0; i < num_inputs && *cursor; i++) {
+			count = pull_length(cursor, max);
+			for (j = 0; j < count && *cursor; j++)
+				skip_length_blob(cursor, max);
+		}
+	}
+
+	start = *cursor;
+	pull_le32(cursor, max);
+	if (!*cursor)
+		return false;
+	/* And locktime. */
+	sha256_update(&ctx, start, *cursor - start);
+	sha256_double_done(&ctx, txid);
+	return true;
+}
+
 struct bitcoin_tx *bitcoin_tx_from_hex(const tal_t *ctx, const char *hex,
 				       size_t hexlen)
 {
@@ -19,6 +19,12 @@ struct bitcoin_tx_output {
 	u8 *script;
 };
 
+/* What an input spends. */
+struct bitcoin_outpoint {
+	struct sha256_double txid;
+	u32 index;
+};
+
 struct bitcoin_tx_input {
 	struct sha256_double txid;
 	u32 index; /* output number referred to by above */
@@ -67,4 +73,11 @@ bool bitcoin_txid_to_hex(const struct sha256_double *txid,
 struct bitcoin_tx *pull_bitcoin_tx(const tal_t *ctx,
 				   const u8 **cursor, size_t *max);
 
+/* Walk over a linearized tx without building it: fills in txid, and
+ * (if spends is non-NULL) resizes *spends to hold what its inputs spend.
+ * Returns false if it's malformed. */
+bool pull_bitcoin_txid(const u8 **cursor, size_t *max,
+		       struct sha256_double *txid,
+		       struct bitcoin_outpoint **spends);
+
 #endif /* LIGHTNING_BITCOIN_TX_H */
@@ -1,4 +1,5 @@
-/* Code for talking to bitcoind.  We use bitcoin-cli. */
+/* Code for talking to bitcoind.  We use its JSON-RPC interface, and fall
+ * back to bitcoin-cli if that doesn't work. */
 #include "bitcoin/base58.h"
 #include "bitcoin/block.h"
 #include "bitcoin/shadouble.h"
@@ -7,9 +8,12 @@
 #include "json.h"
 #include "lightningd.h"
 #include "log.h"
+#include "timeout.h"
 #include "utils.h"
+#include <ccan/array_size/array_size.h>
 #include <ccan/cast/cast.h>
 #include <ccan/io/io.h>
+#include <ccan/mem/mem.h>
 #include <ccan/pipecmd/pipecmd.h>
 #include <ccan/str/hex/hex.h>
 #include <ccan/take/take.h>
@@ -19,13 +23,29 @@
 #include <ccan/tal/tal.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/types.h>
 
 #define BITCOIN_CLI "bitcoin-cli"
 
+/* How many keep-alive JSON-RPC connections we use at once. */
+#define BITCOIND_MAX_PARALLEL 4
+
+/* How long we wait to reconnect if it's not answering (doubling each time). */
+#define RPC_BACKOFF_MIN_MSEC 100
+#define RPC_BACKOFF_MAX_MSEC 10000
+
+/* JSON-RPC's "Method not found" error (-32601), as an exit status. */
+#define RPC_METHOD_NOT_FOUND 32601
+
 char *bitcoin_datadir;
 
 static char **gather_args(struct bitcoind *bitcoind,
-			  const tal_t *ctx, const char *cmd, va_list ap)
+			  const tal_t *ctx, size_t *cmdidx,
+			  const char *cmd, va_list ap)
 {
 	size_t n = 0;
 	char **args = tal_arr(ctx, char *, 2);
@@ -40,6 +60,7 @@ static char **gather_args(struct bitcoind *bitcoind,
 		args[n++] = tal_fmt(args, "-datadir=%s", bitcoind->datadir);
 		tal_resize(&args, n + 1);
 	}
+	*cmdidx = n;
 	args[n++] = cast_const(char *, cmd);
 	tal_resize(&args, n + 1);
 
@@ -58,9 +79,15 @@ struct bitcoin_cli {
 	int *exitstatus;
 	pid_t pid;
 	char **args;
+	/* The command and its args, without bitcoin-cli's. */
+	char **cmdargs;
 	char *output;
 	size_t output_bytes;
 	size_t new_output;
+	/* Output is binary, not what bitcoin-cli would say (REST). */
+	bool binary;
+	/* REST couldn't do it: use JSON-RPC this time. */
+	bool no_rest;
 	void (*process)(struct bitcoin_cli *);
 	void *cb;
 	void *cb_arg;
@@ -85,6 +112,7 @@ static struct io_plan *output_init(struct io_conn *conn, struct bitcoin_cli *bcl
 }
 
 static void next_bcli(struct bitcoind *bitcoind);
+static void next_rpc(struct bitcoind *bitcoind);
 
 /* For printing: simple string of args. */
 static char *bcli_args(struct bitcoin_cli *bcli)
@@ -99,6 +127,22 @@ static char *bcli_args(struct bitcoin_cli *bcli)
 	return ret;
 }
 
+/* Same for bitcoin-cli and JSON-RPC: output is what bitcoin-cli would say. */
+static void bcli_done(struct bitcoin_cli *bcli, int exitstatus)
+{
+	if (!bcli->exitstatus) {
+		if (exitstatus != 0) {
+			fatal("%s exited %u: '%.*s'", bcli_args(bcli),
+			      exitstatus,
+			      (int)bcli->output_bytes,
+			      bcli->output);
+		}
+	} else
+		*bcli->exitstatus = exitstatus;
+
+	bcli->process(bcli);
+}
+
 static void bcli_finished(struct io_conn *conn, struct bitcoin_cli *bcli)
 {
 	int ret, status;
@@ -115,27 +159,655 @@ static void bcli_finished(struct io_conn *conn, struct bitcoin_cli *bcli)
 		      bcli_args(bcli),
 		      WTERMSIG(status));
 
-	if (!bcli->exitstatus) {
-		if (WEXITSTATUS(status) != 0) {
-			fatal("%s exited %u: '%.*s'", bcli_args(bcli),
-			      WEXITSTATUS(status),
-			      (int)bcli->output_bytes,
-			      bcli->output);
+	bitcoind->req_running = false;
+	bcli_done(bcli, WEXITSTATUS(status));
+
+	next_bcli(bitcoind);
+}
+
+static bool is_sendrawtx(const struct bitcoin_cli *bcli)
+{
+	return streq(bcli->cmdargs[0], "sendrawtransaction");
+}
+
+/* Sits in bitcoind until a block arrives (or it times out). */
+static bool is_longpoll(const struct bitcoin_cli *bcli)
+{
+	return streq(bcli->cmdargs[0], "waitfornewblock");
+}
+
+/* "getblock <hash> false" can be a REST request for the binary block. */
+static bool is_rest(const struct bitcoind *bitcoind,
+		    const struct bitcoin_cli *bcli)
+{
+	return bitcoind->rest && !bcli->no_rest
+		&& streq(bcli->cmdargs[0], "getblock");
+}
+
+/* A keep-alive connection to bitcoind's JSON-RPC server. */
+struct bitcoind_rpc {
+	struct list_node list;
+	struct bitcoind *bitcoind;
+	struct io_conn *conn;
+
+	/* Request we're working on, if any. */
+	struct bitcoin_cli *bcli;
+
+	/* "Basic xxx" for the Authorization header. */
+	char *auth;
+
+	/* Has this connection answered before?  (vs. never worked) */
+	bool answered;
+
+	/* Server said Connection: close (or we want it closed). */
+	bool closing;
+
+	/* Why we gave up on the server, if we did. */
+	const char *why;
+
+	/* Request going out (maybe REST), response coming in. */
+	bool rest;
+	char *request;
+	char *in;
+	size_t in_used, new_in, hdrlen;
+	int status;
+};
+
+/* "Unquoted strings" and JSON otherwise, like bitcoin-cli.  These
+ * args aren't strings. */
+static const struct {
+	const char *method;
+	size_t idx;
+} rpc_literal_args[] = {
+	{ "estimatefee", 0 },
+	{ "getblock", 1 },
+	{ "getblockhash", 0 },
+	{ "getblockheader", 1 },
+	{ "waitfornewblock", 0 },
+};
+
+static bool rpc_arg_is_literal(const char *method, size_t idx)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(rpc_literal_args); i++) {
+		if (streq(rpc_literal_args[i].method, method)
+		    && rpc_literal_args[i].idx == idx)
+			return true;
+	}
+	return false;
+}
+
+static char *base64(const tal_t *ctx, const char *s)
+{
+	static const char b64[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t len = strlen(s), i, n = 0;
+	char *out = tal_arr(ctx, char, (len + 2) / 3 * 4 + 1);
+
+	for (i = 0; i < len; i += 3) {
+		u32 v = (u32)(u8)s[i] << 16;
+
+		if (i + 1 < len)
+			v |= (u32)(u8)s[i+1] << 8;
+		if (i + 2 < len)
+			v |= (u8)s[i+2];
+		out[n++] = b64[(v >> 18) & 63];
+		out[n++] = b64[(v >> 12) & 63];
+		out[n++] = i + 1 < len ? b64[(v >> 6) & 63] : '=';
+		out[n++] = i + 2 < len ? b64[v & 63] : '=';
+	}
+	out[n] = '\0';
+	return out;
+}
+
+static const char *bitcoin_dir(const tal_t *ctx,
+			       const struct bitcoind *bitcoind)
+{
+	const char *home;
+
+	if (bitcoind->datadir)
+		return bitcoind->datadir;
+	home = getenv("HOME");
+	if (!home)
+		return NULL;
+	return path_join(ctx, home, ".bitcoin");
+}
+
+/* bitcoind keeps the cookie in a subdirectory for test networks. */
+static const char *cookie_file(const tal_t *ctx,
+			       const struct bitcoind *bitcoind)
+{
+	const char *dir = bitcoin_dir(ctx, bitcoind);
+
+	if (!dir)
+		return NULL;
+	if (streq(bitcoind->chainparams->network_name, "testnet"))
+		dir = path_join(ctx, dir, "testnet3");
+	else if (streq(bitcoind->chainparams->network_name, "regtest"))
+		dir = path_join(ctx, dir, "regtest");
+	return path_join(ctx, dir, ".cookie");
+}
+
+/* Fill in anything we weren't told from bitcoin.conf, like bitcoin-cli. */
+static void read_bitcoin_conf(struct bitcoind *bitcoind)
+{
+	const char *dir = bitcoin_dir(bitcoind, bitcoind);
+	char *contents, **lines;
+	size_t i;
+
+	if (!dir)
+		return;
+	contents = grab_file(bitcoind, path_join(bitcoind, dir, "bitcoin.conf"));
+	if (!contents)
+		return;
+
+	lines = tal_strsplit(contents, contents, "\r\n", STR_NO_EMPTY);
+	for (i = 0; lines[i]; i++) {
+		char *eq = strchr(lines[i], '=');
+		char **val;
+
+		if (!eq || lines[i][0] == '#')
+			continue;
+		*eq = '\0';
+		if (streq(lines[i], "rpcconnect"))
+			val = &bitcoind->rpcconnect;
+		else if (streq(lines[i], "rpcport"))
+			val = &bitcoind->rpcport;
+		else if (streq(lines[i], "rpcuser"))
+			val = &bitcoind->rpcuser;
+		else if (streq(lines[i], "rpcpassword"))
+			val = &bitcoind->rpcpassword;
+		else
+			continue;
+		if (!*val)
+			*val = tal_strdup(bitcoind, eq + 1);
+	}
+	tal_free(contents);
+}
+
+/* Returns error string, or NULL. */
+static const char *setup_rpc_addr(struct bitcoind *bitcoind)
+{
+	struct addrinfo hints;
+	char port[STR_MAX_CHARS(int)];
+	int err;
+
+	read_bitcoin_conf(bitcoind);
+	sprintf(port, "%i", bitcoind->chainparams->rpc_port);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	err = getaddrinfo(bitcoind->rpcconnect ? bitcoind->rpcconnect
+			  : "127.0.0.1",
+			  bitcoind->rpcport ? bitcoind->rpcport : port,
+			  &hints, &bitcoind->rpc_addr);
+	if (err) {
+		bitcoind->rpc_addr = NULL;
+		return gai_strerror(err);
+	}
+	return NULL;
+}
+
+/* Cookie can change whenever bitcoind restarts, so we read it each time. */
+static char *rpc_auth(const tal_t *ctx, const struct bitcoind *bitcoind)
+{
+	const char *file;
+	char *userpass;
+
+	if (bitcoind->rpcpassword)
+		userpass = tal_fmt(ctx, "%s:%s",
+				   bitcoind->rpcuser ? bitcoind->rpcuser : "",
+				   bitcoind->rpcpassword);
+	else {
+		file = cookie_file(ctx, bitcoind);
+		if (!file)
+			return NULL;
+		userpass = grab_file(ctx, file);
+		if (!userpass)
+			return NULL;
+		/* It's user:pass, maybe with a trailing newline. */
+		userpass[strcspn(userpass, "\r\n")] = '\0';
+	}
+	return tal_fmt(ctx, "Basic %s", base64(ctx, userpass));
+}
+
+static char *rpc_request(const tal_t *ctx, struct bitcoind_rpc *rpc)
+{
+	const struct bitcoin_cli *bcli = rpc->bcli;
+	struct bitcoind *bitcoind = rpc->bitcoind;
+	struct json_result *body;
+	const char *host;
+	size_t i;
+
+	host = bitcoind->rpcconnect ? bitcoind->rpcconnect : "127.0.0.1";
+	rpc->rest = is_rest(bitcoind, bcli);
+	if (rpc->rest)
+		return tal_fmt(ctx,
+			       "GET /rest/block/%s.bin HTTP/1.1\r\n"
+			       "Host: %s\r\n"
+			       "Connection: keep-alive\r\n"
+			       "\r\n",
+			       bcli->cmdargs[1], host);
+
+	body = new_json_result(ctx);
+	json_object_start(body, NULL);
+	json_add_string(body, "jsonrpc", "1.0");
+	json_add_u64(body, "id", bitcoind->rpc_id++);
+	json_add_string(body, "method", bcli->cmdargs[0]);
+	json_array_start(body, "params");
+	for (i = 1; bcli->cmdargs[i]; i++) {
+		if (rpc_arg_is_literal(bcli->cmdargs[0], i - 1))
+			json_add_literal(body, NULL, bcli->cmdargs[i],
+					 strlen(bcli->cmdargs[i]));
+		else
+			json_add_string(body, NULL, bcli->cmdargs[i]);
+	}
+	json_array_end(body);
+	json_object_end(body);
+
+	return tal_fmt(ctx,
+		       "POST / HTTP/1.1\r\n"
+		       "Host: %s\r\n"
+		       "Authorization: %s\r\n"
+		       "Content-Type: application/json\r\n"
+		       "Content-Length: %zu\r\n"
+		       "Connection: keep-alive\r\n"
+		       "\r\n"
+		       "%s",
+		       host, rpc->auth, strlen(json_result_string(body)),
+		       json_result_string(body));
+}
+
+/* Give up on JSON-RPC for good (bad auth, not a JSON-RPC server...), and
+ * hand everything to bitcoin-cli. */
+static void rpc_failed(struct bitcoind *bitcoind, const char *why)
+{
+	struct bitcoind_rpc *rpc;
+
+	log_unusual(bitcoind->log,
+		    "JSON-RPC to bitcoind failed (%s): using %s instead",
+		    why, bitcoind->chainparams->cli);
+	bitcoind->cli_only = true;
+
+	/* Their finish callbacks put their requests back on pending. */
+	while ((rpc = list_top(&bitcoind->rpcs, struct bitcoind_rpc, list))
+	       != NULL) {
+		list_del_from(&bitcoind->rpcs, &rpc->list);
+		list_node_init(&rpc->list);
+		tal_free(rpc->conn);
+	}
+}
+
+/* Put our request back at the front of the queue. */
+static void rpc_requeue(struct bitcoind_rpc *rpc)
+{
+	struct bitcoind *bitcoind = rpc->bitcoind;
+
+	if (!rpc->bcli)
+		return;
+	if (is_sendrawtx(rpc->bcli))
+		bitcoind->sendrawtx_running = false;
+	list_add(&bitcoind->pending, &rpc->bcli->list);
+	rpc->bcli = NULL;
+}
+
+static void rpc_reconnect(struct bitcoind *bitcoind)
+{
+	bitcoind->rpc_retry = NULL;
+	next_bcli(bitcoind);
+}
+
+/* We couldn't talk to the server at all (it's restarting?): requests stay
+ * pending while we wait a little longer each time before reconnecting. */
+static void rpc_unreachable(struct bitcoind *bitcoind, const char *why)
+{
+	if (bitcoind->rpc_retry)
+		return;
+
+	bitcoind->rpc_backoff *= 2;
+	if (bitcoind->rpc_backoff < RPC_BACKOFF_MIN_MSEC)
+		bitcoind->rpc_backoff = RPC_BACKOFF_MIN_MSEC;
+	if (bitcoind->rpc_backoff > RPC_BACKOFF_MAX_MSEC)
+		bitcoind->rpc_backoff = RPC_BACKOFF_MAX_MSEC;
+
+	log_unusual(bitcoind->log,
+		    "JSON-RPC to bitcoind failed (%s): retrying in %ums",
+		    why, bitcoind->rpc_backoff);
+	bitcoind->rpc_retry = new_reltimer(bitcoind->timers, bitcoind,
+					   time_from_msec(bitcoind->rpc_backoff),
+					   rpc_reconnect, bitcoind);
+}
+
+static void rpc_finished(struct io_conn *conn, struct bitcoind_rpc *rpc)
+{
+	struct bitcoind *bitcoind = rpc->bitcoind;
+	bool had_req = (rpc->bcli != NULL);
+	/* Why io closed it: rpc_requeue() may well change errno. */
+	int saved_errno = errno;
+
+	list_del(&rpc->list);
+	rpc_requeue(rpc);
+
+	/* bitcoind closes idle connections: just retry on a new one.  If it
+	 * said something we can't use, it never will; if we couldn't even
+	 * get an answer, wait a while before trying again. */
+	if (!bitcoind->cli_only) {
+		if (rpc->why)
+			rpc_failed(bitcoind, rpc->why);
+		else if (had_req && !rpc->answered)
+			rpc_unreachable(bitcoind,
+					tal_fmt(rpc, "%s", strerror(saved_errno)));
+	}
+
+	if (had_req)
+		next_bcli(bitcoind);
+}
+
+static struct io_plan *rpc_idle(struct io_conn *conn, struct bitcoind_rpc *rpc);
+
+/* Returns false if it's malformed. */
+static bool rpc_parse_header(struct bitcoind_rpc *rpc, size_t *bodylen)
+{
+	char *hdr = tal_strndup(rpc, rpc->in, rpc->hdrlen);
+	char **lines = tal_strsplit(hdr, hdr, "\r\n", STR_NO_EMPTY);
+	size_t i;
+	bool have_len = false;
+
+	if (!lines[0] || sscanf(lines[0], "HTTP/%*u.%*u %i", &rpc->status) != 1)
+		goto fail;
+
+	for (i = 1; lines[i]; i++) {
+		char *p;
+
+		if (strncasecmp(lines[i], "Content-Length:", 15) == 0) {
+			*bodylen = strtoul(lines[i] + 15, &p, 10);
+			if (p == lines[i] + 15)
+				goto fail;
+			have_len = true;
+		} else if (strncasecmp(lines[i], "Connection:", 11) == 0) {
+			for (p = lines[i] + 11; *p == ' '; p++);
+			if (strncasecmp(p, "close", 5) == 0)
+				rpc->closing = true;
 		}
-	} else
-		*bcli->exitstatus = WEXITSTATUS(status);
+	}
+	tal_free(hdr);
+	return have_len;
 
-	bitcoind->req_running = false;
-	bcli->process(bcli);
+fail:
+	tal_free(hdr);
+	return false;
+}
+
+static void rpc_request_done(struct bitcoind_rpc *rpc, int exitstatus)
+{
+	struct bitcoind *bitcoind = rpc->bitcoind;
+	struct bitcoin_cli *bcli = rpc->bcli;
 
+	rpc->answered = true;
+	rpc->bcli = NULL;
+	bitcoind->rpc_backoff = 0;
+	if (is_sendrawtx(bcli))
+		bitcoind->sendrawtx_running = false;
+
+	bcli_done(bcli, exitstatus);
+	tal_free(bcli);
+
+	/* This may hand us (or another connection) the next request. */
 	next_bcli(bitcoind);
 }
 
+/* REST reply is just the block: hand over the buffer, no copying. */
+static struct io_plan *rpc_got_rest_body(struct io_conn *conn,
+					 struct bitcoind_rpc *rpc)
+{
+	struct bitcoind *bitcoind = rpc->bitcoind;
+	struct bitcoin_cli *bcli = rpc->bcli;
+	size_t bodylen = tal_count(rpc->in) - rpc->hdrlen;
+
+	/* bitcoind without -rest says 404, but so does one which can't
+	 * find the block: just retry this one over JSON-RPC. */
+	if (rpc->status != 200) {
+		log_debug(bitcoind->log,
+			  "REST request to bitcoind gave HTTP status %i:"
+			  " using JSON-RPC for this block",
+			  rpc->status);
+		bcli->no_rest = true;
+		rpc->answered = true;
+		rpc_requeue(rpc);
+		next_bcli(bitcoind);
+	} else {
+		memmove(rpc->in, rpc->in + rpc->hdrlen, bodylen);
+		tal_resize(&rpc->in, bodylen);
+		bcli->output = tal_steal(bcli, rpc->in);
+		bcli->output_bytes = bodylen;
+		bcli->binary = true;
+		rpc->in = NULL;
+		rpc_request_done(rpc, 0);
+	}
+
+	if (rpc->closing)
+		return io_close(conn);
+	return rpc_idle(conn, rpc);
+}
+
+/* Turn JSON reply into what bitcoin-cli would have printed. */
+static struct io_plan *rpc_got_body(struct io_conn *conn,
+				    struct bitcoind_rpc *rpc)
+{
+	struct bitcoin_cli *bcli = rpc->bcli;
+	size_t bodylen = tal_count(rpc->in) - rpc->hdrlen;
+	const char *body;
+	const jsmntok_t *toks, *result, *error;
+	int exitstatus = 0;
+	bool valid;
+
+	/* json_parse_input wants a tal pointer, so drop the header. */
+	memmove(rpc->in, rpc->in + rpc->hdrlen, bodylen);
+	body = rpc->in;
+	toks = json_parse_input(body, bodylen, &valid);
+	if (!toks || toks[0].type != JSMN_OBJECT) {
+		rpc->why = tal_fmt(rpc, "HTTP status %i%s", rpc->status,
+				   rpc->status == 401
+				   ? " (bad rpcuser/rpcpassword?)" : "");
+		return io_close(conn);
+	}
+
+	result = json_get_member(body, toks, "result");
+	error = json_get_member(body, toks, "error");
+	if (error && !json_tok_is_null(body, error)) {
+		const jsmntok_t *code = json_get_member(body, error, "code");
+		const jsmntok_t *msg = json_get_member(body, error, "message");
+		int c = 1;
+
+		if (code)
+			c = atoi(body + code->start);
+		exitstatus = c ? abs(c) : 1;
+		bcli->output = tal_fmt(bcli,
+				       "error code: %i\n"
+				       "error message:\n%.*s\n",
+				       c,
+				       msg ? msg->end - msg->start : 0,
+				       msg ? body + msg->start : "");
+	} else if (!result) {
+		rpc->why = tal_fmt(rpc, "no result in '%.*s'",
+				   (int)bodylen, body);
+		return io_close(conn);
+	} else
+		/* Strings come out without quotes, like bitcoin-cli. */
+		bcli->output = tal_fmt(bcli, "%.*s\n",
+				       result->end - result->start,
+				       body + result->start);
+	bcli->output_bytes = strlen(bcli->output);
+	tal_free(toks);
+	rpc_request_done(rpc, exitstatus);
+
+	if (rpc->closing)
+		return io_close(conn);
+	return rpc_idle(conn, rpc);
+}
+
+static struct io_plan *rpc_read_more(struct io_conn *conn,
+				     struct bitcoind_rpc *rpc)
+{
+	size_t bodylen;
+	char *end;
+
+	rpc->in_used += rpc->new_in;
+	if (!rpc->hdrlen) {
+		end = memmem(rpc->in, rpc->in_used, "\r\n\r\n", 4);
+		if (end) {
+			rpc->hdrlen = end + 4 - rpc->in;
+			if (!rpc_parse_header(rpc, &bodylen)) {
+				rpc->why = tal_fmt(rpc, "bad HTTP response '%.*s'",
+						   (int)rpc->hdrlen, rpc->in);
+				return io_close(conn);
+			}
+			/* Now we know exactly how much we need. */
+			tal_resize(&rpc->in, rpc->hdrlen + bodylen);
+		} else if (rpc->in_used == tal_count(rpc->in))
+			tal_resize(&rpc->in, rpc->in_used * 2);
+	}
+
+	if (rpc->hdrlen && rpc->in_used >= tal_count(rpc->in)) {
+		if (rpc->rest)
+			return rpc_got_rest_body(conn, rpc);
+		return rpc_got_body(conn, rpc);
+	}
+
+	return io_read_partial(conn, rpc->in + rpc->in_used,
+			       tal_count(rpc->in) - rpc->in_used,
+			       &rpc->new_in, rpc_read_more, rpc);
+}
+
+static struct io_plan *rpc_read_response(struct io_conn *conn,
+					 struct bitcoind_rpc *rpc)
+{
+	rpc->request = tal_free(rpc->request);
+	rpc->in = tal_free(rpc->in);
+	rpc->in = tal_arr(rpc, char, 1024);
+	rpc->in_used = rpc->new_in = rpc->hdrlen = 0;
+	return rpc_read_more(conn, rpc);
+}
+
+static struct io_plan *rpc_write_request(struct io_conn *conn,
+					 struct bitcoind_rpc *rpc)
+{
+	rpc->request = rpc_request(rpc, rpc);
+	return io_write(conn, rpc->request, strlen(rpc->request),
+			rpc_read_response, rpc);
+}
+
+static struct io_plan *rpc_idle(struct io_conn *conn, struct bitcoind_rpc *rpc)
+{
+	if (rpc->bcli)
+		return rpc_write_request(conn, rpc);
+	return io_wait(conn, rpc, rpc_idle, rpc);
+}
+
+static struct io_plan *rpc_connect(struct io_conn *conn,
+				   struct bitcoind_rpc *rpc)
+{
+	return io_connect(conn, rpc->bitcoind->rpc_addr, rpc_idle, rpc);
+}
+
+/* Returns NULL if we're all busy, waiting to reconnect, or we've given up
+ * on JSON-RPC. */
+static struct bitcoind_rpc *rpc_for_request(struct bitcoind *bitcoind)
+{
+	struct bitcoind_rpc *rpc;
+	size_t n = 0;
+	const char *err;
+	int fd;
+
+	if (bitcoind->rpc_retry)
+		return NULL;
+
+	list_for_each(&bitcoind->rpcs, rpc, list) {
+		if (!rpc->bcli && !rpc->closing)
+			return rpc;
+		/* A long poll isn't really busy: don't let it starve others. */
+		if (!rpc->bcli || !is_longpoll(rpc->bcli))
+			n++;
+	}
+	if (n == BITCOIND_MAX_PARALLEL)
+		return NULL;
+
+	if (!bitcoind->rpc_addr) {
+		err = setup_rpc_addr(bitcoind);
+		if (err) {
+			rpc_failed(bitcoind, err);
+			return NULL;
+		}
+	}
+
+	rpc = tal(bitcoind, struct bitcoind_rpc);
+	rpc->bitcoind = bitcoind;
+	rpc->bcli = NULL;
+	rpc->answered = rpc->closing = false;
+	rpc->why = NULL;
+	rpc->rest = false;
+	rpc->request = rpc->in = NULL;
+	rpc->auth = rpc_auth(rpc, bitcoind);
+	if (!rpc->auth) {
+		tal_free(rpc);
+		rpc_failed(bitcoind, "no rpcpassword, and no .cookie");
+		return NULL;
+	}
+
+	fd = socket(bitcoind->rpc_addr->ai_family,
+		    bitcoind->rpc_addr->ai_socktype,
+		    bitcoind->rpc_addr->ai_protocol);
+	if (fd < 0) {
+		int saved_errno = errno;
+		tal_free(rpc);
+		rpc_unreachable(bitcoind, strerror(saved_errno));
+		return NULL;
+	}
+
+	list_add_tail(&bitcoind->rpcs, &rpc->list);
+	rpc->conn = io_new_conn(bitcoind, fd, rpc_connect, rpc);
+	tal_steal(rpc->conn, rpc);
+	io_set_finish(rpc->conn, rpc_finished, rpc);
+	return rpc;
+}
+
+static void next_rpc(struct bitcoind *bitcoind)
+{
+	struct bitcoin_cli *bcli, *next;
+	struct bitcoind_rpc *rpc;
+
+	list_for_each_safe(&bitcoind->pending, bcli, next, list) {
+		/* A tx may spend the one before it, so keep them in order. */
+		if (is_sendrawtx(bcli) && bitcoind->sendrawtx_running)
+			continue;
+
+		rpc = rpc_for_request(bitcoind);
+		if (!rpc) {
+			if (bitcoind->cli_only)
+				next_bcli(bitcoind);
+			return;
+		}
+
+		list_del_from(&bitcoind->pending, &bcli->list);
+		if (is_sendrawtx(bcli))
+			bitcoind->sendrawtx_running = true;
+		rpc->bcli = bcli;
+		io_wake(rpc);
+	}
+}
+
 static void next_bcli(struct bitcoind *bitcoind)
 {
 	struct bitcoin_cli *bcli;
 	struct io_conn *conn;
 
+	if (!bitcoind->cli_only) {
+		next_rpc(bitcoind);
+		return;
+	}
+
 	if (bitcoind->req_running)
 		return;
 
@@ -143,6 +815,16 @@ static void next_bcli(struct bitcoind *bitcoind)
 	if (!bcli)
 		return;
 
+	/* bitcoin-cli runs one at a time: it can't sit there waiting. */
+	if (is_longpoll(bcli)) {
+		bcli->output = tal_strdup(bcli, "no long polls via bitcoin-cli");
+		bcli->output_bytes = strlen(bcli->output);
+		bcli_done(bcli, 1);
+		tal_free(bcli);
+		next_bcli(bitcoind);
+		return;
+	}
+
 	bcli->pid = pipecmdarr(&bcli->fd, NULL, &bcli->fd, bcli->args);
 	if (bcli->pid < 0)
 		fatal("%s exec failed: %s", bcli->args[0], strerror(errno));
@@ -181,12 +863,15 @@ start_bitcoin_cli(struct bitcoind *bitcoind,
 		  char *cmd, ...)
 {
 	va_list ap;
+	size_t cmdidx;
 	struct bitcoin_cli *bcli = tal(bitcoind, struct bitcoin_cli);
 
 	bcli->bitcoind = bitcoind;
 	bcli->process = process;
 	bcli->cb = cb;
 	bcli->cb_arg = cb_arg;
+	bcli->binary = false;
+	bcli->no_rest = false;
 	if (ctx) {
 		/* Create child whose destructor will stop us calling */
 		bcli->stopper = tal(ctx, struct bitcoin_cli *);
@@ -201,7 +886,8 @@ start_bitcoin_cli(struct bitcoind *bitcoind,
 	else
 		bcli->exitstatus = NULL;
 	va_start(ap, cmd);
-	bcli->args = gather_args(bitcoind, bcli, cmd, ap);
+	bcli->args = gather_args(bitcoind, bcli, &cmdidx, cmd, ap);
+	bcli->cmdargs = bcli->args + cmdidx;
 	va_end(ap);
 
 	list_add_tail(&bitcoind->pending, &bcli->list);
@@ -361,13 +1047,22 @@ void bitcoind_get_chaintip_(struct bitcoind *bitcoind,
 
 static void process_rawblock(struct bitcoin_cli *bcli)
 {
-	struct bitcoin_block *blk;
+	struct bitcoin_rawblock *blk;
 	void (*cb)(struct bitcoind *bitcoind,
-		   struct bitcoin_block *blk,
+		   struct bitcoin_rawblock *blk,
 		   void *arg) = bcli->cb;
 
 	/* FIXME: Just get header if we can't get full block. */
-	blk = bitcoin_block_from_hex(bcli, bcli->output, bcli->output_bytes);
+	if (bcli->binary) {
+		blk = bitcoin_rawblock_from_bytes(bcli,
+						  take((u8 *)bcli->output),
+						  bcli->output_bytes);
+		if (!blk)
+			fatal("%s: bad binary block (%zu bytes)?",
+			      bcli_args(bcli), bcli->output_bytes);
+	} else
+		blk = bitcoin_rawblock_from_hex(bcli, bcli->output,
+						bcli->output_bytes);
 	if (!blk)
 		fatal("%s: bad block '%.*s'?",
 		      bcli_args(bcli),
@@ -379,7 +1074,7 @@ static void process_rawblock(struct bitcoin_cli *bcli)
 void bitcoind_getrawblock_(struct bitcoind *bitcoind,
 			   const struct sha256_double *blockid,
 			   void (*cb)(struct bitcoind *bitcoind,
-				      struct bitcoin_block *blk,
+				      struct bitcoin_rawblock *blk,
 				      void *arg),
 			   void *arg)
 {
@@ -390,6 +1085,151 @@ void bitcoind_getrawblock_(struct bitcoind *bitcoind,
 			  "getblock", hex, "false", NULL);
 }
 
+static void process_blockheader(struct bitcoin_cli *bcli)
+{
+	struct bitcoin_rawblock *blk = tal(bcli, struct bitcoin_rawblock);
+	size_t hexlen = bcli->output_bytes;
+	void (*cb)(struct bitcoind *bitcoind,
+		   struct bitcoin_rawblock *blk,
+		   void *arg) = bcli->cb;
+
+	if (hexlen && bcli->output[hexlen-1] == '\n')
+		hexlen--;
+	if (!hex_decode(bcli->output, hexlen, &blk->hdr, sizeof(blk->hdr)))
+		fatal("%s: bad header '%.*s'?",
+		      bcli_args(bcli),
+		      (int)bcli->output_bytes, bcli->output);
+
+	/* No transactions: we don't care what's in it. */
+	blk->num_txs = 0;
+	blk->txs = tal_arr(blk, u8, 0);
+	blk->filter = NULL;
+	cb(bcli->bitcoind, blk, bcli->cb_arg);
+}
+
+void bitcoind_getblockheader_(struct bitcoind *bitcoind,
+			      const struct sha256_double *blockid,
+			      void (*cb)(struct bitcoind *bitcoind,
+					 struct bitcoin_rawblock *blk,
+					 void *arg),
+			      void *arg)
+{
+	char hex[hex_str_size(sizeof(*blockid))];
+
+	bitcoin_blkid_to_hex(blockid, hex, sizeof(hex));
+	start_bitcoin_cli(bitcoind, NULL, process_blockheader, false, cb, arg,
+			  "getblockheader", hex, "false", NULL);
+}
+
+static void process_blockfilter(struct bitcoin_cli *bcli)
+{
+	const jsmntok_t *tokens, *filter;
+	bool valid;
+	u8 *data;
+	void (*cb)(struct bitcoind *bitcoind,
+		   const u8 *filter,
+		   void *arg) = bcli->cb;
+
+	/* Usually because bitcoind isn't running with -blockfilterindex */
+	if (*bcli->exitstatus != 0) {
+		log_debug(bcli->bitcoind->log, "%s: %.*s",
+			  bcli_args(bcli),
+			  (int)bcli->output_bytes, bcli->output);
+		cb(bcli->bitcoind, NULL, bcli->cb_arg);
+		return;
+	}
+
+	tokens = json_parse_input(bcli->output, bcli->output_bytes, &valid);
+	if (!tokens)
+		fatal("%s: %s response",
+		      bcli_args(bcli),
+		      valid ? "partial" : "invalid");
+
+	filter = json_get_member(bcli->output, tokens, "filter");
+	if (!filter)
+		fatal("%s: gave no filter (%.*s)?",
+		      bcli_args(bcli),
+		      (int)bcli->output_bytes, bcli->output);
+
+	data = tal_hexdata(bcli, bcli->output + filter->start,
+			   filter->end - filter->start);
+	if (!data)
+		fatal("%s: gave bad filter (%.*s)?",
+		      bcli_args(bcli),
+		      (int)bcli->output_bytes, bcli->output);
+
+	cb(bcli->bitcoind, data, bcli->cb_arg);
+}
+
+void bitcoind_getblockfilter_(struct bitcoind *bitcoind,
+			      const struct sha256_double *blockid,
+			      void (*cb)(struct bitcoind *bitcoind,
+					 const u8 *filter,
+					 void *arg),
+			      void *arg)
+{
+	char hex[hex_str_size(sizeof(*blockid))];
+
+	bitcoin_blkid_to_hex(blockid, hex, sizeof(hex));
+	start_bitcoin_cli(bitcoind, NULL, process_blockfilter, true, cb, arg,
+			  "getblockfilter", hex, NULL);
+}
+
+static void process_waitfornewblock(struct bitcoin_cli *bcli)
+{
+	const jsmntok_t *tokens, *hash;
+	struct sha256_double tipid;
+	bool valid;
+	void (*cb)(struct bitcoind *bitcoind,
+		   const struct sha256_double *tipid,
+		   bool can_wait,
+		   void *arg) = bcli->cb;
+
+	/* Only an old bitcoind, or bitcoin-cli, can never do this: anything
+	 * else (still loading?) may be fine next time. */
+	if (*bcli->exitstatus != 0) {
+		log_debug(bcli->bitcoind->log, "%s: %.*s",
+			  bcli_args(bcli),
+			  (int)bcli->output_bytes, bcli->output);
+		cb(bcli->bitcoind, NULL,
+		   !bcli->bitcoind->cli_only
+		   && *bcli->exitstatus != RPC_METHOD_NOT_FOUND,
+		   bcli->cb_arg);
+		return;
+	}
+
+	tokens = json_parse_input(bcli->output, bcli->output_bytes, &valid);
+	if (!tokens)
+		fatal("%s: %s response",
+		      bcli_args(bcli),
+		      valid ? "partial" : "invalid");
+
+	hash = json_get_member(bcli->output, tokens, "hash");
+	if (!hash
+	    || !bitcoin_blkid_from_hex(bcli->output + hash->start,
+				       hash->end - hash->start, &tipid))
+		fatal("%s: gave bad hash (%.*s)?",
+		      bcli_args(bcli),
+		      (int)bcli->output_bytes, bcli->output);
+
+	cb(bcli->bitcoind, &tipid, true, bcli->cb_arg);
+}
+
+void bitcoind_waitfornewblock_(struct bitcoind *bitcoind,
+			       struct timerel timeout,
+			       void (*cb)(struct bitcoind *bitcoind,
+					  const struct sha256_double *tipid,
+					  bool can_wait,
+					  void *arg),
+			       void *arg)
+{
+	char str[STR_MAX_CHARS(u64)];
+
+	sprintf(str, "%"PRIu64, time_to_msec(timeout));
+	start_bitcoin_cli(bitcoind, NULL, process_waitfornewblock, true,
+			  cb, arg, "waitfornewblock", str, NULL);
+}
+
 static void process_getblockcount(struct bitcoin_cli *bcli)
 {
 	u32 blockcount;
@@ -448,7 +1288,19 @@ void bitcoind_getblockhash_(struct bitcoind *bitcoind,
 			  "getblockhash", str, NULL);
 }
 
-struct bitcoind *new_bitcoind(const tal_t *ctx, struct log *log)
+static void destroy_bitcoind(struct bitcoind *bitcoind)
+{
+	if (bitcoind->rpc_addr)
+		freeaddrinfo(bitcoind->rpc_addr);
+
+	/* Our connections are about to go: don't start anything new. */
+	bitcoind->rpc_addr = NULL;
+	bitcoind->cli_only = true;
+	bitcoind->req_running = true;
+}
+
+struct bitcoind *new_bitcoind(const tal_t *ctx, struct timers *timers,
+			      struct log *log)
 {
 	struct bitcoind *bitcoind = tal(ctx, struct bitcoind);
 
@@ -456,8 +1308,20 @@ struct bitcoind *new_bitcoind(const tal_t *ctx, struct log *log)
 	bitcoind->chainparams = chainparams_for_network("testnet");
 	bitcoind->datadir = NULL;
 	bitcoind->log = log;
+	bitcoind->timers = timers;
 	bitcoind->req_running = false;
 	list_head_init(&bitcoind->pending);
+	bitcoind->cli_only = false;
+	bitcoind->rpc_backoff = 0;
+	bitcoind->rpc_retry = NULL;
+	bitcoind->rpcconnect = bitcoind->rpcport = NULL;
+	bitcoind->rpcuser = bitcoind->rpcpassword = NULL;
+	bitcoind->rpc_addr = NULL;
+	list_head_init(&bitcoind->rpcs);
+	bitcoind->sendrawtx_running = false;
+	bitcoind->rpc_id = 0;
+	bitcoind->rest = false;
+	tal_add_destructor(bitcoind, destroy_bitcoind);
 
 	return bitcoind;
 }
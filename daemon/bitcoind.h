@@ -5,15 +5,17 @@
 #include <ccan/list/list.h>
 #include <ccan/short_types/short_types.h>
 #include <ccan/tal/tal.h>
+#include <ccan/time/time.h>
 #include <ccan/typesafe_cb/typesafe_cb.h>
 #include <stdbool.h>
 
 struct sha256_double;
+struct timers;
 struct lightningd_state;
 struct ripemd160;
 struct bitcoin_tx;
 struct peer;
-struct bitcoin_block;
+struct bitcoin_rawblock;
 
 enum bitcoind_mode {
 	BITCOIND_MAINNET = 1,
@@ -28,17 +30,47 @@ struct bitcoind {
 	/* Where to do logging. */
 	struct log *log;
 
-	/* Are we currently running a bitcoind request (it's ratelimited) */
+	/* Are we currently running a bitcoin-cli (it's ratelimited) */
 	bool req_running;
 
 	/* Pending requests. */
 	struct list_head pending;
 
+	/* For retrying JSON-RPC connections. */
+	struct timers *timers;
+
+	/* Don't use JSON-RPC (told not to, or it can't ever work)? */
+	bool cli_only;
+
+	/* How long (msec) we wait before reconnecting after a failure, and
+	 * the timer if we're waiting now. */
+	u32 rpc_backoff;
+	struct oneshot *rpc_retry;
+
+	/* JSON-RPC settings: if NULL, we look in bitcoin.conf. */
+	char *rpcconnect, *rpcport, *rpcuser, *rpcpassword;
+
+	/* Where the JSON-RPC server is, once we've looked. */
+	struct addrinfo *rpc_addr;
+
+	/* Keep-alive connections to the JSON-RPC server. */
+	struct list_head rpcs;
+
+	/* Is a sendrawtransaction in flight?  They go in order. */
+	bool sendrawtx_running;
+
+	/* Id for the next JSON-RPC request. */
+	u64 rpc_id;
+
+	/* Fetch blocks as binary from the REST interface (bitcoind -rest)? */
+	bool rest;
+
 	/* What network are we on? */
 	const struct chainparams *chainparams;
 };
 
-struct bitcoind *new_bitcoind(const tal_t *ctx, struct log *log);
+struct bitcoind *new_bitcoind(const tal_t *ctx, struct timers *timers,
+			      struct log *log);
 
 void bitcoind_estimate_fee_(struct bitcoind *bitcoind,
 			    void (*cb)(struct bitcoind *bitcoind,
@@ -113,7 +145,7 @@ void bitcoind_getblockhash_(struct bitcoind *bitcoind,
 void bitcoind_getrawblock_(struct bitcoind *bitcoind,
 			   const struct sha256_double *blockid,
 			   void (*cb)(struct bitcoind *bitcoind,
-				      struct bitcoin_block *blk,
+				      struct bitcoin_rawblock *blk,
 				      void *arg),
 			   void *arg);
 #define bitcoind_getrawblock(bitcoind_, blkid, cb, arg)			\
@@ -121,6 +153,55 @@ void bitcoind_getrawblock_(struct bitcoind *bitcoind,
 			      typesafe_cb_preargs(void, void *,		\
 						  (cb), (arg),		\
 						  struct bitcoind *,	\
-						  struct bitcoin_block *), \
+						  struct bitcoin_rawblock *), \
 			      (arg))
+
+/* Just the header: blk has no transactions. */
+void bitcoind_getblockheader_(struct bitcoind *bitcoind,
+			      const struct sha256_double *blockid,
+			      void (*cb)(struct bitcoind *bitcoind,
+					 struct bitcoin_rawblock *blk,
+					 void *arg),
+			      void *arg);
+#define bitcoind_getblockheader(bitcoind_, blkid, cb, arg)		\
+	bitcoind_getblockheader_((bitcoind_), (blkid),			\
+				 typesafe_cb_preargs(void, void *,	\
+						     (cb), (arg),	\
+						     struct bitcoind *,	\
+						     struct bitcoin_rawblock *), \
+				 (arg))
+
+/* BIP158 basic filter: NULL if bitcoind can't (no -blockfilterindex). */
+void bitcoind_getblockfilter_(struct bitcoind *bitcoind,
+			      const struct sha256_double *blockid,
+			      void (*cb)(struct bitcoind *bitcoind,
+					 const u8 *filter,
+					 void *arg),
+			      void *arg);
+#define bitcoind_getblockfilter(bitcoind_, blkid, cb, arg)		\
+	bitcoind_getblockfilter_((bitcoind_), (blkid),			\
+				 typesafe_cb_preargs(void, void *,	\
+						     (cb), (arg),	\
+						     struct bitcoind *,	\
+						     const u8 *),	\
+				 (arg))
+
+/* Returns as soon as bitcoind's tip changes, or after timeout: tipid
+ * is NULL if that failed, and can_wait is false if it never will work
+ * (bitcoind too old, or we're using bitcoin-cli). */
+void bitcoind_waitfornewblock_(struct bitcoind *bitcoind,
+			       struct timerel timeout,
+			       void (*cb)(struct bitcoind *bitcoind,
+					  const struct sha256_double *tipid,
+					  bool can_wait,
+					  void *arg),
+			       void *arg);
+#define bitcoind_waitfornewblock(bitcoind_, timeout, cb, arg)		\
+	bitcoind_waitfornewblock_((bitcoind_), (timeout),		\
+				  typesafe_cb_preargs(void, void *,	\
+						      (cb), (arg),	\
+						      struct bitcoind *, \
+						      const struct sha256_double *, \
+						      bool),		\
+				  (arg))
 #endif /* LIGHTNING_DAEMON_BITCOIND_H */
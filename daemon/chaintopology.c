@@ -1,7 +1,9 @@
 #include "bitcoin/block.h"
+#include "bitcoin/blockfilter.h"
 #include "bitcoin/tx.h"
 #include "bitcoind.h"
 #include "chaintopology.h"
+#include "header_store.h"
 #include "jsonrpc.h"
 #include "lightningd.h"
 #include "log.h"
@@ -16,16 +18,37 @@
 #include <ccan/tal/str/str.h>
 #include <inttypes.h>
 
+/* How many blocks we keep in memory (plus any with txs we care about). */
+#define BLOCK_WINDOW 100
+
+/* In our lightning dir, next to the database. */
+#define HEADER_STORE_FILE "blockheaders"
+
 static void start_poll_chaintip(struct chain_topology *topo);
 
+static void poll_timer_expired(struct chain_topology *topo)
+{
+	/* The oneshot frees itself after this. */
+	topo->poll_timer = NULL;
+	start_poll_chaintip(topo);
+}
+
 static void next_topology_timer(struct chain_topology *topo)
 {
+	topo->polling = false;
 	if (topo->startup) {
 		topo->startup = false;
 		io_break(topo);
 	}
-	new_reltimer(topo->timers, topo, topo->poll_time,
-		     start_poll_chaintip, topo);
+
+	/* A block came in while we were busy: go again now. */
+	if (topo->poll_again) {
+		topo->poll_again = false;
+		start_poll_chaintip(topo);
+		return;
+	}
+	topo->poll_timer = new_reltimer(topo->timers, topo, topo->poll_time,
+					poll_timer_expired, topo);
 }
 
 static int cmp_times(const u32 *a, const u32 *b, void *unused)
@@ -42,27 +65,80 @@ static u32 get_mediantime(const struct chain_topology *topo, const struct block
 {
 	unsigned int i;
 	u32 times[11];
+	int height = b->height;
 
 	for (i = 0; i < ARRAY_SIZE(times); i++) {
-		if (!b)
+		struct bitcoin_block_hdr hdr;
+
+		/* Before our window, we need to ask the header store. */
+		if (b) {
+			times[i] = le32_to_cpu(b->hdr.timestamp);
+			b = b->prev;
+		} else if (height - (int)i >= 0
+			   && header_store_get(topo->headers, height - i,
+					       &hdr, NULL))
+			times[i] = le32_to_cpu(hdr.timestamp);
+		else
 			return 0;
-		times[i] = le32_to_cpu(b->hdr.timestamp);
-		b = b->prev;
 	}
 	asort(times, ARRAY_SIZE(times), cmp_times, NULL);
 	return times[ARRAY_SIZE(times) / 2];
 }
 
-/* FIXME: Remove tx from block when peer done. */
+static void destroy_block_tx(struct block_tx *btx)
+{
+	block_tx_map_del(&btx->block->topo->tx_index, btx);
+}
+
 static void add_tx_to_block(struct block *b,
-			    const struct bitcoin_tx *tx, const u32 txnum)
+			    const struct bitcoin_tx *tx,
+			    const struct sha256_double *txid,
+			    const u32 txnum)
 {
 	size_t n = tal_count(b->txs);
+	struct block_tx *btx = tal(b, struct block_tx);
 
 	tal_resize(&b->txs, n+1);
 	tal_resize(&b->txnums, n+1);
 	b->txs[n] = tal_steal(b->txs, tx);
 	b->txnums[n] = txnum;
+
+	btx->txid = *txid;
+	btx->block = b;
+	btx->i = n;
+	block_tx_map_add(&b->topo->tx_index, btx);
+	tal_add_destructor(btx, destroy_block_tx);
+}
+
+static void destroy_block(struct block *b)
+{
+	block_map_del(&b->topo->block_map, b);
+	list_del(&b->list);
+}
+
+/* Once it's connected, we can find it by blkid. */
+static void add_block_to_map(struct chain_topology *topo, struct block *b)
+{
+	block_map_add(&topo->block_map, b);
+	tal_add_destructor(b, destroy_block);
+}
+
+/* Forget the oldest blocks in memory (unless they have txs we want: if
+ * we stop wanting those, forget_buried() gets them). */
+static void trim_window(struct chain_topology *topo, const struct block *tip)
+{
+	while (tip->height - topo->root->height >= BLOCK_WINDOW) {
+		struct block *old = topo->root;
+
+		topo->root = old->next;
+		topo->root->prev = NULL;
+		old->next = NULL;
+		block_map_del(&topo->block_map, old);
+		if (tal_count(old->txs))
+			list_add_tail(&topo->buried, &old->list);
+		else
+			tal_free(old);
+	}
 }
 
 static bool we_broadcast(const struct chain_topology *topo,
@@ -77,12 +153,25 @@ static bool we_broadcast(const struct chain_topology *topo,
 	return false;
 }
 
+/* We already walked it with pull_bitcoin_txid, so it's well-formed. */
+static struct bitcoin_tx *raw_tx(const tal_t *ctx,
+				 const u8 *start, const u8 *end)
+{
+	size_t len = end - start;
+	struct bitcoin_tx *tx = pull_bitcoin_tx(ctx, &start, &len);
+
+	assert(tx && len == 0);
+	return tx;
+}
+
 /* Fills in prev, height, mediantime. */
 static void connect_block(struct chain_topology *topo,
 			  struct block *prev,
 			  struct block *b)
 {
-	size_t i;
+	size_t i, len;
+	const u8 *p;
+	struct bitcoin_outpoint *spends;
 
 	assert(b->height == -1);
 	assert(b->mediantime == 0);
@@ -93,68 +182,76 @@ static void connect_block(struct chain_topology *topo,
 	b->height = b->prev->height + 1;
 	b->mediantime = get_mediantime(topo, b);
 
-	block_map_add(&topo->block_map, b);
-
-	/* Now we see if any of those txs are interesting. */
-	for (i = 0; i < tal_count(b->full_txs); i++) {
-		const struct bitcoin_tx *tx = b->full_txs[i];
+	add_block_to_map(topo, b);
+	header_store_put(topo->headers, b->height, &b->hdr, b->mediantime);
+
+	/* Now we see if any of those txs are interesting.  Most aren't, so
+	 * we only build the ones which are. */
+	p = b->raw_txs;
+	len = tal_count(b->raw_txs);
+	spends = tal_arr(b, struct bitcoin_outpoint, 0);
+	for (i = 0; i < b->num_raw_txs; i++) {
+		const u8 *txstart = p;
+		struct bitcoin_tx *tx = NULL;
 		struct sha256_double txid;
 		size_t j;
 
+		if (!pull_bitcoin_txid(&p, &len, &txid, &spends))
+			fatal("Bad transaction %zu in block %s", i,
+			      tal_hexstr(b, &b->blkid, sizeof(b->blkid)));
+
 		/* Tell them if it spends a txo we care about. */
-		for (j = 0; j < tal_count(tx->input); j++) {
+		for (j = 0; j < tal_count(spends); j++) {
 			struct txwatch_output out;
 			struct txowatch *txo;
-			out.txid = tx->input[j].txid;
-			out.index = tx->input[j].index;
+			out.txid = spends[j].txid;
+			out.index = spends[j].index;
 
 			txo = txowatch_hash_get(&topo->txowatches, &out);
-			if (txo)
+			if (txo) {
+				if (!tx)
+					tx = raw_tx(b, txstart, p);
 				txowatch_fire(topo, txo, tx, j, b);
+			}
 		}
 
 		/* We did spends first, in case that tells us to watch tx. */
-		bitcoin_txid(tx, &txid);
-		if (watching_txid(topo, &txid) || we_broadcast(topo, &txid))
-			add_tx_to_block(b, tx, i);
+		if (watching_txid(topo, &txid) || we_broadcast(topo, &txid)) {
+			if (!tx)
+				tx = raw_tx(b, txstart, p);
+			add_tx_to_block(b, tx, &txid, i);
+			txwatch_confirmed(topo, b, tx, &txid);
+		} else
+			tal_free(tx);
 	}
-	b->full_txs = tal_free(b->full_txs);
+	if (len)
+		fatal("Extra bytes after %"PRIu64" txs in block %s",
+		      b->num_raw_txs,
+		      tal_hexstr(b, &b->blkid, sizeof(b->blkid)));
+	tal_free(spends);
+	b->raw_txs = tal_free(b->raw_txs);
+	b->filter = tal_free(b->filter);
+	trim_window(topo, b);
 
 	/* Tell peers about new block. */
 	notify_new_block(topo, b->height);
 }
 
-static const struct bitcoin_tx *tx_in_block(const struct block *b,
-					    const struct sha256_double *txid)
-{
-	size_t i, n = tal_count(b->txs);
-
-	for (i = 0; i < n; i++) {
-		struct sha256_double this_txid;
-		bitcoin_txid(b->txs[i], &this_txid);
-		if (structeq(&this_txid, txid))
-			return b->txs[i];
-	}
-	return NULL;
-}
-
-/* FIXME: Use hash table. */
 static struct block *block_for_tx(const struct chain_topology *topo,
 				  const struct sha256_double *txid,
 				  const struct bitcoin_tx **tx)
 {
-	struct block *b;
-	const struct bitcoin_tx *dummy_tx;
+	const struct block_tx *btx;
 
-	if (!tx)
-		tx = &dummy_tx;
-
-	for (b = topo->tip; b; b = b->prev) {
-		*tx = tx_in_block(b, txid);
-		if (*tx)
-			return b;
+	btx = block_tx_map_get(&topo->tx_index, txid);
+	if (!btx) {
+		if (tx)
+			*tx = NULL;
+		return NULL;
 	}
-	return NULL;
+	if (tx)
+		*tx = btx->block->txs[btx->i];
+	return btx->block;
 }
 
 size_t get_tx_depth(const struct chain_topology *topo,
@@ -279,10 +376,16 @@ void broadcast_tx(struct chain_topology *topo,
 	/* Peer might vanish: topo owns it to start with. */
 	struct outgoing_tx *otx = tal(topo, struct outgoing_tx);
 	const u8 *rawtx = linearize_tx(otx, tx);
+	size_t i;
 
 	otx->peer = peer;
 	bitcoin_txid(tx, &otx->txid);
 	otx->hextx = tal_hex(otx, rawtx);
+	otx->scripts = tal_arr(otx, const u8 *, tal_count(tx->output));
+	for (i = 0; i < tal_count(tx->output); i++)
+		otx->scripts[i] = tal_dup_arr(otx->scripts, u8,
+					      tx->output[i].script,
+					      tal_len(tx->output[i].script), 0);
 	otx->failed = failed;
 	otx->topo = topo;
 	tal_free(rawtx);
@@ -307,7 +410,7 @@ static void free_blocks(struct chain_topology *topo, struct block *b)
 
 		/* Notify that txs are kicked out. */
 		for (i = 0; i < n; i++)
-			txwatch_fire(topo, b->txs[i], 0);
+			txwatch_unconfirmed(topo, b->txs[i]);
 
 		next = b->next;
 		tal_free(b);
@@ -323,34 +426,154 @@ static void update_fee(struct bitcoind *bitcoind, u64 rate,
 	topo->feerate = rate;
 }
 
-/* B is the new chain (linked by ->next); update topology */
-static void topology_changed(struct chain_topology *topo,
+/* Does anyone still care where this tx is? */
+static bool tx_wanted(const struct chain_topology *topo,
+		      const struct bitcoin_tx *tx)
+{
+	struct txwatch_output out;
+
+	bitcoin_txid(tx, &out.txid);
+	if (watching_txid(topo, &out.txid) || we_broadcast(topo, &out.txid))
+		return true;
+
+	for (out.index = 0; out.index < tal_count(tx->output); out.index++)
+		if (txowatch_hash_get(&topo->txowatches, &out))
+			return true;
+	return false;
+}
+
+/* Old blocks are only kept for the txs in them. */
+static void forget_buried(struct chain_topology *topo)
+{
+	struct block *b, *next;
+
+	list_for_each_safe(&topo->buried, b, next, list) {
+		size_t i;
+
+		for (i = 0; i < tal_count(b->txs); i++)
+			if (tx_wanted(topo, b->txs[i]))
+				break;
+		if (i == tal_count(b->txs))
+			tal_free(b);
+	}
+}
+
+/* We've connected one or more new blocks. */
+static void new_tip(struct chain_topology *topo)
+{
+	/* Tell watch code to re-evaluate all txs. */
+	watch_topology_changed(topo);
+
+	/* That may have been the last they needed from old blocks. */
+	forget_buried(topo);
+
+	/* Maybe need to rebroadcast. */
+	rebroadcast_txs(topo, NULL);
+
+	/* Once per new block head, update fee estimate. */
+	bitcoind_estimate_fee(topo->bitcoind, update_fee, topo);
+}
+
+/* What's in a block filter if we care about a block. */
+static const u8 **filter_scripts(const tal_t *ctx,
+				 const struct chain_topology *topo)
+{
+	const u8 **scripts = watched_scripts(ctx, topo);
+	const struct outgoing_tx *otx;
+	size_t i, n;
+
+	if (!scripts)
+		return NULL;
+
+	/* We want to see our own txs go in, too. */
+	n = tal_count(scripts);
+	list_for_each(&topo->outgoing_txs, otx, list) {
+		bool any = false;
+
+		for (i = 0; i < tal_count(otx->scripts); i++) {
+			if (!blockfilter_has_script(otx->scripts[i]))
+				continue;
+			tal_resize(&scripts, n + 1);
+			scripts[n++] = otx->scripts[i];
+			any = true;
+		}
+		if (!any)
+			return tal_free(scripts);
+	}
+	return scripts;
+}
+
+static bool filter_matches(const struct chain_topology *topo,
+			   const struct sha256_double *blkid,
+			   const u8 *filter)
+{
+	const u8 **scripts = filter_scripts(topo, topo);
+	bool match;
+
+	match = !scripts
+		|| blockfilter_match_any(filter, tal_len(filter), blkid, scripts);
+	tal_free(scripts);
+	return match;
+}
+
+/* We skipped this block's txs, but connecting an earlier one may have
+ * given us something new to watch for. */
+static bool skipped_too_much(const struct chain_topology *topo,
+			     const struct block *b)
+{
+	if (!b->filter || !filter_matches(topo, &b->blkid, b->filter))
+		return false;
+
+	log_debug_struct(topo->log, "Block %s matches new watches: refetching",
+			 struct sha256_double, &b->blkid);
+	return true;
+}
+
+/* Blocks we haven't connected (linked by ->next) */
+static void free_unconnected(struct block *b)
+{
+	struct block *next;
+
+	while (b) {
+		next = b->next;
+		tal_free(b);
+		b = next;
+	}
+}
+
+/* B is the new chain (linked by ->next); update topology.  Returns false
+ * if we need to go back for some of it. */
+static bool topology_changed(struct chain_topology *topo,
 			     struct block *prev,
 			     struct block *b)
 {
+	bool complete = true;
+
 	/* Eliminate any old chain. */
 	if (prev->next)
 		free_blocks(topo, prev->next);
 
 	prev->next = b;
 	do {
+		if (skipped_too_much(topo, b)) {
+			/* In a reorg, the old tip is gone already. */
+			topo->tip = prev;
+			prev->next = NULL;
+			free_unconnected(b);
+			complete = false;
+			break;
+		}
 		connect_block(topo, prev, b);
 		topo->tip = prev = b;
 		b = b->next;
 	} while (b);
 
-	/* Tell watch code to re-evaluate all txs. */
-	watch_topology_changed(topo);
-
-	/* Maybe need to rebroadcast. */
-	rebroadcast_txs(topo, NULL);
-
-	/* Once per new block head, update fee estimate. */
-	bitcoind_estimate_fee(topo->bitcoind, update_fee, topo);
+	new_tip(topo);
+	return complete;
 }
 
 static struct block *new_block(struct chain_topology *topo,
-			       struct bitcoin_block *blk,
+			       struct bitcoin_rawblock *blk,
 			       struct block *next)
 {
 	struct block *b = tal(topo, struct block);
@@ -361,6 +584,7 @@ static struct block *new_block(struct chain_topology *topo,
 	assert(!block_map_get(&topo->block_map, &b->blkid));
 	b->next = next;
 	b->topo = topo;
+	list_node_init(&b->list);
 
 	/* We fill these out in topology_changed */
 	b->height = -1;
@@ -371,26 +595,138 @@ static struct block *new_block(struct chain_topology *topo,
 
 	b->txs = tal_arr(b, const struct bitcoin_tx *, 0);
 	b->txnums = tal_arr(b, u32, 0);
-	b->full_txs = tal_steal(b, blk->tx);
+	b->num_raw_txs = blk->num_txs;
+	b->raw_txs = tal_steal(b, blk->txs);
+	b->filter = tal_steal(b, blk->filter);
 
 	return b;
 }
 
+/* Fetching a block, which we may not need all of. */
+struct block_fetch {
+	struct chain_topology *topo;
+	struct sha256_double blkid;
+	const u8 *filter;
+	void (*cb)(struct bitcoind *bitcoind,
+		   struct bitcoin_rawblock *blk,
+		   void *arg);
+	void *arg;
+};
+
+static void got_skipped_header(struct bitcoind *bitcoind,
+			       struct bitcoin_rawblock *blk,
+			       struct block_fetch *f)
+{
+	/* So we can check again, in case we watch more before connecting. */
+	blk->filter = tal_steal(blk, f->filter);
+	f->cb(bitcoind, blk, f->arg);
+	tal_free(f);
+}
+
+static void got_filter(struct bitcoind *bitcoind,
+		       const u8 *filter,
+		       struct block_fetch *f)
+{
+	struct chain_topology *topo = f->topo;
+
+	if (!filter) {
+		log_unusual(topo->log,
+			    "bitcoind gave no block filter:"
+			    " fetching every block instead");
+		topo->use_block_filters = false;
+	} else if (!filter_matches(topo, &f->blkid, filter)) {
+		f->filter = tal_steal(f, filter);
+		bitcoind_getblockheader(bitcoind, &f->blkid,
+					got_skipped_header, f);
+		return;
+	}
+
+	bitcoind_getrawblock_(bitcoind, &f->blkid, f->cb, f->arg);
+	tal_free(f);
+}
+
+/* If the block's filter says there's nothing for us, we just get the
+ * header. */
+static void get_block_(struct chain_topology *topo,
+		       const struct sha256_double *blkid,
+		       void (*cb)(struct bitcoind *bitcoind,
+				  struct bitcoin_rawblock *blk,
+				  void *arg),
+		       void *arg)
+{
+	struct block_fetch *f;
+
+	if (!topo->use_block_filters) {
+		bitcoind_getrawblock_(topo->bitcoind, blkid, cb, arg);
+		return;
+	}
+
+	f = tal(topo, struct block_fetch);
+	f->topo = topo;
+	f->blkid = *blkid;
+	f->cb = cb;
+	f->arg = arg;
+	bitcoind_getblockfilter(topo->bitcoind, blkid, got_filter, f);
+}
+
+#define get_block(topo, blkid, cb, arg)					\
+	get_block_((topo), (blkid),					\
+		   typesafe_cb_preargs(void, void *,			\
+				       (cb), (arg),			\
+				       struct bitcoind *,		\
+				       struct bitcoin_rawblock *),	\
+		   (arg))
+
 static void add_block(struct bitcoind *bitcoind,
 		      struct chain_topology *topo,
-		      struct bitcoin_block *blk,
+		      struct bitcoin_rawblock *blk,
 		      struct block *next);
 
 static void gather_previous_blocks(struct bitcoind *bitcoind,
-				   struct bitcoin_block *blk,
+				   struct bitcoin_rawblock *blk,
 				   struct block *next)
 {
 	add_block(bitcoind, next->topo, blk, next);
 }
 
+/* A block older than our window?  Then it's the new root, and every
+ * block we know is going. */
+static struct block *reorg_below_window(struct chain_topology *topo,
+					const struct sha256_double *blkid)
+{
+	struct bitcoin_rawblock blk;
+	struct block *b, *old, *next;
+	u32 height, mediantime;
+
+	if (!header_store_find(topo->headers, blkid, topo->root->height,
+			       &height))
+		return NULL;
+
+	log_unusual(topo->log, "Reorg back to block %u, below our window at %u",
+		    height, topo->root->height);
+
+	header_store_get(topo->headers, height, &blk.hdr, &mediantime);
+	blk.num_txs = 0;
+	blk.txs = NULL;
+	blk.filter = NULL;
+	b = new_block(topo, &blk, NULL);
+	b->height = height;
+	b->mediantime = mediantime;
+	add_block_to_map(topo, b);
+
+	old = topo->root;
+	topo->root = topo->tip = b;
+	free_blocks(topo, old);
+	list_for_each_safe(&topo->buried, old, next, list) {
+		if (old->height > height)
+			free_blocks(topo, old);
+	}
+	return b;
+}
+
 static void add_block(struct bitcoind *bitcoind,
 		      struct chain_topology *topo,
-		      struct bitcoin_block *blk,
+		      struct bitcoin_rawblock *blk,
 		      struct block *next)
 {
 	struct block *b, *prev;
@@ -399,38 +735,200 @@ static void add_block(struct bitcoind *bitcoind,
 
 	/* Recurse if we need prev. */
 	prev = block_map_get(&topo->block_map, &blk->hdr.prev_hash);
+	if (!prev)
+		prev = reorg_below_window(topo, &blk->hdr.prev_hash);
 	if (!prev) {
-		bitcoind_getrawblock(bitcoind, &blk->hdr.prev_hash,
-				     gather_previous_blocks, b);
+		get_block(topo, &blk->hdr.prev_hash,
+			  gather_previous_blocks, b);
 		return;
 	}
 
-	/* All done. */
-	topology_changed(topo, prev, b);
-	next_topology_timer(topo);
+	/* All done (unless we need to go back for some). */
+	if (topology_changed(topo, prev, b))
+		next_topology_timer(topo);
+	else
+		start_poll_chaintip(topo);
 }
 
 static void rawblock_tip(struct bitcoind *bitcoind,
-			 struct bitcoin_block *blk,
+			 struct bitcoin_rawblock *blk,
 			 struct chain_topology *topo)
 {
 	add_block(bitcoind, topo, blk, NULL);
 }
 
+/* How many blocks we fetch at once when we're catching up. */
+#define CATCHUP_PARALLEL 8
+
+/* Walking back from the tip one block at a time is slow, and holds every
+ * block in memory until we reach one we know.  When we're further behind,
+ * we fetch forwards by height, several at once, and connect as we go. */
+struct catchup {
+	struct chain_topology *topo;
+
+	/* bitcoind's tip when we started. */
+	struct sha256_double tipid;
+
+	/* Where we started, next to fetch, next to connect, and the end. */
+	u32 first, next_fetch, next_connect, last;
+
+	/* Blocks which arrived early, indexed by height % CATCHUP_PARALLEL */
+	struct bitcoin_rawblock *arrived[CATCHUP_PARALLEL];
+
+	/* Requests outstanding. */
+	size_t in_flight;
+
+	/* Chain changed under us: finish up and do it the slow way. */
+	bool abandoned;
+
+	/* We skipped txs we now want: finish up and start again. */
+	bool refetch;
+};
+
+struct catchup_fetch {
+	struct catchup *c;
+	u32 height;
+};
+
+static void catchup_done(struct catchup *c)
+{
+	struct chain_topology *topo = c->topo;
+
+	if (c->next_connect != c->first)
+		new_tip(topo);
+
+	if (c->refetch)
+		start_poll_chaintip(topo);
+	else if (c->abandoned)
+		get_block(topo, &c->tipid, rawblock_tip, topo);
+	else
+		next_topology_timer(topo);
+	tal_free(c);
+}
+
+/* Connect whatever we can, strictly in order. */
+static void catchup_connect(struct catchup *c)
+{
+	struct chain_topology *topo = c->topo;
+	struct bitcoin_rawblock **next;
+
+	while (!c->abandoned
+	       && *(next = &c->arrived[c->next_connect % CATCHUP_PARALLEL])) {
+		struct bitcoin_rawblock *blk = *next;
+		struct block *b;
+
+		*next = NULL;
+		if (!structeq(&blk->hdr.prev_hash, &topo->tip->blkid)) {
+			log_debug(topo->log,
+				  "Chain changed during catchup at %u",
+				  c->next_connect);
+			c->abandoned = true;
+			tal_free(blk);
+			break;
+		}
+
+		b = new_block(topo, blk, NULL);
+		tal_free(blk);
+		if (skipped_too_much(topo, b)) {
+			c->abandoned = c->refetch = true;
+			tal_free(b);
+			break;
+		}
+		topo->tip->next = b;
+		connect_block(topo, topo->tip, b);
+		topo->tip = b;
+		c->next_connect++;
+	}
+}
+
+static void catchup_fetch_more(struct catchup *c);
+
+static void catchup_got_block(struct bitcoind *bitcoind,
+			      struct bitcoin_rawblock *blk,
+			      struct catchup_fetch *f)
+{
+	struct catchup *c = f->c;
+
+	c->in_flight--;
+	if (!c->abandoned)
+		c->arrived[f->height % CATCHUP_PARALLEL] = tal_steal(c, blk);
+	tal_free(f);
+
+	catchup_connect(c);
+	catchup_fetch_more(c);
+}
+
+static void catchup_got_hash(struct bitcoind *bitcoind,
+			     const struct sha256_double *blkid,
+			     struct catchup_fetch *f)
+{
+	struct catchup *c = f->c;
+
+	if (c->abandoned) {
+		c->in_flight--;
+		tal_free(f);
+		catchup_fetch_more(c);
+		return;
+	}
+	get_block(c->topo, blkid, catchup_got_block, f);
+}
+
+static void catchup_fetch_more(struct catchup *c)
+{
+	while (!c->abandoned
+	       && c->next_fetch <= c->last
+	       && c->next_fetch < c->next_connect + CATCHUP_PARALLEL) {
+		struct catchup_fetch *f = tal(c, struct catchup_fetch);
+
+		f->c = c;
+		f->height = c->next_fetch++;
+		c->in_flight++;
+		bitcoind_getblockhash(c->topo->bitcoind, f->height,
+				      catchup_got_hash, f);
+	}
+
+	if (c->in_flight == 0 && (c->abandoned || c->next_connect > c->last))
+		catchup_done(c);
+}
+
+static void start_catchup(struct bitcoind *bitcoind, u32 blockcount,
+			  struct catchup *c)
+{
+	struct chain_topology *topo = c->topo;
+
+	/* Only one new block (or a reorg)?  Walk back from the tip. */
+	if (blockcount <= topo->tip->height + 1) {
+		get_block(topo, &c->tipid, rawblock_tip, topo);
+		tal_free(c);
+		return;
+	}
+
+	log_debug(topo->log, "Catching up from block %u to %u",
+		  topo->tip->height + 1, blockcount);
+	c->first = c->next_fetch = c->next_connect = topo->tip->height + 1;
+	c->last = blockcount;
+	catchup_fetch_more(c);
+}
+
 static void check_chaintip(struct bitcoind *bitcoind,
 			   const struct sha256_double *tipid,
 			   struct chain_topology *topo)
 {
 	/* 0 is the main tip. */
-	if (!structeq(tipid, &topo->tip->blkid))
-		bitcoind_getrawblock(bitcoind, tipid, rawblock_tip, topo);
-	else
+	if (!structeq(tipid, &topo->tip->blkid)) {
+		struct catchup *c = talz(topo, struct catchup);
+
+		c->topo = topo;
+		c->tipid = *tipid;
+		bitcoind_getblockcount(bitcoind, start_catchup, c);
+	} else
 		/* Next! */
 		next_topology_timer(topo);
 }
 
 static void start_poll_chaintip(struct chain_topology *topo)
 {
+	topo->polling = true;
 	if (!list_empty(&topo->bitcoind->pending)) {
 		log_unusual(topo->log,
 			    "Delaying start poll: commands in progress");
@@ -439,24 +937,84 @@ static void start_poll_chaintip(struct chain_topology *topo)
 		bitcoind_get_chaintip(topo->bitcoind, check_chaintip, topo);
 }
 
+/* Below bitcoind's default -rpcservertimeout (30 seconds), which would
+ * otherwise hang up on us while we wait. */
+#define WAIT_FOR_BLOCK_TIMEOUT time_from_sec(20)
+
+static void wait_for_block(struct chain_topology *topo);
+
+/* bitcoind tells us as soon as it has a new tip: the timer is just a
+ * fallback then. */
+static void got_new_block(struct bitcoind *bitcoind,
+			  const struct sha256_double *tipid,
+			  bool can_wait,
+			  struct chain_topology *topo)
+{
+	if (!tipid) {
+		if (!can_wait) {
+			log_unusual(topo->log,
+				    "bitcoind can't tell us about blocks:"
+				    " polling every %"PRIu64" seconds",
+				    time_to_sec(topo->poll_time));
+			return;
+		}
+
+		/* Rely on polling for a cycle, then ask again. */
+		log_debug(topo->log,
+			  "bitcoind didn't wait for a block:"
+			  " asking again in %"PRIu64" seconds",
+			  time_to_sec(topo->poll_time));
+		new_reltimer(topo->timers, topo, topo->poll_time,
+			     wait_for_block, topo);
+		return;
+	}
+
+	/* Timeouts simply give us the tip we already have. */
+	if (!structeq(tipid, &topo->tip->blkid)) {
+		if (topo->polling)
+			topo->poll_again = true;
+		else {
+			topo->poll_timer = tal_free(topo->poll_timer);
+			start_poll_chaintip(topo);
+		}
+	}
+	wait_for_block(topo);
+}
+
+static void wait_for_block(struct chain_topology *topo)
+{
+	bitcoind_waitfornewblock(topo->bitcoind, WAIT_FOR_BLOCK_TIMEOUT,
+				 got_new_block, topo);
+}
+
 static void init_topo(struct bitcoind *bitcoind,
-		      struct bitcoin_block *blk,
+		      struct bitcoin_rawblock *blk,
 		      struct chain_topology *topo)
 {
 	topo->root = new_block(topo, blk, NULL);
 	topo->root->height = topo->first_blocknum;
-	block_map_add(&topo->block_map, topo->root);
+	add_block_to_map(topo, topo->root);
 	topo->tip = topo->root;
 
+	topo->headers = header_store_new(topo, HEADER_STORE_FILE,
+					 topo->first_blocknum);
+	header_store_put(topo->headers, topo->root->height,
+			 &topo->root->hdr, topo->root->mediantime);
+
 	/* Now grab chaintip immediately. */
+	topo->polling = true;
 	bitcoind_get_chaintip(bitcoind, check_chaintip, topo);
+
+	if (!topo->poll_only)
+		wait_for_block(topo);
 }
 
 static void get_init_block(struct bitcoind *bitcoind,
 			   const struct sha256_double *blkid,
 			   struct chain_topology *topo)
 {
-	bitcoind_getrawblock(bitcoind, blkid, init_topo, topo);
+	/* We start watching after this, so don't care what's in it. */
+	bitcoind_getblockheader(bitcoind, blkid, init_topo, topo);
 }
 
 static void get_init_blockhash(struct bitcoind *bitcoind, u32 blockcount,
@@ -512,23 +1070,15 @@ u64 get_feerate(const struct chain_topology *topo)
 struct txlocator *locate_tx(const void *ctx, const struct chain_topology *topo,
 			    const struct sha256_double *txid)
 {
-	struct block *block = block_for_tx(topo, txid, NULL);
-	if (block == NULL) {
+	const struct block_tx *btx = block_tx_map_get(&topo->tx_index, txid);
+	if (btx == NULL) {
 		return NULL;
 	}
 
 	struct txlocator *loc = talz(ctx, struct txlocator);
-	loc->blkheight = block->height;
-	size_t i, n = tal_count(block->txs);
-	for (i = 0; i < n; i++) {
-		struct sha256_double this_txid;
-		bitcoin_txid(block->txs[i], &this_txid);
-		if (structeq(&this_txid, txid)){
-			loc->index = block->txnums[i];
-			return loc;
-		}
-	}
-	return tal_free(loc);
+	loc->blkheight = btx->block->height;
+	loc->index = btx->block->txnums[btx->i];
+	return loc;
 }
 
 void json_dev_broadcast(struct command *cmd,
@@ -592,6 +1142,12 @@ static void destroy_outgoing_txs(struct chain_topology *topo)
 		tal_free(otx);
 }
 
+static void destroy_txwatch_wakes(struct chain_topology *topo)
+{
+	/* The lists themselves are tal children of topo. */
+	uintmap_clear(&topo->txwatch_wakes);
+}
+
 struct chain_topology *new_topology(const tal_t *ctx, struct log *log)
 {
 	struct chain_topology *topo = tal(ctx, struct chain_topology);
@@ -600,10 +1156,21 @@ struct chain_topology *new_topology(const tal_t *ctx, struct log *log)
 	list_head_init(&topo->outgoing_txs);
 	txwatch_hash_init(&topo->txwatches);
 	txowatch_hash_init(&topo->txowatches);
+	uintmap_init(&topo->txwatch_wakes);
+	tal_add_destructor(topo, destroy_txwatch_wakes);
+	list_head_init(&topo->buried);
+	block_tx_map_init(&topo->tx_index);
+	topo->headers = NULL;
+	/* No blocks until setup_topology. */
+	topo->root = topo->tip = NULL;
 	topo->log = log;
 	topo->default_fee_rate = 40000;
 	topo->override_fee_rate = 0;
 	topo->dev_no_broadcast = false;
+	topo->use_block_filters = false;
+	topo->poll_only = false;
+	topo->poll_timer = NULL;
+	topo->polling = topo->poll_again = false;
 
 	return topo;
 }
@@ -3,6 +3,7 @@
 #include "config.h"
 #include <bitcoin/block.h>
 #include <bitcoin/shadouble.h>
+#include <ccan/intmap/intmap.h>
 #include <ccan/list/list.h>
 #include <ccan/short_types/short_types.h>
 #include <ccan/structeq/structeq.h>
@@ -14,7 +15,9 @@
 struct bitcoin_tx;
 struct bitcoind;
 struct command;
+struct header_store;
 struct lightningd_state;
+struct oneshot;
 struct peer;
 struct sha256_double;
 struct txwatch;
@@ -25,6 +28,8 @@ struct outgoing_tx {
 	struct peer *peer;
 	const char *hextx;
 	struct sha256_double txid;
+	/* Its output scripts, to look for in block filters. */
+	const u8 **scripts;
 	void (*failed)(struct peer *peer, int exitstatus, const char *err);
 	/* FIXME: Remove this. */
 	struct chain_topology *topo;
@@ -33,6 +38,9 @@ struct outgoing_tx {
 struct block {
 	int height;
 
+	/* On topo->buried if it's fallen out of our window. */
+	struct list_node list;
+
 	/* Actual header. */
 	struct bitcoin_block_hdr hdr;
 
@@ -54,8 +62,12 @@ struct block {
 	/* And their associated index in the block */
 	u32 *txnums;
 
-	/* Full copy of txs (trimmed to txs list in connect_block) */
-	struct bitcoin_tx **full_txs;
+	/* Linearized txs (scanned, then freed, in connect_block) */
+	u64 num_raw_txs;
+	const u8 *raw_txs;
+
+	/* If we skipped the txs, the BIP158 filter which said we could. */
+	const u8 *filter;
 
 	/* FIXME: Remove this. */
 	struct chain_topology *topo;
@@ -81,10 +93,40 @@ static inline bool block_eq(const struct block *b, const struct sha256_double *k
 }
 HTABLE_DEFINE_TYPE(struct block, keyof_block_map, hash_sha, block_eq, block_map);
 
+/* Where to find a tx we care about: index into block->txs. */
+struct block_tx {
+	struct sha256_double txid;
+	struct block *block;
+	size_t i;
+};
+
+static inline const struct sha256_double *keyof_block_tx(const struct block_tx *btx)
+{
+	return &btx->txid;
+}
+
+static inline bool block_tx_eq(const struct block_tx *btx,
+			       const struct sha256_double *key)
+{
+	return structeq(&btx->txid, key);
+}
+HTABLE_DEFINE_TYPE(struct block_tx, keyof_block_tx, hash_sha, block_tx_eq,
+		   block_tx_map);
+
 struct chain_topology {
+	/* The last BLOCK_WINDOW blocks, root to tip. */
 	struct block *root;
 	struct block *tip;
 	struct block_map block_map;
+
+	/* Older blocks, but only those containing txs we still care about. */
+	struct list_head buried;
+
+	/* Where the txs in all those blocks are. */
+	struct block_tx_map tx_index;
+
+	/* Every header from first_blocknum to tip. */
+	struct header_store *headers;
 	u64 feerate;
 	bool startup;
 
@@ -97,6 +139,16 @@ struct chain_topology {
 	/* How often to poll. */
 	struct timerel poll_time;
 
+	/* Timer for next poll (if any), and are we polling now? */
+	struct oneshot *poll_timer;
+	bool polling;
+
+	/* bitcoind told us about a block while we were polling. */
+	bool poll_again;
+
+	/* Don't wait for bitcoind to tell us about blocks, just poll. */
+	bool poll_only;
+
 	/* The bitcoind. */
 	struct bitcoind *bitcoind;
 
@@ -116,8 +168,14 @@ struct chain_topology {
 	struct txwatch_hash txwatches;
 	struct txowatch_hash txowatches;
 
+	/* Lists of txwatches to tell about their depth, by tip height. */
+	UINTMAP(struct list_head *) txwatch_wakes;
+
 	/* Suppress broadcast (for testing) */
 	bool dev_no_broadcast;
+
+	/* Only fetch blocks whose BIP158 filter matches what we watch. */
+	bool use_block_filters;
 };
 
 /* Information relevant to locating a TX in a blockchain. */
@@ -131,7 +189,7 @@ struct txlocator {
 };
 
 /* This is the number of blocks which would have to be mined to invalidate
- * the tx (optional tx is filled in if return is non-zero). */
+ * the tx (optional tx is filled in, or set to NULL if return is zero). */
 size_t get_tx_depth(const struct chain_topology *topo,
 		    const struct sha256_double *txid,
 		    const struct bitcoin_tx **tx);
@@ -0,0 +1,162 @@
+#include "header_store.h"
+#include "log.h"
+#include <ccan/build_assert/build_assert.h>
+#include <ccan/endian/endian.h>
+#include <ccan/htable/htable_type.h>
+#include <ccan/structeq/structeq.h>
+#include <ccan/tal/str/str.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+/* What's on disk, for each height from base up. */
+struct stored_header {
+	struct bitcoin_block_hdr hdr;
+	le32 mediantime;
+};
+
+/* What's in memory, so we can find a height without reading them all. */
+struct stored_id {
+	struct sha256_double blkid;
+	u32 height;
+};
+
+static const struct sha256_double *keyof_stored_id(const struct stored_id *s)
+{
+	return &s->blkid;
+}
+
+static size_t hash_blkid(const struct sha256_double *key)
+{
+	size_t ret;
+
+	memcpy(&ret, key, sizeof(ret));
+	return ret;
+}
+
+static bool stored_id_eq(const struct stored_id *s,
+			 const struct sha256_double *key)
+{
+	return structeq(&s->blkid, key);
+}
+HTABLE_DEFINE_TYPE(struct stored_id, keyof_stored_id, hash_blkid,
+		   stored_id_eq, stored_id_map);
+
+struct header_store {
+	const char *filename;
+	int fd;
+
+	/* We have heights base to base + num - 1. */
+	u32 base, num;
+
+	/* Their ids, by height - base, and by blkid. */
+	struct stored_id **ids;
+	struct stored_id_map id_map;
+};
+
+static void destroy_header_store(struct header_store *hs)
+{
+	stored_id_map_clear(&hs->id_map);
+	close(hs->fd);
+}
+
+struct header_store *header_store_new(const tal_t *ctx, const char *filename,
+				      u32 base)
+{
+	struct header_store *hs = tal(ctx, struct header_store);
+
+	/* No padding, so the file is the same everywhere. */
+	BUILD_ASSERT(sizeof(struct stored_header) == 84);
+
+	hs->filename = tal_strdup(hs, filename);
+	hs->fd = open(filename, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if (hs->fd < 0)
+		fatal("Could not create %s: %s", filename, strerror(errno));
+	hs->base = base;
+	hs->num = 0;
+	hs->ids = tal_arr(hs, struct stored_id *, 0);
+	stored_id_map_init(&hs->id_map);
+	tal_add_destructor(hs, destroy_header_store);
+	return hs;
+}
+
+static off_t header_off(const struct header_store *hs, u32 height)
+{
+	return (off_t)(height - hs->base) * sizeof(struct stored_header);
+}
+
+void header_store_put(struct header_store *hs, u32 height,
+		      const struct bitcoin_block_hdr *hdr, u32 mediantime)
+{
+	struct stored_header sh;
+
+	if (height < hs->base || height > hs->base + hs->num)
+		fatal("%s: can't put height %u, have %u-%u",
+		      hs->filename, height, hs->base, hs->base + hs->num);
+
+	sh.hdr = *hdr;
+	sh.mediantime = cpu_to_le32(mediantime);
+	if (pwrite(hs->fd, &sh, sizeof(sh), header_off(hs, height))
+	    != sizeof(sh))
+		fatal("%s: writing height %u: %s",
+		      hs->filename, height, strerror(errno));
+
+	/* Reorg?  Anything above this is gone. */
+	if (height + 1 < hs->base + hs->num
+	    && ftruncate(hs->fd, header_off(hs, height + 1)) != 0)
+		fatal("%s: truncating to %u: %s",
+		      hs->filename, height, strerror(errno));
+
+	/* This one's replaced too. */
+	while (hs->num > height - hs->base) {
+		struct stored_id *old = hs->ids[--hs->num];
+		stored_id_map_del(&hs->id_map, old);
+		tal_free(old);
+	}
+
+	hs->num = height - hs->base + 1;
+	tal_resize(&hs->ids, hs->num);
+	hs->ids[hs->num - 1] = tal(hs->ids, struct stored_id);
+	sha256_double(&hs->ids[hs->num - 1]->blkid, hdr, sizeof(*hdr));
+	hs->ids[hs->num - 1]->height = height;
+	stored_id_map_add(&hs->id_map, hs->ids[hs->num - 1]);
+}
+
+static void read_headers(const struct header_store *hs, u32 height, u32 n,
+			 struct stored_header *sh)
+{
+	ssize_t len = (ssize_t)n * sizeof(*sh);
+
+	if (pread(hs->fd, sh, len, header_off(hs, height)) != len)
+		fatal("%s: reading %u headers at %u: %s",
+		      hs->filename, n, height, strerror(errno));
+}
+
+bool header_store_get(const struct header_store *hs, u32 height,
+		      struct bitcoin_block_hdr *hdr, u32 *mediantime)
+{
+	struct stored_header sh;
+
+	if (height < hs->base || height >= hs->base + hs->num)
+		return false;
+
+	read_headers(hs, height, 1, &sh);
+	*hdr = sh.hdr;
+	if (mediantime)
+		*mediantime = le32_to_cpu(sh.mediantime);
+	return true;
+}
+
+bool header_store_find(const struct header_store *hs,
+		       const struct sha256_double *blkid, u32 below,
+		       u32 *height)
+{
+	const struct stored_id *s = stored_id_map_get(&hs->id_map, blkid);
+
+	if (!s || s->height >= below)
+		return false;
+	*height = s->height;
+	return true;
+}
@@ -0,0 +1,30 @@
+#ifndef LIGHTNING_DAEMON_HEADER_STORE_H
+#define LIGHTNING_DAEMON_HEADER_STORE_H
+#include "config.h"
+#include <bitcoin/block.h>
+#include <ccan/short_types/short_types.h>
+#include <ccan/tal/tal.h>
+#include <stdbool.h>
+
+/* Every block header (and its mediantime) we've connected, in a file
+ * indexed by height, so we don't need to keep old blocks in memory (just
+ * their ids, to find them again). */
+struct header_store;
+
+/* Starts empty: the first header will be for height base. */
+struct header_store *header_store_new(const tal_t *ctx, const char *filename,
+				      u32 base);
+
+/* Set header at height (at most one past the top), forgetting any above. */
+void header_store_put(struct header_store *hs, u32 height,
+		      const struct bitcoin_block_hdr *hdr, u32 mediantime);
+
+/* False if we don't have that height.  mediantime may be NULL. */
+bool header_store_get(const struct header_store *hs, u32 height,
+		      struct bitcoin_block_hdr *hdr, u32 *mediantime);
+
+/* False if we don't have that header at a height less than below. */
+bool header_store_find(const struct header_store *hs,
+		       const struct sha256_double *blkid, u32 below,
+		       u32 *height);
+#endif /* LIGHTNING_DAEMON_HEADER_STORE_H */
@@ -178,6 +178,44 @@ static const struct json_command getlog_command = {
 };
 AUTODATA(json_command, &getlog_command);
 
+static void json_setloglevel(struct command *cmd,
+			     const char *buffer, const jsmntok_t *params)
+{
+	jsmntok_t *level;
+	enum log_level l;
+
+	if (!json_get_params(buffer, params, "level", &level, NULL)) {
+		command_fail(cmd, "Need level");
+		return;
+	}
+
+	if (json_tok_streq(buffer, level, "io"))
+		l = LOG_IO;
+	else if (json_tok_streq(buffer, level, "debug"))
+		l = LOG_DBG;
+	else if (json_tok_streq(buffer, level, "info"))
+		l = LOG_INFORM;
+	else if (json_tok_streq(buffer, level, "unusual"))
+		l = LOG_UNUSUAL;
+	else if (json_tok_streq(buffer, level, "broken"))
+		l = LOG_BROKEN;
+	else {
+		command_fail(cmd, "Invalid level param");
+		return;
+	}
+
+	set_log_level(cmd->dstate->log_book, l);
+	command_success(cmd, null_response(cmd));
+}
+
+static const struct json_command setloglevel_command = {
+	"setloglevel",
+	json_setloglevel,
+	"Set the level logs are printed at: io|debug|info|unusual|broken",
+	"Returns an empty result on success"
+};
+AUTODATA(json_command, &setloglevel_command);
+
 static void json_rhash(struct command *cmd,
 		       const char *buffer, const jsmntok_t *params)
 {
@@ -83,7 +83,8 @@ int main(int argc, char *argv[])
 						 | SECP256K1_CONTEXT_SIGN);
 
 	dstate->topology = new_topology(dstate, dstate->base_log);
-	dstate->bitcoind = new_bitcoind(dstate, dstate->base_log);
+	dstate->bitcoind = new_bitcoind(dstate, &dstate->timers,
+					dstate->base_log);
 	dstate->bitcoind->chainparams = chainparams_for_network("regtest");
 
 	/* Handle options and config; move to .lightningd */
@@ -35,6 +35,12 @@ struct log_book {
 		      const char *str, void *arg);
 	void *print_arg;
 	enum log_level print_level;
+	/* We keep entries at this level even if we don't print them. */
+	enum log_level record_level;
+	/* We discarded the last entry, so discard anything added to it. */
+	bool discarding;
+	void (*levelfn)(void *arg);
+	void *levelfn_arg;
 	struct timeabs init_time;
 
 	struct list_head log;
@@ -105,6 +111,9 @@ struct log_book *new_log_book(const tal_t *ctx,
 	lr->max_mem = max_mem;
 	lr->print = log_default_print;
 	lr->print_level = printlevel;
+	lr->record_level = LOG_IO;
+	lr->discarding = false;
+	lr->levelfn = NULL;
 	lr->init_time = time_now();
 	list_head_init(&lr->log);
 
@@ -135,6 +144,40 @@ enum log_level get_log_level(struct log_book *lr)
 void set_log_level(struct log_book *lr, enum log_level level)
 {
 	lr->print_level = level;
+	if (lr->levelfn)
+		lr->levelfn(lr->levelfn_arg);
+}
+
+enum log_level get_log_record_level(struct log_book *lr)
+{
+	return lr->record_level;
+}
+
+void set_log_record_level(struct log_book *lr, enum log_level level)
+{
+	lr->record_level = level;
+	if (lr->levelfn)
+		lr->levelfn(lr->levelfn_arg);
+}
+
+enum log_level log_min_level(const struct log_book *lr)
+{
+	if (lr->print_level < lr->record_level)
+		return lr->print_level;
+	return lr->record_level;
+}
+
+void set_log_levelfn_(struct log_book *lr, void (*fn)(void *arg), void *arg)
+{
+	lr->levelfn = fn;
+	lr->levelfn_arg = arg;
+}
+
+/* Neither printed nor kept?  Then don't even format it. */
+static bool log_discard(struct log_book *lr, enum log_level level)
+{
+	lr->discarding = (level < log_min_level(lr));
+	return lr->discarding;
 }
 
 void set_log_prefix(struct log *log, const char *prefix)
@@ -201,7 +244,12 @@ static struct log_entry *new_log_entry(struct log *log, enum log_level level)
 
 void logv(struct log *log, enum log_level level, const char *fmt, va_list ap)
 {
-	struct log_entry *l = new_log_entry(log, level);
+	struct log_entry *l;
+
+	if (log_discard(log->lr, level))
+		return;
+
+	l = new_log_entry(log, level);
 
 	l->log = tal_vfmt(l, fmt, ap);
 
@@ -215,8 +263,12 @@ void logv(struct log *log, enum log_level level, const char *fmt, va_list ap)
 void log_io(struct log *log, bool in, const void *data, size_t len)
 {
 	int save_errno = errno;
-	struct log_entry *l = new_log_entry(log, LOG_IO);
+	struct log_entry *l;
+
+	if (log_discard(log->lr, LOG_IO))
+		return;
 
+	l = new_log_entry(log, LOG_IO);
 	l->log = tal_arr(l, char, 1 + len);
 	l->log[0] = in;
 	memcpy(l->log + 1, data, len);
@@ -237,8 +289,14 @@ void log_io(struct log *log, bool in, const void *data, size_t len)
 
 void logv_add(struct log *log, const char *fmt, va_list ap)
 {
-	struct log_entry *l = list_tail(&log->lr->log, struct log_entry, list);
-	size_t oldlen = strlen(l->log);
+	struct log_entry *l;
+	size_t oldlen;
+
+	if (log->lr->discarding)
+		return;
+
+	l = list_tail(&log->lr->log, struct log_entry, list);
+	oldlen = strlen(l->log);
 
 	/* Remove from list, so it doesn't get pruned. */
 	log->lr->mem_used -= sizeof(*l) + oldlen + 1;
@@ -274,11 +332,15 @@ void log_struct_(struct log *log, int level,
 		 const char *structname,
 		 const char *fmt, ...)
 {
-	const tal_t *ctx = tal_tmpctx(log);
+	const tal_t *ctx;
 	char *s;
 	union printable_types u;
 	va_list ap;
 
+	if (level == -1 ? log->lr->discarding : log_discard(log->lr, level))
+		return;
+	ctx = tal_tmpctx(log);
+
 	/* Macro wrappers ensure we only have one arg. */
 	va_start(ap, fmt);
 	u.charp_ = va_arg(ap, const char *);
@@ -304,6 +366,9 @@ void log_blob_(struct log *log, int level, const char *fmt,
 	const void *blob;
 	const char *hex;
 
+	if (level == -1 ? log->lr->discarding : log_discard(log->lr, level))
+		return;
+
 	/* Macro wrappers ensure we only have one arg. */
 	va_start(ap, len);
 	blob = va_arg(ap, void *);
@@ -409,6 +474,19 @@ static char *arg_log_level(const char *arg, struct log *log)
 	return tal_fmt(NULL, "unknown log level");
 }
 
+static char *arg_log_record_level(const char *arg, struct log *log)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(log_levels); i++) {
+		if (strcasecmp(arg, log_levels[i].name) == 0) {
+			set_log_record_level(log->lr, log_levels[i].level);
+			return NULL;
+		}
+	}
+	return tal_fmt(NULL, "unknown log level");
+}
+
 static char *arg_log_prefix(const char *arg, struct log *log)
 {
 	set_log_prefix(log, arg);
@@ -442,6 +520,9 @@ void opt_register_logging(struct log *log)
 {
 	opt_register_arg("--log-level", arg_log_level, NULL, log,
 			 "log level (debug, info, unusual, broken)");
+	opt_register_arg("--log-record-level", arg_log_record_level, NULL, log,
+			 "lowest log level kept for getlog and crash logs,"
+			 " even if not printed (io, debug, info, unusual, broken)");
 	opt_register_arg("--log-prefix", arg_log_prefix, NULL, log,
 			 "log prefix");
 	opt_register_arg("--log-file=<file>", arg_log_to_file, NULL, log,
@@ -86,6 +86,15 @@ void PRINTF_FMT(4,5) log_struct_(struct log *log, int level,
 
 enum log_level get_log_level(struct log_book *lr);
 void set_log_level(struct log_book *lr, enum log_level level);
+/* Entries below both this and the print level aren't kept (default all). */
+enum log_level get_log_record_level(struct log_book *lr);
+void set_log_record_level(struct log_book *lr, enum log_level level);
+/* The lowest level which is printed or kept: anything less is discarded. */
+enum log_level log_min_level(const struct log_book *lr);
+/* Called whenever either level is set. */
+#define set_log_levelfn(lr, fn, arg)					\
+	set_log_levelfn_((lr), typesafe_cb(void, void *, (fn), (arg)), (arg))
+void set_log_levelfn_(struct log_book *lr, void (*fn)(void *arg), void *arg);
 void set_log_prefix(struct log *log, const char *prefix);
 const char *log_prefix(const struct log *log);
 #define set_log_outfn(lr, print, arg)					\
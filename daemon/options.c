@@ -505,6 +505,30 @@ void register_opts(struct lightningd_state *dstate)
 	opt_register_arg("--bitcoin-datadir", opt_set_charp, NULL,
 			 &dstate->bitcoind->datadir,
 			 "-datadir arg for bitcoin-cli");
+	opt_register_arg("--bitcoin-rpcconnect", opt_set_charp, NULL,
+			 &dstate->bitcoind->rpcconnect,
+			 "bitcoind JSON-RPC host (default: from bitcoin.conf)");
+	opt_register_arg("--bitcoin-rpcport", opt_set_charp, NULL,
+			 &dstate->bitcoind->rpcport,
+			 "bitcoind JSON-RPC port (default: from bitcoin.conf)");
+	opt_register_arg("--bitcoin-rpcuser", opt_set_charp, NULL,
+			 &dstate->bitcoind->rpcuser,
+			 "bitcoind JSON-RPC user (default: from bitcoin.conf)");
+	opt_register_arg("--bitcoin-rpcpassword", opt_set_charp, NULL,
+			 &dstate->bitcoind->rpcpassword,
+			 "bitcoind JSON-RPC password (default: from bitcoin.conf, or .cookie)");
+	opt_register_noarg("--bitcoin-cli-only", opt_set_bool,
+			   &dstate->bitcoind->cli_only,
+			   "Always run bitcoin-cli, rather than using JSON-RPC");
+	opt_register_noarg("--bitcoin-rest", opt_set_bool,
+			   &dstate->bitcoind->rest,
+			   "Fetch blocks in binary using bitcoind's REST interface (needs bitcoind -rest)");
+	opt_register_noarg("--bitcoin-blockfilters", opt_set_bool,
+			   &dstate->topology->use_block_filters,
+			   "Only fetch blocks whose BIP158 filters match what we watch (needs bitcoind -blockfilterindex)");
+	opt_register_noarg("--bitcoin-poll-only", opt_set_bool,
+			   &dstate->topology->poll_only,
+			   "Only look for new blocks every --bitcoin-poll, rather than asking bitcoind to tell us");
 	opt_register_logging(dstate->base_log);
 	opt_register_version();
 
@@ -642,12 +642,12 @@ u8 *write_ip(const tal_t *ctx, const char *srcip, int port)
 /* Verify the signature of a channel_update message */
 static bool check_channel_update(const struct pubkey *node_key,
 				 const secp256k1_ecdsa_signature *node_sig,
-				 const u8 *update)
+				 const u8 *update, size_t len)
 {
 	/* 2 byte msg type + 64 byte signatures */
 	int offset = 66;
 	struct sha256_double hash;
-	sha256_double(&hash, update + offset, tal_len(update) - offset);
+	sha256_double(&hash, update + offset, len - offset);
 
 	return check_signed_hash(&hash, node_sig, node_key);
 }
@@ -689,18 +689,21 @@ void handle_channel_announcement(
 	struct pubkey bitcoin_key_2;
 	struct sha256_double chain_hash;
 	const tal_t *tmpctx = tal_tmpctx(rstate);
-	u8 *features;
+	u16 features_len;
+	const u8 *features;
 
 	serialized = tal_dup_arr(tmpctx, u8, announce, len, 0);
-	if (!fromwire_channel_announcement(tmpctx, serialized, NULL,
-					   &node_signature_1, &node_signature_2,
-					   &bitcoin_signature_1,
-					   &bitcoin_signature_2,
-					   &features,
-					   &chain_hash,
-					   &short_channel_id,
-					   &node_id_1, &node_id_2,
-					   &bitcoin_key_1, &bitcoin_key_2)) {
+	if (!fromwire_channel_announcement_view(serialized, NULL,
+						&node_signature_1,
+						&node_signature_2,
+						&bitcoin_signature_1,
+						&bitcoin_signature_2,
+						&features_len, &features,
+						&chain_hash,
+						&short_channel_id,
+						&node_id_1, &node_id_2,
+						&bitcoin_key_1,
+						&bitcoin_key_2)) {
 		tal_free(tmpctx);
 		return;
 	}
@@ -770,18 +773,19 @@ void handle_channel_update(struct routing_state *rstate, const u8 *update, size_
 	u64 htlc_minimum_msat;
 	u32 fee_base_msat;
 	u32 fee_proportional_millionths;
-	const tal_t *tmpctx = tal_tmpctx(rstate);
+	const tal_t *tmpctx;
 	struct sha256_double chain_hash;
+	size_t max = len;
 
-	serialized = tal_dup_arr(tmpctx, u8, update, len, 0);
-	if (!fromwire_channel_update(serialized, NULL, &signature,
+	/* Most updates are stale or unknown: only copy once we keep it. */
+	if (!fromwire_channel_update(update, &max, &signature,
 				     &chain_hash, &short_channel_id,
 				     &timestamp, &flags, &expiry,
 				     &htlc_minimum_msat, &fee_base_msat,
-				     &fee_proportional_millionths)) {
-		tal_free(tmpctx);
+				     &fee_proportional_millionths))
 		return;
-	}
+
+	tmpctx = tal_tmpctx(rstate);
 
 	/* BOLT #7:
 	 *
@@ -818,7 +822,7 @@ void handle_channel_update(struct routing_state *rstate, const u8 *update, size_
 		log_debug(rstate->base_log, "Ignoring outdated update.");
 		tal_free(tmpctx);
 		return;
-	} else if (!check_channel_update(&c->src->id, &signature, serialized)) {
+	} else if (!check_channel_update(&c->src->id, &signature, update, len)) {
 		log_debug(rstate->base_log, "Signature verification failed.");
 		tal_free(tmpctx);
 		return;
@@ -838,6 +842,7 @@ void handle_channel_update(struct routing_state *rstate, const u8 *update, size_
 		  flags
 		);
 
+	serialized = tal_dup_arr(tmpctx, u8, update, len, 0);
 	u8 *tag = tal_arr(tmpctx, u8, 0);
 	towire_short_channel_id(&tag, &short_channel_id);
 	towire_u16(&tag, flags & 0x1);
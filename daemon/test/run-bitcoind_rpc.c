@@ -0,0 +1,545 @@
+#include "daemon/bitcoind.c"
+#include "daemon/jsmn/jsmn.c"
+#include "daemon/json.c"
+#include "daemon/timeout.c"
+#include <arpa/inet.h>
+#include <assert.h>
+#include <ccan/structeq/structeq.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+
+/* AUTOGENERATED MOCKS START */
+/* AUTOGENERATED MOCKS END */
+
+void log_(struct log *log UNNEEDED, enum log_level level UNNEEDED,
+	  const char *fmt UNNEEDED, ...)
+{
+}
+
+void fatal(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	abort();
+}
+
+/* A tiny bitcoind: JSON-RPC over keep-alive HTTP, user:pass auth. */
+struct server_conn {
+	struct list_node list;
+	struct io_conn *conn;
+	char *in;
+	size_t used, new_in, hdrlen, bodylen;
+	char *reply;
+};
+
+static struct list_head server_conns;
+static size_t num_accepted, num_requests, num_rest, num_getblock;
+/* Like a restarting bitcoind: hang up on this many connections. */
+static size_t refuse;
+/* Like bitcoind -rest. */
+static bool rest_enabled;
+/* We can hold replies until a number of requests are in flight. */
+static size_t held, max_held, hold_left;
+/* waitfornewblock waits for us to say there's a block. */
+static struct server_conn *waiting;
+static char *waiting_id;
+/* Or it can fail with this error code. */
+static int waiting_error;
+
+/* Not nul-terminated: body may be binary. */
+static char *http_reply_bin(const tal_t *ctx, int status,
+			    const void *body, size_t len)
+{
+	char *reply = tal_fmt(ctx, "HTTP/1.1 %i Whatever\r\n"
+			      "Content-Type: application/json\r\n"
+			      "Content-Length: %zu\r\n"
+			      "\r\n", status, len);
+	size_t hdrlen = strlen(reply);
+
+	tal_resize(&reply, hdrlen + len);
+	memcpy(reply + hdrlen, body, len);
+	return reply;
+}
+
+static char *http_reply(const tal_t *ctx, int status, const char *body)
+{
+	return http_reply_bin(ctx, status, body, strlen(body));
+}
+
+/* An empty block: header then zero transactions. */
+static u8 *test_block(const tal_t *ctx)
+{
+	struct bitcoin_block_hdr hdr;
+	u8 *block;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.version = cpu_to_le32(4);
+	memset(&hdr.prev_hash, 0x11, sizeof(hdr.prev_hash));
+	block = tal_arr(ctx, u8, sizeof(hdr) + 1);
+	memcpy(block, &hdr, sizeof(hdr));
+	block[sizeof(hdr)] = 0;
+	return block;
+}
+
+static char *blockhash_for(const tal_t *ctx, u32 height)
+{
+	return tal_fmt(ctx, "%064x", height);
+}
+
+static char *server_answer(struct server_conn *sc)
+{
+	char *body;
+	const jsmntok_t *toks, *method, *params, *id, *p0;
+	bool valid;
+	char *reply;
+
+	/* REST doesn't need authorization. */
+	if (strstarts(sc->in, "GET /rest/block/")) {
+		num_rest++;
+		if (!rest_enabled)
+			return http_reply(sc, 404, "");
+		assert(strstarts(sc->in + strlen("GET /rest/block/"),
+				 tal_fmt(sc, "%s.bin HTTP/1.1\r\n",
+					 blockhash_for(sc, 7))));
+		return http_reply_bin(sc, 200, test_block(sc),
+				      tal_count(test_block(sc)));
+	}
+
+	if (!strstr(sc->in, "\r\nAuthorization: Basic dXNlcjpwYXNz\r\n"))
+		return http_reply(sc, 401, "");
+
+	body = tal_strndup(sc, sc->in + sc->hdrlen, sc->bodylen);
+	toks = json_parse_input(body, sc->bodylen, &valid);
+	assert(toks);
+	method = json_get_member(body, toks, "method");
+	params = json_get_member(body, toks, "params");
+	id = json_get_member(body, toks, "id");
+	assert(method && params && id);
+	p0 = json_get_arr(params, 0);
+
+	if (json_tok_streq(body, method, "getblockcount"))
+		reply = http_reply(sc, 200,
+				   tal_fmt(sc, "{\"result\":101,\"error\":null,"
+					   "\"id\":%.*s}",
+					   json_tok_len(id),
+					   json_tok_contents(body, id)));
+	else if (json_tok_streq(body, method, "getblockhash")) {
+		unsigned int height;
+
+		/* Must be a number, not a string. */
+		assert(p0->type == JSMN_PRIMITIVE);
+		assert(json_tok_number(body, p0, &height));
+		reply = http_reply(sc, 200,
+				   tal_fmt(sc, "{\"result\":\"%s\","
+					   "\"error\":null,\"id\":%.*s}",
+					   blockhash_for(sc, height),
+					   json_tok_len(id),
+					   json_tok_contents(body, id)));
+	} else if (json_tok_streq(body, method, "getblock")) {
+		u8 *block = test_block(sc);
+
+		assert(p0->type == JSMN_STRING);
+		assert(json_tok_streq(body, p0, blockhash_for(sc, 7)));
+		assert(json_get_arr(params, 1)->type == JSMN_PRIMITIVE);
+		num_getblock++;
+		reply = http_reply(sc, 200,
+				   tal_fmt(sc, "{\"result\":\"%s\","
+					   "\"error\":null,\"id\":%.*s}",
+					   tal_hex(sc, block),
+					   json_tok_len(id),
+					   json_tok_contents(body, id)));
+	} else if (json_tok_streq(body, method, "sendrawtransaction")) {
+		assert(p0->type == JSMN_STRING);
+		reply = http_reply(sc, 500,
+				   tal_fmt(sc, "{\"result\":null,\"error\":"
+					   "{\"code\":-26,\"message\":"
+					   "\"txn-mempool-conflict (code 18)\"},"
+					   "\"id\":%.*s}",
+					   json_tok_len(id),
+					   json_tok_contents(body, id)));
+	} else if (json_tok_streq(body, method, "waitfornewblock")
+		   && waiting_error) {
+		reply = http_reply(sc, waiting_error == -32601 ? 404 : 500,
+				   tal_fmt(sc, "{\"result\":null,\"error\":"
+					   "{\"code\":%i,\"message\":"
+					   "\"Whatever\"},\"id\":%.*s}",
+					   waiting_error,
+					   json_tok_len(id),
+					   json_tok_contents(body, id)));
+	} else if (json_tok_streq(body, method, "waitfornewblock")) {
+		assert(p0->type == JSMN_PRIMITIVE);
+		assert(!waiting);
+		waiting = sc;
+		waiting_id = tal_strndup(sc, json_tok_contents(body, id),
+					 json_tok_len(id));
+		reply = NULL;
+	} else
+		abort();
+
+	tal_free(body);
+	return reply;
+}
+
+static struct io_plan *server_read(struct io_conn *conn,
+				   struct server_conn *sc);
+
+static struct io_plan *server_read_more(struct io_conn *conn,
+					struct server_conn *sc)
+{
+	char *end;
+
+	sc->used += sc->new_in;
+	if (!sc->hdrlen) {
+		end = memmem(sc->in, sc->used, "\r\n\r\n", 4);
+		if (end) {
+			sc->hdrlen = end + 4 - sc->in;
+			end = memmem(sc->in, sc->hdrlen, "Content-Length: ",
+				     strlen("Content-Length: "));
+			/* GET has no body. */
+			if (end)
+				sc->bodylen = atol(end + strlen("Content-Length: "));
+			else
+				sc->bodylen = 0;
+		}
+	}
+
+	if (sc->hdrlen && sc->used == sc->hdrlen + sc->bodylen) {
+		sc->in[sc->used] = '\0';
+		num_requests++;
+		sc->reply = server_answer(sc);
+		return server_read(conn, sc);
+	}
+
+	assert(sc->used < tal_count(sc->in) - 1);
+	return io_read_partial(conn, sc->in + sc->used,
+			       tal_count(sc->in) - 1 - sc->used,
+			       &sc->new_in, server_read_more, sc);
+}
+
+static struct io_plan *server_write(struct io_conn *conn,
+				    struct server_conn *sc)
+{
+	return io_write(conn, sc->reply, tal_count(sc->reply), server_read, sc);
+}
+
+static struct io_plan *server_read(struct io_conn *conn,
+				   struct server_conn *sc)
+{
+	/* Just answered the request in ->in?  Send it, maybe later. */
+	if (sc->hdrlen) {
+		sc->hdrlen = sc->used = sc->new_in = 0;
+		if (!sc->reply)
+			return io_wait(conn, &waiting, server_write, sc);
+		if (!hold_left)
+			return server_write(conn, sc);
+		if (++held > max_held)
+			max_held = held;
+		if (held < BITCOIND_MAX_PARALLEL && held < hold_left)
+			return io_wait(conn, &held, server_write, sc);
+		hold_left -= held;
+		held = 0;
+		io_wake(&held);
+		return server_write(conn, sc);
+	}
+
+	return server_read_more(conn, sc);
+}
+
+static void server_conn_gone(struct io_conn *conn, struct server_conn *sc)
+{
+	list_del_from(&server_conns, &sc->list);
+}
+
+static struct io_plan *server_init(struct io_conn *conn, void *unused)
+{
+	struct server_conn *sc;
+
+	if (refuse) {
+		refuse--;
+		return io_close(conn);
+	}
+
+	sc = tal(conn, struct server_conn);
+	sc->conn = conn;
+	sc->in = tal_arr(sc, char, 100000);
+	sc->used = sc->new_in = sc->hdrlen = 0;
+	list_add_tail(&server_conns, &sc->list);
+	io_set_finish(conn, server_conn_gone, sc);
+	num_accepted++;
+	return server_read_more(conn, sc);
+}
+
+/* Like bitcoind's -rpcservertimeout: drop keep-alive connections. */
+static void server_close_all(void)
+{
+	struct server_conn *sc;
+
+	while ((sc = list_top(&server_conns, struct server_conn, list)))
+		tal_free(sc->conn);
+}
+
+/* Our stand-in for a block arriving at bitcoind. */
+static void server_new_block(u32 height)
+{
+	assert(waiting);
+	waiting->reply = http_reply(waiting, 200,
+				    tal_fmt(waiting, "{\"result\":{\"hash\":"
+					    "\"%s\",\"height\":%u},"
+					    "\"error\":null,\"id\":%s}",
+					    blockhash_for(waiting, height),
+					    height, waiting_id));
+	waiting = NULL;
+	io_wake(&waiting);
+}
+
+static size_t num_replies;
+
+static void got_blockhash(struct bitcoind *bitcoind,
+			  const struct sha256_double *blkid,
+			  u32 *height)
+{
+	char hex[hex_str_size(sizeof(*blkid))];
+
+	bitcoin_blkid_to_hex(blkid, hex, sizeof(hex));
+	assert(streq(hex, blockhash_for(bitcoind, *height)));
+	if (++num_replies == 10)
+		io_break(&num_replies);
+}
+
+static void got_blockcount(struct bitcoind *bitcoind, u32 blockcount,
+			   void *unused)
+{
+	assert(blockcount == 101);
+	io_break(&num_replies);
+}
+
+static void got_rawblock(struct bitcoind *bitcoind,
+			 struct bitcoin_rawblock *blk,
+			 void *unused)
+{
+	struct sha256_double prev;
+
+	memset(&prev, 0x11, sizeof(prev));
+	assert(le32_to_cpu(blk->hdr.version) == 4);
+	assert(structeq(&blk->hdr.prev_hash, &prev));
+	assert(blk->num_txs == 0);
+	assert(tal_count(blk->txs) == 0);
+	io_break(&num_replies);
+}
+
+static bool expect_can_wait;
+
+static void got_newblock(struct bitcoind *bitcoind,
+			 const struct sha256_double *tipid,
+			 bool can_wait,
+			 u32 *height)
+{
+	char hex[hex_str_size(sizeof(*tipid))];
+
+	if (!height) {
+		assert(!tipid);
+		assert(can_wait == expect_can_wait);
+	} else {
+		bitcoin_blkid_to_hex(tipid, hex, sizeof(hex));
+		assert(streq(hex, blockhash_for(bitcoind, *height)));
+	}
+	io_break(&num_replies);
+}
+
+static void got_sendrawtx(struct bitcoind *bitcoind,
+			  int exitstatus, const char *msg,
+			  char *expect)
+{
+	if (streq(expect, "txn-mempool-conflict"))
+		assert(exitstatus == 26);
+	else
+		assert(exitstatus == 0);
+	assert(strstr(msg, expect));
+	io_break(&num_replies);
+}
+
+/* Like lightningd's main loop: run timers until something io_breaks. */
+static void run_loop(struct timers *timers)
+{
+	struct timer *expired;
+
+	for (;;) {
+		expired = NULL;
+		if (io_loop(timers, &expired))
+			return;
+		timer_expired(NULL, expired);
+	}
+}
+
+/* If we fall back, "bitcoin-cli" just echoes its args. */
+static const struct chainparams *test_chainparams(const tal_t *ctx, int port)
+{
+	struct chainparams params = {
+		.network_name = "regtest",
+		.rpc_port = port,
+		.cli = "echo",
+		.cli_args = "fallback"
+	};
+
+	return tal_dup(ctx, struct chainparams, &params);
+}
+
+int main(void)
+{
+	tal_t *ctx = tal_tmpctx(NULL);
+	struct bitcoind *bitcoind;
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int fd;
+	u32 heights[10], tipheight;
+	size_t i;
+	struct io_listener *l;
+	struct sha256_double blkid;
+	struct timers timers;
+	struct timemono start;
+
+	/* We write to connections the server hangs up on. */
+	signal(SIGPIPE, SIG_IGN);
+	timers_init(&timers, time_mono());
+	list_head_init(&server_conns);
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+	    || listen(fd, 10) != 0
+	    || getsockname(fd, (struct sockaddr *)&addr, &len) != 0)
+		abort();
+	l = io_new_listener(ctx, fd, server_init, NULL);
+
+	bitcoind = new_bitcoind(ctx, &timers, NULL);
+	bitcoind->chainparams = test_chainparams(ctx, ntohs(addr.sin_port));
+	bitcoind->datadir = "/nonexistent";
+	bitcoind->rpcuser = "user";
+	bitcoind->rpcpassword = "pass";
+
+	/* Requests go out in parallel, on a few keep-alive connections. */
+	hold_left = 10;
+	for (i = 0; i < 10; i++) {
+		heights[i] = i * 1000;
+		bitcoind_getblockhash(bitcoind, heights[i],
+				      got_blockhash, &heights[i]);
+	}
+	io_loop(NULL, NULL);
+	assert(num_replies == 10);
+	assert(num_requests == 10);
+	assert(num_accepted == BITCOIND_MAX_PARALLEL);
+	assert(max_held == BITCOIND_MAX_PARALLEL);
+
+	bitcoind_getblockcount(bitcoind, got_blockcount, NULL);
+	io_loop(NULL, NULL);
+	assert(num_accepted == BITCOIND_MAX_PARALLEL);
+
+	/* Errors look like bitcoin-cli's. */
+	bitcoind_sendrawtx(bitcoind, "00", got_sendrawtx,
+			   cast_const(char *, "txn-mempool-conflict"));
+	io_loop(NULL, NULL);
+
+	/* Blocks can come over REST, as binary. */
+	bitcoin_blkid_from_hex(blockhash_for(ctx, 7), 64, &blkid);
+	bitcoind->rest = rest_enabled = true;
+	bitcoind_getrawblock(bitcoind, &blkid, got_rawblock, NULL);
+	io_loop(NULL, NULL);
+	assert(num_rest == 1);
+	assert(num_getblock == 0);
+
+	/* If REST says 404, that block comes over JSON-RPC... */
+	rest_enabled = false;
+	bitcoind_getrawblock(bitcoind, &blkid, got_rawblock, NULL);
+	io_loop(NULL, NULL);
+	assert(num_rest == 2);
+	assert(num_getblock == 1);
+	assert(!bitcoind->cli_only);
+
+	/* ... but we still try REST for the next. */
+	rest_enabled = true;
+	bitcoind_getrawblock(bitcoind, &blkid, got_rawblock, NULL);
+	io_loop(NULL, NULL);
+	assert(num_rest == 3);
+	assert(num_getblock == 1);
+
+	/* Server timing out idle connections just means we reconnect. */
+	server_close_all();
+	bitcoind_getblockcount(bitcoind, got_blockcount, NULL);
+	io_loop(NULL, NULL);
+	assert(num_accepted == BITCOIND_MAX_PARALLEL + 1);
+	assert(!bitcoind->cli_only);
+
+	/* If it's restarting, we back off and reconnect rather than give up:
+	 * 100ms, then 200ms. */
+	server_close_all();
+	refuse = 2;
+	start = time_mono();
+	bitcoind_getblockcount(bitcoind, got_blockcount, NULL);
+	run_loop(&timers);
+	assert(refuse == 0);
+	assert(time_to_msec(timemono_since(start)) >= 300);
+	assert(num_accepted == BITCOIND_MAX_PARALLEL + 2);
+	assert(!bitcoind->cli_only);
+	assert(bitcoind->rpc_backoff == 0);
+
+	/* Waiting for a block doesn't hold up other requests. */
+	tipheight = 102;
+	bitcoind_waitfornewblock(bitcoind, time_from_sec(20),
+				 got_newblock, &tipheight);
+	num_replies = 0;
+	hold_left = BITCOIND_MAX_PARALLEL;
+	for (i = 0; i < 10; i++)
+		bitcoind_getblockhash(bitcoind, heights[i],
+				      got_blockhash, &heights[i]);
+	io_loop(NULL, NULL);
+	assert(num_replies == 10);
+	assert(waiting);
+	assert(num_accepted == 2 * BITCOIND_MAX_PARALLEL + 2);
+
+	/* Then the block arrives. */
+	server_new_block(tipheight);
+	io_loop(NULL, NULL);
+	assert(!waiting);
+
+	/* If bitcoind isn't ready, we can wait next time... */
+	waiting_error = -28;
+	expect_can_wait = true;
+	bitcoind_waitfornewblock(bitcoind, time_from_sec(20),
+				 got_newblock, (u32 *)NULL);
+	io_loop(NULL, NULL);
+
+	/* ... but not if it doesn't know how. */
+	waiting_error = -32601;
+	expect_can_wait = false;
+	bitcoind_waitfornewblock(bitcoind, time_from_sec(20),
+				 got_newblock, (u32 *)NULL);
+	io_loop(NULL, NULL);
+	assert(!bitcoind->cli_only);
+	waiting_error = 0;
+
+	/* But if it won't talk to us, we use bitcoin-cli. */
+	server_close_all();
+	bitcoind->rpcpassword = "wrong";
+	bitcoind_sendrawtx(bitcoind, "01", got_sendrawtx,
+			   cast_const(char *, "fallback -datadir=/nonexistent"
+				      " sendrawtransaction 01"));
+	io_loop(NULL, NULL);
+	assert(bitcoind->cli_only);
+	assert(list_empty(&bitcoind->rpcs));
+
+	/* We can't sit in bitcoin-cli waiting for blocks. */
+	bitcoind_waitfornewblock(bitcoind, time_from_sec(20),
+				 got_newblock, (u32 *)NULL);
+	io_loop(NULL, NULL);
+
+	tal_free(l);
+	tal_free(ctx);
+	return 0;
+}
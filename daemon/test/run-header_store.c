@@ -0,0 +1,106 @@
+#include "daemon/header_store.c"
+#include <assert.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+/* AUTOGENERATED MOCKS START */
+/* AUTOGENERATED MOCKS END */
+
+void fatal(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	abort();
+}
+
+/* Each header is a little different, and chained to the one before. */
+static void make_hdr(struct bitcoin_block_hdr *hdr, u32 height, u32 fork,
+		     const struct bitcoin_block_hdr *prev)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->version = cpu_to_le32(4);
+	if (prev)
+		sha256_double(&hdr->prev_hash, prev, sizeof(*prev));
+	hdr->timestamp = cpu_to_le32(1500000000 + height * 600);
+	hdr->nonce = cpu_to_le32(fork);
+}
+
+int main(void)
+{
+	tal_t *ctx = tal_tmpctx(NULL);
+	char filename[] = "/tmp/run-header_store.XXXXXX";
+	struct header_store *hs;
+	struct bitcoin_block_hdr hdrs[200], fork[10], hdr;
+	struct sha256_double blkid;
+	u32 i, height, mediantime;
+	struct stat st;
+	int fd;
+
+	fd = mkstemp(filename);
+	assert(fd >= 0);
+	close(fd);
+
+	/* Starts empty. */
+	hs = header_store_new(ctx, filename, 1000);
+	assert(!header_store_get(hs, 1000, &hdr, NULL));
+
+	for (i = 0; i < 200; i++) {
+		make_hdr(&hdrs[i], 1000 + i, 0, i ? &hdrs[i-1] : NULL);
+		header_store_put(hs, 1000 + i, &hdrs[i], 1000 + i * 2);
+	}
+	assert(stat(filename, &st) == 0);
+	assert(st.st_size == 200 * sizeof(struct stored_header));
+
+	assert(!header_store_get(hs, 999, &hdr, NULL));
+	assert(!header_store_get(hs, 1200, &hdr, NULL));
+	for (i = 0; i < 200; i++) {
+		assert(header_store_get(hs, 1000 + i, &hdr, &mediantime));
+		assert(structeq(&hdr, &hdrs[i]));
+		assert(mediantime == 1000 + i * 2);
+	}
+
+	/* Find by blkid, but only below where we ask. */
+	sha256_double(&blkid, &hdrs[150], sizeof(hdrs[150]));
+	assert(header_store_find(hs, &blkid, 2000, &height));
+	assert(height == 1150);
+	assert(header_store_find(hs, &blkid, 1151, &height));
+	assert(height == 1150);
+	assert(!header_store_find(hs, &blkid, 1150, &height));
+
+	/* Reorg: replacing 1190 forgets everything above it. */
+	for (i = 0; i < 5; i++) {
+		make_hdr(&fork[i], 1190 + i, 1, i ? &fork[i-1] : &hdrs[189]);
+		header_store_put(hs, 1190 + i, &fork[i], 7);
+	}
+	assert(stat(filename, &st) == 0);
+	assert(st.st_size == 195 * sizeof(struct stored_header));
+	assert(!header_store_get(hs, 1195, &hdr, NULL));
+	assert(header_store_get(hs, 1194, &hdr, &mediantime));
+	assert(structeq(&hdr, &fork[4]));
+	assert(mediantime == 7);
+	sha256_double(&blkid, &hdrs[195], sizeof(hdrs[195]));
+	assert(!header_store_find(hs, &blkid, 2000, &height));
+	sha256_double(&blkid, &hdrs[190], sizeof(hdrs[190]));
+	assert(!header_store_find(hs, &blkid, 2000, &height));
+	sha256_double(&blkid, &hdrs[189], sizeof(hdrs[189]));
+	assert(header_store_find(hs, &blkid, 2000, &height));
+	assert(height == 1189);
+	sha256_double(&blkid, &fork[0], sizeof(fork[0]));
+	assert(header_store_find(hs, &blkid, 2000, &height));
+	assert(height == 1190);
+
+	/* Starting again starts empty. */
+	tal_free(hs);
+	hs = header_store_new(ctx, filename, 5);
+	assert(!header_store_get(hs, 1000, &hdr, NULL));
+	assert(stat(filename, &st) == 0);
+	assert(st.st_size == 0);
+
+	unlink(filename);
+	tal_free(ctx);
+	return 0;
+}
@@ -0,0 +1,283 @@
+#include "daemon/watch.c"
+#include <assert.h>
+#include <ccan/time/time.h>
+#include <stdio.h>
+
+/* Give it a count to benchmark, eg. "run-watch 100000". */
+
+/* AUTOGENERATED MOCKS START */
+/* AUTOGENERATED MOCKS END */
+
+void peer_debug(struct peer *peer UNNEEDED, const char *fmt UNNEEDED, ...)
+{
+}
+
+void fatal(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	abort();
+}
+
+const struct siphash_seed *siphash_seed(void)
+{
+	static struct siphash_seed seed;
+	return &seed;
+}
+
+/* Which of our txs are in blocks, for watches added later. */
+static struct block **tx_block;
+static const struct bitcoin_tx **txs;
+static size_t num_in_blocks;
+
+size_t get_tx_depth(const struct chain_topology *topo,
+		    const struct sha256_double *txid,
+		    const struct bitcoin_tx **tx)
+{
+	size_t i;
+
+	/* Like the real one, we say there's no tx if it's not in a block. */
+	if (tx)
+		*tx = NULL;
+
+	/* Don't make the benchmark setup quadratic. */
+	if (!num_in_blocks)
+		return 0;
+
+	for (i = 0; i < tal_count(txs); i++) {
+		struct sha256_double this_txid;
+
+		if (!tx_block[i])
+			continue;
+		bitcoin_txid(txs[i], &this_txid);
+		if (structeq(&this_txid, txid)) {
+			*tx = txs[i];
+			return topo->tip->height - tx_block[i]->height + 1;
+		}
+	}
+	return 0;
+}
+
+/* What each watch callback was told, and what it says back. */
+struct watched {
+	unsigned int called, last_depth;
+	enum watch_result ret;
+	struct txwatch *also_delete;
+};
+
+static size_t total_calls;
+
+static enum watch_result depth_cb(struct peer *peer,
+				  const struct bitcoin_tx *tx,
+				  unsigned int depth,
+				  struct watched *w)
+{
+	w->called++;
+	w->last_depth = depth;
+	total_calls++;
+	if (w->also_delete)
+		w->also_delete = tal_free(w->also_delete);
+	return w->ret;
+}
+
+static struct bitcoin_tx *new_test_tx(const tal_t *ctx, u32 n)
+{
+	struct bitcoin_tx *tx = bitcoin_tx(ctx, 0, 1);
+
+	tx->lock_time = n;
+	tx->output[0].amount = 1000;
+	tx->output[0].script = tal_arr(tx, u8, 1);
+	tx->output[0].script[0] = 0x51;
+	return tx;
+}
+
+static struct block *new_test_block(struct chain_topology *topo)
+{
+	struct block *b = talz(topo, struct block);
+
+	b->height = topo->tip ? topo->tip->height + 1 : 100;
+	b->prev = topo->tip;
+	topo->tip = b;
+	return b;
+}
+
+static void confirm(struct chain_topology *topo, size_t i)
+{
+	struct sha256_double txid;
+
+	tx_block[i] = topo->tip;
+	num_in_blocks++;
+	bitcoin_txid(txs[i], &txid);
+	txwatch_confirmed(topo, topo->tip, txs[i], &txid);
+}
+
+static void unconfirm(struct chain_topology *topo, size_t i)
+{
+	tx_block[i] = NULL;
+	num_in_blocks--;
+	txwatch_unconfirmed(topo, txs[i]);
+}
+
+static struct chain_topology *new_test_topo(const tal_t *ctx, size_t ntxs)
+{
+	struct chain_topology *topo = talz(ctx, struct chain_topology);
+	size_t i;
+
+	txwatch_hash_init(&topo->txwatches);
+	txowatch_hash_init(&topo->txowatches);
+	uintmap_init(&topo->txwatch_wakes);
+	txs = tal_arr(topo, const struct bitcoin_tx *, ntxs);
+	tx_block = tal_arrz(topo, struct block *, ntxs);
+	num_in_blocks = 0;
+	for (i = 0; i < ntxs; i++)
+		txs[i] = new_test_tx(txs, i);
+	new_test_block(topo);
+	return topo;
+}
+
+static struct txwatch *watch(struct chain_topology *topo, size_t i,
+			     struct watched *w, enum watch_result ret)
+{
+	memset(w, 0, sizeof(*w));
+	w->ret = ret;
+	return watch_tx(topo, topo, NULL, txs[i], depth_cb, w);
+}
+
+static void free_test_topo(struct chain_topology *topo)
+{
+	struct txwatch_hash_iter i;
+	struct txwatch *w;
+	struct txwatch **ws = tal_arr(topo, struct txwatch *, 0);
+	size_t n = 0;
+
+	/* Watches unhook themselves from topo as they go. */
+	for (w = txwatch_hash_first(&topo->txwatches, &i);
+	     w;
+	     w = txwatch_hash_next(&topo->txwatches, &i)) {
+		tal_resize(&ws, n + 1);
+		ws[n++] = w;
+	}
+	while (n)
+		tal_free(ws[--n]);
+	txwatch_hash_clear(&topo->txwatches);
+	txowatch_hash_clear(&topo->txowatches);
+	uintmap_clear(&topo->txwatch_wakes);
+	tal_free(topo);
+}
+
+static void test_depths(const tal_t *ctx)
+{
+	struct chain_topology *topo = new_test_topo(ctx, 5);
+	struct watched every, until3, never, late, deleter, deleted;
+
+	watch(topo, 0, &every, KEEP_WATCHING);
+	watch(topo, 1, &until3, WATCH_UNTIL_DEPTH(3));
+	watch(topo, 2, &never, KEEP_WATCHING);
+
+	/* Nothing in a block, nobody hears anything. */
+	watch_topology_changed(topo);
+	assert(total_calls == 0);
+
+	new_test_block(topo);
+	confirm(topo, 0);
+	confirm(topo, 1);
+	watch_topology_changed(topo);
+	assert(every.called == 1 && every.last_depth == 1);
+	assert(until3.called == 1 && until3.last_depth == 1);
+
+	/* Depth 2: until3 doesn't care. */
+	new_test_block(topo);
+	watch_topology_changed(topo);
+	assert(every.called == 2 && every.last_depth == 2);
+	assert(until3.called == 1);
+
+	/* Depth 3: it does. */
+	new_test_block(topo);
+	watch_topology_changed(topo);
+	assert(every.called == 3 && every.last_depth == 3);
+	assert(until3.called == 2 && until3.last_depth == 3);
+
+	/* Several blocks at once: one call, with the new depth. */
+	new_test_block(topo);
+	new_test_block(topo);
+	watch_topology_changed(topo);
+	assert(every.called == 4 && every.last_depth == 5);
+	assert(until3.called == 3 && until3.last_depth == 5);
+	assert(never.called == 0);
+
+	/* A watch on something already in a block hears next time. */
+	watch(topo, 0, &late, DELETE_WATCH);
+	assert(late.called == 0);
+	watch_topology_changed(topo);
+	assert(late.called == 1 && late.last_depth == 5);
+	assert(every.called == 4);
+
+	/* Reorged out: told immediately, then nothing until it's back. */
+	unconfirm(topo, 0);
+	assert(every.called == 5 && every.last_depth == 0);
+	new_test_block(topo);
+	watch_topology_changed(topo);
+	assert(every.called == 5);
+	confirm(topo, 0);
+	watch_topology_changed(topo);
+	assert(every.called == 6 && every.last_depth == 1);
+
+	/* Deleting another watch which is due at the same time is fine. */
+	new_test_block(topo);
+	confirm(topo, 3);
+	confirm(topo, 4);
+	watch(topo, 3, &deleter, DELETE_WATCH);
+	deleter.also_delete = watch(topo, 4, &deleted, KEEP_WATCHING);
+	watch_topology_changed(topo);
+	assert(deleter.called + deleted.called == 1);
+
+	free_test_topo(topo);
+}
+
+/* n channels, each waiting for 100 confirmations. */
+static void benchmark(const tal_t *ctx, size_t n)
+{
+	struct chain_topology *topo = new_test_topo(ctx, n);
+	struct watched *w = tal_arr(ctx, struct watched, n);
+	struct timeabs start;
+	struct timerel elapsed;
+	size_t i;
+
+	new_test_block(topo);
+	for (i = 0; i < n; i++)
+		watch(topo, i, &w[i], WATCH_UNTIL_DEPTH(100));
+	for (i = 0; i < n; i++)
+		confirm(topo, i);
+	watch_topology_changed(topo);
+	total_calls = 0;
+
+	/* They're at depth 1: the last of these takes them to 100. */
+	start = time_now();
+	for (i = 0; i < 99; i++) {
+		new_test_block(topo);
+		watch_topology_changed(topo);
+	}
+	elapsed = time_between(time_now(), start);
+	assert(total_calls == n);
+
+	printf("%zu watches: %.1f usec per block\n",
+	       n, time_to_nsec(elapsed) / 99 / 1000.0);
+	free_test_topo(topo);
+	tal_free(w);
+}
+
+int main(int argc, char *argv[])
+{
+	tal_t *ctx = tal_tmpctx(NULL);
+
+	test_depths(ctx);
+	if (argc > 1)
+		benchmark(ctx, atol(argv[1]));
+
+	tal_free(ctx);
+	return 0;
+}
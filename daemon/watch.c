@@ -26,6 +26,7 @@
  *
  * WE ASSUME NO MALLEABILITY!  This requires segregated witness.
  */
+#include "bitcoin/blockfilter.h"
 #include "bitcoin/script.h"
 #include "bitcoin/tx.h"
 #include "bitcoind.h"
@@ -83,6 +84,22 @@ bool txwatch_eq(const struct txwatch *w, const struct sha256_double *txid)
 static void destroy_txwatch(struct txwatch *w)
 {
 	txwatch_hash_del(&w->topo->txwatches, w);
+	list_del(&w->wake);
+}
+
+/* Don't tell it anything until the tip gets to this height. */
+static void txw_wake_at(struct txwatch *w, u64 height)
+{
+	struct list_head *wakes;
+
+	list_del_init(&w->wake);
+	wakes = uintmap_get(&w->topo->txwatch_wakes, height);
+	if (!wakes) {
+		wakes = tal(w->topo, struct list_head);
+		list_head_init(wakes);
+		uintmap_add(&w->topo->txwatch_wakes, height, wakes);
+	}
+	list_add_tail(wakes, &w->wake);
 }
 
 struct txwatch *watch_txid_(const tal_t *ctx,
@@ -96,21 +113,46 @@ struct txwatch *watch_txid_(const tal_t *ctx,
 			    void *cb_arg)
 {
 	struct txwatch *w;
+	size_t depth;
 
 	w = tal(ctx, struct txwatch);
 	w->topo = topo;
 	w->depth = 0;
 	w->txid = *txid;
+	w->tx = NULL;
+	w->scripts = NULL;
 	w->peer = peer;
 	w->cb = cb;
 	w->cbdata = cb_arg;
+	list_node_init(&w->wake);
 
 	txwatch_hash_add(&w->topo->txwatches, w);
 	tal_add_destructor(w, destroy_txwatch);
 
+	/* It may be in a block already: if so, we tell it next time. */
+	depth = get_tx_depth(topo, txid, &w->tx);
+	if (depth) {
+		w->blockheight = topo->tip->height - depth + 1;
+		txw_wake_at(w, w->blockheight);
+	}
+
 	return w;
 }
 
+static void txw_learn_scripts(struct txwatch *w, const struct bitcoin_tx *tx)
+{
+	size_t i;
+
+	if (w->scripts)
+		return;
+
+	w->scripts = tal_arr(w, const u8 *, tal_count(tx->output));
+	for (i = 0; i < tal_count(tx->output); i++)
+		w->scripts[i] = tal_dup_arr(w->scripts, u8,
+					    tx->output[i].script,
+					    tal_len(tx->output[i].script), 0);
+}
+
 bool watching_txid(const struct chain_topology *topo,
 		   const struct sha256_double *txid)
 {
@@ -128,9 +170,12 @@ struct txwatch *watch_tx_(const tal_t *ctx,
 			  void *cb_arg)
 {
 	struct sha256_double txid;
+	struct txwatch *w;
 
 	bitcoin_txid(tx, &txid);
-	return watch_txid(ctx, topo, peer, &txid, cb, cb_arg);
+	w = watch_txid(ctx, topo, peer, &txid, cb, cb_arg);
+	txw_learn_scripts(w, tx);
+	return w;
 }
 
 struct txowatch *watch_txo_(const tal_t *ctx,
@@ -160,46 +205,91 @@ struct txowatch *watch_txo_(const tal_t *ctx,
 	return w;
 }
 
-/* Returns true if we fired a callback */
-static bool txw_fire(struct chain_topology *topo,
+static void txw_fire(struct chain_topology *topo,
 		     struct txwatch *txw,
 		     const struct bitcoin_tx *tx,
 		     unsigned int depth)
 {
 	enum watch_result r;
 
+	/* If it gets reorged out, we'll need to spot it again. */
+	txw_learn_scripts(txw, tx);
 	if (depth == txw->depth)
-		return false;
-	peer_debug(txw->peer,
-		   "Got depth change %u->%u for %02x%02x%02x...\n",
-		   txw->depth, depth,
-		   txw->txid.sha.u.u8[0],
-		   txw->txid.sha.u.u8[1],
-		   txw->txid.sha.u.u8[2]);
-	txw->depth = depth;
-	r = txw->cb(txw->peer, tx, txw->depth, txw->cbdata);
+		r = KEEP_WATCHING;
+	else {
+		peer_debug(txw->peer,
+			   "Got depth change %u->%u for %02x%02x%02x...\n",
+			   txw->depth, depth,
+			   txw->txid.sha.u.u8[0],
+			   txw->txid.sha.u.u8[1],
+			   txw->txid.sha.u.u8[2]);
+		txw->depth = depth;
+		r = txw->cb(txw->peer, tx, txw->depth, txw->cbdata);
+	}
+
 	switch (r) {
 	case DELETE_WATCH:
 		tal_free(txw);
-		return true;
+		return;
 	case KEEP_WATCHING:
-		return true;
+		depth++;
+		break;
+	default:
+		if ((int)r < 0)
+			fatal("txwatch callback %p returned %i\n",
+			      txw->cb, r);
+		/* Never later than we'd otherwise tell it. */
+		if ((unsigned int)r > depth)
+			depth = r;
+		else
+			depth++;
+		break;
 	}
-	fatal("txwatch callback %p returned %i\n", txw->cb, r);
+
+	/* If it's not in a block, it's waiting for txwatch_confirmed. */
+	if (txw->tx)
+		txw_wake_at(txw, (u64)txw->blockheight + depth - 1);
 }
 
-void txwatch_fire(struct chain_topology *topo,
-		  const struct bitcoin_tx *tx,
-		  unsigned int depth)
+void txwatch_confirmed(struct chain_topology *topo,
+		       const struct block *b,
+		       const struct bitcoin_tx *tx,
+		       const struct sha256_double *txid)
+{
+	struct txwatch_hash_iter i;
+	struct txwatch *w;
+
+	for (w = txwatch_hash_getfirst(&topo->txwatches, txid, &i);
+	     w;
+	     w = txwatch_hash_getnext(&topo->txwatches, txid, &i)) {
+		w->tx = tx;
+		w->blockheight = b->height;
+		/* Depth 1 as soon as b is the tip. */
+		txw_wake_at(w, w->blockheight);
+	}
+}
+
+void txwatch_unconfirmed(struct chain_topology *topo,
+			 const struct bitcoin_tx *tx)
 {
 	struct sha256_double txid;
-	struct txwatch *txw;
+	struct txwatch_hash_iter i;
+	struct txwatch *w;
 
 	bitcoin_txid(tx, &txid);
-	txw = txwatch_hash_get(&topo->txwatches, &txid);
 
-	if (txw)
-		txw_fire(topo, txw, tx, depth);
+	/* Callbacks can delete watches, so start again after each one. */
+	for (;;) {
+		for (w = txwatch_hash_getfirst(&topo->txwatches, &txid, &i);
+		     w && !w->tx;
+		     w = txwatch_hash_getnext(&topo->txwatches, &txid, &i));
+		if (!w)
+			break;
+
+		w->tx = NULL;
+		list_del_init(&w->wake);
+		txw_fire(topo, w, tx, 0);
+	}
 }
 
 void txowatch_fire(struct chain_topology *topo,
@@ -233,25 +323,88 @@ void txowatch_fire(struct chain_topology *topo,
 	fatal("txowatch callback %p returned %i\n", txow->cb, r);
 }
 
+/* Only watches whose depth they care about has been reached wake up: a
+ * watch not yet in a block isn't touched at all. */
 void watch_topology_changed(struct chain_topology *topo)
 {
-	struct txwatch_hash_iter i;
+	struct list_head *wakes;
 	struct txwatch *w;
-	bool needs_rerun;
+	u64 height;
+
+	/* One at a time, since callbacks can add and delete watches. */
+	while ((wakes = uintmap_first(&topo->txwatch_wakes, &height)) != NULL
+	       && height <= topo->tip->height) {
+		w = list_pop(wakes, struct txwatch, wake);
+		if (!w) {
+			uintmap_del(&topo->txwatch_wakes, height);
+			tal_free(wakes);
+			continue;
+		}
+		list_node_init(&w->wake);
+		txw_fire(topo, w, w->tx, topo->tip->height - w->blockheight + 1);
+	}
+}
+
+static bool add_script(const u8 ***scripts, const u8 *script)
+{
+	size_t n = tal_count(*scripts);
+
+	if (!blockfilter_has_script(script))
+		return false;
+	tal_resize(scripts, n + 1);
+	(*scripts)[n] = script;
+	return true;
+}
+
+/* The filter includes scripts spent, so we need the one we're watching. */
+static const u8 *txo_script(const struct chain_topology *topo,
+			    const struct txwatch_output *out)
+{
+	const struct txwatch *w = txwatch_hash_get(&topo->txwatches, &out->txid);
+	const struct bitcoin_tx *tx;
+
+	if (w && w->scripts) {
+		if (out->index < tal_count(w->scripts))
+			return w->scripts[out->index];
+		return NULL;
+	}
+
+	if (get_tx_depth(topo, &out->txid, &tx)
+	    && out->index < tal_count(tx->output))
+		return tx->output[out->index].script;
+	return NULL;
+}
+
+const u8 **watched_scripts(const tal_t *ctx,
+			   const struct chain_topology *topo)
+{
+	const u8 **scripts = tal_arr(ctx, const u8 *, 0);
+	struct txwatch_hash_iter i;
+	struct txowatch_hash_iter oi;
+	const struct txwatch *w;
+	const struct txowatch *ow;
 
-again:
-	/* Iterating a htable during deletes is safe, but might skip entries. */
-	needs_rerun = false;
 	for (w = txwatch_hash_first(&topo->txwatches, &i);
 	     w;
 	     w = txwatch_hash_next(&topo->txwatches, &i)) {
-		u32 depth;
-		const struct bitcoin_tx *tx;
+		size_t j;
+		bool any = false;
+
+		if (!w->scripts)
+			return tal_free(scripts);
+		for (j = 0; j < tal_count(w->scripts); j++)
+			any |= add_script(&scripts, w->scripts[j]);
+		if (!any)
+			return tal_free(scripts);
+	}
+
+	for (ow = txowatch_hash_first(&topo->txowatches, &oi);
+	     ow;
+	     ow = txowatch_hash_next(&topo->txowatches, &oi)) {
+		const u8 *script = txo_script(topo, &ow->out);
 
-		depth = get_tx_depth(topo, &w->txid, &tx);
-		if (depth)
-			needs_rerun |= txw_fire(topo, w, tx, depth);
+		if (!script || !add_script(&scripts, script))
+			return tal_free(scripts);
 	}
-	if (needs_rerun)
-		goto again;
+	return scripts;
 }
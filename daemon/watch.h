@@ -17,6 +17,10 @@ enum watch_result {
 	KEEP_WATCHING = -2
 };
 
+/* A txwatch callback can also return a depth: it won't be called again
+ * until the tx gets that deep (or is kicked out by a reorg). */
+#define WATCH_UNTIL_DEPTH(depth) ((enum watch_result)(depth))
+
 struct txwatch_output {
 	struct sha256_double txid;
 	unsigned int index;
@@ -59,6 +63,16 @@ struct txwatch {
 	struct sha256_double txid;
 	unsigned int depth;
 
+	/* Its output scripts, once we know the tx (for block filters). */
+	const u8 **scripts;
+
+	/* The tx, and the height of the block it's in (if it is). */
+	const struct bitcoin_tx *tx;
+	u32 blockheight;
+
+	/* On a topo->txwatch_wakes list if it's in a block. */
+	struct list_node wake;
+
 	/* A new depth (0 if kicked out, otherwise 1 = tip, etc.) */
 	enum watch_result (*cb)(struct peer *peer,
 				const struct bitcoin_tx *tx,
@@ -135,9 +149,15 @@ struct txowatch *watch_txo_(const tal_t *ctx,
 				       const struct block *block),	\
 		  (cbdata))
 
-void txwatch_fire(struct chain_topology *topo,
-		  const struct bitcoin_tx *tx,
-		  unsigned int depth);
+/* We connected block b, which contains tx. */
+void txwatch_confirmed(struct chain_topology *topo,
+		       const struct block *b,
+		       const struct bitcoin_tx *tx,
+		       const struct sha256_double *txid);
+
+/* Block containing tx is going away. */
+void txwatch_unconfirmed(struct chain_topology *topo,
+			 const struct bitcoin_tx *tx);
 
 void txowatch_fire(struct chain_topology *topo,
 		   const struct txowatch *txow,
@@ -148,4 +168,9 @@ bool watching_txid(const struct chain_topology *topo,
 		   const struct sha256_double *txid);
 
 void watch_topology_changed(struct chain_topology *topo);
+
+/* What a BIP158 filter must contain for a block to interest us: NULL if
+ * we're watching something we can't find that way. */
+const u8 **watched_scripts(const tal_t *ctx,
+			   const struct chain_topology *topo);
 #endif /* LIGHTNING_DAEMON_WATCH_H */
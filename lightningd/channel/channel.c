@@ -29,6 +29,7 @@
 #include <lightningd/msg_queue.h>
 #include <lightningd/peer_failed.h>
 #include <lightningd/ping.h>
+#include <lightningd/shm_ring.h>
 #include <lightningd/sphinx.h>
 #include <lightningd/status.h>
 #include <secp256k1.h>
@@ -92,6 +93,8 @@ struct peer {
 
 	struct daemon_conn gossip_client;
 	struct daemon_conn master;
+	/* If lightningd gave us --shm-transport, master uses this. */
+	struct shm_ring *master_ring;
 
 	/* If we're waiting for a specific reply, defer other messages. */
 	enum channel_wire_type master_reply_type;
@@ -161,6 +164,10 @@ static struct io_plan *gossip_client_recv(struct io_conn *conn,
 		status_failed(WIRE_CHANNEL_GOSSIP_BAD_MESSAGE,
 			      "Got bad message from gossipd: %d", type);
 
+	/* Peer not keeping up?  Stop reading, so gossipd stops sending. */
+	if (msg_queue_full(&peer->peer_out))
+		return msg_queue_wait_room(conn, &peer->peer_out,
+					   daemon_conn_read_next, dc);
 	return daemon_conn_read_next(conn, dc);
 }
 
@@ -712,32 +719,52 @@ static struct io_plan *send_revocation(struct io_conn *conn, struct peer *peer)
 }
 
 /* FIXME: We could do this earlier and call HSM async, for speed. */
-static void get_shared_secret(const struct htlc *htlc,
-			      struct secret *shared_secret)
+static void get_shared_secrets(const struct htlc **htlcs,
+			       struct secret *shared_secrets)
 {
-	tal_t *tmpctx = tal_tmpctx(htlc);
-	struct pubkey ephemeral;
+	tal_t *tmpctx = tal_tmpctx(htlcs);
+	struct pubkey *ephemeral = tal_arr(tmpctx, struct pubkey, 0);
+	size_t *idx = tal_arr(tmpctx, size_t, 0);
+	struct secret *ss;
 	struct onionpacket *op;
 	u8 *msg;
+	size_t i, n;
+
+	/* We unwrap the onions now. */
+	for (i = 0; i < tal_count(htlcs); i++) {
+		op = parse_onionpacket(tmpctx, htlcs[i]->routing,
+				       TOTAL_PACKET_SIZE);
+		if (!op) {
+			/* Return an invalid shared secret. */
+			memset(&shared_secrets[i], 0, sizeof(shared_secrets[i]));
+			continue;
+		}
+
+		/* Because wire takes struct pubkey. */
+		n = tal_count(ephemeral);
+		tal_resize(&ephemeral, n + 1);
+		tal_resize(&idx, n + 1);
+		ephemeral[n].pubkey = op->ephemeralkey;
+		idx[n] = i;
+	}
 
-	/* We unwrap the onion now. */
-	op = parse_onionpacket(tmpctx, htlc->routing, TOTAL_PACKET_SIZE);
-	if (!op) {
-		/* Return an invalid shared secret. */
-		memset(shared_secret, 0, sizeof(*shared_secret));
+	if (tal_count(ephemeral) == 0) {
 		tal_free(tmpctx);
 		return;
 	}
 
-	/* Because wire takes struct pubkey. */
-	ephemeral.pubkey = op->ephemeralkey;
-	msg = towire_hsm_ecdh_req(tmpctx, &ephemeral);
+	/* One round trip to the HSM for all of them. */
+	msg = towire_hsm_ecdh_batch_req(tmpctx, ephemeral);
 	if (!wire_sync_write(HSM_FD, msg))
 		status_failed(WIRE_CHANNEL_HSM_FAILED, "Writing ecdh req");
 	msg = wire_sync_read(tmpctx, HSM_FD);
 	/* Gives all-zero shares_secret if it was invalid. */
-	if (!msg || !fromwire_hsm_ecdh_resp(msg, NULL, shared_secret))
+	if (!msg || !fromwire_hsm_ecdh_batch_resp(tmpctx, msg, NULL, &ss)
+	    || tal_count(ss) != tal_count(ephemeral))
 		status_failed(WIRE_CHANNEL_HSM_FAILED, "Reading ecdh response");
+
+	for (i = 0; i < tal_count(ss); i++)
+		shared_secrets[idx[i]] = ss[i];
 	tal_free(tmpctx);
 }
 
@@ -753,12 +780,13 @@ static u8 *got_commitsig_msg(const tal_t *ctx,
 	struct fulfilled_htlc *fulfilled;
 	struct failed_htlc *failed;
 	struct added_htlc *added;
+	const struct htlc **added_htlcs;
 	struct secret *shared_secret;
 	u8 *msg;
 
 	changed = tal_arr(tmpctx, struct changed_htlc, 0);
 	added = tal_arr(tmpctx, struct added_htlc, 0);
-	shared_secret = tal_arr(tmpctx, struct secret, 0);
+	added_htlcs = tal_arr(tmpctx, const struct htlc *, 0);
 	failed = tal_arr(tmpctx, struct failed_htlc, 0);
 	fulfilled = tal_arr(tmpctx, struct fulfilled_htlc, 0);
 
@@ -766,7 +794,8 @@ static u8 *got_commitsig_msg(const tal_t *ctx,
 		const struct htlc *htlc = changed_htlcs[i];
 		if (htlc->state == RCVD_ADD_COMMIT) {
 			struct added_htlc *a = tal_arr_append(&added);
-			struct secret *s = tal_arr_append(&shared_secret);
+			const struct htlc **h = tal_arr_append(&added_htlcs);
+			*h = htlc;
 			a->id = htlc->id;
 			a->amount_msat = htlc->msatoshi;
 			a->payment_hash = htlc->rhash;
@@ -774,7 +803,6 @@ static u8 *got_commitsig_msg(const tal_t *ctx,
 			memcpy(a->onion_routing_packet,
 			       htlc->routing,
 			       sizeof(a->onion_routing_packet));
-			get_shared_secret(htlc, s);
 		} else if (htlc->state == RCVD_REMOVE_COMMIT) {
 			if (htlc->r) {
 				struct fulfilled_htlc *f;
@@ -800,6 +828,9 @@ static u8 *got_commitsig_msg(const tal_t *ctx,
 		}
 	}
 
+	shared_secret = tal_arr(tmpctx, struct secret, tal_count(added_htlcs));
+	get_shared_secrets(added_htlcs, shared_secret);
+
 	msg = towire_channel_got_commitsig(ctx, local_commit_index,
 					   commit_sig,
 					   htlc_sigs,
@@ -1105,11 +1136,13 @@ static struct io_plan *handle_peer_fail_htlc(struct io_conn *conn,
 	struct channel_id channel_id;
 	u64 id;
 	enum channel_remove_err e;
-	u8 *reason;
+	u16 len;
+	const u8 *reason;
 	struct htlc *htlc;
 
-	if (!fromwire_update_fail_htlc(msg, msg, NULL,
-				       &channel_id, &id, &reason)) {
+	/* Don't copy reason until we know we're keeping it. */
+	if (!fromwire_update_fail_htlc_view(msg, NULL,
+					    &channel_id, &id, &len, &reason)) {
 		peer_failed(io_conn_fd(peer->peer_conn),
 			    &peer->pcs.cs,
 			    &peer->channel_id,
@@ -1122,7 +1155,7 @@ static struct io_plan *handle_peer_fail_htlc(struct io_conn *conn,
 	case CHANNEL_ERR_REMOVE_OK:
 		/* Save reason for when we tell master. */
 		htlc = channel_get_htlc(peer->channel, LOCAL, id);
-		htlc->fail = tal_steal(htlc, reason);
+		htlc->fail = tal_dup_arr(htlc, u8, reason, len, 0);
 		start_commit_timer(peer);
 		return peer_read_message(conn, &peer->pcs, peer_in);
 	case CHANNEL_ERR_NO_SUCH_ID:
@@ -1244,10 +1277,11 @@ static struct io_plan *handle_ping(struct io_conn *conn,
 static struct io_plan *handle_pong(struct io_conn *conn,
 				   struct peer *peer, const u8 *pong)
 {
-	u8 *ignored;
+	u16 byteslen;
+	const u8 *ignored;
 
 	status_trace("Got pong!");
-	if (!fromwire_pong(pong, pong, NULL, &ignored))
+	if (!fromwire_pong_view(pong, NULL, &byteslen, &ignored))
 		status_failed(WIRE_CHANNEL_PEER_READ_FAILED, "Bad pong");
 
 	if (!peer->num_pings_outstanding)
@@ -2005,7 +2039,16 @@ static void init_channel(struct peer *peer)
 	u8 *msg;
 	u32 feerate_per_kw;
 
-	msg = wire_sync_read(peer, REQ_FD);
+	if (peer->master_ring) {
+		/* As status_sync_read() does. */
+		for (;;) {
+			msg = shm_sync_read(peer, peer->master_ring);
+			if (!msg || !status_level_in(NULL, msg))
+				break;
+			tal_free(msg);
+		}
+	} else
+		msg = status_sync_read(peer, REQ_FD);
 	if (!fromwire_channel_init(peer, msg, NULL,
 				   &peer->chain_hash,
 				   &funding_txid, &funding_txout,
@@ -2053,7 +2096,12 @@ static void init_channel(struct peer *peer)
 			      tal_hex(msg, msg));
 
 	/* After this we'll be async, so set up now. */
-	daemon_conn_init(peer, &peer->master, REQ_FD, req_in, master_gone);
+	if (peer->master_ring)
+		daemon_conn_init_shm(peer, &peer->master, REQ_FD,
+				     peer->master_ring, req_in, master_gone);
+	else
+		daemon_conn_init(peer, &peer->master, REQ_FD, req_in,
+				 master_gone);
 	status_setup_async(&peer->master);
 
 	status_trace("init %s: remote_per_commit = %s, old_remote_per_commit = %s"
@@ -2159,6 +2207,7 @@ int main(int argc, char *argv[])
 	}
 
 	subdaemon_debug(argc, argv);
+	peer->master_ring = shm_ring_from_argv(peer, argc, argv, REQ_FD);
 
 	/* We handle write returning errors! */
 	signal(SIGCHLD, SIG_IGN);
@@ -2173,6 +2222,8 @@ int main(int argc, char *argv[])
 	peer->master_reply_type = 0;
 	msg_queue_init(&peer->master_deferred, peer);
 	msg_queue_init(&peer->peer_out, peer);
+	msg_queue_set_watermarks(&peer->peer_out,
+				 PEER_OUT_HIWAT, PEER_OUT_LOWAT);
 	peer->next_commit_sigs = NULL;
 	peer->shutdown_sent[LOCAL] = false;
 
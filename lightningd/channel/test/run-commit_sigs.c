@@ -0,0 +1,111 @@
+/* We want all of channel.c, just not its main(). */
+int channeld_main(int argc, char *argv[]);
+#define main channeld_main
+#include "../channel.c"
+#undef main
+#include <fcntl.h>
+
+/* Give it a count to benchmark, eg. "run-commit_sigs 1000". */
+#define NUM_HTLCS 10
+
+/* A channel we funded, with NUM_HTLCS offered HTLCs fully committed. */
+static struct peer *new_test_peer(const tal_t *ctx)
+{
+	struct peer *peer = talz(ctx, struct peer);
+	struct privkey seed;
+	struct sha256_double funding_txid;
+	struct basepoints localbase, remotebase;
+	struct pubkey local_funding_pubkey, remote_funding_pubkey;
+	const struct htlc **changed_htlcs;
+	u8 *dummy_routing = tal_arr(peer, u8, TOTAL_PACKET_SIZE);
+	size_t i;
+
+	memset(&seed, 1, sizeof(seed));
+	if (!derive_basepoints(&seed, &local_funding_pubkey, &localbase,
+			       &peer->our_secrets, &peer->shaseed))
+		abort();
+	memset(&seed, 2, sizeof(seed));
+	if (!derive_basepoints(&seed, &remote_funding_pubkey, &remotebase,
+			       NULL, NULL))
+		abort();
+	/* Any point will do for theirs. */
+	peer->remote_per_commit = remotebase.revocation;
+
+	for (i = 0; i < NUM_SIDES; i++) {
+		peer->conf[i].dust_limit_satoshis = 546;
+		peer->conf[i].max_htlc_value_in_flight_msat = -1ULL;
+		peer->conf[i].channel_reserve_satoshis = 0;
+		peer->conf[i].htlc_minimum_msat = 0;
+		peer->conf[i].to_self_delay = 144;
+		peer->conf[i].max_accepted_htlcs = 0xFFFF;
+	}
+
+	memset(&funding_txid, 3, sizeof(funding_txid));
+	peer->channel = new_channel(peer, &funding_txid, 0,
+				    10000000, 7000000000ULL, 1000,
+				    &peer->conf[LOCAL], &peer->conf[REMOTE],
+				    &localbase, &remotebase,
+				    &local_funding_pubkey, &remote_funding_pubkey,
+				    LOCAL);
+
+	for (i = 0; i < NUM_HTLCS; i++) {
+		struct preimage preimage;
+		struct sha256 hash;
+
+		memset(&preimage, i, sizeof(preimage));
+		sha256(&hash, &preimage, sizeof(preimage));
+		if (channel_add_htlc(peer->channel, LOCAL, i, 5000000, 500+i,
+				     &hash, dummy_routing)
+		    != CHANNEL_ERR_ADD_OK)
+			abort();
+	}
+
+	changed_htlcs = tal_arr(peer, const struct htlc *, 0);
+	assert(channel_sending_commit(peer->channel, &changed_htlcs));
+	assert(!channel_rcvd_revoke_and_ack(peer->channel, &changed_htlcs));
+	assert(channel_rcvd_commit(peer->channel, &changed_htlcs));
+	assert(!channel_sending_revoke_and_ack(peer->channel));
+	return peer;
+}
+
+static double commits_per_sec(const struct peer *peer, size_t num)
+{
+	struct timeabs start = time_now();
+	struct timerel elapsed;
+	size_t i;
+
+	for (i = 0; i < num; i++) {
+		struct commit_sigs *sigs = calc_commitsigs(NULL, peer, i);
+		assert(tal_count(sigs->htlc_sigs) == NUM_HTLCS);
+		tal_free(sigs);
+	}
+	elapsed = time_between(time_now(), start);
+	return num * 1000000000.0 / (time_to_nsec(elapsed) + 1);
+}
+
+int main(int argc, char *argv[])
+{
+	tal_t *ctx = tal_tmpctx(NULL);
+	size_t num = argc > 1 ? atol(argv[1]) : 2;
+	struct peer *peer;
+	double with_trace, without_trace;
+
+	secp256k1_ctx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY
+						 | SECP256K1_CONTEXT_SIGN);
+	status_setup_sync(open("/dev/null", O_WRONLY));
+	peer = new_test_peer(ctx);
+
+	status_trace_enabled = true;
+	with_trace = commits_per_sec(peer, num);
+	status_trace_enabled = false;
+	without_trace = commits_per_sec(peer, num);
+
+	if (argc > 1)
+		printf("%u htlcs: %.1f commitments/sec with traces,"
+		       " %.1f without\n",
+		       NUM_HTLCS, with_trace, without_trace);
+
+	tal_free(ctx);
+	secp256k1_context_destroy(secp256k1_ctx);
+	return 0;
+}
@@ -178,7 +178,7 @@ int main(int argc, char *argv[])
 						 | SECP256K1_CONTEXT_SIGN);
 	status_setup_sync(REQ_FD);
 
-	msg = wire_sync_read(ctx, REQ_FD);
+	msg = status_sync_read(ctx, REQ_FD);
 	if (!fromwire_closing_init(ctx, msg, NULL,
 				   &cs, &seed,
 				   &funding_txid, &funding_txout,
@@ -391,7 +391,7 @@ int main(int argc, char *argv[])
 				status_failed(WIRE_CLOSING_INTERNAL_ERROR,
 					      "Writing received to master: %s",
 					      strerror(errno));
-			msg = wire_sync_read(tmpctx, REQ_FD);
+			msg = status_sync_read(tmpctx, REQ_FD);
 			if (!fromwire_closing_received_signature_reply(msg,NULL))
 				status_failed(WIRE_CLOSING_INTERNAL_ERROR,
 					      "Bad received reply from master");
@@ -2,14 +2,28 @@
 #include <ccan/io/fdpass/fdpass.h>
 #include <ccan/take/take.h>
 #include <lightningd/daemon_conn.h>
+#include <lightningd/shm_ring.h>
+#include <lightningd/status.h>
 #include <wire/wire_io.h>
 #include <wire/wire_sync.h>
 
+/* lightningd's log level changes are handled here, not by the daemon. */
+static struct io_plan *daemon_conn_got_msg(struct io_conn *conn,
+					   struct daemon_conn *dc)
+{
+	if (status_level_in(dc, dc->msg_in))
+		return daemon_conn_read_next(conn, dc);
+	return dc->daemon_conn_recv(conn, dc);
+}
+
 struct io_plan *daemon_conn_read_next(struct io_conn *conn,
 				      struct daemon_conn *dc)
 {
 	dc->msg_in = tal_free(dc->msg_in);
-	return io_read_wire(conn, dc->ctx, &dc->msg_in, dc->daemon_conn_recv,
+	if (dc->ring)
+		return io_read_shm(conn, dc->ring, dc->ctx, &dc->msg_in,
+				   daemon_conn_got_msg, dc);
+	return io_read_wire(conn, dc->ctx, &dc->msg_in, daemon_conn_got_msg,
 			    dc);
 }
 
@@ -19,6 +33,15 @@ struct io_plan *daemon_conn_write_next(struct io_conn *conn,
 	const u8 *msg = msg_dequeue(&dc->out);
 	if (msg) {
 		int fd = msg_extract_fd(msg);
+		if (dc->ring) {
+			if (fd < 0)
+				return io_write_shm(conn, dc->ring, take(msg),
+						    daemon_conn_write_next, dc);
+			/* fds go over the socket, after the message. */
+			shm_ring_send_fd(dc->ring, fd);
+			tal_free(msg);
+			return daemon_conn_write_next(conn, dc);
+		}
 		if (fd >= 0)
 			return io_send_fd(conn, fd, true,
 					  daemon_conn_write_next, dc);
@@ -37,6 +60,18 @@ bool daemon_conn_sync_flush(struct daemon_conn *dc)
 	const u8 *msg;
 	int daemon_fd;
 
+	if (dc->ring) {
+		while ((msg = msg_dequeue(&dc->out)) != NULL) {
+			int fd = msg_extract_fd(msg);
+			if (fd >= 0) {
+				shm_ring_send_fd(dc->ring, fd);
+				tal_free(msg);
+			} else if (!shm_sync_write(dc->ring, take(msg)))
+				break;
+		}
+		return shm_sync_flush_fds(dc->ring) && msg == NULL;
+	}
+
 	/* Flush any current packet. */
 	if (!io_flush_sync(dc->conn))
 		return false;
@@ -65,6 +100,8 @@ static struct io_plan *daemon_conn_start(struct io_conn *conn,
 					 struct daemon_conn *dc)
 {
 	dc->conn = conn;
+	if (dc->ring)
+		shm_ring_start(dc->ring, dc->sockfd, conn);
 	return io_duplex(conn, daemon_conn_read_next(conn, dc),
 			 daemon_conn_write_next(conn, dc));
 }
@@ -79,6 +116,8 @@ void daemon_conn_init(tal_t *ctx, struct daemon_conn *dc, int fd,
 	dc->daemon_conn_recv = daemon_conn_recv;
 
 	dc->ctx = ctx;
+	dc->ring = NULL;
+	dc->sockfd = fd;
 	dc->msg_in = NULL;
 	msg_queue_init(&dc->out, dc->ctx);
 	dc->msg_queue_cleared_cb = NULL;
@@ -96,3 +135,24 @@ void daemon_conn_send_fd(struct daemon_conn *dc, int fd)
 {
 	msg_enqueue_fd(&dc->out, fd);
 }
+
+void daemon_conn_init_shm(tal_t *ctx, struct daemon_conn *dc, int fd,
+			  struct shm_ring *ring,
+			  struct io_plan *(*daemon_conn_recv)(
+				  struct io_conn *, struct daemon_conn *),
+			  void (*finish)(struct io_conn *, struct daemon_conn *))
+{
+	struct io_conn *conn;
+
+	dc->daemon_conn_recv = daemon_conn_recv;
+
+	dc->ctx = ctx;
+	dc->ring = ring;
+	dc->sockfd = fd;
+	dc->msg_in = NULL;
+	msg_queue_init(&dc->out, dc->ctx);
+	dc->msg_queue_cleared_cb = NULL;
+	conn = io_new_conn(ctx, shm_ring_bellfd(ring), daemon_conn_start, dc);
+	if (finish)
+		io_set_finish(conn, finish, dc);
+}
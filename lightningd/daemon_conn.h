@@ -6,6 +6,8 @@
 #include <ccan/short_types/short_types.h>
 #include <lightningd/msg_queue.h>
 
+struct shm_ring;
+
 struct daemon_conn {
 	/* Context to tallocate all things from, possibly the
 	 * container of this connection. */
@@ -20,6 +22,10 @@ struct daemon_conn {
 	/* Underlying connection */
 	struct io_conn *conn;
 
+	/* If non-NULL, messages go via this instead of the socket. */
+	struct shm_ring *ring;
+	int sockfd;
+
 	/* Callback for incoming messages */
 	struct io_plan *(*daemon_conn_recv)(struct io_conn *conn,
 					    struct daemon_conn *);
@@ -43,6 +49,18 @@ void daemon_conn_init(tal_t *ctx, struct daemon_conn *dc, int fd,
 		      struct io_plan *(*daemon_conn_recv)(
 			  struct io_conn *, struct daemon_conn *),
 		      void (*finish)(struct io_conn *, struct daemon_conn *));
+/**
+ * daemon_conn_init_shm - Initialize a daemon connection over a shm_ring
+ *
+ * As daemon_conn_init, but messages go through @ring: @fd is only used
+ * for passing file descriptors (and noticing the other side close).
+ */
+void daemon_conn_init_shm(tal_t *ctx, struct daemon_conn *dc, int fd,
+			  struct shm_ring *ring,
+			  struct io_plan *(*daemon_conn_recv)(
+				  struct io_conn *, struct daemon_conn *),
+			  void (*finish)(struct io_conn *, struct daemon_conn *));
+
 /**
  * daemon_conn_send - Enqueue an outgoing message to be sent
  */
@@ -1,16 +1,60 @@
+#include <ccan/fdpass/fdpass.h>
+#include <ccan/read_write_all/read_write_all.h>
+#include <ccan/short_types/short_types.h>
 #include <ccan/str/str.h>
 #include <lightningd/debug.h>
 #include <lightningd/dev_disconnect.h>
+#include <lightningd/status.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+/* lightningd started us before it needed us: now it sends its current
+ * log level, and the fds it would have given us as 3, 4, ... */
+static void get_prespawned_fds(void)
+{
+	u8 i, num, level;
+	int fd;
+
+	/* It never needed us after all. */
+	if (!read_all(STDIN_FILENO, &num, sizeof(num)))
+		exit(0);
+
+	if (!read_all(STDIN_FILENO, &level, sizeof(level)))
+		exit(1);
+	status_set_level(level);
+
+	for (i = 0; i < num; i++) {
+		fd = fdpass_recv(STDIN_FILENO);
+		if (fd < 0)
+			exit(1);
+		if (fd != 3 + i) {
+			if (dup2(fd, 3 + i) == -1)
+				exit(1);
+			close(fd);
+		}
+	}
+}
+
 void subdaemon_debug(int argc, char *argv[])
 {
 	int i;
 	bool printed = false;
 
+	for (i = 1; i < argc; i++) {
+		if (strstarts(argv[i], "--log-level="))
+			status_set_level(atoi(argv[i] + strlen("--log-level=")));
+	}
+
+	/* Prespawned, we wait here until we have a peer. */
+	for (i = 1; i < argc; i++) {
+		if (streq(argv[i], "--prespawned"))
+			get_prespawned_fds();
+	}
+
+	/* Only now read the current line: while we were waiting, other
+	 * daemons may have used up the one which was current at exec. */
 	for (i = 1; i < argc; i++) {
 		if (strstarts(argv[i], "--dev-disconnect=")) {
 			dev_disconnect_init(atoi(argv[i]
@@ -13,16 +13,22 @@
 static int dev_disconnect_fd = -1;
 static char dev_disconnect_line[200];
 static int dev_disconnect_count, dev_disconnect_len;
+/* Where in the (shared) file our line is, and whether to check that's
+ * still the current one before we use it. */
+static off_t dev_disconnect_off = -1;
+static bool dev_disconnect_reread;
 
 void dev_disconnect_init(int fd)
 {
 	int r;
 	char *asterisk;
 
+	/* No stale remnants of the previous line, please. */
+	memset(dev_disconnect_line, 0, sizeof(dev_disconnect_line));
 	r = read(fd, dev_disconnect_line, sizeof(dev_disconnect_line)-1);
 	if (r < 0)
 		err(1, "Reading dev_disconnect file");
-	lseek(fd, -r, SEEK_CUR);
+	dev_disconnect_off = lseek(fd, -r, SEEK_CUR);
 
 	/* Get first line */
 	dev_disconnect_line[r] = '\n';
@@ -44,6 +50,11 @@ void dev_disconnect_init(int fd)
 
 char dev_disconnect(int pkt_type)
 {
+	/* Other daemons may have used up lines since we read ours. */
+	if (dev_disconnect_reread && dev_disconnect_fd != -1
+	    && lseek(dev_disconnect_fd, 0, SEEK_CUR) != dev_disconnect_off)
+		dev_disconnect_init(dev_disconnect_fd);
+
 	if (!streq(wire_type_name(pkt_type), dev_disconnect_line+1))
 		return DEV_DISCONNECT_NORMAL;
 
@@ -59,6 +70,11 @@ char dev_disconnect(int pkt_type)
 	return dev_disconnect_line[0];
 }
 
+void dev_disconnect_long_lived(void)
+{
+	dev_disconnect_reread = true;
+}
+
 void dev_sabotage_fd(int fd)
 {
 	int fds[2];
@@ -17,4 +17,8 @@ void dev_sabotage_fd(int fd);
 /* For debug code to set in daemon. */
 void dev_disconnect_init(int fd);
 
+/* For daemons serving many peers over their lifetime (eg. handshake):
+ * re-read the current line before each use, not just at startup. */
+void dev_disconnect_long_lived(void);
+
 #endif /* LIGHTNING_LIGHTNINGD_DEV_DISCONNECT_H */
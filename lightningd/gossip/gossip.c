@@ -21,6 +21,7 @@
 #include <lightningd/debug.h>
 #include <lightningd/gossip/gen_gossip_wire.h>
 #include <lightningd/gossip_msg.h>
+#include <lightningd/msg_queue.h>
 #include <lightningd/ping.h>
 #include <lightningd/status.h>
 #include <secp256k1_ecdh.h>
@@ -111,6 +112,8 @@ static struct peer *setup_new_peer(struct daemon *daemon, const u8 *msg)
 	peer->num_pings_outstanding = 0;
 	peer->broadcast_index = 0;
 	msg_queue_init(&peer->peer_out, peer);
+	msg_queue_set_watermarks(&peer->peer_out,
+				 PEER_OUT_HIWAT, PEER_OUT_LOWAT);
 	list_add_tail(&daemon->peers, &peer->list);
 	tal_add_destructor(peer, destroy_peer);
 	wake_pkt_out(peer);
@@ -134,6 +137,8 @@ static struct peer *setup_new_remote_peer(struct daemon *daemon,
 		peer->broadcast_index = daemon->rstate->broadcasts->next_index;
 
 	msg_queue_init(&peer->peer_out, peer);
+	msg_queue_set_watermarks(&peer->peer_out,
+				 PEER_OUT_HIWAT, PEER_OUT_LOWAT);
 	list_add_tail(&daemon->peers, &peer->list);
 	tal_add_destructor(peer, destroy_peer);
 	wake_pkt_out(peer);
@@ -216,10 +221,11 @@ static bool handle_ping(struct peer *peer, u8 *ping)
 
 static bool handle_pong(struct peer *peer, const u8 *pong)
 {
-	u8 *ignored;
+	u16 byteslen;
+	const u8 *ignored;
 
 	status_trace("Got pong!");
-	if (!fromwire_pong(pong, pong, NULL, &ignored)) {
+	if (!fromwire_pong_view(pong, NULL, &byteslen, &ignored)) {
 		peer->error = "pad pong";
 		return false;
 	}
@@ -235,6 +241,18 @@ static bool handle_pong(struct peer *peer, const u8 *pong)
 	return true;
 }
 
+static struct io_plan *peer_msgin(struct io_conn *conn,
+				  struct peer *peer, u8 *msg);
+
+/* If they're not reading our pongs, stop reading their pings. */
+static struct io_plan *peer_next_in(struct io_conn *conn, struct peer *peer)
+{
+	if (msg_queue_full(&peer->peer_out))
+		return msg_queue_wait_room(conn, &peer->peer_out,
+					   peer_next_in, peer);
+	return peer_read_message(conn, &peer->pcs, peer_msgin);
+}
+
 static struct io_plan *peer_msgin(struct io_conn *conn,
 				  struct peer *peer, u8 *msg)
 {
@@ -251,17 +269,17 @@ static struct io_plan *peer_msgin(struct io_conn *conn,
 	case WIRE_NODE_ANNOUNCEMENT:
 	case WIRE_CHANNEL_UPDATE:
 		handle_gossip_msg(peer->daemon->rstate, msg);
-		return peer_read_message(conn, &peer->pcs, peer_msgin);
+		return peer_next_in(conn, peer);
 
 	case WIRE_PING:
 		if (!handle_ping(peer, msg))
 			return io_close(conn);
-		return peer_read_message(conn, &peer->pcs, peer_msgin);
+		return peer_next_in(conn, peer);
 
 	case WIRE_PONG:
 		if (!handle_pong(peer, msg))
 			return io_close(conn);
-		return peer_read_message(conn, &peer->pcs, peer_msgin);
+		return peer_next_in(conn, peer);
 
 	case WIRE_OPEN_CHANNEL:
 	case WIRE_CHANNEL_REESTABLISH:
@@ -295,7 +313,7 @@ static struct io_plan *peer_msgin(struct io_conn *conn,
 	if (t & 1) {
 		status_trace("Peer %"PRIu64" sent unknown packet %u, ignoring",
 			     peer->unique_id, t);
-		return peer_read_message(conn, &peer->pcs, peer_msgin);
+		return peer_next_in(conn, peer);
 	}
 	peer->error = tal_fmt(peer, "Unknown packet %u", t);
 	return io_close(conn);
@@ -530,12 +548,14 @@ static struct io_plan *getroute_req(struct io_conn *conn, struct daemon *daemon,
 {
 	tal_t *tmpctx = tal_tmpctx(msg);
 	struct pubkey source, destination;
+	u64 reqid;
 	u32 msatoshi;
 	u16 riskfactor;
 	u8 *out;
 	struct route_hop *hops;
 
-	fromwire_gossip_getroute_request(msg, NULL, &source, &destination,
+	fromwire_gossip_getroute_request(msg, NULL, &reqid,
+					 &source, &destination,
 					 &msatoshi, &riskfactor);
 	status_trace("Trying to find a route from %s to %s for %d msatoshi",
 		     pubkey_to_hexstr(tmpctx, &source),
@@ -544,7 +564,7 @@ static struct io_plan *getroute_req(struct io_conn *conn, struct daemon *daemon,
 	hops = get_route(tmpctx, daemon->rstate, &source, &destination,
 			 msatoshi, 1);
 
-	out = towire_gossip_getroute_reply(msg, hops);
+	out = towire_gossip_getroute_reply(msg, reqid, hops);
 	tal_free(tmpctx);
 	daemon_conn_send(&daemon->master, out);
 	return daemon_conn_read_next(conn, &daemon->master);
@@ -674,30 +694,44 @@ static struct io_plan *gossip_init(struct daemon_conn *master,
 static struct io_plan *resolve_channel_req(struct io_conn *conn,
 					   struct daemon *daemon, const u8 *msg)
 {
-	struct short_channel_id scid;
+	struct short_channel_id *scids;
 	struct node_connection *nc;
 	struct pubkey *keys;
+	bool *found;
+	u64 reqid;
+	size_t i, n;
 
-	if (!fromwire_gossip_resolve_channel_request(msg, NULL, &scid))
+	if (!fromwire_gossip_resolve_channel_request(msg, msg, NULL, &reqid,
+						     &scids))
 		status_failed(WIRE_GOSSIPSTATUS_BAD_REQUEST,
 			      "Unable to parse resolver request");
 
-	nc = get_connection_by_scid(daemon->rstate, &scid, 0);
-	if (!nc) {
-		status_trace("Failed to resolve channel %s",
-			     type_to_string(trc, struct short_channel_id, &scid));
-		keys = NULL;
-	} else {
-		keys = tal_arr(msg, struct pubkey, 2);
-		keys[0] = nc->src->id;
-		keys[1] = nc->dst->id;
+	found = tal_arr(msg, bool, tal_count(scids));
+	keys = tal_arr(msg, struct pubkey, 0);
+	for (i = 0; i < tal_count(scids); i++) {
+		nc = get_connection_by_scid(daemon->rstate, &scids[i], 0);
+		found[i] = (nc != NULL);
+		if (!nc) {
+			status_trace("Failed to resolve channel %s",
+				     type_to_string(trc,
+						    struct short_channel_id,
+						    &scids[i]));
+			continue;
+		}
+		n = tal_count(keys);
+		tal_resize(&keys, n + 2);
+		keys[n] = nc->src->id;
+		keys[n + 1] = nc->dst->id;
 		status_trace("Resolved channel %s %s<->%s",
-			     type_to_string(trc, struct short_channel_id, &scid),
-			     type_to_string(trc, struct pubkey, &keys[0]),
-			     type_to_string(trc, struct pubkey, &keys[1]));
+			     type_to_string(trc, struct short_channel_id,
+					    &scids[i]),
+			     type_to_string(trc, struct pubkey, &keys[n]),
+			     type_to_string(trc, struct pubkey, &keys[n + 1]));
 	}
 	daemon_conn_send(&daemon->master,
-			 take(towire_gossip_resolve_channel_reply(msg, keys)));
+			 take(towire_gossip_resolve_channel_reply(msg, reqid,
+								  found,
+								  keys)));
 	return daemon_conn_read_next(conn, &daemon->master);
 }
 
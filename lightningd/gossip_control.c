@@ -205,9 +205,10 @@ static bool json_getroute_reply(struct subd *gossip, const u8 *reply, const int
 {
 	struct json_result *response;
 	struct route_hop *hops;
+	u64 reqid;
 	size_t i;
 
-	fromwire_gossip_getroute_reply(reply, reply, NULL, &hops);
+	fromwire_gossip_getroute_reply(reply, reply, NULL, &reqid, &hops);
 
 	if (tal_count(hops) == 0) {
 		command_fail(cmd, "Could not find a route");
@@ -267,8 +268,10 @@ static void json_getroute(struct command *cmd, const char *buffer, const jsmntok
 			     buffer + riskfactortok->start);
 		return;
 	}
-	u8 *req = towire_gossip_getroute_request(cmd, &cmd->dstate->id, &id, msatoshi, riskfactor*1000);
-	subd_req(ld->gossip, ld->gossip, req, -1, 0, json_getroute_reply, cmd);
+	u64 reqid = subd_next_reqid(ld->gossip);
+	u8 *req = towire_gossip_getroute_request(cmd, reqid, &cmd->dstate->id, &id, msatoshi, riskfactor*1000);
+	subd_req_id(ld->gossip, ld->gossip, req, reqid, -1, 0,
+		    json_getroute_reply, cmd);
 }
 
 static const struct json_command getroute_command = {
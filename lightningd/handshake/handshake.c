@@ -2,17 +2,22 @@
 #include <assert.h>
 #include <bitcoin/privkey.h>
 #include <ccan/build_assert/build_assert.h>
+#include <ccan/container_of/container_of.h>
 #include <ccan/crypto/hkdf_sha256/hkdf_sha256.h>
 #include <ccan/endian/endian.h>
-#include <ccan/fdpass/fdpass.h>
+#include <ccan/io/fdpass/fdpass.h>
+#include <ccan/io/io.h>
 #include <ccan/mem/mem.h>
-#include <ccan/read_write_all/read_write_all.h>
 #include <ccan/short_types/short_types.h>
+#include <ccan/tal/str/str.h>
 #include <errno.h>
-#include <lightningd/crypto_sync.h>
+#include <inttypes.h>
+#include <lightningd/cryptomsg.h>
+#include <lightningd/daemon_conn.h>
 #include <lightningd/debug.h>
+#include <lightningd/dev_disconnect.h>
 #include <lightningd/handshake/gen_handshake_wire.h>
-#include <lightningd/hsm/client.h>
+#include <lightningd/hsm/gen_hsm_client_wire.h>
 #include <lightningd/status.h>
 #include <secp256k1.h>
 #include <secp256k1_ecdh.h>
@@ -23,9 +28,10 @@
 #include <version.h>
 #include <wire/peer_wire.h>
 #include <wire/wire.h>
-#include <wire/wire_sync.h>
+#include <wire/wire_io.h>
 
 #define REQ_FD STDIN_FILENO
+#define HSM_FD 3
 
 /* BOLT #8:
  *
@@ -80,8 +86,26 @@ struct handshake {
 	struct sha256 h;
 	struct keypair e;
 	struct secret ss;
+
+	/* If an act fails, why. */
+	enum handshake_wire_type failcode;
+	const char *failmsg;
 };
 
+/* Record why the handshake failed (for caller to report): returns false. */
+static bool PRINTF_FMT(3,4) handshake_failed(struct handshake *h,
+					     enum handshake_wire_type code,
+					     const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	h->failcode = code;
+	h->failmsg = tal_vfmt(h, fmt, ap);
+	va_end(ap);
+	return false;
+}
+
 /* h = SHA-256(h || data) */
 static void sha_mix_in(struct sha256 *h, const void *data, size_t len)
 {
@@ -221,6 +245,8 @@ static struct handshake *new_handshake(const tal_t *ctx,
 {
 	struct handshake *handshake = tal(ctx, struct handshake);
 
+	handshake->failmsg = NULL;
+
 	/* BOLT #8:
 	 *
 	 * Before the start of the first act, both sides initialize their
@@ -298,14 +324,13 @@ static inline void check_act_one(const struct act_one *act1)
 	BUILD_ASSERT(sizeof(act1->tag) == 16);
 }
 
-static void act_one_initiator(struct handshake *h, int fd,
-			      const struct pubkey *their_id)
+
+static bool act_one_initiator(struct handshake *h,
+			      const struct pubkey *their_id,
+			      struct act_one *act1)
 {
-	struct act_one act1;
 	size_t len;
 
-	status_send_sync(towire_initr_act_one(h));
-
 	/* BOLT #8:
 	 *
 	 * **Sender Actions:**
@@ -335,7 +360,8 @@ static void act_one_initiator(struct handshake *h, int fd,
 	 */
 	if (!secp256k1_ecdh(secp256k1_ctx, h->ss.data,
 			    &their_id->pubkey, h->e.priv.secret.data))
-		status_failed(WIRE_INITR_ACT1_BAD_ECDH_FOR_SS, "%s", "");
+		return handshake_failed(h, WIRE_INITR_ACT1_BAD_ECDH_FOR_SS,
+					"%s", "");
 	status_trace("# ss=0x%s", tal_hexstr(trc, h->ss.data, sizeof(h->ss.data)));
 
 	/* BOLT #8:
@@ -355,8 +381,8 @@ static void act_one_initiator(struct handshake *h, int fd,
 	 *     * where `zero` is a zero-length plaintext
 	 */
 	encrypt_ad(&h->temp_k, 0, &h->h, sizeof(h->h), NULL, 0,
-		   act1.tag, sizeof(act1.tag));
-	status_trace("# c=%s", tal_hexstr(trc, act1.tag, sizeof(act1.tag)));
+		   act1->tag, sizeof(act1->tag));
+	status_trace("# c=%s", tal_hexstr(trc, act1->tag, sizeof(act1->tag)));
 
 	/* BOLT #8:
 	 *
@@ -364,30 +390,27 @@ static void act_one_initiator(struct handshake *h, int fd,
 	 *     * Finally, the generated ciphertext is accumulated into the
 	 *       authenticating handshake digest.
 	 */
-	sha_mix_in(&h->h, act1.tag, sizeof(act1.tag));
+	sha_mix_in(&h->h, act1->tag, sizeof(act1->tag));
 	status_trace("# h=0x%s", tal_hexstr(trc, &h->h, sizeof(h->h)));
 
 	/* BOLT #8:
 	 *
 	 *  * Send `m = 0 || e.pub.serializeCompressed() || c` to the responder over the network buffer.
 	 */
-	act1.v = 0;
-	len = sizeof(act1.pubkey);
-	secp256k1_ec_pubkey_serialize(secp256k1_ctx, act1.pubkey, &len,
+	act1->v = 0;
+	len = sizeof(act1->pubkey);
+	secp256k1_ec_pubkey_serialize(secp256k1_ctx, act1->pubkey, &len,
 				      &h->e.pub.pubkey,
 				      SECP256K1_EC_COMPRESSED);
-	status_trace("output: 0x%s", tal_hexstr(trc, &act1, ACT_ONE_SIZE));
-	if (!write_all(fd, &act1, ACT_ONE_SIZE))
-		status_failed(WIRE_INITR_ACT1_WRITE_FAILED,
-			      "%s", strerror(errno));
+	status_trace("output: 0x%s", tal_hexstr(trc, act1, ACT_ONE_SIZE));
+	return true;
 }
 
-static void act_one_responder(struct handshake *h, int fd, struct pubkey *re)
+/* Caller then sets h->ss = ECDH(re, s.priv) (all zero if HSM fails) */
+static bool act_one_responder_pre_ecdh(struct handshake *h,
+				       const struct act_one *act1,
+				       struct pubkey *re)
 {
-	struct act_one act1;
-
-	status_send_sync(towire_respr_act_one(h));
-
 	/* BOLT #8:
 	 *
 	 *   * Read _exactly_ `50-bytes` from the network buffer.
@@ -398,18 +421,16 @@ static void act_one_responder(struct handshake *h, int fd, struct pubkey *re)
 	 *       next `33` bytes of `m` and `m[34:]` is the last 16 bytes of
 	 *       `m`
 	 */
-	if (!read_all(fd, &act1, ACT_ONE_SIZE))
-		status_failed(WIRE_RESPR_ACT1_READ_FAILED,
-			      "%s", strerror(errno));
-	status_trace("input: 0x%s", tal_hexstr(trc, &act1, ACT_ONE_SIZE));
+	status_trace("input: 0x%s", tal_hexstr(trc, act1, ACT_ONE_SIZE));
 
 	/* BOLT #8:
 	 *
 	 *   * If `v` is an unrecognized handshake version, then the responder
 	 *     MUST abort the connection attempt.
 	 */
-	if (act1.v != 0)
-		status_failed(WIRE_RESPR_ACT1_BAD_VERSION, "%u", act1.v);
+	if (act1->v != 0)
+		return handshake_failed(h, WIRE_RESPR_ACT1_BAD_VERSION,
+					"%u", act1->v);
 
 	/* BOLT #8:
 	 *     * The raw bytes of the remote party's ephemeral public key
@@ -418,10 +439,10 @@ static void act_one_responder(struct handshake *h, int fd, struct pubkey *re)
 	 *       composed format.
 	 */
 	if (secp256k1_ec_pubkey_parse(secp256k1_ctx, &re->pubkey,
-				      act1.pubkey, sizeof(act1.pubkey)) != 1)
-		status_failed(WIRE_RESPR_ACT1_BAD_PUBKEY, "%s",
-			      tal_hexstr(trc, &act1.pubkey,
-					 sizeof(act1.pubkey)));
+				      act1->pubkey, sizeof(act1->pubkey)) != 1)
+		return handshake_failed(h, WIRE_RESPR_ACT1_BAD_PUBKEY, "%s",
+					tal_hexstr(trc, &act1->pubkey,
+						   sizeof(act1->pubkey)));
 	status_trace("# re=0x%s", type_to_string(trc, struct pubkey, re));
 
 	/* BOLT #8:
@@ -432,16 +453,22 @@ static void act_one_responder(struct handshake *h, int fd, struct pubkey *re)
 	 */
 	sha_mix_in_key(&h->h, re);
 	status_trace("# h=0x%s", tal_hexstr(trc, &h->h, sizeof(h->h)));
+	return true;
+}
 
+static bool act_one_responder(struct handshake *h,
+			      const struct act_one *act1,
+			      const struct pubkey *re)
+{
 	/* BOLT #8:
 	 *   * `ss = ECDH(re, s.priv)`
 	 *     * The responder performs an `ECDH` between its static public
 	 *       key and the initiator's ephemeral public key.
 	 */
-	if (!hsm_do_ecdh(&h->ss, re))
-		status_failed(WIRE_RESPR_ACT1_BAD_HSM_ECDH,
-			      "re=%s",
-			      type_to_string(trc, struct pubkey, re));
+	if (memeqzero(&h->ss, sizeof(h->ss)))
+		return handshake_failed(h, WIRE_RESPR_ACT1_BAD_HSM_ECDH,
+					"re=%s",
+					type_to_string(trc, struct pubkey, re));
 	status_trace("# ss=0x%s", tal_hexstr(trc, &h->ss, sizeof(h->ss)));
 
 	/* BOLT #8:
@@ -465,11 +492,13 @@ static void act_one_responder(struct handshake *h, int fd, struct pubkey *re)
 	 *       messages.
 	 */
 	if (!decrypt(&h->temp_k, 0, &h->h, sizeof(h->h),
-		     act1.tag, sizeof(act1.tag), NULL, 0))
-		status_failed(WIRE_RESPR_ACT1_BAD_TAG, "re=%s ss=%s tag=%s",
-			      type_to_string(trc, struct pubkey, re),
-			      tal_hexstr(trc, &h->ss, sizeof(h->ss)),
-			      tal_hexstr(trc, act1.tag, sizeof(act1.tag)));
+		     act1->tag, sizeof(act1->tag), NULL, 0))
+		return handshake_failed(h, WIRE_RESPR_ACT1_BAD_TAG,
+					"re=%s ss=%s tag=%s",
+					type_to_string(trc, struct pubkey, re),
+					tal_hexstr(trc, &h->ss, sizeof(h->ss)),
+					tal_hexstr(trc, act1->tag,
+						   sizeof(act1->tag)));
 
 	/* BOLT #8:
 	 *
@@ -477,8 +506,9 @@ static void act_one_responder(struct handshake *h, int fd, struct pubkey *re)
 	 *      * Mix the received ciphertext into the handshake digest. This
 	 *        step serves to ensure the payload wasn't modified by a MiTM.
 	 */
-	sha_mix_in(&h->h, act1.tag, sizeof(act1.tag));
+	sha_mix_in(&h->h, act1->tag, sizeof(act1->tag));
 	status_trace("# h=0x%s", tal_hexstr(trc, &h->h, sizeof(h->h)));
+	return true;
 }
 
 /* BOLT #8:
@@ -509,14 +539,12 @@ static inline void check_act_two(const struct act_two *act2)
 	BUILD_ASSERT(sizeof(act2->tag) == 16);
 }
 
-static void act_two_responder(struct handshake *h, int fd,
-			      const struct pubkey *re)
+static bool act_two_responder(struct handshake *h,
+			      const struct pubkey *re,
+			      struct act_two *act2)
 {
-	struct act_two act2;
 	size_t len;
 
-	status_send_sync(towire_respr_act_two(h));
-
 	/* BOLT #8:
 	 *
 	 * **Sender Actions:**
@@ -545,9 +573,11 @@ static void act_two_responder(struct handshake *h, int fd,
 	 */
 	if (!secp256k1_ecdh(secp256k1_ctx, h->ss.data, &re->pubkey,
 			    h->e.priv.secret.data))
-		status_failed(WIRE_RESPR_ACT2_BAD_ECDH_FOR_SS, "re=%s e.priv=%s",
-			      type_to_string(trc, struct pubkey, re),
-			      tal_hexstr(trc, &h->e.priv, sizeof(h->e.priv)));
+		return handshake_failed(h, WIRE_RESPR_ACT2_BAD_ECDH_FOR_SS,
+					"re=%s e.priv=%s",
+					type_to_string(trc, struct pubkey, re),
+					tal_hexstr(trc, &h->e.priv,
+						   sizeof(h->e.priv)));
 	status_trace("# ss=0x%s", tal_hexstr(trc, &h->ss, sizeof(h->ss)));
 
 	/* BOLT #8:
@@ -567,8 +597,8 @@ static void act_two_responder(struct handshake *h, int fd,
 	 *      * where `zero` is a zero-length plaintext
 	 */
 	encrypt_ad(&h->temp_k, 0, &h->h, sizeof(h->h), NULL, 0,
-		   act2.tag, sizeof(act2.tag));
-	status_trace("# c=0x%s", tal_hexstr(trc, act2.tag, sizeof(act2.tag)));
+		   act2->tag, sizeof(act2->tag));
+	status_trace("# c=0x%s", tal_hexstr(trc, act2->tag, sizeof(act2->tag)));
 
 	/* BOLT #8:
 	 *
@@ -576,30 +606,26 @@ static void act_two_responder(struct handshake *h, int fd,
 	 *      * Finally, the generated ciphertext is accumulated into the
 	 *        authenticating handshake digest.
 	 */
-	sha_mix_in(&h->h, act2.tag, sizeof(act2.tag));
+	sha_mix_in(&h->h, act2->tag, sizeof(act2->tag));
 	status_trace("# h=0x%s", tal_hexstr(trc, &h->h, sizeof(h->h)));
 
 	/* BOLT #8:
 	 *
 	 * * Send `m = 0 || e.pub.serializeCompressed() || c` to the initiator over the network buffer.
 	 */
-	act2.v = 0;
-	len = sizeof(act2.pubkey);
-	secp256k1_ec_pubkey_serialize(secp256k1_ctx, act2.pubkey, &len,
+	act2->v = 0;
+	len = sizeof(act2->pubkey);
+	secp256k1_ec_pubkey_serialize(secp256k1_ctx, act2->pubkey, &len,
 				      &h->e.pub.pubkey,
 				      SECP256K1_EC_COMPRESSED);
-	status_trace("output: 0x%s", tal_hexstr(trc, &act2, ACT_TWO_SIZE));
-	if (!write_all(fd, &act2, ACT_TWO_SIZE))
-		status_failed(WIRE_RESPR_ACT2_WRITE_FAILED,
-			      "%s", strerror(errno));
+	status_trace("output: 0x%s", tal_hexstr(trc, act2, ACT_TWO_SIZE));
+	return true;
 }
 
-static void act_two_initiator(struct handshake *h, int fd, struct pubkey *re)
+static bool act_two_initiator(struct handshake *h,
+			      const struct act_two *act2,
+			      struct pubkey *re)
 {
-	struct act_two act2;
-
-	status_send_sync(towire_initr_act_two(h));
-
 	/* BOLT #8:
 	 *
 	 *   * Read _exactly_ `50-bytes` from the network buffer.
@@ -610,18 +636,16 @@ static void act_two_initiator(struct handshake *h, int fd, struct pubkey *re)
 	 *       next `33` bytes of `m` and `m[34:]` is the last 16 bytes of
 	 *       `m`
 	 */
-	if (!read_all(fd, &act2, ACT_TWO_SIZE))
-		status_failed(WIRE_INITR_ACT2_READ_FAILED,
-			      "%s", strerror(errno));
-	status_trace("input: 0x%s", tal_hexstr(trc, &act2, ACT_TWO_SIZE));
+	status_trace("input: 0x%s", tal_hexstr(trc, act2, ACT_TWO_SIZE));
 
 	/* BOLT #8:
 	 *
 	 *   * If `v` is an unrecognized handshake version, then the responder
 	 *     MUST abort the connection attempt.
 	 */
-	if (act2.v != 0)
-		status_failed(WIRE_INITR_ACT2_BAD_VERSION, "%u", act2.v);
+	if (act2->v != 0)
+		return handshake_failed(h, WIRE_INITR_ACT2_BAD_VERSION,
+					"%u", act2->v);
 
 	/* BOLT #8:
 	 *
@@ -631,10 +655,10 @@ static void act_two_initiator(struct handshake *h, int fd, struct pubkey *re)
 	 *       composed format.
 	 */
 	if (secp256k1_ec_pubkey_parse(secp256k1_ctx, &re->pubkey,
-				      act2.pubkey, sizeof(act2.pubkey)) != 1)
-		status_failed(WIRE_INITR_ACT2_BAD_PUBKEY, "%s",
-			      tal_hexstr(trc, &act2.pubkey,
-					 sizeof(act2.pubkey)));
+				      act2->pubkey, sizeof(act2->pubkey)) != 1)
+		return handshake_failed(h, WIRE_INITR_ACT2_BAD_PUBKEY, "%s",
+					tal_hexstr(trc, &act2->pubkey,
+						   sizeof(act2->pubkey)));
 	status_trace("# re=0x%s", type_to_string(trc, struct pubkey, re));
 
 	/* BOLT #8:
@@ -650,9 +674,11 @@ static void act_two_initiator(struct handshake *h, int fd, struct pubkey *re)
 	 */
 	if (!secp256k1_ecdh(secp256k1_ctx, h->ss.data, &re->pubkey,
 			    h->e.priv.secret.data))
-		status_failed(WIRE_INITR_ACT2_BAD_ECDH_FOR_SS, "re=%s e.priv=%s",
-			      type_to_string(trc, struct pubkey, re),
-			      tal_hexstr(trc, &h->e.priv, sizeof(h->e.priv)));
+		return handshake_failed(h, WIRE_INITR_ACT2_BAD_ECDH_FOR_SS,
+					"re=%s e.priv=%s",
+					type_to_string(trc, struct pubkey, re),
+					tal_hexstr(trc, &h->e.priv,
+						   sizeof(h->e.priv)));
 	status_trace("# ss=0x%s", tal_hexstr(trc, &h->ss, sizeof(h->ss)));
 
 	/* BOLT #8:
@@ -673,9 +699,10 @@ static void act_two_initiator(struct handshake *h, int fd, struct pubkey *re)
 	 *       MUST terminate the connection without any further messages.
 	 */
 	if (!decrypt(&h->temp_k, 0, &h->h, sizeof(h->h),
-		     act2.tag, sizeof(act2.tag), NULL, 0))
-		status_failed(WIRE_INITR_ACT2_BAD_TAG, "c=%s",
-			      tal_hexstr(trc, act2.tag, sizeof(act2.tag)));
+		     act2->tag, sizeof(act2->tag), NULL, 0))
+		return handshake_failed(h, WIRE_INITR_ACT2_BAD_TAG, "c=%s",
+					tal_hexstr(trc, act2->tag,
+						   sizeof(act2->tag)));
 
 	/* BOLT #8:
 	 *
@@ -683,8 +710,9 @@ static void act_two_initiator(struct handshake *h, int fd, struct pubkey *re)
 	 *      * Mix the received ciphertext into the handshake digest. This
 	 *        step serves to ensure the payload wasn't modified by a MiTM.
 	 */
-	sha_mix_in(&h->h, act2.tag, sizeof(act2.tag));
+	sha_mix_in(&h->h, act2->tag, sizeof(act2->tag));
 	status_trace("# h=0x%s", tal_hexstr(trc, &h->h, sizeof(h->h)));
+	return true;
 }
 
 /* BOLT #8:
@@ -719,16 +747,14 @@ static inline void check_act_three(const struct act_three *act3)
 	BUILD_ASSERT(sizeof(act3->tag) == 16);
 }
 
-static void act_three_initiator(struct handshake *h, int fd,
-				const struct pubkey *re,
-				const struct pubkey *my_id)
+/* Caller then sets h->ss = ECDH(re, s.priv) (all zero if HSM fails) */
+static void act_three_initiator_pre_ecdh(struct handshake *h,
+					 const struct pubkey *my_id,
+					 struct act_three *act3)
 {
-	struct act_three act3;
 	u8 spub[PUBKEY_DER_LEN];
 	size_t len = sizeof(spub);
 
-	status_send_sync(towire_initr_act_three(h));
-
 	/* BOLT #8:
 	 *   * `c = encryptWithAD(temp_k2, 1, h, s.pub.serializeCompressed())`
 	 *     * where `s` is the static public key of the initiator.
@@ -737,26 +763,31 @@ static void act_three_initiator(struct handshake *h, int fd,
 				      &my_id->pubkey,
 				      SECP256K1_EC_COMPRESSED);
 	encrypt_ad(&h->temp_k, 1, &h->h, sizeof(h->h), spub, sizeof(spub),
-		   act3.ciphertext, sizeof(act3.ciphertext));
+		   act3->ciphertext, sizeof(act3->ciphertext));
 	status_trace("# c=0x%s",
-		     tal_hexstr(trc,act3.ciphertext,sizeof(act3.ciphertext)));
+		     tal_hexstr(trc,act3->ciphertext,sizeof(act3->ciphertext)));
 
 	/* BOLT #8:
 	 *   * `h = SHA-256(h || c)`
 	 */
-	sha_mix_in(&h->h, act3.ciphertext, sizeof(act3.ciphertext));
+	sha_mix_in(&h->h, act3->ciphertext, sizeof(act3->ciphertext));
 	status_trace("# h=0x%s", tal_hexstr(trc, &h->h, sizeof(h->h)));
+}
 
+static bool act_three_initiator(struct handshake *h,
+				const struct pubkey *re,
+				struct act_three *act3)
+{
 	/* BOLT #8:
 	 *
 	 *   * `ss = ECDH(re, s.priv)`
 	 *     * where `re` is the ephemeral public key of the responder.
 	 *
 	 */
-	if (!hsm_do_ecdh(&h->ss, re))
-		status_failed(WIRE_INITR_ACT3_BAD_HSM_ECDH,
-			      "re=%s",
-			      type_to_string(trc, struct pubkey, re));
+	if (memeqzero(&h->ss, sizeof(h->ss)))
+		return handshake_failed(h, WIRE_INITR_ACT3_BAD_HSM_ECDH,
+					"re=%s",
+					type_to_string(trc, struct pubkey, re));
 	status_trace("# ss=0x%s", tal_hexstr(trc, &h->ss, sizeof(h->ss)));
 
 	/* BOLT #8:
@@ -776,41 +807,34 @@ static void act_three_initiator(struct handshake *h, int fd,
 	 *
 	 */
 	encrypt_ad(&h->temp_k, 0, &h->h, sizeof(h->h), NULL, 0,
-		   act3.tag, sizeof(act3.tag));
+		   act3->tag, sizeof(act3->tag));
 	status_trace("# t=0x%s",
-		     tal_hexstr(trc, act3.tag, sizeof(act3.tag)));
+		     tal_hexstr(trc, act3->tag, sizeof(act3->tag)));
 
 	/* BOLT #8:
 	 *
 	 *   * Send `m = 0 || c || t` over the network buffer.
 	 *
 	 */
-	act3.v = 0;
+	act3->v = 0;
 
-	status_trace("output: 0x%s", tal_hexstr(trc, &act3, ACT_THREE_SIZE));
-	if (!write_all(fd, &act3, ACT_THREE_SIZE))
-		status_failed(WIRE_INITR_ACT3_WRITE_FAILED,
-			      "%s", strerror(errno));
+	status_trace("output: 0x%s", tal_hexstr(trc, act3, ACT_THREE_SIZE));
+	return true;
 }
 
-static void act_three_responder(struct handshake *h, int fd,
+static bool act_three_responder(struct handshake *h,
+				const struct act_three *act3,
 				struct pubkey *their_id)
 {
-	struct act_three act3;
 	u8 der[PUBKEY_DER_LEN];
 
-	status_send_sync(towire_respr_act_three(h));
-
 	/* BOLT #8:
 	 *
 	 * **Receiver Actions:**
 	 *
 	 *   * Read _exactly_ `66-bytes` from the network buffer.
 	 */
-	if (!read_all(fd, &act3, ACT_THREE_SIZE))
-		status_failed(WIRE_RESPR_ACT3_READ_FAILED,
-			      "%s", strerror(errno));
-	status_trace("input: 0x%s", tal_hexstr(trc, &act3, ACT_THREE_SIZE));
+	status_trace("input: 0x%s", tal_hexstr(trc, act3, ACT_THREE_SIZE));
 
 	/* BOLT #8:
 	 *
@@ -822,8 +846,9 @@ static void act_three_responder(struct handshake *h, int fd,
 	 *   * If `v` is an unrecognized handshake version, then the responder MUST
 	 *     abort the connection attempt.
 	 */
-	if (act3.v != 0)
-		status_failed(WIRE_RESPR_ACT3_BAD_VERSION, "%u", act3.v);
+	if (act3->v != 0)
+		return handshake_failed(h, WIRE_RESPR_ACT3_BAD_VERSION,
+					"%u", act3->v);
 
 	/* BOLT #8:
 	 *
@@ -832,25 +857,25 @@ static void act_three_responder(struct handshake *h, int fd,
 	 *        initiator.
 	 */
 	if (!decrypt(&h->temp_k, 1, &h->h, sizeof(h->h),
-		     act3.ciphertext, sizeof(act3.ciphertext),
+		     act3->ciphertext, sizeof(act3->ciphertext),
 		     der, sizeof(der)))
-		status_failed(WIRE_RESPR_ACT3_BAD_CIPHERTEXT,
-			      "ciphertext=%s",
-			      tal_hexstr(trc, act3.ciphertext,
-					 sizeof(act3.ciphertext)));
+		return handshake_failed(h, WIRE_RESPR_ACT3_BAD_CIPHERTEXT,
+					"ciphertext=%s",
+					tal_hexstr(trc, act3->ciphertext,
+						   sizeof(act3->ciphertext)));
 	status_trace("# rs=0x%s", tal_hexstr(trc, der, sizeof(der)));
 
 	if (secp256k1_ec_pubkey_parse(secp256k1_ctx, &their_id->pubkey,
 				      der, sizeof(der)) != 1)
-		status_failed(WIRE_RESPR_ACT3_BAD_PUBKEY, "%s",
-			      tal_hexstr(trc, &der, sizeof(der)));
+		return handshake_failed(h, WIRE_RESPR_ACT3_BAD_PUBKEY, "%s",
+					tal_hexstr(trc, &der, sizeof(der)));
 
 	/* BOLT #8:
 	 *
 	 *   * `h = SHA-256(h || c)`
 	 *
 	 */
-	sha_mix_in(&h->h, act3.ciphertext, sizeof(act3.ciphertext));
+	sha_mix_in(&h->h, act3->ciphertext, sizeof(act3->ciphertext));
 	status_trace("# h=0x%s", tal_hexstr(trc, &h->h, sizeof(h->h)));
 
 	/* BOLT #8:
@@ -860,9 +885,12 @@ static void act_three_responder(struct handshake *h, int fd,
 	 */
 	if (!secp256k1_ecdh(secp256k1_ctx, h->ss.data, &their_id->pubkey,
 			    h->e.priv.secret.data))
-		status_failed(WIRE_RESPR_ACT3_BAD_ECDH_FOR_SS, "rs=%s e.priv=%s",
-			      type_to_string(trc, struct pubkey, their_id),
-			      tal_hexstr(trc, &h->e.priv, sizeof(h->e.priv)));
+		return handshake_failed(h, WIRE_RESPR_ACT3_BAD_ECDH_FOR_SS,
+					"rs=%s e.priv=%s",
+					type_to_string(trc, struct pubkey,
+						       their_id),
+					tal_hexstr(trc, &h->e.priv,
+						   sizeof(h->e.priv)));
 	status_trace("# ss=0x%s", tal_hexstr(trc, &h->ss, sizeof(h->ss)));
 
 	/* BOLT #8:
@@ -880,27 +908,22 @@ static void act_three_responder(struct handshake *h, int fd,
 	 *
 	 */
 	if (!decrypt(&h->temp_k, 0, &h->h, sizeof(h->h),
-		     act3.tag, sizeof(act3.tag), NULL, 0))
-		status_failed(WIRE_RESPR_ACT3_BAD_TAG, "temp_k3=%s h=%s t=%s",
-			      tal_hexstr(trc, &h->temp_k, sizeof(h->temp_k)),
-			      tal_hexstr(trc, &h->h, sizeof(h->h)),
-			      tal_hexstr(trc, act3.tag, sizeof(act3.tag)));
+		     act3->tag, sizeof(act3->tag), NULL, 0))
+		return handshake_failed(h, WIRE_RESPR_ACT3_BAD_TAG,
+					"temp_k3=%s h=%s t=%s",
+					tal_hexstr(trc, &h->temp_k,
+						   sizeof(h->temp_k)),
+					tal_hexstr(trc, &h->h, sizeof(h->h)),
+					tal_hexstr(trc, act3->tag,
+						   sizeof(act3->tag)));
+	return true;
 }
 
-static void initiator(int fd, const struct pubkey *my_id,
-		      const struct pubkey *their_id,
-		      struct secret *ck, struct secret *sk, struct secret *rk)
+static void initiator_keys(const struct handshake *h, struct crypto_state *cs)
 {
-	const tal_t *tmpctx = tal_tmpctx(NULL);
-	struct handshake *h = new_handshake(tmpctx, their_id);
-	struct pubkey re;
-
-	act_one_initiator(h, fd, their_id);
-	act_two_initiator(h, fd, &re);
-	act_three_initiator(h, fd, &re, my_id);
-
 	/* We need this for re-keying */
-	*ck = h->ck;
+	cs->s_ck = cs->r_ck = h->ck;
+	cs->rn = cs->sn = 0;
 
 	/* BOLT #8:
 	 *
@@ -915,28 +938,17 @@ static void initiator(int fd, const struct pubkey *my_id,
 	 *        sending and receiving messages for the duration of the
 	 *        session.
 	 */
-	hkdf_two_keys(sk, rk, ck, NULL, 0);
+	hkdf_two_keys(&cs->sk, &cs->rk, &h->ck, NULL, 0);
 	status_trace("output: sk,rk=0x%s,0x%s",
-		     tal_hexstr(trc, sk, sizeof(*sk)),
-		     tal_hexstr(trc, rk, sizeof(*rk)));
-	tal_free(tmpctx);
+		     tal_hexstr(trc, &cs->sk, sizeof(cs->sk)),
+		     tal_hexstr(trc, &cs->rk, sizeof(cs->rk)));
 }
 
-static void responder(int fd,
-		      const struct pubkey *my_id,
-		      struct pubkey *their_id,
-		      struct secret *ck, struct secret *sk, struct secret *rk)
+static void responder_keys(const struct handshake *h, struct crypto_state *cs)
 {
-	const tal_t *tmpctx = tal_tmpctx(NULL);
-	struct handshake *h = new_handshake(tmpctx, my_id);
-	struct pubkey re;
-
-	act_one_responder(h, fd, &re);
-	act_two_responder(h, fd, &re);
-	act_three_responder(h, fd, their_id);
-
 	/* We need this for re-keying */
-	*ck = h->ck;
+	cs->s_ck = cs->r_ck = h->ck;
+	cs->rn = cs->sn = 0;
 
 	/* BOLT #8:
 	 *
@@ -950,16 +962,248 @@ static void responder(int fd,
 	 *        sending and receiving messages for the duration of the
 	 *        session.
 	 */
-	hkdf_two_keys(rk, sk, ck, NULL, 0);
+	hkdf_two_keys(&cs->rk, &cs->sk, &h->ck, NULL, 0);
 	status_trace("output: rk,sk=0x%s,0x%s",
-		     tal_hexstr(trc, rk, sizeof(*rk)),
-		     tal_hexstr(trc, sk, sizeof(*sk)));
-	tal_free(tmpctx);
+		     tal_hexstr(trc, &cs->rk, sizeof(cs->rk)),
+		     tal_hexstr(trc, &cs->sk, sizeof(cs->sk)));
 }
 
 #ifndef TESTING
-static void exchange_init(int fd, struct crypto_state *cs,
-			  u8 **gfeatures, u8 **lfeatures)
+/*
+ * We run every handshake lightningd hands us in this one process: each is a
+ * state machine on its own io_conn.  The two ECDH operations which need our
+ * node secret go to the HSM; rather than a round trip each, whoever is ready
+ * goes into the next hsm_ecdh_batch_req, so under load it's one round trip
+ * for many handshakes.
+ */
+struct daemon {
+	/* Connection to lightningd. */
+	struct daemon_conn master;
+
+	/* Handshakes waiting for the next HSM batch, and in the current one
+	 * (NULL entries if they've gone away meanwhile). */
+	struct handshake_conn **ecdh_waiting, **ecdh_inflight;
+	u8 *hsm_in;
+};
+
+struct handshake_conn {
+	struct daemon *daemon;
+
+	/* lightningd's id for this request. */
+	u64 reqid;
+	bool initiator;
+
+	/* The peer: we hand back the fd on success. */
+	int fd;
+	bool replied;
+
+	struct pubkey my_id, their_id, re;
+	struct handshake *h;
+
+	/* The act we're reading or writing. */
+	struct act_one act1;
+	struct act_two act2;
+	struct act_three act3;
+
+	/* Then we exchange init messages. */
+	struct crypto_state cs;
+	u8 *enc, hdr[18];
+	u8 *gfeatures, *lfeatures;
+};
+
+static void remove_ecdh(struct handshake_conn **arr, struct handshake_conn *hc)
+{
+	size_t i;
+
+	for (i = 0; i < tal_count(arr); i++)
+		if (arr[i] == hc)
+			arr[i] = NULL;
+}
+
+static void destroy_handshake_conn(struct handshake_conn *hc)
+{
+	remove_ecdh(hc->daemon->ecdh_waiting, hc);
+	remove_ecdh(hc->daemon->ecdh_inflight, hc);
+}
+
+/* Sets hc->h->ss to ECDH(point, node secret), or all zero on failure. */
+static struct io_plan *hsm_ecdh(struct io_conn *conn,
+				struct handshake_conn *hc,
+				struct io_plan *(*next)(struct io_conn *,
+							struct handshake_conn *))
+{
+	struct daemon *daemon = hc->daemon;
+	size_t n = tal_count(daemon->ecdh_waiting);
+
+	tal_resize(&daemon->ecdh_waiting, n + 1);
+	daemon->ecdh_waiting[n] = hc;
+	io_wake(&daemon->ecdh_waiting);
+	return io_wait(conn, hc, next, hc);
+}
+
+static struct io_plan *hsm_send_batch(struct io_conn *conn,
+				      struct daemon *daemon);
+
+static struct io_plan *hsm_got_batch(struct io_conn *conn,
+				     struct daemon *daemon)
+{
+	struct secret *ss;
+	size_t i;
+
+	if (!fromwire_hsm_ecdh_batch_resp(daemon, daemon->hsm_in, NULL, &ss)
+	    || tal_count(ss) != tal_count(daemon->ecdh_inflight))
+		status_failed(WIRE_HANDSHAKE_BAD_COMMAND,
+			      "Bad HSM ecdh batch response: %s",
+			      tal_hex(trc, daemon->hsm_in));
+
+	for (i = 0; i < tal_count(ss); i++) {
+		struct handshake_conn *hc = daemon->ecdh_inflight[i];
+		if (!hc)
+			continue;
+		hc->h->ss = ss[i];
+		io_wake(hc);
+	}
+	tal_free(ss);
+	daemon->hsm_in = tal_free(daemon->hsm_in);
+	daemon->ecdh_inflight = tal_free(daemon->ecdh_inflight);
+	return hsm_send_batch(conn, daemon);
+}
+
+static struct io_plan *hsm_read_batch(struct io_conn *conn,
+				      struct daemon *daemon)
+{
+	return io_read_wire(conn, daemon, &daemon->hsm_in,
+			    hsm_got_batch, daemon);
+}
+
+static struct io_plan *hsm_send_batch(struct io_conn *conn,
+				      struct daemon *daemon)
+{
+	const tal_t *tmpctx;
+	struct pubkey *points;
+	u8 *msg;
+	size_t i, n = 0;
+
+	/* Everyone who's waited since the last batch goes in this one. */
+	for (i = 0; i < tal_count(daemon->ecdh_waiting); i++)
+		if (daemon->ecdh_waiting[i])
+			daemon->ecdh_waiting[n++] = daemon->ecdh_waiting[i];
+	tal_resize(&daemon->ecdh_waiting, n);
+	if (n == 0)
+		return io_wait(conn, &daemon->ecdh_waiting,
+			       hsm_send_batch, daemon);
+
+	daemon->ecdh_inflight = daemon->ecdh_waiting;
+	daemon->ecdh_waiting = tal_arr(daemon, struct handshake_conn *, 0);
+
+	tmpctx = tal_tmpctx(conn);
+	points = tal_arr(tmpctx, struct pubkey, n);
+	for (i = 0; i < n; i++)
+		points[i] = daemon->ecdh_inflight[i]->re;
+	msg = towire_hsm_ecdh_batch_req(NULL, points);
+	tal_free(tmpctx);
+
+	status_trace("HSM ecdh batch of %zu", n);
+	return io_write_wire(conn, take(msg), hsm_read_batch, daemon);
+}
+
+/* Tell lightningd it's done: hand back the fd on success. */
+static void handshake_reply(struct handshake_conn *hc, bool ok)
+{
+	struct daemon_conn *master = &hc->daemon->master;
+	u8 *msg;
+
+	hc->replied = true;
+	if (!ok)
+		msg = hc->initiator
+			? towire_handshake_initiator_replyfail(hc, hc->reqid)
+			: towire_handshake_responder_replyfail(hc, hc->reqid);
+	else if (hc->initiator)
+		msg = towire_handshake_initiator_reply(hc, hc->reqid, &hc->cs,
+						       hc->gfeatures,
+						       hc->lfeatures);
+	else
+		msg = towire_handshake_responder_reply(hc, hc->reqid,
+						       &hc->their_id, &hc->cs,
+						       hc->gfeatures,
+						       hc->lfeatures);
+	daemon_conn_send(master, take(msg));
+	if (ok)
+		daemon_conn_send_fd(master, hc->fd);
+}
+
+/* However the connection closes, lightningd gets an answer. */
+static void handshake_conn_finished(struct io_conn *conn,
+				    struct handshake_conn *hc)
+{
+	if (!hc->replied) {
+		status_trace("Handshake %"PRIu64" failed: %s", hc->reqid,
+			     strerror(errno));
+		handshake_reply(hc, false);
+	}
+}
+
+static struct io_plan *handshake_fail(struct io_conn *conn,
+				      struct handshake_conn *hc)
+{
+	status_trace("Handshake %"PRIu64" failed: %s: %s", hc->reqid,
+		     handshake_wire_type_name(hc->h->failcode),
+		     hc->h->failmsg);
+	handshake_reply(hc, false);
+	return io_close(conn);
+}
+
+static struct io_plan *init_done(struct io_conn *conn,
+				 struct handshake_conn *hc)
+{
+	u8 *msg = cryptomsg_decrypt_body(hc, &hc->cs, hc->enc);
+
+	if (!msg) {
+		status_trace("Handshake %"PRIu64": failed init body decrypt",
+			     hc->reqid);
+		return io_close(conn);
+	}
+
+	if (!fromwire_init(hc, msg, NULL, &hc->gfeatures, &hc->lfeatures)) {
+		status_trace("Handshake %"PRIu64": bad init: %s",
+			     hc->reqid, tal_hex(trc, msg));
+		return io_close(conn);
+	}
+
+	handshake_reply(hc, true);
+	/* daemon_conn_send_fd closes it, once sent. */
+	return io_close_taken_fd(conn);
+}
+
+static struct io_plan *init_read_body(struct io_conn *conn,
+				      struct handshake_conn *hc)
+{
+	u16 len;
+
+	if (!cryptomsg_decrypt_header(&hc->cs, hc->hdr, &len)) {
+		status_trace("Handshake %"PRIu64": failed init hdr decrypt",
+			     hc->reqid);
+		return io_close(conn);
+	}
+
+	tal_free(hc->enc);
+	hc->enc = tal_arr(hc, u8, len + 16);
+	return io_read(conn, hc->enc, tal_len(hc->enc), init_done, hc);
+}
+
+static struct io_plan *init_read_hdr(struct io_conn *conn,
+				     struct handshake_conn *hc)
+{
+	/* BOLT #1:
+	 *
+	 * Each node MUST wait to receive `init` before sending any other
+	 * messages.
+	 */
+	return io_read(conn, hc->hdr, sizeof(hc->hdr), init_read_body, hc);
+}
+
+static struct io_plan *exchange_init(struct io_conn *conn,
+				     struct handshake_conn *hc)
 {
 	/* BOLT #1:
 	 *
@@ -971,36 +1215,174 @@ static void exchange_init(int fd, struct crypto_state *cs,
 	 * not defined.
 	 */
 	u8 *localfeatures = tal_arrz(NULL, u8, 1);
+	u8 *msg;
+
 	localfeatures[0] = LOCALFEATURES_INITIAL_ROUTING_SYNC;
-	u8 *msg = towire_init(NULL, NULL, localfeatures);
-	localfeatures = tal_free(localfeatures);
+	msg = towire_init(NULL, NULL, localfeatures);
+	tal_free(localfeatures);
+
+	hc->enc = cryptomsg_encrypt_msg(hc, &hc->cs, take(msg));
+	switch (dev_disconnect(WIRE_INIT)) {
+	case DEV_DISCONNECT_BEFORE:
+	case DEV_DISCONNECT_DROPPKT:
+		return io_close(conn);
+	case DEV_DISCONNECT_AFTER:
+		return io_write(conn, hc->enc, tal_len(hc->enc),
+				io_close_cb, NULL);
+	default:
+		break;
+	}
+	return io_write(conn, hc->enc, tal_len(hc->enc), init_read_hdr, hc);
+}
+
+static struct io_plan *initiator_act_three(struct io_conn *conn,
+					   struct handshake_conn *hc)
+{
+	if (!act_three_initiator(hc->h, &hc->re, &hc->act3))
+		return handshake_fail(conn, hc);
 
-	if (!sync_crypto_write(cs, fd, msg))
-		status_failed(WIRE_INITMSG_WRITE_FAILED, "%s", strerror(errno));
+	initiator_keys(hc->h, &hc->cs);
+	return io_write(conn, &hc->act3, ACT_THREE_SIZE, exchange_init, hc);
+}
 
-	/* BOLT #1:
-	 *
-	 * Each node MUST wait to receive `init` before sending any other
-	 * messages.
-	 */
-	msg = sync_crypto_read(NULL, cs, fd);
-	if (!msg)
-		status_failed(WIRE_INITMSG_READ_FAILED, "%s", strerror(errno));
+static struct io_plan *initiator_act_two(struct io_conn *conn,
+					 struct handshake_conn *hc)
+{
+	if (!act_two_initiator(hc->h, &hc->act2, &hc->re))
+		return handshake_fail(conn, hc);
 
-	if (!fromwire_init(msg, msg, NULL, gfeatures, lfeatures))
-		status_failed(WIRE_INITMSG_READ_FAILED, "bad init: %s",
-			      tal_hex(msg, msg));
+	act_three_initiator_pre_ecdh(hc->h, &hc->my_id, &hc->act3);
+	return hsm_ecdh(conn, hc, initiator_act_three);
+}
+
+static struct io_plan *initiator_read_act_two(struct io_conn *conn,
+					      struct handshake_conn *hc)
+{
+	return io_read(conn, &hc->act2, ACT_TWO_SIZE, initiator_act_two, hc);
 }
 
-/* We expect hsmfd as fd 3, clientfd as 4 */
+static struct io_plan *responder_act_three(struct io_conn *conn,
+					   struct handshake_conn *hc)
+{
+	if (!act_three_responder(hc->h, &hc->act3, &hc->their_id))
+		return handshake_fail(conn, hc);
+
+	responder_keys(hc->h, &hc->cs);
+	return exchange_init(conn, hc);
+}
+
+static struct io_plan *responder_read_act_three(struct io_conn *conn,
+						struct handshake_conn *hc)
+{
+	return io_read(conn, &hc->act3, ACT_THREE_SIZE,
+		       responder_act_three, hc);
+}
+
+static struct io_plan *responder_act_one(struct io_conn *conn,
+					 struct handshake_conn *hc)
+{
+	if (!act_one_responder(hc->h, &hc->act1, &hc->re)
+	    || !act_two_responder(hc->h, &hc->re, &hc->act2))
+		return handshake_fail(conn, hc);
+
+	return io_write(conn, &hc->act2, ACT_TWO_SIZE,
+			responder_read_act_three, hc);
+}
+
+static struct io_plan *responder_got_act_one(struct io_conn *conn,
+					     struct handshake_conn *hc)
+{
+	if (!act_one_responder_pre_ecdh(hc->h, &hc->act1, &hc->re))
+		return handshake_fail(conn, hc);
+
+	return hsm_ecdh(conn, hc, responder_act_one);
+}
+
+static struct io_plan *handshake_start(struct io_conn *conn,
+				       struct handshake_conn *hc)
+{
+	/* Handshake lives as long as the connection. */
+	tal_steal(conn, hc);
+	io_set_finish(conn, handshake_conn_finished, hc);
+
+	if (!hc->initiator) {
+		hc->h = new_handshake(hc, &hc->my_id);
+		return io_read(conn, &hc->act1, ACT_ONE_SIZE,
+			       responder_got_act_one, hc);
+	}
+
+	hc->h = new_handshake(hc, &hc->their_id);
+	if (!act_one_initiator(hc->h, &hc->their_id, &hc->act1))
+		return handshake_fail(conn, hc);
+	return io_write(conn, &hc->act1, ACT_ONE_SIZE,
+			initiator_read_act_two, hc);
+}
+
+static struct io_plan *got_peer_fd(struct io_conn *conn,
+				   struct handshake_conn *hc)
+{
+	io_new_conn(hc->daemon, hc->fd, handshake_start, hc);
+	return daemon_conn_read_next(conn, &hc->daemon->master);
+}
+
+/* A handshake_responder or handshake_initiator request from lightningd. */
+static struct handshake_conn *new_handshake_conn(struct daemon *daemon,
+						 const u8 *msg)
+{
+	struct handshake_conn *hc = tal(daemon, struct handshake_conn);
+
+	hc->daemon = daemon;
+	hc->fd = -1;
+	hc->replied = false;
+	hc->enc = NULL;
+	if (fromwire_handshake_responder(msg, NULL, &hc->reqid, &hc->my_id))
+		hc->initiator = false;
+	else if (fromwire_handshake_initiator(msg, NULL, &hc->reqid,
+					      &hc->my_id, &hc->their_id))
+		hc->initiator = true;
+	else
+		return tal_free(hc);
+
+	tal_add_destructor(hc, destroy_handshake_conn);
+	return hc;
+}
+
+static struct io_plan *recv_req(struct io_conn *conn,
+				struct daemon_conn *master)
+{
+	struct daemon *daemon = container_of(master, struct daemon, master);
+	struct handshake_conn *hc = new_handshake_conn(daemon, master->msg_in);
+
+	if (!hc)
+		status_failed(WIRE_HANDSHAKE_BAD_COMMAND, "%s",
+			      tal_hex(trc, master->msg_in));
+
+	return io_recv_fd(conn, &hc->fd, got_peer_fd, hc);
+}
+
+static void master_gone(struct io_conn *unused, struct daemon_conn *dc)
+{
+	/* Can't tell master, it's gone. */
+	exit(2);
+}
+
+static struct daemon *new_daemon(const tal_t *ctx, int masterfd, int hsmfd)
+{
+	struct daemon *daemon = tal(ctx, struct daemon);
+
+	daemon->ecdh_waiting = tal_arr(daemon, struct handshake_conn *, 0);
+	daemon->ecdh_inflight = NULL;
+	daemon->hsm_in = NULL;
+	daemon_conn_init(daemon, &daemon->master, masterfd, recv_req,
+			 master_gone);
+	io_new_conn(daemon, hsmfd, hsm_send_batch, daemon);
+	return daemon;
+}
+
+/* We expect hsmfd as fd 3: peer fds come from lightningd with requests. */
 int main(int argc, char *argv[])
 {
-	u8 *msg;
-	struct pubkey my_id, their_id;
-	int hsmfd = 3, clientfd = 4;
-	struct secret ck, rk, sk;
-	struct crypto_state cs;
-	u8 *gfeatures, *lfeatures;
+	struct daemon *daemon;
 
 	if (argc == 2 && streq(argv[1], "--version")) {
 		printf("%s\n", version());
@@ -1008,50 +1390,16 @@ int main(int argc, char *argv[])
 	}
 
 	subdaemon_debug(argc, argv);
+	dev_disconnect_long_lived();
 	secp256k1_ctx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY
 						 | SECP256K1_CONTEXT_SIGN);
-	status_setup_sync(REQ_FD);
-
-	hsm_setup(hsmfd);
-
-	msg = wire_sync_read(NULL, REQ_FD);
-	if (!msg)
-		status_failed(WIRE_HANDSHAKE_BAD_COMMAND, "%s", strerror(errno));
-
-	if (fromwire_handshake_responder(msg, NULL, &my_id)) {
-		responder(clientfd, &my_id, &their_id, &ck, &sk, &rk);
-
-		cs.rn = cs.sn = 0;
-		cs.sk = sk;
-		cs.rk = rk;
-		cs.r_ck = cs.s_ck = ck;
-		exchange_init(clientfd, &cs, &gfeatures, &lfeatures);
-		wire_sync_write(REQ_FD,
-				towire_handshake_responder_reply(msg,
-								 &their_id,
-								 &cs,
-								 gfeatures,
-								 lfeatures));
-	} else if (fromwire_handshake_initiator(msg, NULL, &my_id,
-						&their_id)) {
-		initiator(clientfd, &my_id, &their_id, &ck, &sk, &rk);
-		cs.rn = cs.sn = 0;
-		cs.sk = sk;
-		cs.rk = rk;
-		cs.r_ck = cs.s_ck = ck;
-		exchange_init(clientfd, &cs, &gfeatures, &lfeatures);
-		wire_sync_write(REQ_FD,
-				towire_handshake_initiator_reply(msg, &cs,
-								 gfeatures,
-								 lfeatures));
-	} else
-		status_failed(WIRE_HANDSHAKE_BAD_COMMAND, "%i",
-			      fromwire_peektype(msg));
-
-	/* Hand back the fd. */
-	fdpass_send(REQ_FD, clientfd);
-
-	tal_free(msg);
+
+	daemon = new_daemon(NULL, REQ_FD, HSM_FD);
+	status_setup_async(&daemon->master);
+
+	io_loop(NULL, NULL);
+
+	tal_free(daemon);
 	return 0;
 }
 #endif /* TESTING */
@@ -12,36 +12,15 @@
 /* Since we use pipes, we need different fds for read and write. */
 static int read_fd, write_fd;
 
-static bool fake_read_all(int fd, void *buf, size_t count)
-{
-	return read_all(read_fd, buf, count);
-}
-
-static ssize_t fake_write_all(int fd, const void *buf, size_t count)
-{
-	return write_all(write_fd, buf, count);
-}
-
 static const char *status_prefix;
 
 /* Simply print out status updates. */
-#define status_send_sync(msg)			\
-	printf("%s:# Act %s\n", status_prefix,	\
-	       fromwire_peektype(msg) == WIRE_INITR_ACT_ONE ? "One"	\
-	       : fromwire_peektype(msg) == WIRE_INITR_ACT_TWO ? "Two"	\
-	       : fromwire_peektype(msg) == WIRE_INITR_ACT_THREE ? "Three" \
-	       : fromwire_peektype(msg) == WIRE_RESPR_ACT_ONE ? "One" \
-	       : fromwire_peektype(msg) == WIRE_RESPR_ACT_TWO ? "Two" \
-	       : fromwire_peektype(msg) == WIRE_RESPR_ACT_THREE ? "Three" \
-	       : "UNKNOWN")
 #define status_failed(code, fmt, ...)	\
 	errx(1, "%s:%s:" fmt "\n", status_prefix, #code, __VA_ARGS__)
+#undef status_trace
 #define status_trace(fmt, ...) \
 	printf("%s:" fmt "\n", status_prefix, __VA_ARGS__)
 
-#define read_all fake_read_all
-#define write_all fake_write_all
-
 /* No randomness please, we want to replicate test vectors. */
 #include <sodium/randombytes.h>
 
@@ -57,14 +36,89 @@ secp256k1_context *secp256k1_ctx;
 const void *trc;
 static struct privkey privkey;
 
-void hsm_setup(int fd)
+/* What the HSM would do for us. */
+static void hsm_ecdh(struct handshake *h, const struct pubkey *point)
+{
+	if (secp256k1_ecdh(secp256k1_ctx, h->ss.data, &point->pubkey,
+			   privkey.secret.data) != 1)
+		memset(&h->ss, 0, sizeof(h->ss));
+}
+
+static void act_failed(const struct handshake *h)
+{
+	status_failed(h->failcode, "%s", h->failmsg);
+}
+
+/* Run the acts synchronously over our pipes. */
+static void initiator(const struct pubkey *my_id,
+		      const struct pubkey *their_id,
+		      struct crypto_state *cs)
 {
+	const tal_t *tmpctx = tal_tmpctx(NULL);
+	struct handshake *h = new_handshake(tmpctx, their_id);
+	struct act_one act1;
+	struct act_two act2;
+	struct act_three act3;
+	struct pubkey re;
+
+	status_trace("# Act %s", "One");
+	if (!act_one_initiator(h, their_id, &act1))
+		act_failed(h);
+	if (!write_all(write_fd, &act1, ACT_ONE_SIZE))
+		err(1, "writing act one");
+
+	status_trace("# Act %s", "Two");
+	if (!read_all(read_fd, &act2, ACT_TWO_SIZE))
+		err(1, "reading act two");
+	if (!act_two_initiator(h, &act2, &re))
+		act_failed(h);
+
+	status_trace("# Act %s", "Three");
+	act_three_initiator_pre_ecdh(h, my_id, &act3);
+	hsm_ecdh(h, &re);
+	if (!act_three_initiator(h, &re, &act3))
+		act_failed(h);
+	if (!write_all(write_fd, &act3, ACT_THREE_SIZE))
+		err(1, "writing act three");
+
+	initiator_keys(h, cs);
+	tal_free(tmpctx);
 }
 
-bool hsm_do_ecdh(struct secret *ss, const struct pubkey *point)
+static void responder(const struct pubkey *my_id,
+		      struct pubkey *their_id,
+		      struct crypto_state *cs)
 {
-	return secp256k1_ecdh(secp256k1_ctx, ss->data, &point->pubkey,
-			      privkey.secret.data) == 1;
+	const tal_t *tmpctx = tal_tmpctx(NULL);
+	struct handshake *h = new_handshake(tmpctx, my_id);
+	struct act_one act1;
+	struct act_two act2;
+	struct act_three act3;
+	struct pubkey re;
+
+	status_trace("# Act %s", "One");
+	if (!read_all(read_fd, &act1, ACT_ONE_SIZE))
+		err(1, "reading act one");
+	if (!act_one_responder_pre_ecdh(h, &act1, &re))
+		act_failed(h);
+	hsm_ecdh(h, &re);
+	if (!act_one_responder(h, &act1, &re))
+		act_failed(h);
+
+	status_trace("# Act %s", "Two");
+	if (!act_two_responder(h, &re, &act2))
+		act_failed(h);
+	if (!write_all(write_fd, &act2, ACT_TWO_SIZE))
+		err(1, "writing act two");
+
+	status_trace("# Act %s", "Three");
+	if (!read_all(read_fd, &act3, ACT_THREE_SIZE))
+		err(1, "reading act three");
+	if (!act_three_responder(h, &act3, their_id))
+		act_failed(h);
+
+	responder_keys(h, cs);
+	tal_free(tmpctx);
 }
 
 int main(void)
@@ -72,7 +126,7 @@ int main(void)
 	int fds1[2], fds2[2];
 	struct pubkey responder_id;
 	struct privkey responder_privkey;
-	struct secret ck, sk, rk;
+	struct crypto_state cs;
 	const tal_t *ctx = tal_tmpctx(NULL);
 
 	trc = tal_tmpctx(ctx);
@@ -108,10 +162,10 @@ int main(void)
 					sizeof(responder_privkey)));
 		status_trace("ls.pub: 0x%s",
 			     type_to_string(trc, struct pubkey, &responder_id));
-		responder(-1, &responder_id, &their_id, &ck, &sk, &rk);
-		if (!write_all(write_fd, &ck, sizeof(ck))
-		    || !write_all(write_fd, &sk, sizeof(sk))
-		    || !write_all(write_fd, &rk, sizeof(rk)))
+		responder(&responder_id, &their_id, &cs);
+		if (!write_all(write_fd, &cs.s_ck, sizeof(cs.s_ck))
+		    || !write_all(write_fd, &cs.sk, sizeof(cs.sk))
+		    || !write_all(write_fd, &cs.rk, sizeof(cs.rk)))
 			err(1, "writing out secrets failed");
 		goto out;
 	}
@@ -142,15 +196,15 @@ int main(void)
 		status_trace("ls.pub: 0x%s",
 			     type_to_string(trc, struct pubkey, &initiator_id));
 
-		initiator(-1, &initiator_id, &responder_id, &ck, &sk, &rk);
+		initiator(&initiator_id, &responder_id, &cs);
 		if (!read_all(read_fd, &their_ck, sizeof(their_ck))
 		    || !read_all(read_fd, &their_sk, sizeof(their_sk))
 		    || !read_all(read_fd, &their_rk, sizeof(their_rk)))
 			err(1, "reading their secrets failed");
 
-		assert(structeq(&ck, &their_ck));
-		assert(structeq(&sk, &their_rk));
-		assert(structeq(&rk, &their_sk));
+		assert(structeq(&cs.s_ck, &their_ck));
+		assert(structeq(&cs.sk, &their_rk));
+		assert(structeq(&cs.rk, &their_sk));
 		goto out;
 	}
 	}
@@ -0,0 +1,160 @@
+/* We want all of handshake.c, just not its main(). */
+int handshaked_main(int argc, char *argv[]);
+#define main handshaked_main
+#include "../handshake.c"
+#undef main
+#include <ccan/err/err.h>
+#include <ccan/time/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+/* Give it a count to benchmark, eg. "run-many_handshakes 1000".  Each is
+ * a connection where we're both initiator and responder, so the daemon
+ * runs twice that many handshakes at once. */
+
+static struct privkey privkey;
+static size_t num_replies, num_expected, hsm_batches, hsm_points;
+static u8 *hsm_msg, *master_msg;
+static int reply_fd;
+
+/* What the HSM does, using our node key. */
+static struct io_plan *hsm_read_req(struct io_conn *conn, void *unused);
+
+static struct io_plan *hsm_reply(struct io_conn *conn, void *unused)
+{
+	struct pubkey *points;
+	struct secret *ss;
+	u8 *msg;
+	size_t i;
+
+	if (!fromwire_hsm_ecdh_batch_req(hsm_msg, hsm_msg, NULL, &points))
+		errx(1, "Bad HSM request %s", tal_hex(hsm_msg, hsm_msg));
+
+	ss = tal_arr(hsm_msg, struct secret, tal_count(points));
+	for (i = 0; i < tal_count(points); i++)
+		assert(secp256k1_ecdh(secp256k1_ctx, ss[i].data,
+				      &points[i].pubkey,
+				      privkey.secret.data) == 1);
+	hsm_batches++;
+	hsm_points += tal_count(points);
+
+	msg = towire_hsm_ecdh_batch_resp(NULL, ss);
+	hsm_msg = tal_free(hsm_msg);
+	return io_write_wire(conn, take(msg), hsm_read_req, NULL);
+}
+
+static struct io_plan *hsm_read_req(struct io_conn *conn, void *unused)
+{
+	return io_read_wire(conn, conn, &hsm_msg, hsm_reply, NULL);
+}
+
+/* What lightningd sees: every reply should be a success, with the fd. */
+static struct io_plan *master_read_reply(struct io_conn *conn, void *unused);
+
+static struct io_plan *master_got_fd(struct io_conn *conn, void *unused)
+{
+	close(reply_fd);
+	if (++num_replies == num_expected)
+		io_break(&num_replies);
+	return master_read_reply(conn, NULL);
+}
+
+static struct io_plan *master_got_reply(struct io_conn *conn, void *unused)
+{
+	int type = fromwire_peektype(master_msg);
+
+	if (type != WIRE_HANDSHAKE_RESPONDER_REPLY
+	    && type != WIRE_HANDSHAKE_INITIATOR_REPLY)
+		errx(1, "Bad reply %s", tal_hex(master_msg, master_msg));
+
+	master_msg = tal_free(master_msg);
+	return io_recv_fd(conn, &reply_fd, master_got_fd, NULL);
+}
+
+static struct io_plan *master_read_reply(struct io_conn *conn, void *unused)
+{
+	return io_read_wire(conn, conn, &master_msg, master_got_reply, NULL);
+}
+
+static void start_handshake(struct daemon *daemon, int fd, const u8 *req TAKES)
+{
+	struct handshake_conn *hc = new_handshake_conn(daemon, req);
+
+	assert(hc);
+	if (taken(req))
+		tal_free(req);
+	hc->fd = fd;
+	io_new_conn(daemon, fd, handshake_start, hc);
+}
+
+int main(int argc, char *argv[])
+{
+	tal_t *ctx = tal_tmpctx(NULL);
+	size_t i, num = argc > 1 ? atol(argv[1]) : 10;
+	int masterfds[2], hsmfds[2];
+	struct pubkey id;
+	struct daemon *daemon;
+	struct rlimit limit;
+	struct timeabs start;
+	struct timerel elapsed;
+
+	secp256k1_ctx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY
+						 | SECP256K1_CONTEXT_SIGN);
+	status_trace_enabled = false;
+
+	/* Two fds each end, and one each for replies in flight. */
+	if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+		err(1, "getrlimit");
+	limit.rlim_cur = limit.rlim_max;
+	if (limit.rlim_cur < num * 4 + 20)
+		errx(1, "Need %zu fds, can only have %zu",
+		     num * 4 + 20, (size_t)limit.rlim_cur);
+	if (setrlimit(RLIMIT_NOFILE, &limit) != 0)
+		err(1, "setrlimit");
+
+	/* Both ends are us: we connect to ourselves. */
+	memset(&privkey, 0x21, sizeof(privkey));
+	assert(secp256k1_ec_pubkey_create(secp256k1_ctx, &id.pubkey,
+					  privkey.secret.data));
+
+	if (socketpair(AF_LOCAL, SOCK_STREAM, 0, masterfds) != 0
+	    || socketpair(AF_LOCAL, SOCK_STREAM, 0, hsmfds) != 0)
+		err(1, "socketpair");
+	daemon = new_daemon(ctx, masterfds[0], hsmfds[0]);
+	io_new_conn(ctx, masterfds[1], master_read_reply, NULL);
+	io_new_conn(ctx, hsmfds[1], hsm_read_req, NULL);
+
+	num_expected = num * 2;
+	for (i = 0; i < num; i++) {
+		int fds[2];
+
+		if (socketpair(AF_LOCAL, SOCK_STREAM, 0, fds) != 0)
+			err(1, "socketpair %zu", i);
+		start_handshake(daemon, fds[0],
+				take(towire_handshake_initiator(NULL, i * 2,
+								&id, &id)));
+		start_handshake(daemon, fds[1],
+				take(towire_handshake_responder(NULL, i * 2 + 1,
+								&id)));
+	}
+
+	start = time_now();
+	io_loop(NULL, NULL);
+	elapsed = time_between(time_now(), start);
+	assert(num_replies == num_expected);
+	/* Each handshake needs one ECDH from the HSM. */
+	assert(hsm_points == num_expected);
+
+	if (argc > 1)
+		printf("%zu dialers: %.1f handshakes/sec,"
+		       " %zu HSM round trips (avg %.1f points)\n",
+		       num, num_expected * 1000000000.0
+		       / (time_to_nsec(elapsed) + 1),
+		       hsm_batches, (double)hsm_points / hsm_batches);
+
+	/* Don't exit when we close master's conn. */
+	io_set_finish_(daemon->master.conn, NULL, NULL);
+	tal_free(ctx);
+	secp256k1_context_destroy(secp256k1_ctx);
+	return 0;
+}
@@ -19,6 +19,7 @@
 #include <inttypes.h>
 #include <lightningd/build_utxos.h>
 #include <lightningd/daemon_conn.h>
+#include <lightningd/debug.h>
 #include <lightningd/funding_tx.h>
 #include <lightningd/hsm/client.h>
 #include <lightningd/hsm/gen_hsm_client_wire.h>
@@ -123,6 +124,61 @@ static struct io_plan *handle_ecdh(struct io_conn *conn, struct daemon_conn *dc)
 	return daemon_conn_read_next(conn, dc);
 }
 
+static struct io_plan *handle_ecdh_batch(struct io_conn *conn,
+					 struct daemon_conn *dc)
+{
+	struct client *c = container_of(dc, struct client, dc);
+	tal_t *tmpctx = tal_tmpctx(conn);
+	struct privkey privkey;
+	struct pubkey *points;
+	struct secret *ss;
+	size_t i;
+
+	if (!fromwire_hsm_ecdh_batch_req(tmpctx, dc->msg_in, NULL, &points)) {
+		daemon_conn_send(c->master,
+				 take(towire_hsmstatus_client_bad_request(c,
+								c->id,
+								dc->msg_in)));
+		tal_free(tmpctx);
+		return io_close(conn);
+	}
+
+	node_key(&privkey, NULL);
+	ss = tal_arr(tmpctx, struct secret, tal_count(points));
+	for (i = 0; i < tal_count(points); i++) {
+		/* Caller treats all-zero as "HSM wouldn't do it". */
+		if (secp256k1_ecdh(secp256k1_ctx, ss[i].data,
+				   &points[i].pubkey,
+				   privkey.secret.data) != 1) {
+			status_trace("secp256k1_ecdh fail for client %"PRIu64,
+				     c->id);
+			memset(&ss[i], 0, sizeof(ss[i]));
+		}
+	}
+
+	daemon_conn_send(dc, take(towire_hsm_ecdh_batch_resp(c, ss)));
+	tal_free(tmpctx);
+	return daemon_conn_read_next(conn, dc);
+}
+
+/* Handshake daemon's fd: does ECDH, one or many points at a time. */
+static struct io_plan *handle_ecdh_client(struct io_conn *conn,
+					  struct daemon_conn *dc)
+{
+	struct client *c = container_of(dc, struct client, dc);
+
+	if (fromwire_peektype(dc->msg_in) == WIRE_HSM_ECDH_BATCH_REQ)
+		return handle_ecdh_batch(conn, dc);
+	if (fromwire_peektype(dc->msg_in) == WIRE_HSM_ECDH_REQ)
+		return handle_ecdh(conn, dc);
+
+	daemon_conn_send(c->master,
+			 take(towire_hsmstatus_client_bad_request(c,
+								  c->id,
+								  dc->msg_in)));
+	return io_close(conn);
+}
+
 static struct io_plan *handle_cannouncement_sig(struct io_conn *conn,
 						struct daemon_conn *dc)
 {
@@ -223,12 +279,15 @@ static struct io_plan *handle_channeld(struct io_conn *conn,
 	switch (t) {
 	case WIRE_HSM_ECDH_REQ:
 		return handle_ecdh(conn, dc);
+	case WIRE_HSM_ECDH_BATCH_REQ:
+		return handle_ecdh_batch(conn, dc);
 	case WIRE_HSM_CANNOUNCEMENT_SIG_REQ:
 		return handle_cannouncement_sig(conn, dc);
 	case WIRE_HSM_CUPDATE_SIG_REQ:
 		return handle_channel_update_sig(conn, dc);
 
 	case WIRE_HSM_ECDH_RESP:
+	case WIRE_HSM_ECDH_BATCH_RESP:
 	case WIRE_HSM_CANNOUNCEMENT_SIG_REPLY:
 	case WIRE_HSM_CUPDATE_SIG_REPLY:
 		break;
@@ -425,7 +484,7 @@ static void pass_hsmfd_ecdh(struct daemon_conn *master, const u8 *msg)
 		status_failed(WIRE_HSMSTATUS_FD_FAILED,
 			      "creating fds: %s", strerror(errno));
 
-	new_client(master, id, handle_ecdh, fds[0]);
+	new_client(master, id, handle_ecdh_client, fds[0]);
 	daemon_conn_send(master,
 			 take(towire_hsmctl_hsmfd_ecdh_fd_reply(master)));
 	daemon_conn_send_fd(master, fds[1]);
@@ -662,6 +721,7 @@ int main(int argc, char *argv[])
 		exit(0);
 	}
 
+	subdaemon_debug(argc, argv);
 	breakpoint();
 	secp256k1_ctx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY
 						 | SECP256K1_CONTEXT_SIGN);
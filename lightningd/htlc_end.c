@@ -96,6 +96,7 @@ struct htlc_in *new_htlc_in(const tal_t *ctx,
 {
 	struct htlc_in *hin = tal(ctx, struct htlc_in);
 
+	hin->dbid = 0;
 	hin->key.peer = peer;
 	hin->key.id = id;
 	hin->msatoshi = msatoshi;
@@ -123,7 +124,7 @@ struct htlc_out *htlc_out_check(const struct htlc_out *hout,
 			       htlc_state_name(hout->hstate));
 	else if (hout->failuremsg && hout->preimage)
 		return corrupt(hout, abortstr, "Both failed and succeeded");
-	else if (!hout->in && !hout->pay_command)
+	else if (!hout->in && !hout->pay_command && !hout->dbid)
 		return corrupt(hout, abortstr,
 			       "Neither hout->in nor paycommand");
 
@@ -141,6 +142,7 @@ struct htlc_out *new_htlc_out(const tal_t *ctx,
 {
 	struct htlc_out *hout = tal(ctx, struct htlc_out);
 
+	hout->dbid = 0;
 	hout->key.peer = peer;
 	hout->msatoshi = msatoshi;
 	hout->cltv_expiry = cltv_expiry;
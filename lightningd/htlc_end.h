@@ -15,6 +15,8 @@ struct htlc_key {
 
 /* Incoming HTLC */
 struct htlc_in {
+	/* Unique in the database, once it's committed (otherwise 0). */
+	u64 dbid;
 	struct htlc_key key;
 	u64 msatoshi;
 	u32 cltv_expiry;
@@ -39,6 +41,8 @@ struct htlc_in {
 };
 
 struct htlc_out {
+	/* Unique in the database, once it's committed (otherwise 0). */
+	u64 dbid;
 	struct htlc_key key;
 	u64 msatoshi;
 	u32 cltv_expiry;
@@ -61,7 +65,8 @@ struct htlc_out {
 	/* Where it's from, if not going to us. */
 	struct htlc_in *in;
 
-	/* Otherwise, payment command which created it. */
+	/* Otherwise, payment command which created it (NULL if that was
+	 * before we restarted). */
 	struct pay_command *pay_command;
 };
 
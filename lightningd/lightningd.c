@@ -13,6 +13,7 @@
 #include <ccan/take/take.h>
 #include <ccan/tal/grab_file/grab_file.h>
 #include <ccan/tal/path/path.h>
+#include <ccan/tal/str/str.h>
 #include <daemon/bitcoind.h>
 #include <daemon/chaintopology.h>
 #include <daemon/invoice.h>
@@ -21,6 +22,7 @@
 #include <daemon/options.h>
 #include <daemon/routing.h>
 #include <daemon/timeout.h>
+#include <inttypes.h>
 #include <lightningd/onchain/onchain_wire.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -101,12 +103,22 @@ static struct lightningd *new_lightningd(const tal_t *ctx)
 	struct lightningd *ld = tal(ctx, struct lightningd);
 
 	list_head_init(&ld->peers);
+	list_head_init(&ld->subds);
+	ld->hsm_fd = -1;
 	ld->peer_counter = 0;
+	ld->handshaked = NULL;
 	ld->dev_debug_subdaemon = NULL;
+	ld->dev_shm_subdaemon = NULL;
 	htlc_in_map_init(&ld->htlcs_in);
 	htlc_out_map_init(&ld->htlcs_out);
 	ld->dev_disconnect_fd = -1;
+	list_head_init(&ld->prespawned);
+	ld->prespawn_timer = NULL;
 	ld->dstate.log_book = new_log_book(&ld->dstate, 20*1024*1024,LOG_INFORM);
+	/* Debug is only worth making, in here and in subdaemons, if someone
+	 * asks for it (--log-level or --log-record-level). */
+	set_log_record_level(ld->dstate.log_book, LOG_INFORM);
+	set_log_levelfn(ld->dstate.log_book, subd_log_level_changed, ld);
 	ld->log = ld->dstate.base_log = new_log(&ld->dstate,
 						ld->dstate.log_book,
 						"lightningd(%u):",
@@ -124,7 +136,8 @@ static struct lightningd *new_lightningd(const tal_t *ctx)
 	ld->dstate.external_ip = NULL;
 	ld->dstate.announce = NULL;
 	ld->topology = ld->dstate.topology = new_topology(ld, ld->log);
-	ld->bitcoind = ld->dstate.bitcoind = new_bitcoind(ld, ld->log);
+	ld->bitcoind = ld->dstate.bitcoind = new_bitcoind(ld, &ld->dstate.timers,
+							 ld->log);
 	ld->chainparams = chainparams_for_network("testnet");
 
 	/* FIXME: Move into invoice daemon. */
@@ -198,7 +211,11 @@ static void shutdown_subdaemons(struct lightningd *ld)
 
 	/* Let everyone shutdown cleanly. */
 	close(ld->hsm_fd);
+	ld->hsm_fd = -1;
+	ld->hsm_fd = -1;
 	subd_shutdown(ld->gossip, 10);
+	if (ld->handshaked)
+		subd_shutdown(ld->handshaked, 0);
 
 	/* Duplicates are OK: no need to check here. */
 	list_for_each(&ld->peers, p, list)
@@ -206,10 +223,39 @@ static void shutdown_subdaemons(struct lightningd *ld)
 			subd_shutdown(p->owner, 0);
 }
 
+static char *opt_set_db_sync(const char *arg, int *synchronous)
+{
+	if (streq(arg, "normal"))
+		*synchronous = 1;
+	else if (streq(arg, "full"))
+		*synchronous = 2;
+	else
+		return tal_fmt(NULL, "'%s' is not normal or full", arg);
+	return NULL;
+}
+
+static void opt_show_db_sync(char buf[OPT_SHOW_LEN], const int *synchronous)
+{
+	strncpy(buf, *synchronous == 1 ? "normal" : "full", OPT_SHOW_LEN);
+}
+
+/* How long since *start (in msec), and start timing the next thing. */
+static u64 lap_msec(struct timeabs *start)
+{
+	struct timeabs now = time_now();
+	u64 msec = time_to_msec(time_between(now, *start));
+
+	*start = now;
+	return msec;
+}
+
 int main(int argc, char *argv[])
 {
 	struct lightningd *ld = new_lightningd(NULL);
 	bool newdir;
+	struct timeabs start;
+	u64 db_msec, channels_msec, peers_msec, htlcs_msec;
+	size_t num_channels = 0;
 
 	err_set_progname(argv[0]);
 
@@ -230,13 +276,64 @@ int main(int argc, char *argv[])
 	opt_register_arg("--dev-disconnect=<filename>", opt_subd_dev_disconnect,
 			 NULL, ld, "File containing disconnection points");
 
+	opt_register_arg("--dev-shm-transport=<subdaemon>",
+			 opt_subd_shm_transport, NULL, ld,
+			 "Talk to <subdaemon> over shared memory rings");
+
+	opt_register_arg("--subdaemon-prespawn=<num>", opt_set_uintval,
+			 opt_show_uintval, &ld->num_prespawn,
+			 "Keep this many of each per-peer subdaemon started in advance");
+
+	opt_register_arg("--queue-high-watermark=<msgs>", opt_set_uintval,
+			 opt_show_uintval, &ld->queue_hiwat,
+			 "Defer non-urgent messages to a subdaemon with this many queued");
+	opt_register_arg("--queue-low-watermark=<msgs>", opt_set_uintval,
+			 opt_show_uintval, &ld->queue_lowat,
+			 "Resume non-urgent messages once queue drains to this");
+	opt_register_arg("--db-commit-window=<ms>", opt_set_uintval,
+			 opt_show_uintval, &ld->db_commit_window,
+			 "Share database commits between channel updates this close together");
+	opt_register_arg("--db-wal=<bool>", opt_set_bool_arg, opt_show_bool,
+			 &ld->db_profile.wal,
+			 "Use a write-ahead log for the database");
+	opt_register_arg("--db-synchronous=<normal|full>", opt_set_db_sync,
+			 opt_show_db_sync, &ld->db_profile.synchronous,
+			 "normal only syncs the write-ahead log at checkpoints: faster, but a crash can lose recent commits");
+	opt_register_arg("--db-mmap-size=<bytes>", opt_set_ulonglongval_bi,
+			 opt_show_ulonglongval_bi, &ld->db_profile.mmap_size,
+			 "How much of the database to access through mmap");
+	opt_register_arg("--db-cache-size=<KiB>", opt_set_uintval,
+			 opt_show_uintval, &ld->db_profile.cache_kb,
+			 "Database page cache size");
+	opt_register_arg("--db-page-size=<bytes>", opt_set_uintval,
+			 opt_show_uintval, &ld->db_profile.page_size,
+			 "Database page size, if we're creating it");
+	opt_register_arg("--db-checkpoint-interval=<secs>", opt_set_uintval,
+			 opt_show_uintval, &ld->db_checkpoint_interval,
+			 "How often to checkpoint the database's write-ahead log");
+	opt_register_arg("--db-stats-interval=<secs>", opt_set_uintval,
+			 opt_show_uintval, &ld->db_stats_interval,
+			 "How often to log the slowest database call sites (0 = never)");
+
 	/* FIXME: move to option initialization once we drop the
 	 * legacy daemon */
 	ld->broadcast_interval = 30000;
+	ld->queue_hiwat = 1000;
+	ld->queue_lowat = 500;
+	ld->num_prespawn = 1;
+	ld->db_commit_window = 0;
+	ld->db_profile = db_profile_default;
+	ld->db_checkpoint_interval = 30;
+	ld->db_stats_interval = 0;
 
 	/* Handle options and config; move to .lightningd */
 	newdir = handle_opts(&ld->dstate, argc, argv);
 
+	if (ld->queue_lowat >= ld->queue_hiwat)
+		errx(1, "--queue-low-watermark must be below --queue-high-watermark");
+	if (!ld->db_checkpoint_interval)
+		errx(1, "--db-checkpoint-interval must be non-zero");
+
 	/* Activate crash log now we're in the right place. */
 	crashlog_activate(ld->log);
 
@@ -247,7 +344,13 @@ int main(int argc, char *argv[])
 	test_daemons(ld);
 
 	/* Initialize wallet, now that we are in the correct directory */
-	ld->wallet = wallet_new(ld, ld->log);
+	start = time_now();
+	ld->wallet = wallet_new(ld, ld->log, &ld->dstate.timers,
+				&ld->db_profile,
+				time_from_msec(ld->db_commit_window),
+				time_from_sec(ld->db_checkpoint_interval),
+				time_from_sec(ld->db_stats_interval));
+	db_msec = lap_msec(&start);
 
 	/* Mark ourselves live. */
 	log_info(ld->log, "Hello world from %s!", version());
@@ -258,6 +361,9 @@ int main(int argc, char *argv[])
 	/* Set up gossip daemon. */
 	gossip_init(ld);
 
+	/* Get some per-peer subdaemons ready. */
+	subd_prespawn(ld);
+
 	/* Initialize block topology. */
 	setup_topology(ld->topology, ld->bitcoind, &ld->dstate.timers,
 		       ld->dstate.config.poll_time,
@@ -265,7 +371,9 @@ int main(int argc, char *argv[])
 		       0);
 
 	/* Load peers from database */
+	start = time_now();
 	wallet_channels_load_active(ld->wallet, &ld->peers);
+	channels_msec = lap_msec(&start);
 
 	/* TODO(cdecker) Move this into common location for initialization */
 	struct peer *peer;
@@ -274,7 +382,20 @@ int main(int argc, char *argv[])
 		peer->seed = tal(peer, struct privkey);
 		derive_peer_seed(ld, peer->seed, &peer->id, peer->channel->id);
 		peer->htlcs = tal_arr(peer, struct htlc_stub, 0);
+		num_channels++;
 	}
+	peers_msec = lap_msec(&start);
+	if (!wallet_htlcs_load(ld->wallet, &ld->peers, ld,
+			       &ld->htlcs_in, &ld->htlcs_out))
+		fatal("Could not load HTLCs from database: %s",
+		      ld->wallet->db->err);
+	htlcs_msec = lap_msec(&start);
+
+	/* Restart time is downtime: show where it goes. */
+	log_info(ld->log, "Startup: database %"PRIu64"msec,"
+		 " %zu channels %"PRIu64"msec, peer setup %"PRIu64"msec,"
+		 " HTLCs %"PRIu64"msec",
+		 db_msec, num_channels, channels_msec, peers_msec, htlcs_msec);
 
 	/* Create RPC socket (if any) */
 	setup_jsonrpc(&ld->dstate, ld->dstate.rpc_filename);
@@ -32,8 +32,13 @@ struct lightningd {
 	/* Daemon looking after peers during init / before channel. */
 	struct subd *gossip;
 
+	/* Daemon doing all the handshakes (started when first needed). */
+	struct subd *handshaked;
+
 	/* All peers we're tracking. */
 	struct list_head peers;
+	/* All our subds (not the HSM, which is hsm_fd). */
+	struct list_head subds;
 	/* FIXME: This should stay in HSM */
 	struct secret peer_seed;
 	/* Used to give a unique seed to every peer. */
@@ -51,6 +56,9 @@ struct lightningd {
 	/* If we want to debug a subdaemon. */
 	const char *dev_debug_subdaemon;
 
+	/* If we want a subdaemon to use the shared memory transport. */
+	const char *dev_shm_subdaemon;
+
 	/* If we have a --dev-disconnect file */
 	int dev_disconnect_fd;
 
@@ -60,7 +68,23 @@ struct lightningd {
 
 	u32 broadcast_interval;
 
+	/* Subdaemon queues hold non-urgent messages above hiwat until
+	 * they drain to lowat. */
+	u32 queue_hiwat, queue_lowat;
+
+	/* How many of each per-peer subdaemon to keep ready. */
+	unsigned int num_prespawn;
+	struct list_head prespawned;
+	struct oneshot *prespawn_timer;
+
 	struct wallet *wallet;
+	/* How long we group channels' db writes into one commit (msec). */
+	u32 db_commit_window;
+	/* How we store the db, how often we checkpoint it, and how often
+	 * we log its stats (seconds, 0 for never). */
+	struct db_profile db_profile;
+	u32 db_checkpoint_interval;
+	u32 db_stats_interval;
 
 	const struct chainparams *chainparams;
 };
@@ -5,15 +5,48 @@
 
 void msg_queue_init(struct msg_queue *q, const tal_t *ctx)
 {
-	q->q = tal_arr(ctx, const u8 *, 0);
+	q->q = tal_arr(ctx, const u8 *, 8);
+	q->head = q->count = 0;
+	q->hiwat = SIZE_MAX;
+	q->lowat = 0;
+	q->full = false;
 	q->ctx = ctx;
 }
 
+void msg_queue_set_watermarks(struct msg_queue *q, size_t hiwat, size_t lowat)
+{
+	assert(lowat < hiwat);
+	q->hiwat = hiwat;
+	q->lowat = lowat;
+	q->full = (q->count >= hiwat);
+}
+
+/* Double the ring, unwrapping it so head is at 0. */
+static void grow_queue(struct msg_queue *q)
+{
+	size_t n = tal_count(q->q);
+	const u8 **newq = tal_arr(q->ctx, const u8 *, n * 2);
+	size_t first = n - q->head;
+
+	memcpy(newq, q->q + q->head, sizeof(*newq) * first);
+	memcpy(newq + first, q->q, sizeof(*newq) * q->head);
+	tal_free(q->q);
+	q->q = newq;
+	q->head = 0;
+}
+
 static void do_enqueue(struct msg_queue *q, const u8 *add)
 {
 	size_t n = tal_count(q->q);
-	tal_resize(&q->q, n+1);
-	q->q[n] = tal_dup_arr(q->ctx, u8, add, tal_len(add), 0);
+
+	if (q->count == n) {
+		grow_queue(q);
+		n *= 2;
+	}
+	q->q[(q->head + q->count) & (n - 1)]
+		= tal_dup_arr(q->ctx, u8, add, tal_len(add), 0);
+	if (++q->count >= q->hiwat)
+		q->full = true;
 
 	/* In case someone is waiting */
 	io_wake(q);
@@ -35,18 +68,33 @@ void msg_enqueue_fd(struct msg_queue *q, int fd)
 
 const u8 *msg_dequeue(struct msg_queue *q)
 {
-	size_t n = tal_count(q->q);
 	const u8 *msg;
 
-	if (!n)
+	if (!q->count)
 		return NULL;
 
-	msg = q->q[0];
-	memmove(q->q, q->q + 1, sizeof(*q->q) * (n-1));
-	tal_resize(&q->q, n-1);
+	msg = q->q[q->head];
+	q->head = (q->head + 1) & (tal_count(q->q) - 1);
+	q->count--;
+
+	/* Let any producer waiting in msg_queue_wait_room() go. */
+	if (q->full && q->count <= q->lowat) {
+		q->full = false;
+		io_wake(&q->full);
+	}
 	return msg;
 }
 
+size_t msg_queue_length(const struct msg_queue *q)
+{
+	return q->count;
+}
+
+bool msg_queue_full(const struct msg_queue *q)
+{
+	return q->full;
+}
+
 int msg_extract_fd(const u8 *msg)
 {
 	const u8 *p = msg + sizeof(u16);
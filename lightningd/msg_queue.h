@@ -9,12 +9,30 @@
 #define MSG_PASS_FD 0xFFFF
 
 struct msg_queue {
+	/* Ring buffer: tal_count(q) is always a power of 2. */
 	const u8 **q;
+	size_t head, count;
+
+	/* Once count reaches hiwat we're full, until it drains to lowat. */
+	size_t hiwat, lowat;
+	bool full;
+
 	const tal_t *ctx;
 };
 
+/* No watermarks by default: never full. */
 void msg_queue_init(struct msg_queue *q, const tal_t *ctx);
 
+/* Producers should check msg_queue_full() before adding anything which
+ * can wait.  Nothing stops them exceeding hiwat though. */
+void msg_queue_set_watermarks(struct msg_queue *q, size_t hiwat, size_t lowat);
+
+/* Watermarks for every daemon's queue of messages out to a peer: when
+ * it's full, they stop adding gossip (channeld) or stop reading from the
+ * peer (gossipd) until it drains. */
+#define PEER_OUT_HIWAT 100
+#define PEER_OUT_LOWAT 50
+
 /* If add is taken(), freed after sending.  msg_wake() implied. */
 void msg_enqueue(struct msg_queue *q, const u8 *add);
 
@@ -27,10 +45,21 @@ void msg_wake(const struct msg_queue *q);
 /* Returns NULL if nothing to do. */
 const u8 *msg_dequeue(struct msg_queue *q);
 
+/* How many messages are queued. */
+size_t msg_queue_length(const struct msg_queue *q);
+
+/* Has it hit the high watermark (and not yet drained to the low one)? */
+bool msg_queue_full(const struct msg_queue *q);
+
 /* Returns -1 if not an fd: close after sending. */
 int msg_extract_fd(const u8 *msg);
 
+/* Consumer waits for something to be queued. */
 #define msg_queue_wait(conn, q, next, arg) \
 	io_out_wait((conn), (q), (next), (arg))
 
+/* Producer waits for it to drain to the low watermark. */
+#define msg_queue_wait_room(conn, q, next, arg) \
+	io_wait((conn), &(q)->full, (next), (arg))
+
 #endif /* LIGHTNING_LIGHTNINGD_MSG_QUEUE_H */
@@ -124,14 +124,21 @@ static bool handshake_succeeded(struct subd *handshaked,
 	struct crypto_state cs;
 	struct pubkey *id;
 	u8 *globalfeatures, *localfeatures;
-
-	assert(tal_count(fds) == 1);
+	u64 reqid;
 
 	/* FIXME: Look for peer duplicates! */
 
+	if (fromwire_handshake_responder_replyfail(msg, NULL, &reqid)
+	    || fromwire_handshake_initiator_replyfail(msg, NULL, &reqid)) {
+		connection_failed(c, handshaked->log, "Handshake failed");
+		return true;
+	}
+
+	assert(tal_count(fds) == 1);
 	if (!c->known_id) {
 		id = tal(msg, struct pubkey);
-		if (!fromwire_handshake_responder_reply(c, msg, NULL, id, &cs,
+		if (!fromwire_handshake_responder_reply(c, msg, NULL, &reqid,
+							id, &cs,
 							&globalfeatures,
 							&localfeatures))
 			goto err;
@@ -139,7 +146,8 @@ static bool handshake_succeeded(struct subd *handshaked,
 				struct pubkey, id);
 	} else {
 		id = c->known_id;
-		if (!fromwire_handshake_initiator_reply(c, msg, NULL, &cs,
+		if (!fromwire_handshake_initiator_reply(c, msg, NULL, &reqid,
+							&cs,
 							&globalfeatures,
 							&localfeatures))
 			goto err;
@@ -156,6 +164,7 @@ static bool handshake_succeeded(struct subd *handshaked,
 	if (requires_unsupported_features(
 		globalfeatures, supported_global_features,
 		ARRAY_SIZE(supported_global_features))) {
+		close(fds[0]);
 		connection_failed(c, handshaked->log,
 				  "peer %s: bad globalfeatures: %s",
 				  type_to_string(c, struct pubkey, id),
@@ -166,6 +175,7 @@ static bool handshake_succeeded(struct subd *handshaked,
 	if (requires_unsupported_features(
 		localfeatures, supported_local_features,
 		ARRAY_SIZE(supported_local_features))) {
+		close(fds[0]);
 		connection_failed(c, handshaked->log,
 				  "peer %s: bad localfeatures: %s",
 				  type_to_string(c, struct pubkey, id),
@@ -185,27 +195,37 @@ static bool handshake_succeeded(struct subd *handshaked,
 	}
 
 	add_peer(handshaked->ld, c->unique_id, fds[0], id, &cs);
-	/* Now shut handshaked down (frees c as well) */
-	return false;
+	tal_free(c);
+	return true;
 
 err:
 	log_broken(handshaked->log, "Malformed resp: %s", tal_hex(c, msg));
 	close(fds[0]);
-	return false;
+	/* Other peers' handshakes share the daemon: only fail this one. */
+	connection_failed(c, handshaked->log, "Malformed handshake reply");
+	return true;
 }
 
-/* Same path for connecting in vs connecting out. */
-static struct io_plan *hsm_then_handshake(struct io_conn *conn,
-					  struct lightningd *ld,
-					  struct connection *c)
+static void handshaked_finished(struct subd *handshaked, int status)
 {
-	const tal_t *tmpctx = tal_tmpctx(conn);
-	int connfd = io_conn_fd(conn), hsmfd;
-	struct subd *handshaked;
+	log_unusual(handshaked->log, "Handshake daemon exited with %i",
+		    status);
+	handshaked->ld->handshaked = NULL;
+}
+
+/* One handshake daemon does all connections: start it if we need to. */
+static struct subd *get_handshaked(struct lightningd *ld)
+{
+	const tal_t *tmpctx;
+	int hsmfd;
 	u8 *msg;
 
-	/* Get HSM fd for this peer. */
-	msg = towire_hsmctl_hsmfd_ecdh(tmpctx, c->unique_id);
+	if (ld->handshaked)
+		return ld->handshaked;
+
+	/* Get HSM fd for handshakes (id is only used for its logging). */
+	tmpctx = tal_tmpctx(ld);
+	msg = towire_hsmctl_hsmfd_ecdh(tmpctx, 0);
 	if (!wire_sync_write(ld->hsm_fd, msg))
 		fatal("Could not write to HSM: %s", strerror(errno));
 
@@ -216,45 +236,53 @@ static struct io_plan *hsm_then_handshake(struct io_conn *conn,
 	hsmfd = fdpass_recv(ld->hsm_fd);
 	if (hsmfd < 0)
 		fatal("Could not read fd from HSM: %s", strerror(errno));
+	tal_free(tmpctx);
 
-	/* Make sure connection fd is blocking */
-	io_fd_block(connfd, true);
-
-	/* Give handshake daemon the hsm fd. */
-	handshaked = new_subd(ld, ld,
-			      "lightningd_handshake", NULL,
-			      handshake_wire_type_name,
-			      NULL, NULL,
-			      take(&hsmfd), take(&connfd), NULL);
-	if (!handshaked) {
+	ld->handshaked = new_subd(ld, ld,
+				  "lightningd_handshake", NULL,
+				  handshake_wire_type_name,
+				  NULL, handshaked_finished,
+				  take(&hsmfd), NULL);
+	if (!ld->handshaked) {
 		log_unusual(ld->log, "Could not subdaemon handshake: %s",
 			    strerror(errno));
-		goto error;
+		close(hsmfd);
+	}
+	return ld->handshaked;
+}
+
+/* Same path for connecting in vs connecting out. */
+static struct io_plan *hsm_then_handshake(struct io_conn *conn,
+					  struct lightningd *ld,
+					  struct connection *c)
+{
+	struct subd *handshaked = get_handshaked(ld);
+	u64 reqid;
+	u8 *msg;
+
+	if (!handshaked) {
+		tal_free(c);
+		return io_close(conn);
 	}
 
 	/* If handshake daemon fails, we just drop connection. */
 	tal_steal(handshaked, c);
 
+	reqid = subd_next_reqid(handshaked);
 	if (c->known_id) {
-		msg = towire_handshake_initiator(tmpctx, &ld->dstate.id,
+		msg = towire_handshake_initiator(c, reqid, &ld->dstate.id,
 						 c->known_id);
 	} else {
-		msg = towire_handshake_responder(tmpctx, &ld->dstate.id);
+		msg = towire_handshake_responder(c, reqid, &ld->dstate.id);
 	}
 
-	/* Now hand peer request to the handshake daemon: hands it
-	 * back on success */
-	subd_req(c, handshaked, take(msg), -1, 1, handshake_succeeded, c);
-
-	tal_free(tmpctx);
+	/* Now hand peer fd to the handshake daemon: hands it back on
+	 * success */
+	subd_req_id(c, handshaked, take(msg), reqid, io_conn_fd(conn), 1,
+		    handshake_succeeded, c);
 
 	/* We don't need conn, we've passed fd to handshaked. */
 	return io_close_taken_fd(conn);
-
-error:
-	close(hsmfd);
-	tal_free(tmpctx);
-	return io_close(conn);
 }
 
 struct io_plan *connection_out(struct io_conn *conn,
@@ -500,7 +500,7 @@ static void handle_preimage(struct tracked_output **outs,
 static void wait_for_resolved(struct tracked_output **outs)
 {
 	while (!all_irrevocably_resolved(outs)) {
-		u8 *msg = wire_sync_read(outs, REQ_FD);
+		u8 *msg = status_sync_read(outs, REQ_FD);
 		struct sha256_double txid;
 		struct bitcoin_tx *tx = tal(msg, struct bitcoin_tx);
 		u32 input_num, depth, tx_blockheight;
@@ -1251,7 +1251,7 @@ int main(int argc, char *argv[])
 						 | SECP256K1_CONTEXT_SIGN);
 	status_setup_sync(REQ_FD);
 
-	msg = wire_sync_read(ctx, REQ_FD);
+	msg = status_sync_read(ctx, REQ_FD);
 	tx = tal(ctx, struct bitcoin_tx);
 	if (!fromwire_onchain_init(ctx, msg, NULL,
 				   &seed, &shachain,
@@ -1287,7 +1287,7 @@ int main(int argc, char *argv[])
 			      "Can't allocate %"PRIu64" htlcs", num_htlcs);
 
 	for (size_t i = 0; i < num_htlcs; i++) {
-		msg = wire_sync_read(ctx, REQ_FD);
+		msg = status_sync_read(ctx, REQ_FD);
 		if (!msg || !fromwire_onchain_htlc(msg, NULL, &htlcs[i]))
 			status_failed(WIRE_ONCHAIN_BAD_COMMAND,
 				      "Can't read %"PRIu64"/%"PRIu64" htlc",
@@ -704,7 +704,7 @@ int main(int argc, char *argv[])
 						 | SECP256K1_CONTEXT_SIGN);
 	status_setup_sync(REQ_FD);
 
-	msg = wire_sync_read(state, REQ_FD);
+	msg = status_sync_read(state, REQ_FD);
 	if (!msg)
 		status_failed(WIRE_OPENING_BAD_COMMAND, "%s", strerror(errno));
 
@@ -738,7 +738,7 @@ int main(int argc, char *argv[])
 	status_trace("First per_commit_point = %s",
 		     type_to_string(trc, struct pubkey,
 				    &state->next_per_commit[LOCAL]));
-	msg = wire_sync_read(state, REQ_FD);
+	msg = status_sync_read(state, REQ_FD);
 	if (fromwire_opening_funder(state, msg, NULL,
 				    &state->funding_satoshis,
 				    &state->push_msat,
@@ -1000,7 +1000,7 @@ static enum watch_result funding_announce_cb(struct peer *peer,
 					     void *unused)
 {
 	if (depth < ANNOUNCE_MIN_DEPTH) {
-		return KEEP_WATCHING;
+		return WATCH_UNTIL_DEPTH(ANNOUNCE_MIN_DEPTH);
 	}
 	if (peer->state != CHANNELD_NORMAL || !peer->owner) {
 		log_debug(peer->ld->log,
@@ -1308,7 +1308,7 @@ static enum watch_result funding_lockin_cb(struct peer *peer,
 	tal_free(txidstr);
 
 	if (depth < peer->minimum_depth)
-		return KEEP_WATCHING;
+		return WATCH_UNTIL_DEPTH(peer->minimum_depth);
 
 	loc = locate_tx(peer, peer->ld->topology, &txid);
 
@@ -1470,7 +1470,7 @@ static int peer_channel_announced(struct peer *peer, const u8 *msg)
 	 * gossipd so it can take care of forwarding it. */
 	announcement = create_node_announcement(tmpctx, ld, &sig);
 	wrappedmsg = towire_gossip_forwarded_msg(tmpctx, announcement);
-	subd_send_msg(ld->gossip, take(wrappedmsg));
+	subd_send_msg_nonurgent(ld->gossip, take(wrappedmsg));
 	tal_free(tmpctx);
 
 	return 0;
@@ -1857,6 +1857,21 @@ static int peer_start_closingd_after_shutdown(struct peer *peer, const u8 *msg,
 	return -1;
 }
 
+/* Commitment steps share a db commit with any other channels' nearby: they
+ * hold their replies (and so channeld's next message to the peer) until it's
+ * done. */
+static int batched(struct peer *peer, const u8 *msg,
+		   int (*handler)(struct peer *peer, const u8 *msg))
+{
+	struct wallet *w = peer->ld->wallet;
+	int ret;
+
+	wallet_batch_start(w);
+	ret = handler(peer, msg);
+	wallet_batch_end(w);
+	return ret;
+}
+
 static int channel_msg(struct subd *sd, const u8 *msg, const int *fds)
 {
 	enum channel_wire_type t = fromwire_peektype(msg);
@@ -1867,11 +1882,11 @@ static int channel_msg(struct subd *sd, const u8 *msg, const int *fds)
 				   CHANNELD_AWAITING_LOCKIN, CHANNELD_NORMAL);
 		break;
 	case WIRE_CHANNEL_SENDING_COMMITSIG:
-		return peer_sending_commitsig(sd->peer, msg);
+		return batched(sd->peer, msg, peer_sending_commitsig);
 	case WIRE_CHANNEL_GOT_COMMITSIG:
-		return peer_got_commitsig(sd->peer, msg);
+		return batched(sd->peer, msg, peer_got_commitsig);
 	case WIRE_CHANNEL_GOT_REVOKE:
-		return peer_got_revoke(sd->peer, msg);
+		return batched(sd->peer, msg, peer_got_revoke);
 	case WIRE_CHANNEL_ANNOUNCED:
 		return peer_channel_announced(sd->peer, msg);
 	case WIRE_CHANNEL_GOT_FUNDING_LOCKED:
@@ -48,6 +48,17 @@ static bool state_update_ok(struct peer *peer,
 	return true;
 }
 
+static void save_htlc_state(struct wallet *w, u64 dbid,
+			    enum htlc_state hstate,
+			    const struct preimage *preimage,
+			    enum onion_type malformed,
+			    const u8 *failuremsg)
+{
+	if (!wallet_htlc_update(w, dbid, hstate, preimage, malformed,
+				failuremsg))
+		fatal("Could not save HTLC to database: %s", w->db->err);
+}
+
 static bool htlc_in_update_state(struct peer *peer,
 				 struct htlc_in *hin,
 				 enum htlc_state newstate)
@@ -55,9 +66,10 @@ static bool htlc_in_update_state(struct peer *peer,
 	if (!state_update_ok(peer, hin->hstate, newstate, hin->key.id, "in"))
 		return false;
 
-	/* FIXME: db commit */
 	hin->hstate = newstate;
 	htlc_in_check(hin, __func__);
+	save_htlc_state(peer->ld->wallet, hin->dbid, newstate, hin->preimage,
+			hin->malformed, hin->failuremsg);
 	return true;
 }
 
@@ -68,14 +80,18 @@ static bool htlc_out_update_state(struct peer *peer,
 	if (!state_update_ok(peer, hout->hstate, newstate, hout->key.id, "out"))
 		return false;
 
-	/* FIXME: db commit */
 	hout->hstate = newstate;
 	htlc_out_check(hout, __func__);
+	/* Not in the db until it's committed: see update_out_htlc. */
+	if (hout->dbid)
+		save_htlc_state(peer->ld->wallet, hout->dbid, newstate,
+				hout->preimage, hout->malformed,
+				hout->failuremsg);
 	return true;
 }
 
-/* This is where we write to the database the minimal HTLC info
- * required to do penalty transaction */
+/* This is the minimal HTLC info required to do penalty transaction: it's
+ * in the db's channel_htlcs too, which is where we get it on restart. */
 static void save_htlc_stub(struct lightningd *ld,
 			   struct peer *peer,
 			   enum side owner,
@@ -88,8 +104,6 @@ static void save_htlc_stub(struct lightningd *ld,
 	peer->htlcs[n].cltv_expiry = cltv_value;
 	ripemd160(&peer->htlcs[n].ripemd,
 		  payment_hash->u.u8, sizeof(payment_hash->u));
-
-	/* FIXME: save to db instead! */
 }
 
 static void fail_in_htlc(struct htlc_in *hin,
@@ -212,8 +226,11 @@ static void fail_out_htlc(struct htlc_out *hout, const char *localfail)
 	assert(!hout->malformed || !hout->failuremsg);
 	if (hout->in) {
 		fail_in_htlc(hout->in, hout->malformed, hout->failuremsg);
-	} else {
+	} else if (hout->pay_command) {
 		payment_failed(hout->key.peer->ld, hout, localfail);
+	} else {
+		log_info(hout->key.peer->log, "Payment for HTLC %"PRIu64
+			 " from before restart failed", hout->key.id);
 	}
 }
 
@@ -542,7 +559,8 @@ fail:
 	local_fail_htlc(hin, failcode);
 }
 
-/* Temporary information, while we resolve the next hop */
+/* Temporary information, while we resolve the next hops: we ask gossipd
+ * about all the HTLCs accepted by one revoke in a single request. */
 struct gossip_resolve {
 	struct short_channel_id next_channel;
 	u64 amt_to_forward;
@@ -552,50 +570,100 @@ struct gossip_resolve {
 };
 
 /* We received a resolver reply, which gives us the node_ids of the
- * channel we want to forward over */
+ * channels we want to forward over */
 static bool channel_resolve_reply(struct subd *gossip, const u8 *msg,
 				  const int *fds, struct gossip_resolve *gr)
 {
 	struct pubkey *nodes, *peer_id;
+	bool *found;
+	u64 reqid;
+	size_t i, n;
 
-	if (!fromwire_gossip_resolve_channel_reply(msg, msg, NULL, &nodes)) {
+	if (!fromwire_gossip_resolve_channel_reply(msg, msg, NULL, &reqid,
+						   &found, &nodes)) {
 		log_broken(gossip->log,
 			   "bad fromwire_gossip_resolve_channel_reply %s",
 			   tal_hex(msg, msg));
-		return false;
+		goto fail;
 	}
 
-	if (tal_count(nodes) == 0) {
-		local_fail_htlc(gr->hin, WIRE_UNKNOWN_NEXT_PEER);
-		return true;
-	} else if (tal_count(nodes) != 2) {
+	if (tal_count(found) != tal_count(gr)) {
 		log_broken(gossip->log,
-			   "fromwire_gossip_resolve_channel_reply has %zu nodes",
-			   tal_count(nodes));
-		return false;
+			   "fromwire_gossip_resolve_channel_reply has %zu"
+			   " results for %zu channels",
+			   tal_count(found), tal_count(gr));
+		goto fail;
 	}
 
-	/* Get the other peer matching the id that is not us */
-	if (pubkey_cmp(&nodes[0], &gossip->ld->dstate.id) == 0) {
-		peer_id = &nodes[1];
-	} else {
-		peer_id = &nodes[0];
+	for (i = n = 0; i < tal_count(found); i++)
+		n += found[i];
+	if (tal_count(nodes) != 2 * n) {
+		log_broken(gossip->log,
+			   "fromwire_gossip_resolve_channel_reply has %zu nodes"
+			   " for %zu channels",
+			   tal_count(nodes), n);
+		goto fail;
 	}
 
-	forward_htlc(gr->hin, gr->hin->cltv_expiry, &gr->hin->payment_hash,
-		     gr->amt_to_forward, gr->outgoing_cltv_value, peer_id,
-		     gr->next_onion);
+	for (i = n = 0; i < tal_count(gr); i++) {
+		if (!found[i]) {
+			local_fail_htlc(gr[i].hin, WIRE_UNKNOWN_NEXT_PEER);
+			continue;
+		}
+
+		/* Get the other peer matching the id that is not us */
+		if (pubkey_cmp(&nodes[n], &gossip->ld->dstate.id) == 0) {
+			peer_id = &nodes[n+1];
+		} else {
+			peer_id = &nodes[n];
+		}
+		n += 2;
+
+		forward_htlc(gr[i].hin, gr[i].hin->cltv_expiry,
+			     &gr[i].hin->payment_hash,
+			     gr[i].amt_to_forward, gr[i].outgoing_cltv_value,
+			     peer_id, gr[i].next_onion);
+	}
 	tal_free(gr);
 	return true;
+
+fail:
+	tal_free(gr);
+	return false;
+}
+
+/* One round trip to gossipd for all the channels we need. */
+static void resolve_channels(struct peer *peer, struct gossip_resolve *gr)
+{
+	struct short_channel_id *scids;
+	struct subd *gossip = peer->ld->gossip;
+	u64 reqid = subd_next_reqid(gossip);
+	size_t i;
+	u8 *req;
+
+	scids = tal_arr(gr, struct short_channel_id, tal_count(gr));
+	for (i = 0; i < tal_count(gr); i++)
+		scids[i] = gr[i].next_channel;
+
+	log_debug(peer->log, "Asking gossip to resolve %zu channels",
+		  tal_count(gr));
+	req = towire_gossip_resolve_channel_request(gr, reqid, scids);
+	tal_free(scids);
+
+	/* htlc_ins are owned by peer, so reply is moot if it's freed. */
+	tal_steal(peer, gr);
+	subd_req_id(peer, gossip, take(req), reqid, -1, 0,
+		    channel_resolve_reply, gr);
 }
 
-/* Everyone is committed to this htlc of theirs */
+/* Everyone is committed to this htlc of theirs: if it's to be forwarded,
+ * we append to *gr for resolve_channels(). */
 static bool peer_accepted_htlc(struct peer *peer,
 			       u64 id,
+			       struct gossip_resolve **gr,
 			       enum onion_type *failcode)
 {
 	struct htlc_in *hin;
-	u8 *req;
 	struct route_step *rs;
 	struct onionpacket *op;
 	const tal_t *tmpctx = tal_tmpctx(peer);
@@ -658,21 +726,18 @@ static bool peer_accepted_htlc(struct peer *peer,
 	}
 
 	if (rs->nextcase == ONION_FORWARD) {
-		struct gossip_resolve *gr = tal(peer->ld, struct gossip_resolve);
+		size_t n = tal_count(*gr);
 
-		gr->next_onion = serialize_onionpacket(gr, rs->next);
-		gr->next_channel = rs->hop_data.channel_id;
-		gr->amt_to_forward = rs->hop_data.amt_forward;
-		gr->outgoing_cltv_value = rs->hop_data.outgoing_cltv;
-		gr->hin = hin;
+		tal_resize(gr, n + 1);
+		(*gr)[n].next_onion = serialize_onionpacket(*gr, rs->next);
+		(*gr)[n].next_channel = rs->hop_data.channel_id;
+		(*gr)[n].amt_to_forward = rs->hop_data.amt_forward;
+		(*gr)[n].outgoing_cltv_value = rs->hop_data.outgoing_cltv;
+		(*gr)[n].hin = hin;
 
-		req = towire_gossip_resolve_channel_request(tmpctx,
-							    &gr->next_channel);
-		log_debug(peer->log, "Asking gossip to resolve channel %s",
+		log_debug(peer->log, "Will ask gossip to resolve channel %s",
 			  type_to_string(tmpctx, struct short_channel_id,
-					 &gr->next_channel));
-		subd_req(hin, peer->ld->gossip, req, -1, 0,
-			 channel_resolve_reply, gr);
+					 &rs->hop_data.channel_id));
 	} else
 		handle_localpay(hin, hin->cltv_expiry, &hin->payment_hash,
 				rs->hop_data.amt_forward,
@@ -693,12 +758,16 @@ static void fulfill_our_htlc_out(struct peer *peer, struct htlc_out *hout,
 	hout->preimage = tal_dup(hout, struct preimage, preimage);
 	htlc_out_check(hout, __func__);
 
-	/* FIXME: Save to db */
+	save_htlc_state(peer->ld->wallet, hout->dbid, hout->hstate,
+			hout->preimage, hout->malformed, hout->failuremsg);
 
 	if (hout->in)
 		fulfill_htlc(hout->in, preimage);
-	else
+	else if (hout->pay_command)
 		payment_succeeded(peer->ld, hout, preimage);
+	else
+		log_info(peer->log, "Payment for HTLC %"PRIu64
+			 " from before restart succeeded", hout->key.id);
 }
 
 static bool peer_fulfilled_our_htlc(struct peer *peer,
@@ -723,26 +792,27 @@ static bool peer_fulfilled_our_htlc(struct peer *peer,
 
 void onchain_fulfilled_htlc(struct peer *peer, const struct preimage *preimage)
 {
-	struct htlc_out_map_iter outi;
 	struct htlc_out *hout;
 	struct sha256 payment_hash;
+	u64 *ids;
+	size_t i;
 
 	sha256(&payment_hash, preimage, sizeof(*preimage));
 
-	/* FIXME: use db to look this up! */
-	for (hout = htlc_out_map_first(&peer->ld->htlcs_out, &outi);
-	     hout;
-	     hout = htlc_out_map_next(&peer->ld->htlcs_out, &outi)) {
-		if (hout->key.peer != peer)
-			continue;
-
-		if (!structeq(&hout->payment_hash, &payment_hash))
+	ids = wallet_htlc_out_ids_by_payment_hash(peer, peer->ld->wallet,
+						  peer->channel,
+						  &payment_hash);
+	for (i = 0; i < tal_count(ids); i++) {
+		/* Might be finished already. */
+		hout = find_htlc_out(&peer->ld->htlcs_out, peer, ids[i]);
+		if (!hout)
 			continue;
 
 		fulfill_our_htlc_out(peer, hout, preimage);
 		/* We keep going: this is something of a leak, but onchain
 		 * we have no real way of distinguishing HTLCs anyway */
 	}
+	tal_free(ids);
 }
 
 static bool peer_failed_our_htlc(struct peer *peer,
@@ -855,6 +925,11 @@ static bool update_out_htlc(struct peer *peer, u64 id, enum htlc_state newstate)
 		tal_del_destructor(hout, hout_subd_died);
 		tal_steal(peer->ld, hout);
 
+		if (!wallet_htlc_save_out(peer->ld->wallet, peer->channel,
+					  hout))
+			fatal("Could not save HTLC to database: %s",
+			      peer->ld->wallet->db->err);
+
 		/* From now onwards, penalty tx might need this */
 		save_htlc_stub(peer->ld, peer, LOCAL,
 			       hout->cltv_expiry,
@@ -874,7 +949,16 @@ static bool changed_htlc(struct peer *peer,
 		return update_in_htlc(peer, changed->id, changed->newstate);
 }
 
-static bool peer_save_commitsig_received(struct peer *peer, u64 commitnum)
+static void peer_save_channel(struct peer *peer)
+{
+	if (!wallet_channel_save(peer->ld->wallet, peer->channel))
+		fatal("Could not save channel to database: %s",
+		      peer->ld->wallet->db->err);
+}
+
+static bool peer_save_commitsig_received(struct peer *peer, u64 commitnum,
+					 struct bitcoin_tx *tx,
+					 const secp256k1_ecdsa_signature *commit_sig)
 {
 	if (commitnum != peer->next_index[LOCAL]) {
 		peer_internal_error(peer,
@@ -885,12 +969,15 @@ static bool peer_save_commitsig_received(struct peer *peer, u64 commitnum)
 	}
 
 	peer->next_index[LOCAL]++;
+	peer_last_tx(peer, tx, commit_sig);
 
-	/* FIXME: Save to database, with sig and HTLCs. */
+	/* FIXME: Save HTLCs and their sigs too. */
+	peer_save_channel(peer);
 	return true;
 }
 
-static bool peer_save_commitsig_sent(struct peer *peer, u64 commitnum)
+static bool peer_save_commitsig_sent(struct peer *peer, u64 commitnum,
+				     struct changed_htlc *changed_htlcs)
 {
 	if (commitnum != peer->next_index[REMOTE]) {
 		peer_internal_error(peer,
@@ -902,10 +989,39 @@ static bool peer_save_commitsig_sent(struct peer *peer, u64 commitnum)
 
 	peer->next_index[REMOTE]++;
 
-	/* FIXME: Save to database, with sig and HTLCs. */
+	/* Last was commit. */
+	peer->last_was_revoke = false;
+	tal_free(peer->last_sent_commit);
+	peer->last_sent_commit = tal_steal(peer, changed_htlcs);
+
+	/* FIXME: Save HTLCs too. */
+	peer_save_channel(peer);
 	return true;
 }
 
+/* Replies which tell channeld it can talk to the peer about something we've
+ * saved: they wait until it's on disk. */
+struct committed_reply {
+	struct subd *owner;
+	const u8 *msg;
+};
+
+static void send_committed_reply(struct committed_reply *r)
+{
+	subd_send_msg(r->owner, take(r->msg));
+	tal_free(r);
+}
+
+static void reply_when_committed(struct peer *peer, const u8 *msg TAKES)
+{
+	/* If channeld dies meanwhile, never mind. */
+	struct committed_reply *r = tal(peer->owner, struct committed_reply);
+
+	r->owner = peer->owner;
+	r->msg = tal_dup_arr(r, u8, msg, tal_len(msg), 0);
+	wallet_after_commit(peer->ld->wallet, r, send_committed_reply, r);
+}
+
 int peer_sending_commitsig(struct peer *peer, const u8 *msg)
 {
 	u64 commitnum;
@@ -952,17 +1068,12 @@ int peer_sending_commitsig(struct peer *peer, const u8 *msg)
 		peer->next_htlc_id += num_local_added;
 	}
 
-	if (!peer_save_commitsig_sent(peer, commitnum))
+	if (!peer_save_commitsig_sent(peer, commitnum, changed_htlcs))
 		return -1;
 
-	/* Last was commit. */
-	peer->last_was_revoke = false;
-	tal_free(peer->last_sent_commit);
-	peer->last_sent_commit = tal_steal(peer, changed_htlcs);
-
 	/* Tell it we've got it, and to go ahead with commitment_signed. */
-	subd_send_msg(peer->owner,
-		      take(towire_channel_sending_commitsig_reply(msg)));
+	reply_when_committed(peer,
+			     take(towire_channel_sending_commitsig_reply(msg)));
 	return 0;
 }
 
@@ -978,7 +1089,9 @@ static void added_their_htlc(struct peer *peer,
 			  added->cltv_expiry, &added->payment_hash,
 			  shared_secret, added->onion_routing_packet);
 
-	/* FIXME: Save to db */
+	if (!wallet_htlc_save_in(peer->ld->wallet, peer->channel, hin))
+		fatal("Could not save HTLC to database: %s",
+		      peer->ld->wallet->db->err);
 
 	log_debug(peer->log, "Adding their HTLC %"PRIu64, added->id);
 	connect_htlc_in(&peer->ld->htlcs_in, hin);
@@ -1096,17 +1209,16 @@ int peer_got_commitsig(struct peer *peer, const u8 *msg)
 	if (!peer_sending_revocation(peer, added, fulfilled, failed, changed))
 		return -1;
 
-	if (!peer_save_commitsig_received(peer, commitnum))
-		return -1;
-
-	peer_last_tx(peer, tx, &commit_sig);
 	/* FIXME: Put these straight in the db! */
 	tal_free(peer->last_htlc_sigs);
 	peer->last_htlc_sigs = tal_steal(peer, htlc_sigs);
 
+	if (!peer_save_commitsig_received(peer, commitnum, tx, &commit_sig))
+		return -1;
+
 	/* Tell it we've committed, and to go ahead with revoke. */
 	msg = towire_channel_got_commitsig_reply(msg);
-	subd_send_msg(peer->owner, take(msg));
+	reply_when_committed(peer, take(msg));
 	return 0;
 }
 
@@ -1126,6 +1238,7 @@ int peer_got_revoke(struct peer *peer, const u8 *msg)
 	struct pubkey next_per_commitment_point;
 	struct changed_htlc *changed;
 	enum onion_type *failcodes;
+	struct gossip_resolve *gr;
 	size_t i;
 
 	if (!fromwire_channel_got_revoke(msg, msg, NULL,
@@ -1143,10 +1256,11 @@ int peer_got_revoke(struct peer *peer, const u8 *msg)
 
 	/* Save any immediate failures for after we reply. */
 	failcodes = tal_arrz(msg, enum onion_type, tal_count(changed));
+	gr = tal_arr(msg, struct gossip_resolve, 0);
 	for (i = 0; i < tal_count(changed); i++) {
 		/* If we're doing final accept, we need to forward */
 		if (changed[i].newstate == RCVD_ADD_ACK_REVOCATION) {
-			if (!peer_accepted_htlc(peer, changed[i].id,
+			if (!peer_accepted_htlc(peer, changed[i].id, &gr,
 						&failcodes[i]))
 				return -1;
 		} else {
@@ -1158,6 +1272,9 @@ int peer_got_revoke(struct peer *peer, const u8 *msg)
 		}
 	}
 
+	if (tal_count(gr))
+		resolve_channels(peer, gr);
+
 	if (revokenum >= (1ULL << 48)) {
 		peer_internal_error(peer, "got_revoke: too many txs %"PRIu64,
 				    revokenum);
@@ -1190,12 +1307,11 @@ int peer_got_revoke(struct peer *peer, const u8 *msg)
 
 	/* FIXME: Check per_commitment_secret -> per_commit_point */
 	update_per_commit_point(peer, &next_per_commitment_point);
-
-	/* FIXME: Commit shachain and next_per_commit_point to db */
+	peer_save_channel(peer);
 
 	/* Tell it we've committed, and to go ahead with revoke. */
 	msg = towire_channel_got_revoke_reply(msg);
-	subd_send_msg(peer->owner, take(msg));
+	reply_when_committed(peer, take(msg));
 
 	/* Now, any HTLCs we need to immediately fail? */
 	for (i = 0; i < tal_count(changed); i++) {
@@ -3,12 +3,13 @@
 
 bool check_ping_make_pong(const tal_t *ctx, const u8 *ping, u8 **pong)
 {
-	u16 num_pong_bytes;
-	u8 *ignored;
+	u16 num_pong_bytes, byteslen;
+	const u8 *ignored;
+	u8 *zeroes;
 
-	if (!fromwire_ping(ctx, ping, NULL, &num_pong_bytes, &ignored))
+	if (!fromwire_ping_view(ping, NULL, &num_pong_bytes, &byteslen,
+				&ignored))
 		return false;
-	tal_free(ignored);
 
 	/* FIXME: */
 	/* BOLT #1:
@@ -30,9 +31,9 @@ bool check_ping_make_pong(const tal_t *ctx, const u8 *ping, u8 **pong)
 		 * zeroes, but MUST NOT set `ignored` to sensitive data such
 		 * as secrets, or portions of initialized memory.
 		*/
-		ignored = tal_arrz(ctx, u8, num_pong_bytes);
-		*pong = towire_pong(ctx, ignored);
-		tal_free(ignored);
+		zeroes = tal_arrz(ctx, u8, num_pong_bytes);
+		*pong = towire_pong(ctx, zeroes);
+		tal_free(zeroes);
 	} else
 		*pong = NULL;
 
@@ -0,0 +1,579 @@
+#include "config.h"
+#include <assert.h>
+#include <ccan/endian/endian.h>
+#include <ccan/err/err.h>
+#include <ccan/fdpass/fdpass.h>
+#include <ccan/io/fdpass/fdpass.h>
+#include <ccan/str/str.h>
+#include <ccan/tal/str/str.h>
+#include <errno.h>
+#include <lightningd/shm_ring.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Bytes of message space in each direction: must be a power of 2, and
+ * big enough for a few maximal (65535 byte) messages. */
+#define SHM_RING_SIZE (1 << 18)
+
+/* Control block for one direction.  head and tail are free-running byte
+ * counts: head - tail is the number of bytes in the ring. */
+struct shm_ring_hdr {
+	/* Only written by the producer. */
+	u32 head;
+	/* Only written by the consumer. */
+	u32 tail;
+	/* Consumer found it empty: producer should ring when it adds. */
+	u32 consumer_waiting;
+	/* Producer found it full: consumer should ring when it removes. */
+	u32 producer_waiting;
+	/* Keep the data off this cacheline. */
+	u8 pad[64 - 4 * sizeof(u32)];
+};
+
+#define SHM_REGION_SIZE (sizeof(struct shm_ring_hdr) + SHM_RING_SIZE)
+
+struct shm_half {
+	struct shm_ring_hdr *hdr;
+	u8 *data;
+};
+
+struct shm_ring {
+	/* We consume from in, and produce into out. */
+	struct shm_half in, out;
+	void *map;
+
+	/* We sleep on mybell, and wake them via theirbell. */
+	int mybell, theirbell;
+	/* Where we read mybell's counter into. */
+	u64 bellval;
+
+	/* Other side wrote garbage into the ring. */
+	bool broken;
+
+	/* Socket to other side, and (once started) connections. */
+	int sockfd;
+	struct io_conn *fdconn, *main;
+
+	/* fds which came in on the socket, and those to go out. */
+	int *fds_in, *fds_out;
+	int fd_in;
+
+	/* Pending io_read_shm */
+	const tal_t *rd_ctx;
+	u8 **rd_data;
+	struct io_plan *(*rd_next)(struct io_conn *, void *);
+	void *rd_arg;
+
+	/* Pending io_write_shm */
+	const u8 *wr_msg;
+	struct io_plan *(*wr_next)(struct io_conn *, void *);
+	void *wr_arg;
+
+	/* Pending io_recv_shm_fd */
+	int *fd_ptr;
+	struct io_plan *(*fd_next)(struct io_conn *, void *);
+	void *fd_arg;
+};
+
+static void ring_bell(int fd)
+{
+	u64 one = 1;
+
+	/* Gcc's warn-unused-result fail: EAGAIN means it's rung already. */
+	if (write(fd, &one, sizeof(one)) != sizeof(one)) {
+		;
+	}
+}
+
+static void copy_in(struct shm_half *h, u32 off, const void *src, size_t len)
+{
+	size_t first;
+
+	off %= SHM_RING_SIZE;
+	first = SHM_RING_SIZE - off;
+	if (first > len)
+		first = len;
+	memcpy(h->data + off, src, first);
+	memcpy(h->data, (const u8 *)src + first, len - first);
+}
+
+static void copy_out(struct shm_half *h, u32 off, void *dst, size_t len)
+{
+	size_t first;
+
+	off %= SHM_RING_SIZE;
+	first = SHM_RING_SIZE - off;
+	if (first > len)
+		first = len;
+	memcpy(dst, h->data + off, first);
+	memcpy((u8 *)dst + first, h->data, len - first);
+}
+
+static void set_half(struct shm_half *h, void *map, int region)
+{
+	h->hdr = (struct shm_ring_hdr *)((u8 *)map + region * SHM_REGION_SIZE);
+	h->data = (u8 *)(h->hdr + 1);
+}
+
+static void destroy_main(struct io_conn *main, struct shm_ring *ring)
+{
+	ring->main = NULL;
+}
+
+static void destroy_shm_ring(struct shm_ring *ring)
+{
+	size_t i;
+
+	/* Don't let fdconn's finish free main. */
+	if (ring->main) {
+		tal_del_destructor2(ring->main, destroy_main, ring);
+		ring->main = NULL;
+	}
+	tal_free(ring->fdconn);
+
+	for (i = 0; i < tal_count(ring->fds_in); i++)
+		close(ring->fds_in[i]);
+	for (i = 0; i < tal_count(ring->fds_out); i++)
+		close(ring->fds_out[i]);
+	munmap(ring->map, 2 * SHM_REGION_SIZE);
+	close(ring->theirbell);
+}
+
+static struct shm_ring *setup_ring(const tal_t *ctx, int memfd,
+				   int mybell, int theirbell, bool master)
+{
+	struct shm_ring *ring = tal(ctx, struct shm_ring);
+
+	ring->map = mmap(NULL, 2 * SHM_REGION_SIZE, PROT_READ|PROT_WRITE,
+			 MAP_SHARED, memfd, 0);
+	if (ring->map == MAP_FAILED)
+		return tal_free(ring);
+
+	/* Region 0 is lightningd -> subdaemon, region 1 the reverse. */
+	set_half(&ring->out, ring->map, master ? 0 : 1);
+	set_half(&ring->in, ring->map, master ? 1 : 0);
+	ring->mybell = mybell;
+	ring->theirbell = theirbell;
+	ring->broken = false;
+	ring->sockfd = -1;
+	ring->fdconn = ring->main = NULL;
+	ring->fds_in = tal_arr(ring, int, 0);
+	ring->fds_out = tal_arr(ring, int, 0);
+	tal_add_destructor(ring, destroy_shm_ring);
+	return ring;
+}
+
+struct shm_ring *new_shm_ring(const tal_t *ctx,
+			      int childfds[SHM_RING_NUM_FDS])
+{
+	int memfd, bell[2];
+	struct shm_ring *ring;
+
+	memfd = memfd_create("lightningd-shm-ring", MFD_CLOEXEC);
+	if (memfd < 0)
+		return NULL;
+
+	/* Zero-filled, so all counters and flags start at 0. */
+	if (ftruncate(memfd, 2 * SHM_REGION_SIZE) != 0)
+		goto close_memfd;
+
+	/* bell[0] is the subdaemon's, bell[1] ours. */
+	bell[0] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (bell[0] < 0)
+		goto close_memfd;
+	bell[1] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (bell[1] < 0)
+		goto close_bell0;
+
+	ring = setup_ring(ctx, memfd, bell[1], bell[0], true);
+	if (!ring)
+		goto close_bell1;
+
+	/* Subdaemon gets its own copies of everything. */
+	childfds[0] = memfd;
+	childfds[1] = dup(bell[0]);
+	childfds[2] = dup(bell[1]);
+	if (childfds[1] < 0 || childfds[2] < 0) {
+		int saved_errno = errno;
+		if (childfds[1] >= 0)
+			close(childfds[1]);
+		if (childfds[2] >= 0)
+			close(childfds[2]);
+		close(memfd);
+		close(bell[1]);
+		/* Destructor closes bell[0] */
+		tal_free(ring);
+		errno = saved_errno;
+		return NULL;
+	}
+	return ring;
+
+close_bell1:
+	close(bell[1]);
+close_bell0:
+	close(bell[0]);
+close_memfd:
+	close(memfd);
+	return NULL;
+}
+
+char *shm_ring_arg(const tal_t *ctx, const int fds[SHM_RING_NUM_FDS])
+{
+	return tal_fmt(ctx, "--shm-transport=%i,%i,%i",
+		       fds[0], fds[1], fds[2]);
+}
+
+struct shm_ring *shm_ring_from_argv(const tal_t *ctx, int argc, char *argv[],
+				    int sockfd)
+{
+	int i, fds[SHM_RING_NUM_FDS];
+	struct shm_ring *ring;
+
+	for (i = 1; i < argc; i++) {
+		if (!strstarts(argv[i], "--shm-transport="))
+			continue;
+		if (sscanf(argv[i] + strlen("--shm-transport="), "%i,%i,%i",
+			   &fds[0], &fds[1], &fds[2]) != 3)
+			errx(1, "Bad %s", argv[i]);
+
+		ring = setup_ring(ctx, fds[0], fds[1], fds[2], false);
+		if (!ring)
+			err(1, "Mapping %s", argv[i]);
+		close(fds[0]);
+		ring->sockfd = sockfd;
+		return ring;
+	}
+	return NULL;
+}
+
+int shm_ring_bellfd(const struct shm_ring *ring)
+{
+	return ring->mybell;
+}
+
+bool shm_ring_put(struct shm_ring *ring, const u8 *msg)
+{
+	struct shm_ring_hdr *hdr = ring->out.hdr;
+	size_t len = tal_count(msg);
+	be16 be_len = cpu_to_be16(len);
+	u32 head = hdr->head, tail;
+
+	assert(len == be16_to_cpu(be_len));
+
+	tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+	if (SHM_RING_SIZE - (head - tail) < sizeof(be_len) + len) {
+		/* Ask to be woken, then make sure we didn't just miss it. */
+		__atomic_store_n(&hdr->producer_waiting, 1, __ATOMIC_SEQ_CST);
+		tail = __atomic_load_n(&hdr->tail, __ATOMIC_SEQ_CST);
+		if (SHM_RING_SIZE - (head - tail) < sizeof(be_len) + len)
+			return false;
+		__atomic_store_n(&hdr->producer_waiting, 0, __ATOMIC_RELAXED);
+	}
+
+	copy_in(&ring->out, head, &be_len, sizeof(be_len));
+	copy_in(&ring->out, head + sizeof(be_len), msg, len);
+	__atomic_store_n(&hdr->head, head + sizeof(be_len) + len,
+			 __ATOMIC_SEQ_CST);
+
+	if (__atomic_exchange_n(&hdr->consumer_waiting, 0, __ATOMIC_SEQ_CST))
+		ring_bell(ring->theirbell);
+	return true;
+}
+
+u8 *shm_ring_get(const tal_t *ctx, struct shm_ring *ring)
+{
+	struct shm_ring_hdr *hdr = ring->in.hdr;
+	u32 tail = hdr->tail, head;
+	be16 be_len;
+	size_t len;
+	u8 *msg;
+
+	head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	if (head == tail) {
+		/* Ask to be woken, then make sure we didn't just miss it. */
+		__atomic_store_n(&hdr->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+		head = __atomic_load_n(&hdr->head, __ATOMIC_SEQ_CST);
+		if (head == tail)
+			return NULL;
+		__atomic_store_n(&hdr->consumer_waiting, 0, __ATOMIC_RELAXED);
+	}
+
+	/* Don't trust the other side to get this right. */
+	if (head - tail < sizeof(be_len) || head - tail > SHM_RING_SIZE) {
+		ring->broken = true;
+		return NULL;
+	}
+	copy_out(&ring->in, tail, &be_len, sizeof(be_len));
+	len = be16_to_cpu(be_len);
+	if (head - tail < sizeof(be_len) + len) {
+		ring->broken = true;
+		return NULL;
+	}
+
+	msg = tal_arr(ctx, u8, len);
+	copy_out(&ring->in, tail + sizeof(be_len), msg, len);
+	__atomic_store_n(&hdr->tail, tail + sizeof(be_len) + len,
+			 __ATOMIC_SEQ_CST);
+
+	if (__atomic_exchange_n(&hdr->producer_waiting, 0, __ATOMIC_SEQ_CST))
+		ring_bell(ring->theirbell);
+	return msg;
+}
+
+static struct io_plan *fdconn_recv(struct io_conn *conn, struct shm_ring *ring);
+
+static struct io_plan *fdconn_got(struct io_conn *conn, struct shm_ring *ring)
+{
+	size_t n = tal_count(ring->fds_in);
+
+	tal_resize(&ring->fds_in, n + 1);
+	ring->fds_in[n] = ring->fd_in;
+	io_wake(&ring->fds_in);
+	return fdconn_recv(conn, ring);
+}
+
+static struct io_plan *fdconn_recv(struct io_conn *conn, struct shm_ring *ring)
+{
+	return io_recv_fd(conn, &ring->fd_in, fdconn_got, ring);
+}
+
+static struct io_plan *fdconn_send(struct io_conn *conn, struct shm_ring *ring)
+{
+	size_t n = tal_count(ring->fds_out);
+	int fd;
+
+	if (n == 0)
+		return io_out_wait(conn, &ring->fds_out, fdconn_send, ring);
+
+	fd = ring->fds_out[0];
+	memmove(ring->fds_out, ring->fds_out + 1, sizeof(int) * (n - 1));
+	tal_resize(&ring->fds_out, n - 1);
+	return io_send_fd(conn, fd, true, fdconn_send, ring);
+}
+
+static struct io_plan *fdconn_init(struct io_conn *conn, struct shm_ring *ring)
+{
+	return io_duplex(conn, fdconn_recv(conn, ring), fdconn_send(conn, ring));
+}
+
+/* Socket closed: other side is gone, so close main too. */
+static void fdconn_finish(struct io_conn *conn, struct shm_ring *ring)
+{
+	ring->fdconn = NULL;
+	/* Wake anyone waiting for fds, so they notice. */
+	io_wake(&ring->fds_in);
+	if (ring->main)
+		tal_free(ring->main);
+}
+
+void shm_ring_start(struct shm_ring *ring, int sockfd, struct io_conn *main)
+{
+	ring->sockfd = sockfd;
+	ring->main = main;
+	tal_add_destructor2(main, destroy_main, ring);
+
+	/* Owned by main, so other side sees socket close when main does. */
+	ring->fdconn = io_new_conn(main, sockfd, fdconn_init, ring);
+	io_set_finish(ring->fdconn, fdconn_finish, ring);
+}
+
+static struct io_plan *read_try(struct io_conn *conn, struct shm_ring *ring);
+
+static struct io_plan *read_bell(struct io_conn *conn, struct shm_ring *ring)
+{
+	/* Bell means there's a new message, or more room for ours. */
+	io_wake(&ring->out);
+	return read_try(conn, ring);
+}
+
+static struct io_plan *read_try(struct io_conn *conn, struct shm_ring *ring)
+{
+	*ring->rd_data = shm_ring_get(ring->rd_ctx, ring);
+	if (*ring->rd_data)
+		return io_always_(conn, ring->rd_next, ring->rd_arg);
+	if (ring->broken)
+		return io_close(conn);
+
+	return io_read(conn, &ring->bellval, sizeof(ring->bellval),
+		       read_bell, ring);
+}
+
+struct io_plan *io_read_shm_(struct io_conn *conn,
+			     struct shm_ring *ring,
+			     const tal_t *ctx,
+			     u8 **data,
+			     struct io_plan *(*next)(struct io_conn *, void *),
+			     void *next_arg)
+{
+	ring->rd_ctx = ctx;
+	ring->rd_data = data;
+	ring->rd_next = next;
+	ring->rd_arg = next_arg;
+	return read_try(conn, ring);
+}
+
+static struct io_plan *write_try(struct io_conn *conn, struct shm_ring *ring)
+{
+	if (!shm_ring_put(ring, ring->wr_msg))
+		return io_out_wait(conn, &ring->out, write_try, ring);
+
+	ring->wr_msg = tal_free(ring->wr_msg);
+	return io_out_always_(conn, ring->wr_next, ring->wr_arg);
+}
+
+struct io_plan *io_write_shm_(struct io_conn *conn,
+			      struct shm_ring *ring,
+			      const u8 *data TAKES,
+			      struct io_plan *(*next)(struct io_conn *, void *),
+			      void *next_arg)
+{
+	/* Usual case: straight in, no copy. */
+	if (shm_ring_put(ring, data)) {
+		if (taken(data))
+			tal_free(data);
+		return io_out_always_(conn, next, next_arg);
+	}
+
+	ring->wr_msg = tal_dup_arr(ring, u8, data, tal_count(data), 0);
+	ring->wr_next = next;
+	ring->wr_arg = next_arg;
+	return io_out_wait(conn, &ring->out, write_try, ring);
+}
+
+void shm_ring_send_fd(struct shm_ring *ring, int fd)
+{
+	size_t n = tal_count(ring->fds_out);
+
+	tal_resize(&ring->fds_out, n + 1);
+	ring->fds_out[n] = fd;
+	io_wake(&ring->fds_out);
+}
+
+static struct io_plan *recv_fd_try(struct io_conn *conn, struct shm_ring *ring)
+{
+	size_t n = tal_count(ring->fds_in);
+
+	if (n == 0) {
+		if (!ring->fdconn)
+			return io_close(conn);
+		return io_wait(conn, &ring->fds_in, recv_fd_try, ring);
+	}
+
+	*ring->fd_ptr = ring->fds_in[0];
+	memmove(ring->fds_in, ring->fds_in + 1, sizeof(int) * (n - 1));
+	tal_resize(&ring->fds_in, n - 1);
+	return io_always_(conn, ring->fd_next, ring->fd_arg);
+}
+
+struct io_plan *io_recv_shm_fd_(struct io_conn *conn,
+				struct shm_ring *ring,
+				int *fd,
+				struct io_plan *(*next)(struct io_conn *,
+							void *),
+				void *next_arg)
+{
+	ring->fd_ptr = fd;
+	ring->fd_next = next;
+	ring->fd_arg = next_arg;
+	return recv_fd_try(conn, ring);
+}
+
+/* Block until our bell rings; false if the other side has gone.  If
+ * @want_fds, we pick up any fds on the socket (we're not in io_loop). */
+static bool sync_wait(struct shm_ring *ring, bool want_fds)
+{
+	struct pollfd pfd[2];
+
+	pfd[0].fd = ring->mybell;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ring->sockfd;
+	pfd[1].events = want_fds ? POLLIN : 0;
+
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (pfd[1].revents & POLLIN) {
+			size_t n = tal_count(ring->fds_in);
+			int fd;
+
+			io_fd_block(ring->sockfd, true);
+			fd = fdpass_recv(ring->sockfd);
+			io_fd_block(ring->sockfd, false);
+			if (fd < 0)
+				return false;
+			tal_resize(&ring->fds_in, n + 1);
+			ring->fds_in[n] = fd;
+		} else if (pfd[1].revents & (POLLHUP|POLLERR))
+			return false;
+
+		if (pfd[0].revents & POLLIN) {
+			if (read(ring->mybell, &ring->bellval,
+				 sizeof(ring->bellval)) < 0
+			    && errno != EAGAIN)
+				return false;
+			return true;
+		}
+	}
+}
+
+u8 *shm_sync_read(const tal_t *ctx, struct shm_ring *ring)
+{
+	u8 *msg;
+
+	while ((msg = shm_ring_get(ctx, ring)) == NULL) {
+		if (ring->broken || !sync_wait(ring, true))
+			return NULL;
+	}
+	return msg;
+}
+
+bool shm_sync_write(struct shm_ring *ring, const u8 *msg TAKES)
+{
+	bool ok = true, swallowed = false;
+
+	while (!shm_ring_put(ring, msg)) {
+		if (!sync_wait(ring, false)) {
+			ok = false;
+			break;
+		}
+		swallowed = true;
+	}
+
+	/* If io_read_shm was asleep on the bell, we may have eaten its
+	 * wakeup: ring it again (a spurious wakeup is harmless). */
+	if (swallowed)
+		ring_bell(ring->mybell);
+
+	if (taken(msg))
+		tal_free(msg);
+	return ok;
+}
+
+bool shm_sync_flush_fds(struct shm_ring *ring)
+{
+	size_t i;
+	bool ok = true;
+
+	/* Finish any fd io_loop was halfway through sending. */
+	if (ring->fdconn && !io_flush_sync(ring->fdconn))
+		return false;
+
+	io_fd_block(ring->sockfd, true);
+	for (i = 0; i < tal_count(ring->fds_out); i++) {
+		if (ok && !fdpass_send(ring->sockfd, ring->fds_out[i]))
+			ok = false;
+		close(ring->fds_out[i]);
+	}
+	io_fd_block(ring->sockfd, false);
+	tal_resize(&ring->fds_out, 0);
+	return ok;
+}
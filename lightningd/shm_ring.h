@@ -0,0 +1,116 @@
+/* Shared-memory message transport between lightningd and a subdaemon. */
+#ifndef LIGHTNING_LIGHTNINGD_SHM_RING_H
+#define LIGHTNING_LIGHTNINGD_SHM_RING_H
+#include "config.h"
+#include <ccan/io/io.h>
+#include <ccan/short_types/short_types.h>
+#include <ccan/take/take.h>
+#include <ccan/tal/tal.h>
+
+/*
+ * Messages go through a pair of single-producer, single-consumer rings in a
+ * memfd, with an eventfd each side to wake the other up.  The original
+ * socket is only used for passing fds (and noticing the other side die).
+ */
+
+/* The memfd, the subdaemon's doorbell, then lightningd's doorbell. */
+#define SHM_RING_NUM_FDS 3
+
+struct shm_ring;
+
+/**
+ * new_shm_ring - create a ring pair for a new subdaemon (lightningd side).
+ * @ctx: context to allocate from.
+ * @childfds: set to fds to hand to the subdaemon (caller closes them).
+ *
+ * Returns NULL and sets errno if we can't create memfd or eventfds.
+ */
+struct shm_ring *new_shm_ring(const tal_t *ctx,
+			      int childfds[SHM_RING_NUM_FDS]);
+
+/**
+ * shm_ring_arg - the commandline argument to hand to the subdaemon.
+ * @ctx: context to allocate from.
+ * @fds: the fd numbers as the subdaemon will see them.
+ */
+char *shm_ring_arg(const tal_t *ctx, const int fds[SHM_RING_NUM_FDS]);
+
+/**
+ * shm_ring_from_argv - attach to ring given by lightningd (subdaemon side).
+ * @ctx: context to allocate from.
+ * @argc, @argv: our commandline.
+ * @sockfd: the socket to lightningd, still used for fd passing.
+ *
+ * Returns NULL if we weren't given --shm-transport.
+ */
+struct shm_ring *shm_ring_from_argv(const tal_t *ctx, int argc, char *argv[],
+				    int sockfd);
+
+/**
+ * shm_ring_bellfd - the eventfd to build the message io_conn on.
+ */
+int shm_ring_bellfd(const struct shm_ring *ring);
+
+/**
+ * shm_ring_start - start passing fds over the socket.
+ * @ring: the ring pair.
+ * @sockfd: the socket (for lightningd, the one we created the subdaemon with).
+ * @main: the connection on shm_ring_bellfd(): freed if the socket closes.
+ */
+void shm_ring_start(struct shm_ring *ring, int sockfd, struct io_conn *main);
+
+/* Non-blocking primitives: return false/NULL if full/empty. */
+bool shm_ring_put(struct shm_ring *ring, const u8 *msg);
+u8 *shm_ring_get(const tal_t *ctx, struct shm_ring *ring);
+
+/* Read message into *data, allocating off ctx (compare io_read_wire). */
+struct io_plan *io_read_shm_(struct io_conn *conn,
+			     struct shm_ring *ring,
+			     const tal_t *ctx,
+			     u8 **data,
+			     struct io_plan *(*next)(struct io_conn *, void *),
+			     void *next_arg);
+
+#define io_read_shm(conn, ring, ctx, data, next, arg)			\
+	io_read_shm_((conn), (ring), (ctx), (data),			\
+		     typesafe_cb_preargs(struct io_plan *, void *,	\
+					 (next), (arg), struct io_conn *), \
+		     (arg))
+
+/* Write message from data (compare io_write_wire).  data can be take() */
+struct io_plan *io_write_shm_(struct io_conn *conn,
+			      struct shm_ring *ring,
+			      const u8 *data TAKES,
+			      struct io_plan *(*next)(struct io_conn *, void *),
+			      void *next_arg);
+
+#define io_write_shm(conn, ring, data, next, arg)			\
+	io_write_shm_((conn), (ring), (data),				\
+		      typesafe_cb_preargs(struct io_plan *, void *,	\
+					  (next), (arg), struct io_conn *), \
+		      (arg))
+
+/* Queue an fd to send over the socket (closed after sending). */
+void shm_ring_send_fd(struct shm_ring *ring, int fd);
+
+/* Get the next fd which came in over the socket. */
+struct io_plan *io_recv_shm_fd_(struct io_conn *conn,
+				struct shm_ring *ring,
+				int *fd,
+				struct io_plan *(*next)(struct io_conn *,
+							void *),
+				void *next_arg);
+
+#define io_recv_shm_fd(conn, ring, fd, next, arg)			\
+	io_recv_shm_fd_((conn), (ring), (fd),				\
+			typesafe_cb_preargs(struct io_plan *, void *,	\
+					    (next), (arg), struct io_conn *), \
+			(arg))
+
+/* Blocking versions, for use outside io_loop (compare wire_sync). */
+u8 *shm_sync_read(const tal_t *ctx, struct shm_ring *ring);
+bool shm_sync_write(struct shm_ring *ring, const u8 *msg TAKES);
+/* Send any queued fds, blocking. */
+bool shm_sync_flush_fds(struct shm_ring *ring);
+
+#endif /* LIGHTNING_LIGHTNINGD_SHM_RING_H */
@@ -16,6 +16,48 @@
 static int status_fd = -1;
 static struct daemon_conn *status_conn;
 const void *trc;
+bool status_trace_enabled = true;
+
+void status_set_level(enum log_level level)
+{
+	status_trace_enabled = (level <= LOG_DBG);
+}
+
+u8 *towire_status_level(const tal_t *ctx, enum log_level level)
+{
+	u8 *msg = tal_arr(ctx, u8, 0);
+	towire_u16(&msg, STATUS_LEVEL);
+	towire_u32(&msg, level);
+	return msg;
+}
+
+bool status_level_in(const struct daemon_conn *dc, const u8 *msg)
+{
+	const u8 *cursor = msg;
+	size_t max = tal_len(msg);
+	u32 level;
+
+	if ((dc && dc != status_conn)
+	    || fromwire_u16(&cursor, &max) != STATUS_LEVEL)
+		return false;
+
+	level = fromwire_u32(&cursor, &max);
+	/* Let the daemon complain about it as an unknown message. */
+	if (!cursor)
+		return false;
+	status_set_level(level);
+	return true;
+}
+
+u8 *status_sync_read(const tal_t *ctx, int fd)
+{
+	u8 *msg;
+
+	while ((msg = wire_sync_read(ctx, fd)) != NULL
+	       && status_level_in(NULL, msg))
+		tal_free(msg);
+	return msg;
+}
 
 void status_setup_sync(int fd)
 {
@@ -72,7 +114,7 @@ static void status_send_with_hdr(u16 type, const void *p, size_t len)
 	}
 }
 
-void status_trace(const char *fmt, ...)
+void status_trace_(const char *fmt, ...)
 {
 	va_list ap;
 	char *str;
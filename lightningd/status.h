@@ -3,6 +3,9 @@
 #include "config.h"
 #include <ccan/compiler/compiler.h>
 #include <ccan/short_types/short_types.h>
+#include <ccan/tal/tal.h>
+#include <daemon/log.h>
+#include <stdbool.h>
 #include <stdlib.h>
 
 struct daemon_conn;
@@ -20,10 +23,37 @@ extern const void *trc;
 /* Failure codes always have high bit set. */
 #define STATUS_FAIL 0x8000
 
+/* From lightningd: the lowest log level it keeps (u32 after the type). */
+#define STATUS_LEVEL 0x7FFE
+
+u8 *towire_status_level(const tal_t *ctx, enum log_level level);
+
+/* At startup, lightningd tells us its level on the commandline (or when
+ * it hands a prespawned daemon its fds). */
+void status_set_level(enum log_level level);
+
+/* If @msg is a STATUS_LEVEL which came from lightningd, act on it and
+ * return true.  @dc is the connection it came in on (only the one given
+ * to status_setup_async counts), or NULL if the caller read it
+ * synchronously from lightningd. */
+bool status_level_in(const struct daemon_conn *dc, const u8 *msg);
+
+/* wire_sync_read() from lightningd, acting on any STATUS_LEVEL first. */
+u8 *status_sync_read(const tal_t *ctx, int fd);
+
 /* Send a message (frees the message). */
 void status_send_sync(const u8 *msg);
-/* Send a printf-style debugging trace. */
-void status_trace(const char *fmt, ...) PRINTF_FMT(1,2);
+/* Set if lightningd is keeping traces (LOG_DBG), see status_set_level. */
+extern bool status_trace_enabled;
+
+/* Send a printf-style debugging trace.  Arguments are only evaluated if
+ * traces are enabled, so it's cheap to trace expensive formatting. */
+#define status_trace(...)				\
+	do {						\
+		if (status_trace_enabled)		\
+			status_trace_(__VA_ARGS__);	\
+	} while (0)
+void status_trace_(const char *fmt, ...) PRINTF_FMT(1,2);
 /* Send a failure status code with printf-style msg, and exit. */
 void status_failed(u16 code, const char *fmt, ...) PRINTF_FMT(2,3) NORETURN;
 
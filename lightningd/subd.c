@@ -1,33 +1,62 @@
+#include <ccan/array_size/array_size.h>
+#include <ccan/fdpass/fdpass.h>
 #include <ccan/io/fdpass/fdpass.h>
 #include <ccan/io/io.h>
 #include <ccan/mem/mem.h>
 #include <ccan/noerr/noerr.h>
+#include <ccan/read_write_all/read_write_all.h>
+#include <ccan/str/str.h>
 #include <ccan/take/take.h>
 #include <ccan/tal/path/path.h>
 #include <ccan/tal/str/str.h>
 #include <daemon/log.h>
+#include <daemon/timeout.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <lightningd/lightningd.h>
+#include <lightningd/shm_ring.h>
 #include <lightningd/status.h>
 #include <lightningd/subd.h>
 #include <stdarg.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <wire/wire.h>
 #include <wire/wire_io.h>
+#include <wire/wire_sync.h>
 
 static bool move_fd(int from, int to)
 {
+	/* dup2 would do nothing, then we'd close it! */
+	if (from == to)
+		return true;
 	if (dup2(from, to) == -1)
 		return false;
 	close(from);
 	return true;
 }
 
+/* Where the child's fds go: 3 up for the extra fds, then dev_disconnect at
+ * 101 and the shm transport fds after it.  Above all those is clear. */
+#define SUBD_FD_CLEAR (102 + SHM_RING_NUM_FDS)
+
+/* Dup fd above every place we'll move fds to, so moving them can't
+ * clobber one we haven't moved yet.  close_fds_except() gets the old one. */
+static bool dup_clear(int *fd)
+{
+	int newfd = fcntl(*fd, F_DUPFD, SUBD_FD_CLEAR);
+
+	if (newfd < 0)
+		return false;
+	*fd = newfd;
+	return true;
+}
+
 struct subd_req {
 	struct list_node list;
 
@@ -37,6 +66,11 @@ struct subd_req {
 	void *replycb_data;
 
 	size_t num_reply_fds;
+
+	/* For subd_req_id: the reply has to carry this. */
+	bool has_reqid;
+	u64 reqid;
+
 	/* If non-NULL, this is here to disable replycb */
 	void *disabler;
 };
@@ -69,6 +103,7 @@ static void disable_cb(void *disabler, struct subd_req *sr)
 
 static void add_req(const tal_t *ctx,
 		    struct subd *sd, int type, size_t num_fds_in,
+		    const u64 *reqid,
 		    bool (*replycb)(struct subd *, const u8 *, const int *,
 				    void *),
 		    void *replycb_data)
@@ -76,6 +111,8 @@ static void add_req(const tal_t *ctx,
 	struct subd_req *sr = tal(sd, struct subd_req);
 
 	sr->type = type;
+	sr->has_reqid = (reqid != NULL);
+	sr->reqid = reqid ? *reqid : 0;
 	sr->replycb = replycb;
 	sr->replycb_data = replycb_data;
 	sr->num_reply_fds = num_fds_in;
@@ -90,17 +127,31 @@ static void add_req(const tal_t *ctx,
 		sr->disabler = NULL;
 	assert(strends(sd->msgname(sr->type + SUBD_REPLY_OFFSET), "_REPLY"));
 
-	/* Keep in FIFO order: we sent in order, so replies will be too. */
+	/* Keep in FIFO order: we sent in order, so replies will be too
+	 * (except for those with reqids, which we match by id). */
 	list_add_tail(&sd->reqs, &sr->list);
 	tal_add_destructor(sr, free_subd_req);
 }
 
+/* Does this msg carry this reqid as its first field? */
+static bool msg_has_reqid(const u8 *msg, u64 reqid)
+{
+	const u8 *cursor = msg + sizeof(be16);
+	size_t max = tal_count(msg) - sizeof(be16);
+	u64 id = fromwire_u64(&cursor, &max);
+
+	return cursor && id == reqid;
+}
+
 /* Caller must free. */
-static struct subd_req *get_req(struct subd *sd, int reply_type)
+static struct subd_req *get_req(struct subd *sd, int reply_type,
+				const u8 *msg)
 {
 	struct subd_req *sr;
 
 	list_for_each(&sd->reqs, sr, list) {
+		if (sr->has_reqid && !msg_has_reqid(msg, sr->reqid))
+			continue;
 		if (sr->type + SUBD_REPLY_OFFSET == reply_type)
 			return sr;
 		/* If it's a fail, and that's a valid type. */
@@ -114,12 +165,75 @@ static struct subd_req *get_req(struct subd *sd, int reply_type)
 }
 
 /* We use sockets, not pipes, because fds are bidir. */
+static bool keep_fd(int fd, const int *keep, size_t num_keep)
+{
+	size_t i;
+
+	for (i = 0; i < num_keep; i++)
+		if (keep[i] == fd)
+			return true;
+	return false;
+}
+
+/* Close all fds >= from, except those in keep[] (ascending). */
+static void close_fds_except(int from, const int *keep, size_t num_keep)
+{
+	DIR *dir;
+	struct dirent *d;
+	int *fds, fd;
+	size_t i, n;
+	long max;
+
+#ifdef SYS_close_range
+	/* Linux >= 5.9 does it in one syscall per gap. */
+	for (i = 0; i <= num_keep; i++) {
+		int to = (i == num_keep) ? INT_MAX : keep[i] - 1;
+		if (to >= from && syscall(SYS_close_range, from, to, 0) != 0)
+			break;
+		if (i < num_keep)
+			from = keep[i] + 1;
+	}
+	if (i > num_keep)
+		return;
+#endif
+
+	/* Otherwise only close what's actually open, rather than trying
+	 * every possible fd up to the rlimit. */
+	dir = opendir("/proc/self/fd");
+	if (dir) {
+		fds = tal_arr(NULL, int, 0);
+		while ((d = readdir(dir)) != NULL) {
+			if (!cisdigit(d->d_name[0]))
+				continue;
+			fd = atoi(d->d_name);
+			if (fd < from || fd == dirfd(dir)
+			    || keep_fd(fd, keep, num_keep))
+				continue;
+			n = tal_count(fds);
+			tal_resize(&fds, n + 1);
+			fds[n] = fd;
+		}
+		closedir(dir);
+		for (i = 0; i < tal_count(fds); i++)
+			close(fds[i]);
+		tal_free(fds);
+		return;
+	}
+
+	/* Make (fairly!) sure all other fds are closed. */
+	max = sysconf(_SC_OPEN_MAX);
+	for (fd = from; fd < max; fd++)
+		if (!keep_fd(fd, keep, num_keep))
+			close(fd);
+}
+
 static int subd(const char *dir, const char *name, const char *debug_subdaemon,
-		int *msgfd, int dev_disconnect_fd, va_list *ap)
+		int *msgfd, int dev_disconnect_fd, int *shmfds,
+		enum log_level level, bool prespawn, va_list *ap)
 {
 	int childmsg[2], execfail[2];
 	pid_t childpid;
-	int err, *fd;
+	int err, *fd, i;
 	bool debug = debug_subdaemon && strends(name, debug_subdaemon);
 
 	if (socketpair(AF_LOCAL, SOCK_STREAM, 0, childmsg) != 0)
@@ -137,9 +251,10 @@ static int subd(const char *dir, const char *name, const char *debug_subdaemon,
 		goto close_execfail_fail;
 
 	if (childpid == 0) {
-		int fdnum = 3, i;
-		long max;
-		const char *debug_arg[2] = { NULL, NULL };
+		int fdnum = 3;
+		int keep[1 + SHM_RING_NUM_FDS];
+		const char *debug_arg[5] = { NULL, NULL, NULL, NULL, NULL };
+		size_t num_args = 0, num_keep = 0;
 
 		close(childmsg[0]);
 		close(execfail[0]);
@@ -150,6 +265,29 @@ static int subd(const char *dir, const char *name, const char *debug_subdaemon,
 				goto child_errno_fail;
 		}
 
+		// Out of the way of everything, before we move any of it.
+		if (dev_disconnect_fd != -1 && !dup_clear(&dev_disconnect_fd))
+			goto child_errno_fail;
+		if (shmfds) {
+			for (i = 0; i < SHM_RING_NUM_FDS; i++)
+				if (!dup_clear(&shmfds[i]))
+					goto child_errno_fail;
+		}
+		if (ap) {
+			va_list ap2;
+
+			va_copy(ap2, *ap);
+			while ((fd = va_arg(ap2, int *)) != NULL) {
+				/* If this were stdin, dup2 closed! */
+				assert(*fd != STDIN_FILENO);
+				if (!dup_clear(fd)) {
+					va_end(ap2);
+					goto child_errno_fail;
+				}
+			}
+			va_end(ap2);
+		}
+
 		// Move dev_disconnect_fd out the way.
 		if (dev_disconnect_fd != -1) {
 			if (!move_fd(dev_disconnect_fd, 101))
@@ -157,28 +295,45 @@ static int subd(const char *dir, const char *name, const char *debug_subdaemon,
 			dev_disconnect_fd = 101;
 		}
 
+		// And shm transport fds out past that.
+		if (shmfds) {
+			for (i = 0; i < SHM_RING_NUM_FDS; i++) {
+				if (!move_fd(shmfds[i], 102 + i))
+					goto child_errno_fail;
+				shmfds[i] = 102 + i;
+			}
+		}
+
 		/* Dup any extra fds up first. */
 		if (ap) {
 			while ((fd = va_arg(*ap, int *)) != NULL) {
-				/* If this were stdin, dup2 closed! */
-				assert(*fd != STDIN_FILENO);
 				if (!move_fd(*fd, fdnum))
 					goto child_errno_fail;
 				fdnum++;
 			}
 		}
 
-		/* Make (fairly!) sure all other fds are closed. */
-		max = sysconf(_SC_OPEN_MAX);
-		for (i = fdnum; i < max; i++)
-			if (i != dev_disconnect_fd)
-				close(i);
+		/* Close all other fds. */
+		if (dev_disconnect_fd != -1)
+			keep[num_keep++] = dev_disconnect_fd;
+		if (shmfds) {
+			for (i = 0; i < SHM_RING_NUM_FDS; i++)
+				keep[num_keep++] = shmfds[i];
+		}
+		close_fds_except(fdnum, keep, num_keep);
 
+		debug_arg[num_args++] = tal_fmt(NULL, "--log-level=%u", level);
 		if (dev_disconnect_fd != -1)
-			debug_arg[0] = tal_fmt(NULL, "--dev-disconnect=%i", dev_disconnect_fd);
+			debug_arg[num_args++] = tal_fmt(NULL, "--dev-disconnect=%i", dev_disconnect_fd);
+		if (shmfds)
+			debug_arg[num_args++] = shm_ring_arg(NULL, shmfds);
+		if (prespawn)
+			debug_arg[num_args++] = "--prespawned";
 		if (debug)
-			debug_arg[debug_arg[0] ? 1 : 0] = "--debugger";
-		execl(path_join(NULL, dir, name), name, debug_arg[0], debug_arg[1], NULL);
+			debug_arg[num_args++] = "--debugger";
+		execl(path_join(NULL, dir, name), name,
+		      debug_arg[0], debug_arg[1], debug_arg[2], debug_arg[3],
+		      debug_arg[4], NULL);
 
 	child_errno_fail:
 		err = errno;
@@ -192,6 +347,11 @@ static int subd(const char *dir, const char *name, const char *debug_subdaemon,
 	close(childmsg[1]);
 	close(execfail[1]);
 
+	if (shmfds) {
+		for (i = 0; i < SHM_RING_NUM_FDS; i++)
+			close(shmfds[i]);
+	}
+
 	if (ap) {
 		while ((fd = va_arg(*ap, int *)) != NULL) {
 			if (taken(fd)) {
@@ -219,6 +379,10 @@ close_msgfd_fail:
 	close_noerr(childmsg[0]);
 	close_noerr(childmsg[1]);
 fail:
+	if (shmfds) {
+		for (i = 0; i < SHM_RING_NUM_FDS; i++)
+			close_noerr(shmfds[i]);
+	}
 	return -1;
 }
 
@@ -227,8 +391,10 @@ int subd_raw(struct lightningd *ld, const char *name)
 	pid_t pid;
 	int msg_fd;
 
+	/* The HSM has no peer to disconnect. */
 	pid = subd(ld->daemon_dir, name, ld->dev_debug_subdaemon,
-		   &msg_fd, ld->dev_disconnect_fd, NULL);
+		   &msg_fd, -1, NULL, log_min_level(ld->dstate.log_book),
+		   false, NULL);
 	if (pid == (pid_t)-1) {
 		log_unusual(ld->log, "subd %s failed: %s",
 			    name, strerror(errno));
@@ -240,6 +406,14 @@ int subd_raw(struct lightningd *ld, const char *name)
 
 static struct io_plan *sd_msg_read(struct io_conn *conn, struct subd *sd);
 
+static struct io_plan *sd_read_next(struct io_conn *conn, struct subd *sd)
+{
+	if (sd->ring)
+		return io_read_shm(conn, sd->ring, sd, &sd->msg_in,
+				   sd_msg_read, sd);
+	return io_read_wire(conn, sd, &sd->msg_in, sd_msg_read, sd);
+}
+
 static struct io_plan *sd_msg_reply(struct io_conn *conn, struct subd *sd,
 				    struct subd_req *sr)
 {
@@ -269,7 +443,7 @@ static struct io_plan *sd_msg_reply(struct io_conn *conn, struct subd *sd,
 	sd->conn = conn;
 	/* Free any fd array. */
 	sd->fds_in = tal_free(sd->fds_in);
-	return io_read_wire(conn, sd, &sd->msg_in, sd_msg_read, sd);
+	return sd_read_next(conn, sd);
 }
 
 static struct io_plan *read_fds(struct io_conn *conn, struct subd *sd)
@@ -282,6 +456,10 @@ static struct io_plan *read_fds(struct io_conn *conn, struct subd *sd)
 			io_fd_block(sd->fds_in[i], true);
 		return sd_msg_read(conn, sd);
 	}
+	if (sd->ring)
+		return io_recv_shm_fd(conn, sd->ring,
+				      &sd->fds_in[sd->num_fds_in_read++],
+				      read_fds, sd);
 	return io_recv_fd(conn, &sd->fds_in[sd->num_fds_in_read++],
 			  read_fds, sd);
 }
@@ -309,7 +487,7 @@ static struct io_plan *sd_msg_read(struct io_conn *conn, struct subd *sd)
 	}
 
 	/* First, check for replies. */
-	sr = get_req(sd, type);
+	sr = get_req(sd, type, sd->msg_in);
 	if (sr) {
 		if (sr->num_reply_fds && sd->fds_in == NULL)
 			return sd_collect_fds(conn, sd, sr->num_reply_fds);
@@ -352,13 +530,15 @@ static struct io_plan *sd_msg_read(struct io_conn *conn, struct subd *sd)
 	sd->msg_in = NULL;
 	sd->fds_in = tal_free(sd->fds_in);
 	tal_free(tmpctx);
-	return io_read_wire(conn, sd, &sd->msg_in, sd_msg_read, sd);
+	return sd_read_next(conn, sd);
 }
 
 static void destroy_subd(struct subd *sd)
 {
 	int status;
 
+	list_del_init(&sd->list);
+
 	switch (waitpid(sd->pid, &status, WNOHANG)) {
 	case 0:
 		log_debug(sd->log, "Status closed, but not exited. Killing");
@@ -383,9 +563,16 @@ static void destroy_subd(struct subd *sd)
 
 static struct io_plan *msg_send_next(struct io_conn *conn, struct subd *sd)
 {
-	const u8 *msg = msg_dequeue(&sd->outq);
+	const u8 *msg;
 	int fd;
 
+	/* Drained enough to send non-urgent messages again? */
+	while (!msg_queue_full(&sd->outq)
+	       && (msg = msg_dequeue(&sd->deferq)) != NULL)
+		msg_enqueue(&sd->outq, take(msg));
+
+	msg = msg_dequeue(&sd->outq);
+
 	/* Nothing to do?  Wait for msg_enqueue. */
 	if (!msg)
 		return msg_queue_wait(conn, &sd->outq, msg_send_next, sd);
@@ -393,16 +580,147 @@ static struct io_plan *msg_send_next(struct io_conn *conn, struct subd *sd)
 	fd = msg_extract_fd(msg);
 	if (fd >= 0) {
 		tal_free(msg);
+		if (sd->ring) {
+			/* Goes over the socket, after the message it's for. */
+			shm_ring_send_fd(sd->ring, fd);
+			return msg_send_next(conn, sd);
+		}
 		return io_send_fd(conn, fd, true, msg_send_next, sd);
 	}
+	if (sd->ring)
+		return io_write_shm(conn, sd->ring, take(msg),
+				    msg_send_next, sd);
 	return io_write_wire(conn, take(msg), msg_send_next, sd);
 }
 
 static struct io_plan *msg_setup(struct io_conn *conn, struct subd *sd)
 {
-	return io_duplex(conn,
-			 io_read_wire(conn, sd, &sd->msg_in, sd_msg_read, sd),
-			 msg_send_next(conn, sd));
+	return io_duplex(conn, sd_read_next(conn, sd), msg_send_next(conn, sd));
+}
+
+/* These are spawned per-peer, so worth keeping some ready. */
+static const char *prespawn_names[] = {
+	"lightningd_opening",
+	"lightningd_channel",
+	"lightningd_closing",
+	"lightningd_onchain"
+};
+
+/* A subdaemon we exec'd in advance; it's waiting in subdaemon_debug()
+ * for the fds new_subd() would have given it on the commandline. */
+struct prespawned {
+	struct list_node list;
+	const char *name;
+	pid_t pid;
+	int msg_fd;
+};
+
+static void destroy_prespawned(struct prespawned *p)
+{
+	list_del(&p->list);
+	if (p->pid != -1) {
+		kill(p->pid, SIGKILL);
+		waitpid(p->pid, NULL, 0);
+	}
+	if (p->msg_fd != -1)
+		close(p->msg_fd);
+}
+
+static size_t num_prespawned(struct lightningd *ld, const char *name)
+{
+	struct prespawned *p;
+	size_t n = 0;
+
+	list_for_each(&ld->prespawned, p, list)
+		n += streq(p->name, name);
+	return n;
+}
+
+static struct prespawned *take_prespawned(struct lightningd *ld,
+					  const char *name)
+{
+	struct prespawned *p;
+
+	list_for_each(&ld->prespawned, p, list) {
+		if (streq(p->name, name))
+			return p;
+	}
+	return NULL;
+}
+
+/* Tell it how many fds and the log level now, then send the fds; false
+ * if it's gone. */
+static bool send_prespawned_fds(int msg_fd, enum log_level level, va_list *ap)
+{
+	va_list ap2;
+	int *fd;
+	u8 num = 0, lvl = level;
+	bool ok = true;
+
+	va_copy(ap2, *ap);
+	while (va_arg(ap2, int *) != NULL)
+		num++;
+	va_end(ap2);
+
+	if (!write_all(msg_fd, &num, sizeof(num))
+	    || !write_all(msg_fd, &lvl, sizeof(lvl)))
+		return false;
+
+	va_copy(ap2, *ap);
+	while (ok && (fd = va_arg(ap2, int *)) != NULL)
+		ok = fdpass_send(msg_fd, *fd);
+	va_end(ap2);
+	if (!ok)
+		return false;
+
+	/* Same as subd() would do. */
+	while ((fd = va_arg(*ap, int *)) != NULL) {
+		if (taken(fd)) {
+			close(*fd);
+			*fd = -1;
+		}
+	}
+	return true;
+}
+
+static void prespawn_subds(struct lightningd *ld)
+{
+	size_t i;
+
+	ld->prespawn_timer = NULL;
+	for (i = 0; i < ARRAY_SIZE(prespawn_names); i++) {
+		const char *name = prespawn_names[i];
+
+		if (ld->dev_shm_subdaemon && strends(name, ld->dev_shm_subdaemon))
+			continue;
+
+		while (num_prespawned(ld, name) < ld->num_prespawn) {
+			struct prespawned *p = tal(ld, struct prespawned);
+			p->name = name;
+			p->pid = subd(ld->daemon_dir, name,
+				      ld->dev_debug_subdaemon, &p->msg_fd,
+				      ld->dev_disconnect_fd, NULL,
+				      log_min_level(ld->dstate.log_book),
+				      true, NULL);
+			if (p->pid == (pid_t)-1) {
+				log_unusual(ld->log, "prespawn %s failed: %s",
+					    name, strerror(errno));
+				tal_free(p);
+				break;
+			}
+			list_add_tail(&ld->prespawned, &p->list);
+			tal_add_destructor(p, destroy_prespawned);
+		}
+	}
+}
+
+void subd_prespawn(struct lightningd *ld)
+{
+	/* Don't do it now: we're probably about to use the one we took. */
+	if (ld->num_prespawn && !ld->prespawn_timer)
+		ld->prespawn_timer = new_reltimer(&ld->dstate.timers, ld,
+						  time_from_msec(0),
+						  prespawn_subds, ld);
 }
 
 struct subd *new_subd(const tal_t *ctx,
@@ -417,15 +735,46 @@ struct subd *new_subd(const tal_t *ctx,
 {
 	va_list ap;
 	struct subd *sd = tal(ctx, struct subd);
-	int msg_fd;
+	int msg_fd, shmfds[SHM_RING_NUM_FDS];
+
+	sd->ring = NULL;
+	if (ld->dev_shm_subdaemon && strends(name, ld->dev_shm_subdaemon)) {
+		sd->ring = new_shm_ring(sd, shmfds);
+		if (!sd->ring)
+			log_unusual(ld->log, "subd %s shm transport failed: %s",
+				    name, strerror(errno));
+	}
 
 	va_start(ap, finished);
-	sd->pid = subd(ld->daemon_dir, name, ld->dev_debug_subdaemon,
-		       &msg_fd, ld->dev_disconnect_fd, &ap);
+	sd->pid = -1;
+	if (!sd->ring) {
+		struct prespawned *p = take_prespawned(ld, name);
+		if (p) {
+			if (send_prespawned_fds(p->msg_fd,
+						log_min_level(ld->dstate.log_book),
+						&ap)) {
+				sd->pid = p->pid;
+				msg_fd = p->msg_fd;
+				/* It's ours now: don't kill it. */
+				p->pid = -1;
+				p->msg_fd = -1;
+			}
+			tal_free(p);
+			subd_prespawn(ld);
+		}
+	}
+	if (sd->pid == (pid_t)-1)
+		sd->pid = subd(ld->daemon_dir, name, ld->dev_debug_subdaemon,
+			       &msg_fd, ld->dev_disconnect_fd,
+			       sd->ring ? shmfds : NULL,
+			       log_min_level(ld->dstate.log_book), false, &ap);
 	va_end(ap);
 	if (sd->pid == (pid_t)-1) {
 		log_unusual(ld->log, "subd %s failed: %s",
 			    name, strerror(errno));
+		/* No conn owns our bell yet: the ring only closes theirs. */
+		if (sd->ring)
+			close(shm_ring_bellfd(sd->ring));
 		return tal_free(sd);
 	}
 	sd->ld = ld;
@@ -436,12 +785,21 @@ struct subd *new_subd(const tal_t *ctx,
 	sd->msgcb = msgcb;
 	sd->fds_in = NULL;
 	msg_queue_init(&sd->outq, sd);
+	msg_queue_set_watermarks(&sd->outq, ld->queue_hiwat, ld->queue_lowat);
+	msg_queue_init(&sd->deferq, sd);
 	tal_add_destructor(sd, destroy_subd);
+	list_add_tail(&ld->subds, &sd->list);
 	list_head_init(&sd->reqs);
+	sd->next_reqid = 0;
 	sd->peer = peer;
 
 	/* conn actually owns daemon: we die when it does. */
-	sd->conn = io_new_conn(ctx, msg_fd, msg_setup, sd);
+	if (sd->ring) {
+		sd->conn = io_new_conn(ctx, shm_ring_bellfd(sd->ring),
+				       msg_setup, sd);
+		shm_ring_start(sd->ring, msg_fd, sd->conn);
+	} else
+		sd->conn = io_new_conn(ctx, msg_fd, msg_setup, sd);
 	tal_steal(sd->conn, sd);
 
 	log_info(sd->log, "pid %u, msgfd %i", sd->pid, msg_fd);
@@ -454,6 +812,30 @@ void subd_send_msg(struct subd *sd, const u8 *msg_out)
 	msg_enqueue(&sd->outq, msg_out);
 }
 
+void subd_log_level_changed(struct lightningd *ld)
+{
+	enum log_level level = log_min_level(ld->dstate.log_book);
+	struct subd *sd;
+
+	list_for_each(&ld->subds, sd, list)
+		subd_send_msg(sd, take(towire_status_level(NULL, level)));
+
+	/* We only talk to the HSM synchronously: it doesn't reply to this. */
+	if (ld->hsm_fd != -1
+	    && !wire_sync_write(ld->hsm_fd, take(towire_status_level(NULL,
+								      level))))
+		fatal("Could not write to HSM: %s", strerror(errno));
+}
+
+void subd_send_msg_nonurgent(struct subd *sd, const u8 *msg_out)
+{
+	/* Keep them in order behind any already deferred. */
+	if (msg_queue_full(&sd->outq) || msg_queue_length(&sd->deferq))
+		msg_enqueue(&sd->deferq, msg_out);
+	else
+		msg_enqueue(&sd->outq, msg_out);
+}
+
 void subd_send_fd(struct subd *sd, int fd)
 {
 	msg_enqueue_fd(&sd->outq, fd);
@@ -473,7 +855,32 @@ void subd_req_(const tal_t *ctx,
 	if (fd_out >= 0)
 		subd_send_fd(sd, fd_out);
 
-	add_req(ctx, sd, type, num_fds_in, replycb, replycb_data);
+	add_req(ctx, sd, type, num_fds_in, NULL, replycb, replycb_data);
+}
+
+u64 subd_next_reqid(struct subd *sd)
+{
+	return sd->next_reqid++;
+}
+
+void subd_req_id_(const tal_t *ctx,
+		  struct subd *sd,
+		  const u8 *msg_out,
+		  u64 reqid,
+		  int fd_out, size_t num_fds_in,
+		  bool (*replycb)(struct subd *, const u8 *, const int *,
+				  void *),
+		  void *replycb_data)
+{
+	/* Grab type now in case msg_out is taken() */
+	int type = fromwire_peektype(msg_out);
+
+	assert(msg_has_reqid(msg_out, reqid));
+	subd_send_msg(sd, msg_out);
+	if (fd_out >= 0)
+		subd_send_fd(sd, fd_out);
+
+	add_req(ctx, sd, type, num_fds_in, &reqid, replycb, replycb_data);
 }
 
 void subd_shutdown(struct subd *sd, unsigned int seconds)
@@ -484,8 +891,9 @@ void subd_shutdown(struct subd *sd, unsigned int seconds)
 
 	log_debug(sd->log, "Shutting down");
 
-	/* No finished callback any more. */
+	/* No finished callback any more, nor log levels. */
 	sd->finished = NULL;
+	list_del_init(&sd->list);
 	/* Don't free sd when we close connection manually. */
 	tal_steal(sd->ld, sd);
 	/* Close connection: should begin shutdown now. */
@@ -508,6 +916,16 @@ char *opt_subd_debug(const char *optarg, struct lightningd *ld)
 	return NULL;
 }
 
+char *opt_subd_shm_transport(const char *optarg, struct lightningd *ld)
+{
+	/* Others still use the socket directly for sync requests. */
+	if (!strends("lightningd_channel", optarg))
+		return tal_fmt(ld, "--dev-shm-transport only supports"
+			       " lightningd_channel, not %s", optarg);
+	ld->dev_shm_subdaemon = optarg;
+	return NULL;
+}
+
 char *opt_subd_dev_disconnect(const char *optarg, struct lightningd *ld)
 {
 	ld->dev_disconnect_fd = open(optarg, O_RDONLY);
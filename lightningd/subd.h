@@ -8,6 +8,7 @@
 #include <lightningd/msg_queue.h>
 
 struct io_conn;
+struct shm_ring;
 
 /* By convention, replies are requests + 100 */
 #define SUBD_REPLY_OFFSET 100
@@ -20,10 +21,14 @@ struct subd {
 	const char *name;
 	/* The Big Cheese. */
 	struct lightningd *ld;
+	/* In ld->subds. */
+	struct list_node list;
 	/* pid, for waiting for status when it dies. */
 	int pid;
 	/* Connection. */
 	struct io_conn *conn;
+	/* If non-NULL, messages go via shared memory, not conn's socket. */
+	struct shm_ring *ring;
 
 	/* If we are associated with a single peer, this points to it. */
 	struct peer *peer;
@@ -46,8 +51,14 @@ struct subd {
 	/* Messages queue up here. */
 	struct msg_queue outq;
 
+	/* Non-urgent messages wait here while outq is full. */
+	struct msg_queue deferq;
+
 	/* Callbacks for replies. */
 	struct list_head reqs;
+
+	/* Next id for subd_req_id. */
+	u64 next_reqid;
 };
 
 /**
@@ -81,6 +92,15 @@ struct subd *new_subd(const tal_t *ctx,
  */
 int subd_raw(struct lightningd *ld, const char *name);
 
+/**
+ * subd_prespawn - top up the pool of waiting per-peer subdaemons.
+ * @ld: global state
+ *
+ * new_subd() hands these their fds instead of fork+exec'ing a new one,
+ * and calls this again.  The pool holds ld->num_prespawn of each.
+ */
+void subd_prespawn(struct lightningd *ld);
+
 /**
  * subd_send_msg - queue a message to the subdaemon.
  * @sd: subdaemon to request
@@ -88,6 +108,24 @@ int subd_raw(struct lightningd *ld, const char *name);
  */
 void subd_send_msg(struct subd *sd, const u8 *msg_out);
 
+/**
+ * subd_log_level_changed - tell every subdaemon our new log level.
+ * @ld: global state
+ *
+ * They only make traces if log_min_level() of our log book wants them.
+ */
+void subd_log_level_changed(struct lightningd *ld);
+
+/**
+ * subd_send_msg_nonurgent - queue a message which can wait.
+ * @sd: subdaemon to request
+ * @msg_out: message (can be take)
+ *
+ * If the subdaemon isn't keeping up, this is held until it drains to the
+ * low watermark.  It may be overtaken by subd_send_msg messages.
+ */
+void subd_send_msg_nonurgent(struct subd *sd, const u8 *msg_out);
+
 /**
  * subd_send_fd - queue a file descriptor to pass to the subdaemon.
  * @sd: subdaemon to request
@@ -123,6 +161,38 @@ void subd_req_(const tal_t *ctx,
 	       bool (*replycb)(struct subd *, const u8 *, const int *, void *),
 	       void *replycb_data);
 
+/**
+ * subd_next_reqid - get a fresh request id for subd_req_id.
+ * @sd: subdaemon to request
+ */
+u64 subd_next_reqid(struct subd *sd);
+
+/**
+ * subd_req_id - queue a request which carries a request id.
+ * @reqid: from subd_next_reqid(), and the first field of @msg_out.
+ *
+ * As subd_req, but the reply (or replyfail) must carry @reqid as its
+ * first field: replies are matched on it, rather than by order, so the
+ * subdaemon can answer these in any order.
+ */
+#define subd_req_id(ctx, sd, msg_out, reqid, fd_out, num_fds_in,	\
+		    replycb, replycb_data)				\
+	subd_req_id_((ctx), (sd), (msg_out), (reqid), (fd_out),		\
+		     (num_fds_in),					\
+		     typesafe_cb_preargs(bool, void *,			\
+					 (replycb), (replycb_data),	\
+					 struct subd *,			\
+					 const u8 *, const int *),	\
+		     (replycb_data))
+void subd_req_id_(const tal_t *ctx,
+		  struct subd *sd,
+		  const u8 *msg_out,
+		  u64 reqid,
+		  int fd_out, size_t num_fds_in,
+		  bool (*replycb)(struct subd *, const u8 *, const int *,
+				  void *),
+		  void *replycb_data);
+
 /**
  * subd_shutdown - try to politely shut down a subdaemon.
  * @subd: subd to shutdown.
@@ -134,6 +204,7 @@ void subd_req_(const tal_t *ctx,
 void subd_shutdown(struct subd *subd, unsigned int seconds);
 
 char *opt_subd_debug(const char *optarg, struct lightningd *ld);
+char *opt_subd_shm_transport(const char *optarg, struct lightningd *ld);
 char *opt_subd_dev_disconnect(const char *optarg, struct lightningd *ld);
 
 bool dev_disconnect_permanent(struct lightningd *ld);
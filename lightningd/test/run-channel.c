@@ -1,5 +1,6 @@
  #include <lightningd/status.h>
  #include <stdio.h>
+#undef status_trace
 #define status_trace(fmt , ...) \
 	printf(fmt "\n" , ## __VA_ARGS__)
 
@@ -36,6 +36,7 @@ static void do_write(const void *buf, size_t len)
 #define io_write(conn, p, len, next, arg) \
 	(do_write((p), (len)), (next)((conn), (arg)), NULL)
 
+#undef status_trace
 #define status_trace(fmt, ...) \
 	printf(fmt "\n", __VA_ARGS__)
 
@@ -0,0 +1,88 @@
+#include "../msg_queue.c"
+#include <stdio.h>
+#include <utils.h>
+
+static u8 *make_msg(const tal_t *ctx, u16 val)
+{
+	u8 *msg = tal_arr(ctx, u8, 0);
+	towire_u16(&msg, val);
+	return msg;
+}
+
+static bool check_msg(const u8 *msg, u16 val)
+{
+	bool ok = (fromwire_peektype(msg) == val);
+	tal_free(msg);
+	return ok;
+}
+
+int main(void)
+{
+	tal_t *ctx = tal_tmpctx(NULL);
+	struct msg_queue q;
+	const u8 *msg;
+	size_t i, n;
+
+	msg_queue_init(&q, ctx);
+	assert(!msg_dequeue(&q));
+	assert(msg_queue_length(&q) == 0);
+
+	/* Wrap around many times with a few in flight, never growing. */
+	for (i = 0; i < 1000; i++) {
+		msg_enqueue(&q, take(make_msg(ctx, i)));
+		if (i >= 5)
+			assert(check_msg(msg_dequeue(&q), i - 5));
+	}
+	assert(tal_count(q.q) == 8);
+	for (i = 1000 - 5; i < 1000; i++)
+		assert(check_msg(msg_dequeue(&q), i));
+	assert(!msg_dequeue(&q));
+
+	/* Grow while wrapped: order is preserved. */
+	for (i = 0; i < 6; i++)
+		msg_enqueue(&q, take(make_msg(ctx, i)));
+	assert(check_msg(msg_dequeue(&q), 0));
+	assert(check_msg(msg_dequeue(&q), 1));
+	for (i = 6; i < 100; i++)
+		msg_enqueue(&q, take(make_msg(ctx, i)));
+	assert(msg_queue_length(&q) == 98);
+	for (i = 2; i < 100; i++)
+		assert(check_msg(msg_dequeue(&q), i));
+	assert(!msg_dequeue(&q));
+
+	/* Non-taken messages are copied; fds are just messages too. */
+	msg = make_msg(ctx, 7);
+	msg_enqueue(&q, msg);
+	msg_enqueue_fd(&q, 3);
+	assert(check_msg(msg_dequeue(&q), 7));
+	assert(fromwire_peektype(msg) == 7);
+	msg = msg_dequeue(&q);
+	assert(msg_extract_fd(msg) == 3);
+	tal_free(msg);
+
+	/* Never full without watermarks. */
+	assert(!msg_queue_full(&q));
+
+	/* Full at hiwat, until we drain to lowat. */
+	msg_queue_set_watermarks(&q, 10, 4);
+	for (n = 0; !msg_queue_full(&q); n++)
+		msg_enqueue(&q, take(make_msg(ctx, n)));
+	assert(n == 10);
+	/* Producer can still go past it if it has to. */
+	msg_enqueue(&q, take(make_msg(ctx, n++)));
+	for (i = 0; msg_queue_full(&q); i++)
+		assert(check_msg(msg_dequeue(&q), i));
+	assert(msg_queue_length(&q) == 4);
+	while ((msg = msg_dequeue(&q)) != NULL)
+		assert(check_msg(msg, i++));
+	assert(i == n);
+
+	/* Setting watermarks below current length makes it full. */
+	for (i = 0; i < 5; i++)
+		msg_enqueue(&q, take(make_msg(ctx, i)));
+	msg_queue_set_watermarks(&q, 3, 1);
+	assert(msg_queue_full(&q));
+
+	tal_free(ctx);
+	return 0;
+}
@@ -0,0 +1,134 @@
+#include "../shm_ring.c"
+#include <assert.h>
+#include <stdio.h>
+#include <utils.h>
+
+static u8 *make_msg(const tal_t *ctx, size_t len, u8 seed)
+{
+	u8 *msg = tal_arr(ctx, u8, len);
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		msg[i] = seed + i;
+	return msg;
+}
+
+static bool check_msg(const u8 *msg, size_t len, u8 seed)
+{
+	size_t i;
+
+	if (tal_count(msg) != len)
+		return false;
+	for (i = 0; i < len; i++)
+		if (msg[i] != (u8)(seed + i))
+			return false;
+	return true;
+}
+
+/* Has this eventfd been written to?  Resets it. */
+static bool bell_rang(int fd)
+{
+	u64 val;
+	return read(fd, &val, sizeof(val)) == sizeof(val);
+}
+
+int main(void)
+{
+	tal_t *ctx = tal_tmpctx(NULL);
+	int childfds[SHM_RING_NUM_FDS], sv[2];
+	char *argv[3];
+	struct shm_ring *master, *child;
+	size_t i, n;
+	u8 *msg;
+
+	master = new_shm_ring(ctx, childfds);
+	assert(master);
+	assert(socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) == 0);
+
+	/* Other side parses the argument we hand it. */
+	argv[0] = "test";
+	argv[1] = shm_ring_arg(ctx, childfds);
+	argv[2] = "--other";
+	assert(!shm_ring_from_argv(ctx, 1, argv, sv[1]));
+	child = shm_ring_from_argv(ctx, 3, argv, sv[1]);
+	assert(child);
+
+	/* Empty: consumer asks to be woken. */
+	assert(!shm_ring_get(ctx, child));
+	assert(!shm_ring_get(ctx, master));
+	assert(!bell_rang(shm_ring_bellfd(child)));
+
+	/* Each direction is separate, and consumer gets rung. */
+	assert(shm_ring_put(master, make_msg(ctx, 10, 1)));
+	assert(bell_rang(shm_ring_bellfd(child)));
+	assert(!bell_rang(shm_ring_bellfd(master)));
+	assert(!shm_ring_get(ctx, master));
+	msg = shm_ring_get(ctx, child);
+	assert(check_msg(msg, 10, 1));
+	assert(!shm_ring_get(ctx, child));
+
+	msg = make_msg(ctx, 0, 0);
+	assert(shm_ring_put(child, msg));
+	assert(bell_rang(shm_ring_bellfd(master)));
+	msg = shm_ring_get(ctx, master);
+	assert(msg && tal_count(msg) == 0);
+
+	/* No bell if consumer isn't waiting. */
+	assert(shm_ring_put(master, make_msg(ctx, 1, 2)));
+	assert(bell_rang(shm_ring_bellfd(child)));
+	assert(shm_ring_put(master, make_msg(ctx, 1, 3)));
+	assert(!bell_rang(shm_ring_bellfd(child)));
+	assert(check_msg(shm_ring_get(ctx, child), 1, 2));
+	assert(check_msg(shm_ring_get(ctx, child), 1, 3));
+
+	/* Fill it with maximal messages until it's full. */
+	for (n = 0; shm_ring_put(master, make_msg(ctx, 65535, n)); n++);
+	assert(n == SHM_RING_SIZE / (65535 + sizeof(be16)));
+	assert(!bell_rang(shm_ring_bellfd(master)));
+
+	/* Removing one rings producer. */
+	assert(check_msg(shm_ring_get(ctx, child), 65535, 0));
+	assert(bell_rang(shm_ring_bellfd(master)));
+	assert(shm_ring_put(master, make_msg(ctx, 65535, n)));
+	for (i = 1; i <= n; i++)
+		assert(check_msg(shm_ring_get(ctx, child), 65535, i));
+	assert(!shm_ring_get(ctx, child));
+
+	/* Odd lengths, five in flight, so we wrap at many offsets. */
+	for (i = 0; i < 20000; i++) {
+		assert(shm_ring_put(child, make_msg(ctx, i % 3001, i)));
+		if (i >= 5)
+			assert(check_msg(shm_ring_get(ctx, master),
+					 (i - 5) % 3001, i - 5));
+	}
+	for (i = 20000 - 5; i < 20000; i++)
+		assert(check_msg(shm_ring_get(ctx, master), i % 3001, i));
+	assert(!shm_ring_get(ctx, master));
+
+	/* Sync versions, when there's no need to wait. */
+	assert(shm_sync_write(master, take(make_msg(NULL, 100, 7))));
+	assert(check_msg(shm_sync_read(ctx, child), 100, 7));
+
+	/* fds come over the socket (not picked up if we don't wait). */
+	shm_ring_send_fd(child, dup(STDOUT_FILENO));
+	assert(shm_sync_flush_fds(child));
+	master->sockfd = sv[0];
+	assert(shm_sync_write(child, take(make_msg(NULL, 1, 0))));
+	assert(check_msg(shm_sync_read(ctx, master), 1, 0));
+	assert(tal_count(master->fds_in) == 0);
+
+	/* Sync read picks up fds while waiting, and notices close. */
+	shm_ring_send_fd(child, dup(STDOUT_FILENO));
+	assert(shm_sync_flush_fds(child));
+	close(sv[1]);
+	assert(!shm_sync_read(ctx, master));
+	assert(tal_count(master->fds_in) == 2);
+
+	/* Garbage from other side is noticed. */
+	master->in.hdr->head += 1;
+	assert(!shm_ring_get(ctx, master));
+	assert(master->broken);
+
+	tal_free(ctx);
+	return 0;
+}
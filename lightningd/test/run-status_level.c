@@ -0,0 +1,131 @@
+#include "../daemon_conn.c"
+#include "../msg_queue.c"
+#include "../shm_ring.c"
+#include "../status.c"
+#include <assert.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <utils.h>
+
+/* Our pretend request, and its reply (how many traces we evaluated). */
+#define REQ 1
+#define REPLY (REQ + 100)
+
+static u32 evaluated;
+
+static const char *expensive(void)
+{
+	evaluated++;
+	return "expensive";
+}
+
+static struct io_plan *recv_req(struct io_conn *conn, struct daemon_conn *dc)
+{
+	u8 *reply = tal_arr(dc->ctx, u8, 0);
+
+	assert(fromwire_peektype(dc->msg_in) == REQ);
+	status_trace("Formatting %s", expensive());
+
+	towire_u16(&reply, REPLY);
+	towire_u32(&reply, evaluated);
+	daemon_conn_send(dc, take(reply));
+	return daemon_conn_read_next(conn, dc);
+}
+
+static void master_gone(struct io_conn *unused, struct daemon_conn *dc)
+{
+	exit(0);
+}
+
+/* A subdaemon which traces in response to every REQ. */
+static void run_subdaemon(int fd)
+{
+	struct daemon_conn *master = tal(NULL, struct daemon_conn);
+
+	daemon_conn_init(master, master, fd, recv_req, master_gone);
+	status_setup_async(master);
+	io_loop(NULL, NULL);
+	exit(1);
+}
+
+static u8 *make_req(const tal_t *ctx)
+{
+	u8 *msg = tal_arr(ctx, u8, 0);
+	towire_u16(&msg, REQ);
+	return msg;
+}
+
+/* Returns how many traces it evaluated, and sets *traces to how many it
+ * sent us before the reply. */
+static u32 do_req(const tal_t *ctx, int fd, size_t *traces)
+{
+	const u8 *msg, *cursor;
+	size_t max;
+
+	assert(wire_sync_write(fd, make_req(ctx)));
+	*traces = 0;
+	while (fromwire_peektype(msg = wire_sync_read(ctx, fd)) == STATUS_TRACE)
+		(*traces)++;
+
+	cursor = msg;
+	max = tal_len(msg);
+	assert(fromwire_u16(&cursor, &max) == REPLY);
+	return fromwire_u32(&cursor, &max);
+}
+
+int main(void)
+{
+	tal_t *ctx = tal_tmpctx(NULL);
+	int sv[2], status;
+	size_t traces;
+	pid_t pid;
+	u8 *msg;
+
+	/* Synchronous reads handle the level before the message. */
+	assert(socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) == 0);
+	assert(wire_sync_write(sv[0], towire_status_level(ctx, LOG_INFORM)));
+	assert(wire_sync_write(sv[0], make_req(ctx)));
+	msg = status_sync_read(ctx, sv[1]);
+	assert(fromwire_peektype(msg) == REQ);
+	assert(!status_trace_enabled);
+
+	assert(wire_sync_write(sv[0], towire_status_level(ctx, LOG_DBG)));
+	assert(wire_sync_write(sv[0], make_req(ctx)));
+	msg = status_sync_read(ctx, sv[1]);
+	assert(fromwire_peektype(msg) == REQ);
+	assert(status_trace_enabled);
+	close(sv[0]);
+	close(sv[1]);
+
+	/* A running subdaemon changes when we tell it to. */
+	assert(socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) == 0);
+	pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		close(sv[0]);
+		run_subdaemon(sv[1]);
+	}
+	close(sv[1]);
+
+	assert(do_req(ctx, sv[0], &traces) == 1);
+	assert(traces == 1);
+
+	/* Traces off: not sent, and arguments not even evaluated. */
+	assert(wire_sync_write(sv[0], towire_status_level(ctx, LOG_INFORM)));
+	assert(do_req(ctx, sv[0], &traces) == 1);
+	assert(traces == 0);
+	assert(do_req(ctx, sv[0], &traces) == 1);
+	assert(traces == 0);
+
+	/* And back on. */
+	assert(wire_sync_write(sv[0], towire_status_level(ctx, LOG_DBG)));
+	assert(do_req(ctx, sv[0], &traces) == 2);
+	assert(traces == 1);
+
+	close(sv[0]);
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	tal_free(ctx);
+	return 0;
+}
@@ -575,6 +575,19 @@ class LightningDTests(BaseLightningDTests):
         # channeld pinging
         self.ping_tests(l1, l2)
 
+    def test_subdaemon_trace_level(self):
+        l1,l2 = self.connect()
+
+        # Nothing keeps debug now, so gossipd doesn't even make the trace.
+        l1.rpc.setloglevel('info')
+        l1.rpc.dev_ping(l2.info['id'], 0, 1)
+        l1.rpc.setloglevel('debug')
+        l1.rpc.dev_ping(l2.info['id'], 0, 2)
+        l1.daemon.wait_for_log('TRACE: Got pong!')
+
+        assert len([l for l in l1.rpc.getlog('debug')['log']
+                    if 'sending ping expecting' in l.get('log', '')]) == 1
+
     def test_routing_gossip_reconnect(self):
         # Connect two peers, reconnect and then see if we resume the
         # gossip.
@@ -203,6 +203,25 @@ fromwire_impl_templ = """bool fromwire_{name}({ctx}const void *p, size_t *plen{a
 fromwire_header_templ = """bool fromwire_{name}({ctx}const void *p, size_t *plen{args});
 """
 
+fromwire_view_impl_templ = """bool fromwire_{name}_view(const void *p, size_t *plen{args})
+{{
+	const u8 *cursor = p;
+	size_t tmp_len;
+
+	if (!plen) {{
+		tmp_len = tal_count(p);
+		plen = &tmp_len;
+	}}
+	if (fromwire_u16(&cursor, plen) != {enum.name})
+		return false;
+{subcalls}
+	return cursor != NULL;
+}}
+"""
+
+fromwire_view_header_templ = """bool fromwire_{name}_view(const void *p, size_t *plen{args});
+"""
+
 towire_header_templ = """u8 *towire_{name}(const tal_t *ctx{args});
 """
 towire_impl_templ = """u8 *towire_{name}(const tal_t *ctx{args})
@@ -325,6 +344,72 @@ class Message(object):
             subcalls='\n'.join(subcalls)
         )
 
+    # Views hand back pointers into the message itself, so every array
+    # element needs a fixed wire size we can skip over.
+    def has_view(self):
+        has_arrays = False
+        for f in self.fields:
+            if f.is_padding() or f.is_len_var:
+                continue
+            if f.is_array() or f.is_variable_size():
+                if f.fieldtype.tsize == 0:
+                    return False
+                has_arrays = True
+            if f.basetype() in varlen_structs:
+                return False
+        return has_arrays
+
+    def print_fromwire_view(self,is_header):
+        if not self.has_view():
+            return None
+
+        args = []
+        for f in self.fields:
+            if f.is_padding():
+                continue
+            elif f.is_len_var:
+                args.append(', {} *{}'.format(f.fieldtype.name, f.name))
+            elif f.is_array() or f.is_variable_size():
+                args.append(', const u8 **{}'.format(f.name))
+            else:
+                args.append(', {} *{}'.format(f.fieldtype.name, f.name))
+
+        template = fromwire_view_header_templ if is_header else fromwire_view_impl_templ
+
+        subcalls = []
+        for f in self.fields:
+            basetype=f.basetype()
+
+            for c in f.comments:
+                subcalls.append('\t/*{} */'.format(c))
+
+            if f.is_padding():
+                subcalls.append('\tfromwire_pad(&cursor, plen, {});'
+                                .format(f.num_elems))
+            elif f.is_array():
+                subcalls.append('\t*{} = fromwire(&cursor, plen, NULL, {});'
+                                .format(f.name, f.num_elems * f.fieldtype.tsize))
+            elif f.is_variable_size():
+                if f.fieldtype.tsize == 1:
+                    size = '*' + f.lenvar
+                else:
+                    size = '*{} * {}'.format(f.lenvar, f.fieldtype.tsize)
+                subcalls.append('\t*{} = fromwire(&cursor, plen, NULL, {});'
+                                .format(f.name, size))
+            elif f.is_assignable() or f.is_len_var:
+                subcalls.append('\t*{} = fromwire_{}(&cursor, plen);'
+                                .format(f.name, basetype))
+            else:
+                subcalls.append('\tfromwire_{}(&cursor, plen, {});'
+                                .format(basetype, f.name))
+
+        return template.format(
+            name=self.name,
+            args=''.join(args),
+            enum=self.enum,
+            subcalls='\n'.join(subcalls)
+        )
+
     def print_towire_array(self, subcalls, basetype, f, num_elems):
         if f.has_array_helper():
             subcalls.append('\ttowire_{}_array(&p, {}, {});'
@@ -391,6 +476,7 @@ class Message(object):
 
 parser = argparse.ArgumentParser(description='Generate C from from CSV')
 parser.add_argument('--header', action='store_true', help="Create wire header")
+parser.add_argument('--views', action='store_true', help="Also create zero-copy fromwire_*_view decoders")
 parser.add_argument('headerfilename', help='The filename of the header')
 parser.add_argument('enumname', help='The name of the enum to produce')
 parser.add_argument('files', nargs='*', help='Files to read in (or stdin)')
@@ -488,6 +574,10 @@ cases = ['case {enum.name}: return "{enum.name}";'.format(enum=m.enum) for m in
 
 fromwire_decls = [m.print_fromwire(options.header) for m in messages]
 towire_decls = [m.print_towire(options.header) for m in messages]
+view_decls = []
+if options.views:
+    view_decls = [m.print_fromwire_view(options.header) for m in messages]
+    view_decls = [v for v in view_decls if v is not None]
 
 print(template.format(
     headerfilename=options.headerfilename,
@@ -496,5 +586,5 @@ print(template.format(
     includes=includes,
     enumname=options.enumname,
     enums=enums,
-    func_decls='\n'.join(fromwire_decls + towire_decls),
+    func_decls='\n'.join(fromwire_decls + view_decls + towire_decls),
 ))
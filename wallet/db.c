@@ -1,8 +1,13 @@
 #include "db.h"
 
 #include "daemon/log.h"
+#include "daemon/pseudorand.h"
 #include "lightningd/lightningd.h"
 
+#include <ccan/array_size/array_size.h>
+#include <ccan/asort/asort.h>
+#include <ccan/crypto/siphash24/siphash24.h>
+#include <ccan/htable/htable_type.h>
 #include <ccan/str/hex/hex.h>
 #include <ccan/tal/str/str.h>
 #include <ccan/tal/tal.h>
@@ -93,24 +98,274 @@ char *dbmigrations[] = {
     "  max_accepted_htlcs INTEGER,"
     "  PRIMARY KEY (id)"
     ");",
+    "CREATE TABLE channel_htlcs ("
+    "  id INTEGER,"
+    "  channel_id INTEGER REFERENCES channels(id) ON DELETE CASCADE,"
+    "  direction INTEGER," /* 0 incoming, 1 outgoing */
+    "  channel_htlc_id INTEGER,"
+    "  origin_htlc INTEGER," /* id of the incoming HTLC we forwarded */
+    "  msatoshi INTEGER,"
+    "  cltv_expiry INTEGER,"
+    "  payment_hash BLOB,"
+    "  payment_key BLOB,"
+    "  hstate INTEGER,"
+    "  shared_secret BLOB,"
+    "  routing_onion BLOB,"
+    "  malformed_onion INTEGER,"
+    "  failuremsg BLOB,"
+    "  PRIMARY KEY (id),"
+    "  UNIQUE (channel_id, direction, channel_htlc_id)"
+    ");",
+    "CREATE INDEX channel_htlcs_payment_hash"
+    "  ON channel_htlcs (payment_hash);",
+    "CREATE TABLE our_scripts ("
+    "  script BLOB,"
+    "  keyindex INTEGER,"
+    "  is_p2sh INTEGER,"
+    "  PRIMARY KEY (script)"
+    ");",
+    /* Packed known[] (see wallet_shachain_add_hash): NULL means it's
+     * still in shachain_known. */
+    "ALTER TABLE shachains ADD COLUMN known BLOB;",
     NULL,
 };
 
+/* Binary fields which we used to store hex-encoded, as TEXT. */
+static const char *hex_columns[][2] = {
+	{ "outputs", "prev_out_tx" },
+	{ "shachain_known", "hash" },
+	{ "channels", "funding_tx_id" },
+	{ "channels", "fundingkey_remote" },
+	{ "channels", "revocation_basepoint_remote" },
+	{ "channels", "payment_basepoint_remote" },
+	{ "channels", "delayed_payment_basepoint_remote" },
+	{ "channels", "per_commit_remote" },
+	{ "channels", "old_per_commit_remote" },
+	{ "channels", "shutdown_scriptpubkey_remote" },
+	{ "channels", "last_tx" },
+	{ "channels", "last_sig" },
+	{ "peers", "node_id" },
+};
+
+/* A statement from db_prepare, and the query it was prepared from. */
+struct cached_stmt {
+	const char *query;
+	sqlite3_stmt *stmt;
+};
+
+static const char *keyof_cached_stmt(const struct cached_stmt *c)
+{
+	return c->query;
+}
+
+/* Keyed by call site: the query's address, not its contents. */
+static size_t hash_query(const char *query)
+{
+	return siphash24(siphash_seed(), &query, sizeof(query));
+}
+
+static bool cached_stmt_eq(const struct cached_stmt *c, const char *query)
+{
+	return c->query == query;
+}
+HTABLE_DEFINE_TYPE(struct cached_stmt, keyof_cached_stmt, hash_query,
+		   cached_stmt_eq, stmt_cache);
+
+static const void *keyof_db_stat(const struct db_stat *s)
+{
+	return s->key;
+}
+
+static size_t hash_stat_key(const void *key)
+{
+	return siphash24(siphash_seed(), &key, sizeof(key));
+}
+
+static bool db_stat_eq(const struct db_stat *s, const void *key)
+{
+	return s->key == key;
+}
+HTABLE_DEFINE_TYPE(struct db_stat, keyof_db_stat, hash_stat_key,
+		   db_stat_eq, db_stat_map);
+
+const struct db_profile db_profile_default = {
+	.wal = true,
+	.synchronous = 2,
+	.mmap_size = 64 * 1024 * 1024,
+	.cache_kb = 8 * 1024,
+	.page_size = 4096
+};
+
+static void add_timing(u64 *count, struct timerel *total, struct timerel *max,
+		       struct timemono start)
+{
+	struct timerel t = timemono_since(start);
+
+	(*count)++;
+	*total = timerel_add(*total, t);
+	if (time_greater(t, *max))
+		*max = t;
+}
+
+static struct db_stat *db_stat_get(struct db_stat_map *map, const void *key,
+				   const char *caller, const char *query)
+{
+	struct db_stat *s = db_stat_map_get(map, key);
+
+	if (!s) {
+		s = talz(map, struct db_stat);
+		s->key = key;
+		s->caller = caller;
+		s->query = query;
+		db_stat_map_add(map, s);
+	}
+	return s;
+}
+
+/* The actual COMMIT, which is where we wait for the disk: its stats go
+ * to whoever it's committing for. */
+static bool db_commit(const char *caller, struct db *db)
+{
+	struct timemono start = time_mono();
+	struct db_stat *prev = db->trace_stat;
+	bool ok;
+
+	db->trace_stat = db_stat_get(db->commit_stats, caller, caller,
+				     "COMMIT;");
+	ok = db_exec_prepared(db, db_prepare(db, "COMMIT;"));
+	db->trace_stat = prev;
+
+	add_timing(&db->timings.commits, &db->timings.commit_time,
+		   &db->timings.commit_max, start);
+	return ok;
+}
+
+/* Nobody's adding to the batch: it mustn't delay anyone else's write. */
+static void db_flush_batch(const char *caller, struct db *db)
+{
+	if (db->in_batch && !db->batch_holds && !db_batch_commit_(caller, db))
+		fatal("Could not commit batch: %s", db->err);
+}
+
+/* What a result row costs us to read, without converting anything. */
+static u64 row_bytes(sqlite3_stmt *stmt)
+{
+	int i, n = sqlite3_column_count(stmt);
+	u64 bytes = 0;
+
+	for (i = 0; i < n; i++) {
+		switch (sqlite3_column_type(stmt, i)) {
+		case SQLITE_BLOB:
+		case SQLITE_TEXT:
+			bytes += sqlite3_column_bytes(stmt, i);
+			break;
+		case SQLITE_NULL:
+			break;
+		default:
+			bytes += 8;
+		}
+	}
+	return bytes;
+}
+
+/* sqlite tells us about every row, and how long every statement took. */
+static int db_trace(unsigned int type, void *arg, void *p, void *x)
+{
+	struct db *db = arg;
+	sqlite3_stmt *stmt = p;
+	struct db_stat *s;
+
+	if (db->trace_stat)
+		s = db->trace_stat;
+	else if (stmt == db->query_stmt)
+		s = db->query_stat;
+	else
+		s = db_stat_map_get(db->stats, stmt);
+
+	/* Not one of ours (eg. sqlite's own). */
+	if (!s)
+		return 0;
+
+	if (type == SQLITE_TRACE_ROW) {
+		s->rows++;
+		s->bytes += row_bytes(stmt);
+	} else {
+		struct timerel t = time_from_nsec(*(sqlite3_int64 *)x);
+		int pages, highwater;
+
+		s->calls++;
+		s->total = timerel_add(s->total, t);
+		if (time_greater(t, s->max))
+			s->max = t;
+
+		sqlite3_db_status(db->sql, SQLITE_DBSTATUS_CACHE_WRITE,
+				  &pages, &highwater, 0);
+		s->pages += pages - db->pages_written;
+		db->pages_written = pages;
+	}
+	return 0;
+}
+
+static int db_stat_cmp(const struct db_stat *const *a,
+		       const struct db_stat *const *b, void *unused)
+{
+	if (time_greater((*a)->total, (*b)->total))
+		return -1;
+	if (time_less((*a)->total, (*b)->total))
+		return 1;
+	return 0;
+}
+
+static void add_stats(const struct db_stat ***stats,
+		      const struct db_stat_map *map)
+{
+	struct db_stat_map_iter it;
+	const struct db_stat *s;
+	size_t n = tal_count(*stats);
+
+	for (s = db_stat_map_first(map, &it);
+	     s;
+	     s = db_stat_map_next(map, &it)) {
+		/* eg. COMMIT's own statement, whose runs go to callers. */
+		if (!s->calls)
+			continue;
+		tal_resize(stats, n + 1);
+		(*stats)[n++] = s;
+	}
+}
+
+const struct db_stat **db_stats(const tal_t *ctx, const struct db *db)
+{
+	const struct db_stat **stats = tal_arr(ctx, const struct db_stat *, 0);
+
+	add_stats(&stats, db->stats);
+	add_stats(&stats, db->commit_stats);
+	asort(stats, tal_count(stats), db_stat_cmp, NULL);
+	return stats;
+}
+
 bool PRINTF_FMT(3, 4)
     db_exec(const char *caller, struct db *db, const char *fmt, ...)
 {
 	va_list ap;
 	char *cmd, *errmsg;
-	int err;
+	int err, changes;
+	struct db_stat *stat;
 
 	if (db->in_transaction && db->err)
 		return false;
 
+	db_flush_batch(caller, db);
+
 	va_start(ap, fmt);
 	cmd = tal_vfmt(db, fmt, ap);
 	va_end(ap);
 
+	changes = sqlite3_total_changes(db->sql);
+	db->trace_stat = db_stat_get(db->stats, caller, caller, NULL);
 	err = sqlite3_exec(db->sql, cmd, NULL, NULL, &errmsg);
+	stat = db->trace_stat;
+	db->trace_stat = NULL;
 	if (err != SQLITE_OK) {
 		tal_free(db->err);
 		db->err = tal_fmt(db, "%s:%s:%s:%s", caller,
@@ -120,6 +375,7 @@ bool PRINTF_FMT(3, 4)
 		return false;
 	}
 	tal_free(cmd);
+	stat->rows += sqlite3_total_changes(db->sql) - changes;
 	return true;
 }
 
@@ -144,9 +400,92 @@ sqlite3_stmt *PRINTF_FMT(3, 4)
 		db->err = tal_fmt(db, "%s:%s:%s:%s", caller,
 				  sqlite3_errstr(err), query, sqlite3_errmsg(db->sql));
 	}
+	/* Callers finalize these, so we only track the latest. */
+	db->query_stmt = stmt;
+	db->query_stat = db_stat_get(db->stats, caller, caller, NULL);
 	return stmt;
 }
 
+sqlite3_stmt *db_prepare_(const char *caller, struct db *db, const char *query)
+{
+	struct cached_stmt *c;
+	int err;
+
+	if (db->in_transaction && db->err)
+		return NULL;
+
+	c = stmt_cache_get(db->stmts, query);
+	if (c) {
+		/* Still stepping through its results? */
+		if (sqlite3_stmt_busy(c->stmt))
+			fatal("%s: statement already in use: %s", caller, query);
+		return c->stmt;
+	}
+
+	c = tal(db->stmts, struct cached_stmt);
+	c->query = query;
+	err = sqlite3_prepare_v2(db->sql, query, -1, &c->stmt, NULL);
+	if (err != SQLITE_OK) {
+		tal_free(db->err);
+		db->err = tal_fmt(db, "%s:%s:%s:%s", caller,
+				  sqlite3_errstr(err), query,
+				  sqlite3_errmsg(db->sql));
+		tal_free(c);
+		return NULL;
+	}
+	stmt_cache_add(db->stmts, c);
+
+	/* It may have the address of a db_query one which is gone. */
+	if (db->query_stmt == c->stmt)
+		db->query_stmt = NULL;
+	db_stat_get(db->stats, c->stmt, caller, query);
+	return c->stmt;
+}
+
+void db_stmt_done(sqlite3_stmt *stmt)
+{
+	/* db_prepare failed: sqlite3_clear_bindings() doesn't like NULL. */
+	if (!stmt)
+		return;
+
+	/* Bound values may point into memory which is about to go away. */
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
+
+bool db_exec_prepared_(const char *caller, struct db *db, sqlite3_stmt *stmt)
+{
+	int err, changes;
+	struct db_stat *stat;
+
+	/* db_prepare failed, and already said why. */
+	if (!stmt)
+		return false;
+
+	if (db->in_transaction && db->err) {
+		db_stmt_done(stmt);
+		return false;
+	}
+
+	db_flush_batch(caller, db);
+	stat = db->trace_stat;
+	if (!stat)
+		stat = db_stat_get(db->stats, stmt, caller, sqlite3_sql(stmt));
+	changes = sqlite3_total_changes(db->sql);
+	err = sqlite3_step(stmt);
+	if (err != SQLITE_DONE) {
+		tal_free(db->err);
+		db->err = tal_fmt(db, "%s:%s:%s:%s", caller,
+				  sqlite3_errstr(err), sqlite3_sql(stmt),
+				  sqlite3_errmsg(db->sql));
+		db_stmt_done(stmt);
+		return false;
+	}
+	stat->rows += sqlite3_total_changes(db->sql) - changes;
+	db_stmt_done(stmt);
+	return true;
+}
+
 /**
  * db_clear_error - Clear any errors from previous queries
  */
@@ -156,7 +495,27 @@ static void db_clear_error(struct db *db)
 }
 
 
-static void close_db(struct db *db) { sqlite3_close(db->sql); }
+static void close_db(struct db *db)
+{
+	struct stmt_cache_iter it;
+	struct cached_stmt *c;
+
+	/* sqlite3_close fails while there are statements left. */
+	for (c = stmt_cache_first(db->stmts, &it);
+	     c;
+	     c = stmt_cache_next(db->stmts, &it))
+		sqlite3_finalize(c->stmt);
+	stmt_cache_clear(db->stmts);
+	db_stat_map_clear(db->stats);
+	db_stat_map_clear(db->commit_stats);
+	sqlite3_close(db->sql);
+}
+
+/* Inside a batch, transactions are savepoints. */
+static bool db_nested(const struct db *db)
+{
+	return db->in_batch && db->batch_holds;
+}
 
 bool db_begin_transaction(struct db *db)
 {
@@ -164,14 +523,23 @@ bool db_begin_transaction(struct db *db)
 	/* Clear any errors from previous transactions and
 	 * non-transactional queries */
 	db_clear_error(db);
-	db->in_transaction = db_exec(__func__, db, "BEGIN TRANSACTION;");
+	if (db_nested(db))
+		db->in_transaction = db_exec_prepared(
+		    db, db_prepare(db, "SAVEPOINT txn;"));
+	else
+		db->in_transaction = db_exec_prepared(
+		    db, db_prepare(db, "BEGIN TRANSACTION;"));
 	return db->in_transaction;
 }
 
-bool db_commit_transaction(struct db *db)
+bool db_commit_transaction_(const char *caller, struct db *db)
 {
 	assert(db->in_transaction);
-	bool ret = db_exec(__func__, db, "COMMIT;");
+	bool ret;
+	if (db_nested(db))
+		ret = db_exec_prepared(db, db_prepare(db, "RELEASE txn;"));
+	else
+		ret = db_commit(caller, db);
 	db->in_transaction = false;
 	return ret;
 }
@@ -179,11 +547,112 @@ bool db_commit_transaction(struct db *db)
 bool db_rollback_transaction(struct db *db)
 {
 	assert(db->in_transaction);
-	bool ret = db_exec(__func__, db, "ROLLBACK;");
+	bool ret;
+	/* Don't let the error we're undoing stop us undoing it. */
 	db->in_transaction = false;
+	if (db_nested(db)) {
+		/* Savepoint stays on the stack after rolling back to it. */
+		ret = db_exec_prepared(db, db_prepare(db, "ROLLBACK TO txn;"));
+		ret &= db_exec_prepared(db, db_prepare(db, "RELEASE txn;"));
+	} else
+		ret = db_exec_prepared(db, db_prepare(db, "ROLLBACK;"));
 	return ret;
 }
 
+bool db_batch_hold(struct db *db)
+{
+	assert(!db->in_transaction);
+	if (!db->in_batch) {
+		if (!db_exec_prepared(db, db_prepare(db, "BEGIN TRANSACTION;")))
+			return false;
+		db->in_batch = true;
+	}
+	db->batch_holds++;
+	return true;
+}
+
+void db_batch_release(struct db *db)
+{
+	assert(db->batch_holds);
+	db->batch_holds--;
+}
+
+bool db_batch_commit_(const char *caller, struct db *db)
+{
+	assert(!db->batch_holds);
+	assert(!db->in_transaction);
+	if (!db->in_batch)
+		return true;
+
+	/* Clear first, or the COMMIT itself would try to flush us. */
+	db->in_batch = false;
+	return db_commit(caller, db);
+}
+
+bool db_checkpoint(struct db *db)
+{
+	struct timemono start;
+	int err;
+
+	if (!db->profile || !db->profile->wal)
+		return true;
+
+	/* Can't checkpoint what's not committed. */
+	assert(!db->in_transaction);
+	db_flush_batch(__func__, db);
+
+	start = time_mono();
+	err = sqlite3_wal_checkpoint_v2(db->sql, NULL, SQLITE_CHECKPOINT_PASSIVE,
+					NULL, NULL);
+	if (err != SQLITE_OK) {
+		tal_free(db->err);
+		db->err = tal_fmt(db, "Checkpointing: %s",
+				  sqlite3_errmsg(db->sql));
+		return false;
+	}
+	add_timing(&db->timings.checkpoints, &db->timings.checkpoint_time,
+		   &db->timings.checkpoint_max, start);
+	return true;
+}
+
+/* Before anything's written, so page_size can still take effect. */
+static bool db_set_profile(struct db *db, const struct db_profile *profile)
+{
+	sqlite3_stmt *stmt;
+	bool wal;
+
+	db->profile = profile;
+	if (!db_exec(__func__, db, "PRAGMA page_size = %u;",
+		     profile->page_size)
+	    || !db_exec(__func__, db, "PRAGMA cache_size = -%u;",
+			profile->cache_kb)
+	    || !db_exec(__func__, db, "PRAGMA mmap_size = %llu;",
+			profile->mmap_size)
+	    || !db_exec(__func__, db, "PRAGMA synchronous = %d;",
+			profile->synchronous))
+		return false;
+
+	/* Tells us what it ended up as. */
+	stmt = db_query(__func__, db, "PRAGMA journal_mode = %s;",
+			profile->wal ? "WAL" : "DELETE");
+	if (!stmt)
+		return false;
+	wal = sqlite3_step(stmt) == SQLITE_ROW
+		&& streq((const char *)sqlite3_column_text(stmt, 0), "wal");
+	sqlite3_finalize(stmt);
+	if (wal != profile->wal) {
+		tal_free(db->err);
+		db->err = tal_fmt(db, "Could not set journal_mode %s",
+				  profile->wal ? "WAL" : "DELETE");
+		return false;
+	}
+
+	/* We checkpoint ourselves, outside of anyone's commit. */
+	if (wal && !db_exec(__func__, db, "PRAGMA wal_autocheckpoint = 0;"))
+		return false;
+	return true;
+}
+
 /**
  * db_open - Open or create a sqlite3 database
  */
@@ -208,8 +677,24 @@ static struct db *db_open(const tal_t *ctx, char *filename)
 	db = tal(ctx, struct db);
 	db->filename = tal_dup_arr(db, char, filename, strlen(filename), 0);
 	db->sql = sql;
+	db->stmts = tal(db, struct stmt_cache);
+	stmt_cache_init(db->stmts);
 	tal_add_destructor(db, close_db);
 	db->in_transaction = false;
+	db->in_batch = false;
+	db->batch_holds = 0;
+	db->profile = NULL;
+	memset(&db->timings, 0, sizeof(db->timings));
+	db->stats = tal(db, struct db_stat_map);
+	db_stat_map_init(db->stats);
+	db->commit_stats = tal(db, struct db_stat_map);
+	db_stat_map_init(db->commit_stats);
+	db->trace_stat = NULL;
+	db->query_stmt = NULL;
+	db->query_stat = NULL;
+	db->pages_written = 0;
+	sqlite3_trace_v2(sql, SQLITE_TRACE_ROW|SQLITE_TRACE_PROFILE,
+			 db_trace, db);
 	db->err = NULL;
 	if (!db_exec(__func__, db, "PRAGMA foreign_keys = ON;")) {
 		fatal("Could not enable foreignkeys on database: %s", db->err);
@@ -261,6 +746,93 @@ static int db_migration_count(void)
 	return count - 1;
 }
 
+/**
+ * db_unhex_column - Turn any hex-encoded TEXT in a column into a BLOB
+ *
+ * An empty string (we used to write that for a NULL script) becomes NULL.
+ * We decode them all before updating any: sqlite doesn't promise what a
+ * SELECT sees if we change its table while stepping through it.
+ */
+static bool db_unhex_column(struct db *db, const char *table,
+			    const char *column)
+{
+	bool ok = true;
+	sqlite3_stmt *stmt;
+	const tal_t *tmpctx = tal_tmpctx(db);
+	s64 *rowids = tal_arr(tmpctx, s64, 0);
+	/* NULL for an empty string. */
+	u8 **bins = tal_arr(tmpctx, u8 *, 0);
+	size_t i, n = 0;
+
+	stmt = db_query(__func__, db,
+			"SELECT rowid, %s FROM %s WHERE typeof(%s)='text';",
+			column, table, column);
+	if (!stmt) {
+		tal_free(tmpctx);
+		return false;
+	}
+
+	while (ok && sqlite3_step(stmt) == SQLITE_ROW) {
+		const char *hex = (const char *)sqlite3_column_text(stmt, 1);
+		size_t len = sqlite3_column_bytes(stmt, 1);
+		u8 *bin = NULL;
+
+		if (len != 0) {
+			bin = tal_arr(bins, u8, hex_data_size(len));
+			if (!hex_decode(hex, len, bin, tal_len(bin))) {
+				tal_free(db->err);
+				db->err = tal_fmt(db, "%s: bad hex in %s.%s: %s",
+						  __func__, table, column, hex);
+				ok = false;
+			}
+		}
+		tal_resize(&rowids, n + 1);
+		tal_resize(&bins, n + 1);
+		rowids[n] = sqlite3_column_int64(stmt, 0);
+		bins[n++] = bin;
+	}
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+
+	if (ok && n) {
+		stmt = db_query(__func__, db,
+				"UPDATE %s SET %s=? WHERE rowid=?;",
+				table, column);
+		ok = (stmt != NULL);
+	}
+
+	for (i = 0; ok && i < n; i++) {
+		if (bins[i])
+			sqlite3_bind_blob(stmt, 1, bins[i], tal_len(bins[i]),
+					  SQLITE_STATIC);
+		else
+			sqlite3_bind_null(stmt, 1);
+		sqlite3_bind_int64(stmt, 2, rowids[i]);
+		ok = sqlite3_step(stmt) == SQLITE_DONE;
+		sqlite3_reset(stmt);
+	}
+	sqlite3_finalize(stmt);
+	tal_free(tmpctx);
+	return ok;
+}
+
+/**
+ * db_unhex_columns - Convert any old hex-encoded fields, once
+ */
+static bool db_unhex_columns(struct db *db)
+{
+	size_t i;
+
+	if (db_get_intvar(db, "binary_fields", 0))
+		return true;
+
+	for (i = 0; i < ARRAY_SIZE(hex_columns); i++) {
+		if (!db_unhex_column(db, hex_columns[i][0], hex_columns[i][1]))
+			return false;
+	}
+	return db_set_intvar(db, "binary_fields", 1);
+}
+
 /**
  * db_migrate - Apply all remaining migrations from the current version
  */
@@ -283,6 +855,9 @@ static bool db_migrate(struct db *db)
 	/* Finally update the version number in the version table */
 	db_exec(__func__, db, "UPDATE version SET version=%d;", available);
 
+	if (!db_unhex_columns(db))
+		goto fail;
+
 	if (!db_commit_transaction(db)) {
 		goto fail;
 	}
@@ -293,13 +868,16 @@ fail:
 	return false;
 }
 
-struct db *db_setup(const tal_t *ctx)
+struct db *db_setup(const tal_t *ctx, const struct db_profile *profile)
 {
 	struct db *db = db_open(ctx, DB_FILE);
 	if (!db) {
 		return db;
 	}
 
+	if (!db_set_profile(db, profile))
+		fatal("Could not set up database storage: %s", db->err);
+
 	if (!db_migrate(db)) {
 		return tal_free(db);
 	}
@@ -308,39 +886,39 @@ struct db *db_setup(const tal_t *ctx)
 
 s64 db_get_intvar(struct db *db, char *varname, s64 defval)
 {
-	int err;
 	s64 res = defval;
-	const unsigned char *stringvar;
 	sqlite3_stmt *stmt =
-	    db_query(__func__, db,
-		     "SELECT val FROM vars WHERE name='%s' LIMIT 1", varname);
+	    db_prepare(db, "SELECT val FROM vars WHERE name=? LIMIT 1");
 
 	if (!stmt)
 		return defval;
 
-	err = sqlite3_step(stmt);
-	if (err == SQLITE_ROW) {
-		stringvar = sqlite3_column_text(stmt, 0);
-		res = atol((const char *)stringvar);
-	}
-	sqlite3_finalize(stmt);
+	sqlite3_bind_text(stmt, 1, varname, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		res = sqlite3_column_int64(stmt, 0);
+	db_stmt_done(stmt);
 	return res;
 }
 
 bool db_set_intvar(struct db *db, char *varname, s64 val)
 {
+	sqlite3_stmt *stmt;
+
 	/* Attempt to update */
-	db_exec(__func__, db,
-		"UPDATE vars SET val='%" PRId64 "' WHERE name='%s';", val,
-		varname);
-	if (sqlite3_changes(db->sql) > 0)
+	stmt = db_prepare(db, "UPDATE vars SET val=? WHERE name=?;");
+	if (!stmt)
+		return false;
+	sqlite3_bind_int64(stmt, 1, val);
+	sqlite3_bind_text(stmt, 2, varname, -1, SQLITE_STATIC);
+	if (db_exec_prepared(db, stmt) && sqlite3_changes(db->sql) > 0)
 		return true;
-	else
-		return db_exec(
-		    __func__, db,
-		    "INSERT INTO vars (name, val) VALUES ('%s', '%" PRId64
-		    "');",
-		    varname, val);
+
+	stmt = db_prepare(db, "INSERT INTO vars (name, val) VALUES (?, ?);");
+	if (!stmt)
+		return false;
+	sqlite3_bind_text(stmt, 1, varname, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, val);
+	return db_exec_prepared(db, stmt);
 }
 
 bool sqlite3_column_hexval(sqlite3_stmt *s, int col, void *dest, size_t destlen)
@@ -351,3 +929,12 @@ bool sqlite3_column_hexval(sqlite3_stmt *s, int col, void *dest, size_t destlen)
 		return false;
 	return hex_decode(source, sourcelen, dest, destlen);
 }
+
+bool sqlite3_column_blobval(sqlite3_stmt *s, int col, void *dest,
+			    size_t destlen)
+{
+	if (sqlite3_column_bytes(s, col) != destlen)
+		return false;
+	memcpy(dest, sqlite3_column_blob(s, col), destlen);
+	return true;
+}
@@ -4,14 +4,76 @@
 #include "config.h"
 #include "daemon/log.h"
 
+#include <ccan/time/time.h>
 #include <sqlite3.h>
 #include <stdbool.h>
 
+struct stmt_cache;
+struct db_stat_map;
+
+/* How we ask sqlite to keep the database on disk. */
+struct db_profile {
+	/* Write-ahead log, rather than a rollback journal. */
+	bool wal;
+	/* PRAGMA synchronous: 1 (NORMAL) or 2 (FULL).  In WAL mode, NORMAL
+	 * only fsyncs at checkpoints, so a crash can lose the last commits. */
+	int synchronous;
+	/* Bytes to mmap (0 for none), and KiB of page cache. */
+	unsigned long long mmap_size;
+	unsigned int cache_kb;
+	/* Only takes effect when the database is created. */
+	unsigned int page_size;
+};
+
+/* What we recommend: WAL, but every commit is still durable. */
+extern const struct db_profile db_profile_default;
+
+/* How long we spend waiting for the disk. */
+struct db_timings {
+	u64 commits;
+	struct timerel commit_time, commit_max;
+	u64 checkpoints;
+	struct timerel checkpoint_time, checkpoint_max;
+};
+
+/* What one call site has done in the database (see db_stats). */
+struct db_stat {
+	/* The statement (db_prepare), or the caller (db_exec, db_query). */
+	const void *key;
+	const char *caller;
+	/* For db_prepare, the query; NULL otherwise. */
+	const char *query;
+	/* Statements run, rows returned or changed, bytes returned, and
+	 * pages written to disk while it ran (mostly by COMMITs). */
+	u64 calls, rows, bytes, pages;
+	struct timerel total, max;
+};
+
 struct db {
 	char *filename;
 	bool in_transaction;
 	const char *err;
 	sqlite3 *sql;
+
+	/* Statements from db_prepare, kept for reuse. */
+	struct stmt_cache *stmts;
+
+	/* Group commit: is there a batch transaction open, and how many
+	 * are writing into it right now? */
+	bool in_batch;
+	size_t batch_holds;
+
+	const struct db_profile *profile;
+	struct db_timings timings;
+
+	/* Per call site stats (COMMITs by who they're for), and what
+	 * sqlite's trace callback needs to attribute statements to them
+	 * when it can't tell by the statement alone. */
+	struct db_stat_map *stats, *commit_stats;
+	struct db_stat *trace_stat;
+	sqlite3_stmt *query_stmt;
+	struct db_stat *query_stat;
+	int pages_written;
 };
 
 /**
@@ -22,9 +84,9 @@ struct db {
  *
  * Params:
  *  @ctx: the tal_t context to allocate from
- *  @log: where to log messages to
+ *  @profile: how to store it (must outlive the db)
  */
-struct db *db_setup(const tal_t *ctx);
+struct db *db_setup(const tal_t *ctx, const struct db_profile *profile);
 
 /**
  * db_query - Prepare and execute a query, and return the result
@@ -35,6 +97,37 @@ sqlite3_stmt *PRINTF_FMT(3, 4)
 bool PRINTF_FMT(3, 4)
 	db_exec(const char *caller, struct db *db, const char *fmt, ...);
 
+/**
+ * db_prepare - Get a prepared statement for @query, to bind parameters to
+ *
+ * The statement is prepared the first time through, and reused after
+ * that: it's keyed by the address of @query, so that must be a string
+ * literal (or otherwise live as long as @db, and never change).  Bind
+ * parameters with sqlite3_bind_*, then either db_exec_prepared() it or
+ * sqlite3_step() through the results and call db_stmt_done().
+ *
+ * A statement can't be used again until it's done, so don't prepare
+ * the same query while iterating through its results.  Returns NULL
+ * (and sets db->err) on failure.
+ */
+#define db_prepare(db, query) db_prepare_(__func__, (db), (query))
+sqlite3_stmt *db_prepare_(const char *caller, struct db *db, const char *query);
+
+/**
+ * db_exec_prepared - Execute a statement from db_prepare which returns no rows
+ *
+ * Marks the statement done.  Returns false (and sets db->err) on failure.
+ */
+#define db_exec_prepared(db, stmt) db_exec_prepared_(__func__, (db), (stmt))
+bool db_exec_prepared_(const char *caller, struct db *db, sqlite3_stmt *stmt);
+
+/**
+ * db_stmt_done - We've finished with the results of a db_prepare statement
+ *
+ * Resets it so it can be used again; NULL is fine.
+ */
+void db_stmt_done(sqlite3_stmt *stmt);
+
 /**
  * db_begin_transaction - Begin a transaction
  *
@@ -48,15 +141,58 @@ bool db_begin_transaction(struct db *db);
  * db_commit_transaction - Commit a running transaction
  *
  * Requires that we are currently in a transaction. Returns whether
- * the commit was successful.
+ * the commit was successful.  The COMMIT's cost shows up in db_stats()
+ * under the calling function.
  */
-bool db_commit_transaction(struct db *db);
+#define db_commit_transaction(db) db_commit_transaction_(__func__, (db))
+bool db_commit_transaction_(const char *caller, struct db *db);
 
 /**
  * db_rollback_transaction - Whoops... undo! undo!
  */
 bool db_rollback_transaction(struct db *db);
 
+/**
+ * db_batch_hold - Write into a transaction shared with other writers
+ *
+ * Opens the batch transaction if there isn't one.  Until the matching
+ * db_batch_release(), db_begin_transaction() nests inside it, and
+ * nothing is durable until someone calls db_batch_commit().
+ *
+ * Writes made while nobody holds the batch commit it first, so
+ * they're as durable as ever when they return.
+ */
+bool db_batch_hold(struct db *db);
+void db_batch_release(struct db *db);
+
+/**
+ * db_batch_commit - Commit the batch transaction, if there is one
+ *
+ * Nobody may be holding it.
+ */
+#define db_batch_commit(db) db_batch_commit_(__func__, (db))
+bool db_batch_commit_(const char *caller, struct db *db);
+
+/**
+ * db_checkpoint - Copy the write-ahead log back into the database
+ *
+ * A passive checkpoint, so it never blocks.  We turn off sqlite's own
+ * checkpoints (which happen inside whichever commit crosses the limit),
+ * so call this every so often in WAL mode.  Does nothing otherwise.
+ */
+bool db_checkpoint(struct db *db);
+
+/**
+ * db_stats - What each call site has done in the database
+ *
+ * Counted from sqlite's own trace of every statement, so db_exec() and
+ * db_query() are per caller, and db_prepare() statements are per query.
+ * COMMITs are per caller of db_commit_transaction() or db_batch_commit(),
+ * or of whichever write flushed the batch.
+ * Returns a tal_arr, those which have taken longest in total first.
+ */
+const struct db_stat **db_stats(const tal_t *ctx, const struct db *db);
+
 /**
  * db_set_intvar - Set an integer variable in the database
  *
@@ -79,4 +215,12 @@ s64 db_get_intvar(struct db *db, char *varname, s64 defval);
 bool sqlite3_column_hexval(sqlite3_stmt *s, int col, void *dest,
 			   size_t destlen);
 
+/**
+ * sqlite3_column_blobval - Helper to populate a binary field from a BLOB
+ *
+ * Fails if it's not exactly @destlen bytes (eg. NULL).
+ */
+bool sqlite3_column_blobval(sqlite3_stmt *s, int col, void *dest,
+			    size_t destlen);
+
 #endif /* WALLET_DB_H */
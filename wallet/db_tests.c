@@ -72,6 +72,256 @@ static bool test_vars(void)
 	return true;
 }
 
+static bool test_prepared(void)
+{
+	struct db *db = create_test_db(__func__);
+	const char *ins = "INSERT INTO vars (name, val) VALUES (?, ?);";
+	sqlite3_stmt *stmt, *stmt2;
+	CHECK(db);
+	CHECK(db_migrate(db));
+
+	/* Same call site, same statement. */
+	stmt = db_prepare(db, ins);
+	CHECK(stmt);
+	sqlite3_bind_text(stmt, 1, "a", -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, 1);
+	CHECK(db_exec_prepared(db, stmt));
+	stmt2 = db_prepare(db, ins);
+	CHECK(stmt2 == stmt);
+	sqlite3_bind_text(stmt2, 1, "b", -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt2, 2, 2);
+	CHECK(db_exec_prepared(db, stmt2));
+	CHECK(db_get_intvar(db, "a", 0) == 1);
+	CHECK(db_get_intvar(db, "b", 0) == 2);
+
+	/* Failing to execute leaves it usable. */
+	sqlite3_bind_text(stmt, 1, "a", -1, SQLITE_STATIC);
+	CHECK_MSG(!db_exec_prepared(db, stmt), "Duplicate name");
+	CHECK(db->err);
+	sqlite3_bind_text(stmt, 1, "c", -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, 3);
+	CHECK(db_exec_prepared(db, stmt));
+	CHECK(db_get_intvar(db, "c", 0) == 3);
+
+	CHECK_MSG(!db_prepare(db, "not a valid SQL statement"),
+		  "Failing to prepare");
+	CHECK(!db_exec_prepared(db, NULL));
+	/* Callers can be done with what they didn't get. */
+	db_stmt_done(NULL);
+
+	tal_free(db);
+	return true;
+}
+
+static bool test_unhex(void)
+{
+	struct db *db = create_test_db(__func__);
+	sqlite3_stmt *stmt;
+	u8 txid[32];
+	int i;
+	CHECK(db);
+	CHECK(db_migrate(db));
+	CHECK(db_get_intvar(db, "binary_fields", 0) == 1);
+
+	/* How things used to be stored. */
+	for (i = 0; i < 10; i++)
+		CHECK(db_exec(__func__, db, "INSERT INTO outputs (prev_out_tx, prev_out_index) VALUES ('%s', %i);",
+			      "0102030405060708091011121314151617181920212223242526272829303132", i));
+	CHECK(db_exec(__func__, db, "INSERT INTO peers (node_id) VALUES ('');"));
+	CHECK(db_set_intvar(db, "binary_fields", 0));
+	CHECK(db_migrate(db));
+	CHECK(db_get_intvar(db, "binary_fields", 0) == 1);
+
+	/* Every row, not just those the SELECT saw before we changed it. */
+	stmt = db_query(__func__, db, "SELECT COUNT(*) FROM outputs WHERE typeof(prev_out_tx)='blob';");
+	CHECK(stmt && sqlite3_step(stmt) == SQLITE_ROW);
+	CHECK(sqlite3_column_int(stmt, 0) == 10);
+	sqlite3_finalize(stmt);
+
+	stmt = db_query(__func__, db, "SELECT prev_out_tx FROM outputs;");
+	CHECK(stmt && sqlite3_step(stmt) == SQLITE_ROW);
+	CHECK(sqlite3_column_type(stmt, 0) == SQLITE_BLOB);
+	CHECK(sqlite3_column_blobval(stmt, 0, txid, sizeof(txid)));
+	CHECK(txid[0] == 0x01 && txid[31] == 0x32);
+	sqlite3_finalize(stmt);
+
+	stmt = db_query(__func__, db, "SELECT node_id FROM peers;");
+	CHECK(stmt && sqlite3_step(stmt) == SQLITE_ROW);
+	CHECK(sqlite3_column_type(stmt, 0) == SQLITE_NULL);
+	sqlite3_finalize(stmt);
+
+	/* Bad hex anywhere means we change nothing. */
+	CHECK(db_exec(__func__, db, "INSERT INTO peers (node_id) VALUES ('02');"));
+	CHECK(db_exec(__func__, db, "INSERT INTO peers (node_id) VALUES ('zz');"));
+	CHECK(db_set_intvar(db, "binary_fields", 0));
+	CHECK(!db_migrate(db));
+	CHECK(db_get_intvar(db, "binary_fields", 0) == 0);
+	stmt = db_query(__func__, db, "SELECT COUNT(*) FROM peers WHERE typeof(node_id)='text';");
+	CHECK(stmt && sqlite3_step(stmt) == SQLITE_ROW);
+	CHECK(sqlite3_column_int(stmt, 0) == 2);
+	sqlite3_finalize(stmt);
+
+	tal_free(db);
+	return true;
+}
+
+static bool test_batch(void)
+{
+	struct db *db = create_test_db(__func__);
+	CHECK(db);
+	CHECK(db_migrate(db));
+
+	/* Two writers share one transaction, until it's committed. */
+	CHECK(db_batch_hold(db));
+	CHECK(db_batch_hold(db));
+	CHECK(!sqlite3_get_autocommit(db->sql));
+	CHECK(db_set_intvar(db, "a", 1));
+	db_batch_release(db);
+	CHECK(db_set_intvar(db, "b", 2));
+	db_batch_release(db);
+	CHECK(!sqlite3_get_autocommit(db->sql));
+	CHECK(db_batch_commit(db));
+	CHECK(sqlite3_get_autocommit(db->sql));
+	CHECK(db_get_intvar(db, "a", 0) == 1);
+	CHECK(db_get_intvar(db, "b", 0) == 2);
+	CHECK(db_batch_commit(db));
+
+	/* A transaction inside the batch only undoes itself. */
+	CHECK(db_batch_hold(db));
+	CHECK(db_set_intvar(db, "a", 3));
+	CHECK(db_begin_transaction(db));
+	CHECK(db_set_intvar(db, "b", 4));
+	CHECK(db_rollback_transaction(db));
+	CHECK(db_begin_transaction(db));
+	CHECK(db_set_intvar(db, "c", 5));
+	CHECK(db_commit_transaction(db));
+	db_batch_release(db);
+	CHECK(db_get_intvar(db, "a", 0) == 3);
+	CHECK(db_get_intvar(db, "b", 0) == 2);
+	CHECK(db_get_intvar(db, "c", 0) == 5);
+
+	/* Someone else writing flushes the batch first. */
+	CHECK(!sqlite3_get_autocommit(db->sql));
+	CHECK(db_set_intvar(db, "d", 6));
+	CHECK(sqlite3_get_autocommit(db->sql));
+	CHECK(!db->in_batch);
+	CHECK(db_batch_commit(db));
+	CHECK(db_get_intvar(db, "c", 0) == 5);
+
+	tal_free(db);
+	return true;
+}
+
+static bool test_profile(void)
+{
+	struct db *db = create_test_db(__func__);
+	struct db_profile journal = db_profile_default;
+	sqlite3_stmt *stmt;
+	CHECK(db);
+	CHECK(db_set_profile(db, &db_profile_default));
+	CHECK(db_migrate(db));
+
+	stmt = db_query(__func__, db, "PRAGMA journal_mode;");
+	CHECK(stmt && sqlite3_step(stmt) == SQLITE_ROW);
+	CHECK(streq((const char *)sqlite3_column_text(stmt, 0), "wal"));
+	sqlite3_finalize(stmt);
+	stmt = db_query(__func__, db, "PRAGMA page_size;");
+	CHECK(stmt && sqlite3_step(stmt) == SQLITE_ROW);
+	CHECK(sqlite3_column_int(stmt, 0) == db_profile_default.page_size);
+	sqlite3_finalize(stmt);
+
+	/* Commits and checkpoints are timed. */
+	CHECK(db->timings.commits > 0);
+	CHECK(db_batch_hold(db));
+	CHECK(db_set_intvar(db, "a", 1));
+	db_batch_release(db);
+	CHECK(db_checkpoint(db));
+	CHECK(!db->in_batch);
+	CHECK(db->timings.checkpoints == 1);
+	tal_free(db);
+
+	/* Without WAL, there's nothing to checkpoint. */
+	db = create_test_db(__func__);
+	journal.wal = false;
+	CHECK(db_set_profile(db, &journal));
+	CHECK(db_migrate(db));
+	CHECK(db_checkpoint(db));
+	CHECK(db->timings.checkpoints == 0);
+	tal_free(db);
+	return true;
+}
+
+static const struct db_stat *find_stat(const struct db_stat **stats,
+				       const char *caller, const char *query)
+{
+	for (size_t i = 0; i < tal_count(stats); i++) {
+		if (!streq(stats[i]->caller, caller))
+			continue;
+		if (query ? stats[i]->query && streq(stats[i]->query, query)
+		    : !stats[i]->query)
+			return stats[i];
+	}
+	return NULL;
+}
+
+static bool test_stats(void)
+{
+	static const char insert[] = "INSERT INTO t VALUES (?, ?);";
+	static const char select[] = "SELECT a, b FROM t;";
+	struct db *db = create_test_db(__func__);
+	const struct db_stat **stats, *s;
+	sqlite3_stmt *stmt;
+	u8 blob[10];
+	u64 pages = 0;
+	int i;
+	CHECK(db);
+
+	memset(blob, 1, sizeof(blob));
+	CHECK(db_exec("setup", db, "CREATE TABLE t (a INTEGER, b BLOB);"));
+	CHECK(db_begin_transaction(db));
+	for (i = 0; i < 3; i++) {
+		stmt = db_prepare(db, insert);
+		sqlite3_bind_int(stmt, 1, i);
+		sqlite3_bind_blob(stmt, 2, blob, sizeof(blob), SQLITE_STATIC);
+		CHECK(db_exec_prepared(db, stmt));
+	}
+	CHECK(db_commit_transaction(db));
+
+	stmt = db_prepare(db, select);
+	while (sqlite3_step(stmt) == SQLITE_ROW);
+	db_stmt_done(stmt);
+	CHECK(db_exec(__func__, db, "UPDATE t SET a = 3 WHERE a = 2;"));
+	stmt = db_query(__func__, db, "SELECT a FROM t WHERE a > 0;");
+	while (sqlite3_step(stmt) == SQLITE_ROW);
+	sqlite3_finalize(stmt);
+
+	stats = db_stats(db, db);
+	for (i = 1; i < tal_count(stats); i++)
+		CHECK(!time_less(stats[i-1]->total, stats[i]->total));
+
+	/* Writes count the rows they change, reads what they return. */
+	s = find_stat(stats, __func__, insert);
+	CHECK(s && s->calls == 3 && s->rows == 3 && s->bytes == 0);
+	s = find_stat(stats, __func__, select);
+	CHECK(s && s->calls == 1 && s->rows == 3);
+	CHECK(s->bytes == 3 * (8 + sizeof(blob)));
+
+	/* db_exec and db_query are counted together, by caller. */
+	s = find_stat(stats, __func__, NULL);
+	CHECK(s && s->calls == 2 && s->rows == 3);
+
+	/* The commit is where the writing happens, for whoever committed. */
+	s = find_stat(stats, __func__, "COMMIT;");
+	CHECK(s && s->calls == 1 && s->pages > 0);
+	CHECK(!find_stat(stats, "db_commit", "COMMIT;"));
+	for (i = 0; i < tal_count(stats); i++)
+		pages += stats[i]->pages;
+	CHECK(pages > 0);
+
+	tal_free(db);
+	return true;
+}
+
 int main(void)
 {
 	bool ok = true;
@@ -79,6 +329,11 @@ int main(void)
 	ok &= test_empty_db_migrate();
 	ok &= test_vars();
 	ok &= test_primitives();
+	ok &= test_prepared();
+	ok &= test_unhex();
+	ok &= test_batch();
+	ok &= test_profile();
+	ok &= test_stats();
 
 	return !ok;
 }
@@ -1,40 +1,240 @@
 #include "wallet.h"
 
 #include <bitcoin/script.h>
-#include <ccan/str/hex/hex.h>
+#include <ccan/array_size/array_size.h>
+#include <ccan/asort/asort.h>
+#include <ccan/build_assert/build_assert.h>
+#include <ccan/crypto/ripemd160/ripemd160.h>
+#include <ccan/endian/endian.h>
+#include <ccan/intmap/intmap.h>
+#include <ccan/structeq/structeq.h>
 #include <ccan/tal/str/str.h>
+#include <daemon/timeout.h>
 #include <inttypes.h>
 #include <lightningd/lightningd.h>
 #include <lightningd/peer_control.h>
+#include <lightningd/onchain/onchain_wire.h>
 #include <lightningd/peer_htlcs.h>
 
 #define SQLITE_MAX_UINT 0x7FFFFFFFFFFFFFFF
 
-struct wallet *wallet_new(const tal_t *ctx, struct log *log)
+static u64 avg_usec(struct timerel total, u64 count)
+{
+	return count ? time_to_usec(total) / count : 0;
+}
+
+static void wallet_checkpoint(struct wallet *w)
+{
+	const struct db_timings *t = &w->db->timings;
+
+	if (!db_checkpoint(w->db))
+		log_unusual(w->log, "%s", w->db->err);
+
+	log_debug(w->log, "db: %"PRIu64" commits, avg %"PRIu64"usec"
+		  " (max %"PRIu64"); %"PRIu64" checkpoints,"
+		  " avg %"PRIu64"usec (max %"PRIu64")",
+		  t->commits, avg_usec(t->commit_time, t->commits),
+		  time_to_usec(t->commit_max),
+		  t->checkpoints, avg_usec(t->checkpoint_time, t->checkpoints),
+		  time_to_usec(t->checkpoint_max));
+
+	new_reltimer(w->timers, w, w->checkpoint_interval,
+		     wallet_checkpoint, w);
+}
+
+/* Where the time's going: the sites which have taken longest so far. */
+#define STATS_LOG_SITES 10
+
+static void wallet_log_stats(struct wallet *w)
+{
+	const struct db_stat **stats = db_stats(w, w->db);
+	size_t i;
+
+	for (i = 0; i < tal_count(stats) && i < STATS_LOG_SITES; i++)
+		log_info(w->log, "db: %s%s%s: %"PRIu64" calls,"
+			 " %"PRIu64"usec (max %"PRIu64"), %"PRIu64" rows,"
+			 " %"PRIu64" bytes, %"PRIu64" pages written",
+			 stats[i]->caller, stats[i]->query ? " " : "",
+			 stats[i]->query ? stats[i]->query : "",
+			 stats[i]->calls, time_to_usec(stats[i]->total),
+			 time_to_usec(stats[i]->max), stats[i]->rows,
+			 stats[i]->bytes, stats[i]->pages);
+	tal_free(stats);
+
+	new_reltimer(w->timers, w, w->stats_interval, wallet_log_stats, w);
+}
+
+struct wallet *wallet_new(const tal_t *ctx, struct log *log,
+			  struct timers *timers,
+			  const struct db_profile *profile,
+			  struct timerel commit_window,
+			  struct timerel checkpoint_interval,
+			  struct timerel stats_interval)
 {
 	struct wallet *wallet = tal(ctx, struct wallet);
-	wallet->db = db_setup(wallet);
+	wallet->db = db_setup(wallet, profile);
 	wallet->log = log;
 	wallet->bip32_base = NULL;
+	wallet->available = NULL;
+	wallet->timers = timers;
+	wallet->commit_window = commit_window;
+	wallet->commit_timer = NULL;
+	list_head_init(&wallet->commit_waiters);
+	wallet->checkpoint_interval = checkpoint_interval;
+	wallet->stats_interval = stats_interval;
 	if (!wallet->db) {
 		fatal("Unable to setup the wallet database");
 	}
+	if (profile->wal)
+		new_reltimer(timers, wallet, checkpoint_interval,
+			     wallet_checkpoint, wallet);
+	if (time_to_msec(stats_interval))
+		new_reltimer(timers, wallet, stats_interval,
+			     wallet_log_stats, wallet);
 	return wallet;
 }
 
+struct commit_waiter {
+	struct list_node list;
+	void (*cb)(void *arg);
+	void *arg;
+};
+
+static void destroy_commit_waiter(struct commit_waiter *cw)
+{
+	list_del(&cw->list);
+}
+
+static void wallet_batch_commit(struct wallet *w)
+{
+	struct commit_waiter *cw;
+
+	w->commit_timer = NULL;
+	if (!db_batch_commit(w->db))
+		fatal("Could not commit to database: %s", w->db->err);
+
+	while ((cw = list_top(&w->commit_waiters, struct commit_waiter, list))
+	       != NULL) {
+		void (*cb)(void *arg) = cw->cb;
+		void *arg = cw->arg;
+
+		/* Unhooks itself; cb may well free its ctx. */
+		tal_free(cw);
+		cb(arg);
+	}
+}
+
+void wallet_batch_start(struct wallet *w)
+{
+	if (!db_batch_hold(w->db))
+		fatal("Could not start database batch: %s", w->db->err);
+	if (!w->commit_timer)
+		w->commit_timer = new_reltimer(w->timers, w, w->commit_window,
+					       wallet_batch_commit, w);
+}
+
+void wallet_batch_end(struct wallet *w)
+{
+	db_batch_release(w->db);
+}
+
+void wallet_after_commit_(struct wallet *w, const tal_t *ctx,
+			  void (*cb)(void *arg), void *arg)
+{
+	struct commit_waiter *cw;
+
+	/* Nothing pending?  It's already on disk. */
+	if (!w->commit_timer) {
+		cb(arg);
+		return;
+	}
+
+	cw = tal(ctx, struct commit_waiter);
+	cw->cb = cb;
+	cw->arg = arg;
+	list_add_tail(&w->commit_waiters, &cw->list);
+	tal_add_destructor(cw, destroy_commit_waiter);
+}
+
+static int cmp_utxo_amount(struct utxo *const *a, struct utxo *const *b,
+			   void *unused)
+{
+	if ((*a)->amount < (*b)->amount)
+		return -1;
+	return (*a)->amount > (*b)->amount;
+}
+
+/* First of @avail (ascending) with at least @amount. */
+static size_t available_lower_bound(struct utxo **avail, u64 amount)
+{
+	size_t lo = 0, hi = tal_count(avail);
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (avail[mid]->amount < amount)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static struct utxo **wallet_available(struct wallet *w)
+{
+	if (!w->available) {
+		w->available = wallet_get_utxos(w, w, output_state_available);
+		if (!w->available)
+			fatal("Unable to load outputs: %s", w->db->err);
+		asort(w->available, tal_count(w->available), cmp_utxo_amount,
+		      NULL);
+	}
+	return w->available;
+}
+
+static struct utxo *available_add(struct wallet *w, const struct utxo *utxo)
+{
+	size_t n, i;
+
+	/* Not loaded?  We'll get it from the db when it is. */
+	if (!w->available)
+		return NULL;
+
+	n = tal_count(w->available);
+	i = available_lower_bound(w->available, utxo->amount);
+	tal_resize(&w->available, n + 1);
+	memmove(w->available + i + 1, w->available + i,
+		(n - i) * sizeof(w->available[0]));
+	w->available[i] = tal_dup(w->available, struct utxo, utxo);
+	w->available[i]->status = output_state_available;
+	return w->available[i];
+}
+
 bool wallet_add_utxo(struct wallet *w, struct utxo *utxo,
 		     enum wallet_output_type type)
 {
-	tal_t *tmpctx = tal_tmpctx(w);
-	char *hextxid = tal_hexstr(tmpctx, &utxo->txid, 32);
-	bool result = db_exec(
-	    __func__, w->db,
+	sqlite3_stmt *stmt = db_prepare(
+	    w->db,
 	    "INSERT INTO outputs (prev_out_tx, prev_out_index, value, type, "
-	    "status, keyindex) VALUES ('%s', %d, %zu, %d, %d, %d);",
-	    hextxid, utxo->outnum, utxo->amount, type, output_state_available,
-	    utxo->keyindex);
-	tal_free(tmpctx);
-	return result;
+	    "status, keyindex) VALUES (?, ?, ?, ?, ?, ?);");
+	struct utxo *added;
+
+	if (!stmt)
+		return false;
+
+	sqlite3_bind_blob(stmt, 1, &utxo->txid, sizeof(utxo->txid),
+			  SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 2, utxo->outnum);
+	sqlite3_bind_int64(stmt, 3, utxo->amount);
+	sqlite3_bind_int(stmt, 4, type);
+	sqlite3_bind_int(stmt, 5, output_state_available);
+	sqlite3_bind_int(stmt, 6, utxo->keyindex);
+	if (!db_exec_prepared(w->db, stmt))
+		return false;
+
+	added = available_add(w, utxo);
+	if (added)
+		added->is_p2sh = (type == p2sh_wpkh);
+	return true;
 }
 
 /**
@@ -44,10 +244,9 @@ bool wallet_add_utxo(struct wallet *w, struct utxo *utxo,
  */
 static bool wallet_stmt2output(sqlite3_stmt *stmt, struct utxo *utxo)
 {
-	const unsigned char *hextxid = sqlite3_column_text(stmt, 0);
-	hex_decode((const char*)hextxid, sizeof(utxo->txid) * 2, &utxo->txid, sizeof(utxo->txid));
+	sqlite3_column_blobval(stmt, 0, &utxo->txid, sizeof(utxo->txid));
 	utxo->outnum = sqlite3_column_int(stmt, 1);
-	utxo->amount = sqlite3_column_int(stmt, 2);
+	utxo->amount = sqlite3_column_int64(stmt, 2);
 	utxo->is_p2sh = sqlite3_column_int(stmt, 3) == p2sh_wpkh;
 	utxo->status = sqlite3_column_int(stmt, 4);
 	utxo->keyindex = sqlite3_column_int(stmt, 5);
@@ -59,23 +258,86 @@ bool wallet_update_output_status(struct wallet *w,
 				 const u32 outnum, enum output_status oldstatus,
 				 enum output_status newstatus)
 {
-	tal_t *tmpctx = tal_tmpctx(w);
-	char *hextxid = tal_hexstr(tmpctx, txid, sizeof(*txid));
+	sqlite3_stmt *stmt;
+
 	if (oldstatus != output_state_any) {
-		db_exec(__func__, w->db,
-			"UPDATE outputs SET status=%d WHERE status=%d "
-			"AND prev_out_tx = '%s' AND prev_out_index = "
-			"%d;",
-			newstatus, oldstatus, hextxid, outnum);
+		stmt = db_prepare(w->db,
+				  "UPDATE outputs SET status=?3 WHERE status=?4 "
+				  "AND prev_out_tx=?1 AND prev_out_index=?2;");
+		if (stmt)
+			sqlite3_bind_int(stmt, 4, oldstatus);
 	} else {
-		db_exec(__func__, w->db,
-			"UPDATE outputs SET status=%d WHERE "
-			"AND prev_out_tx = '%s' AND prev_out_index = "
-			"%d;",
-			newstatus, hextxid, outnum);
+		stmt = db_prepare(w->db,
+				  "UPDATE outputs SET status=?3 WHERE "
+				  "prev_out_tx=?1 AND prev_out_index=?2;");
 	}
-	tal_free(tmpctx);
-	return sqlite3_changes(w->db->sql) > 0;
+	if (!stmt)
+		return false;
+
+	sqlite3_bind_blob(stmt, 1, txid, sizeof(*txid), SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 2, outnum);
+	sqlite3_bind_int(stmt, 3, newstatus);
+	if (!db_exec_prepared(w->db, stmt) || sqlite3_changes(w->db->sql) == 0)
+		return false;
+
+	/* Behind our back: reload the available ones next time. */
+	if (oldstatus == output_state_available
+	    || oldstatus == output_state_any
+	    || newstatus == output_state_available)
+		w->available = tal_free(w->available);
+	return true;
+}
+
+/* How many outputs update_outputs_status does in one statement. */
+#define STATUS_BATCH 8
+
+/* Change them all from @oldstatus to @newstatus: fails unless they all were. */
+static bool update_outputs_status(struct wallet *w, const struct utxo **utxos,
+				  enum output_status oldstatus,
+				  enum output_status newstatus)
+{
+	size_t i, j, n, num = tal_count(utxos);
+	bool multi = num > STATUS_BATCH;
+
+	if (multi && !db_begin_transaction(w->db))
+		return false;
+
+	for (i = 0; i < num; i += n) {
+		/* Unused slots just repeat the last one. */
+		sqlite3_stmt *stmt = db_prepare(w->db,
+			"UPDATE outputs SET status=?1 WHERE status=?2 AND ("
+			"(prev_out_tx=?3 AND prev_out_index=?4) OR "
+			"(prev_out_tx=?5 AND prev_out_index=?6) OR "
+			"(prev_out_tx=?7 AND prev_out_index=?8) OR "
+			"(prev_out_tx=?9 AND prev_out_index=?10) OR "
+			"(prev_out_tx=?11 AND prev_out_index=?12) OR "
+			"(prev_out_tx=?13 AND prev_out_index=?14) OR "
+			"(prev_out_tx=?15 AND prev_out_index=?16) OR "
+			"(prev_out_tx=?17 AND prev_out_index=?18));");
+
+		if (!stmt)
+			goto fail;
+
+		n = num - i < STATUS_BATCH ? num - i : STATUS_BATCH;
+		sqlite3_bind_int(stmt, 1, newstatus);
+		sqlite3_bind_int(stmt, 2, oldstatus);
+		for (j = 0; j < STATUS_BATCH; j++) {
+			const struct utxo *u = utxos[i + (j < n ? j : n - 1)];
+			sqlite3_bind_blob(stmt, 3 + j * 2, &u->txid,
+					  sizeof(u->txid), SQLITE_STATIC);
+			sqlite3_bind_int(stmt, 4 + j * 2, u->outnum);
+		}
+		if (!db_exec_prepared(w->db, stmt)
+		    || sqlite3_changes(w->db->sql) != (int)n)
+			goto fail;
+	}
+
+	return !multi || db_commit_transaction(w->db);
+
+fail:
+	if (multi)
+		db_rollback_transaction(w->db);
+	return false;
 }
 
 struct utxo **wallet_get_utxos(const tal_t *ctx, struct wallet *w, const enum output_status state)
@@ -83,56 +345,175 @@ struct utxo **wallet_get_utxos(const tal_t *ctx, struct wallet *w, const enum ou
 	struct utxo **results;
 	int i;
 	sqlite3_stmt *stmt =
-	    db_query(__func__, w->db, "SELECT prev_out_tx, prev_out_index, "
-				      "value, type, status, keyindex FROM "
-				      "outputs WHERE status=%d OR %d=255",
-		     state, state);
+	    db_prepare(w->db, "SELECT prev_out_tx, prev_out_index, "
+			      "value, type, status, keyindex FROM "
+			      "outputs WHERE status=?1 OR ?1=255");
 
 	if (!stmt)
 		return NULL;
 
+	sqlite3_bind_int(stmt, 1, state);
 	results = tal_arr(ctx, struct utxo*, 0);
 	for (i=0; sqlite3_step(stmt) == SQLITE_ROW; i++) {
 		tal_resize(&results, i+1);
 		results[i] = tal(results, struct utxo);
 		wallet_stmt2output(stmt, results[i]);
 	}
-	sqlite3_finalize(stmt);
+	db_stmt_done(stmt);
 
 	return results;
 }
 
-/**
- * unreserve_utxo - Mark a reserved UTXO as available again
- */
-static void unreserve_utxo(struct wallet *w, const struct utxo *unres)
-{
-	if (!wallet_update_output_status(w, &unres->txid, unres->outnum,
-					 output_state_reserved,
-					 output_state_available)) {
-		fatal("Unable to unreserve output: %s", w->db->err);
-	}
-}
-
 /**
  * destroy_utxos - Destructor for an array of pointers to utxo
+ *
+ * Marks the reserved UTXOs available again.
  */
 static void destroy_utxos(const struct utxo **utxos, struct wallet *w)
 {
+	if (!update_outputs_status(w, utxos, output_state_reserved,
+				   output_state_available))
+		fatal("Unable to unreserve outputs: %s", w->db->err);
+
 	for (size_t i = 0; i < tal_count(utxos); i++)
-		unreserve_utxo(w, utxos[i]);
+		available_add(w, utxos[i]);
 }
 
 void wallet_confirm_utxos(struct wallet *w, const struct utxo **utxos)
 {
 	tal_del_destructor2(utxos, destroy_utxos, w);
-	for (size_t i = 0; i < tal_count(utxos); i++) {
-		if (!wallet_update_output_status(
-			w, &utxos[i]->txid, utxos[i]->outnum,
-			output_state_reserved, output_state_spent)) {
-			fatal("Unable to mark output as spent: %s", w->db->err);
+	if (!update_outputs_status(w, utxos, output_state_reserved,
+				   output_state_spent))
+		fatal("Unable to mark outputs as spent: %s", w->db->err);
+}
+
+/* We assume two outputs for the weight. */
+#define BASE_WEIGHT ((4 + (8 + 22) * 2 + 4) * 4)
+
+/* Callers drop change below dust, so that much excess needs no change. */
+#define CHANGE_WINDOW 546
+
+/* How many outputs we usually consider, and for how long we search among
+ * them for a selection which needs no change. */
+#define MAX_SELECT_COINS 1000
+#define BNB_TRIES 100000
+
+static u64 input_weight(const struct utxo *utxo)
+{
+	u64 weight = (32 + 4 + 4) * 4;
+
+	if (utxo->is_p2sh)
+		weight += 22 * 4;
+
+	/* Account for witness (1 byte count + sig + key */
+	return weight + 1 + (1 + 73 + 1 + 33);
+}
+
+/* Rounded up, so the parts never add up to less than the whole. */
+static u64 weight_fee(u64 weight, u32 feerate_per_kw)
+{
+	return (weight * feerate_per_kw + 999) / 1000;
+}
+
+/* An available output, and what it's worth once it's paid for itself. */
+struct coin {
+	size_t idx;
+	u64 value;
+};
+
+/**
+ * select_bnb - Branch and bound for coins worth @target to @target + @window
+ *
+ * Depth first, including each coin before excluding it, and giving up
+ * on a branch once it's over or can no longer reach @target.
+ */
+static bool select_bnb(const tal_t *ctx, const struct coin *coins, size_t n,
+		       u64 target, u64 window, bool *chosen)
+{
+	u64 *rest = tal_arr(ctx, u64, n + 1);
+	bool *cur = tal_arrz(ctx, bool, n);
+	size_t i, depth = 0, tries;
+	u64 sum = 0;
+	bool found = false;
+
+	/* rest[i] is what coins i onwards are worth. */
+	rest[n] = 0;
+	for (i = n; i > 0; i--)
+		rest[i-1] = rest[i] + coins[i-1].value;
+
+	for (tries = 0; tries < BNB_TRIES; tries++) {
+		if (sum + rest[depth] >= target && sum <= target + window) {
+			if (sum >= target) {
+				memcpy(chosen, cur, n * sizeof(*cur));
+				found = true;
+				break;
+			}
+			/* Try including the next one. */
+			cur[depth] = true;
+			sum += coins[depth++].value;
+			continue;
 		}
+
+		/* Back to the last one we included, and exclude it. */
+		while (depth > 0 && !cur[depth-1])
+			depth--;
+		if (depth == 0)
+			break;
+		cur[depth-1] = false;
+		sum -= coins[depth-1].value;
+	}
+	tal_free(rest);
+	tal_free(cur);
+	return found;
+}
+
+/**
+ * select_knapsack - Coins worth at least @target, with change
+ *
+ * Either the smallest which does it alone, or the largest of those
+ * which don't until they do together, whichever overshoots less.
+ */
+static bool select_knapsack(const struct coin *coins, size_t n, u64 target,
+			    bool *chosen)
+{
+	size_t i, larger = n;
+	u64 sum = 0;
+
+	memset(chosen, 0, n * sizeof(*chosen));
+	for (i = 0; i < n; i++) {
+		if (coins[i].value >= target) {
+			if (larger == n || coins[i].value < coins[larger].value)
+				larger = i;
+			continue;
+		}
+		if (sum < target) {
+			chosen[i] = true;
+			sum += coins[i].value;
+		}
+	}
+
+	if (larger != n && (sum < target || coins[larger].value <= sum)) {
+		memset(chosen, 0, n * sizeof(*chosen));
+		chosen[larger] = true;
+		return true;
 	}
+	return sum >= target;
+}
+
+/* Largest first, skipping any which cost more than they're worth. */
+static size_t available_coins(struct utxo **avail, size_t lo, size_t end,
+			      u32 feerate_per_kw, struct coin *coins)
+{
+	size_t i, n = 0;
+
+	for (i = end; i > lo; i--) {
+		u64 fee = weight_fee(input_weight(avail[i-1]), feerate_per_kw);
+		if (avail[i-1]->amount <= fee)
+			continue;
+		coins[n].idx = i-1;
+		coins[n++].value = avail[i-1]->amount - fee;
+	}
+	return n;
 }
 
 const struct utxo **wallet_select_coins(const tal_t *ctx, struct wallet *w,
@@ -140,212 +521,325 @@ const struct utxo **wallet_select_coins(const tal_t *ctx, struct wallet *w,
 					const u32 feerate_per_kw,
 					u64 *fee_estimate, u64 *changesatoshi)
 {
-	size_t i = 0;
-	struct utxo **available;
-	const struct utxo **utxos = tal_arr(ctx, const struct utxo *, 0);
-	*fee_estimate = 0;
+	struct utxo **avail = wallet_available(w);
+	size_t i, n, lo, end, num = tal_count(avail), first, off;
+	struct coin *coins;
+	const struct utxo **utxos;
+	u64 target = value + weight_fee(BASE_WEIGHT, feerate_per_kw);
+	u64 satoshi_in = 0, weight = BASE_WEIGHT;
+	struct utxo p2sh;
+	bool *chosen;
+
+	/* Anything above this covers it alone: we only want the smallest. */
+	p2sh.is_p2sh = true;
+	end = available_lower_bound(avail, target + CHANGE_WINDOW
+				    + weight_fee(input_weight(&p2sh),
+						 feerate_per_kw) + 1);
+	if (end < num)
+		end++;
+
+	/* Usually the largest of the rest will do; otherwise, all of them. */
+	lo = end > MAX_SELECT_COINS ? end - MAX_SELECT_COINS : 0;
+	coins = tal_arr(ctx, struct coin, end - lo);
+	chosen = tal_arr(coins, bool, end - lo);
+	for (;;) {
+		n = available_coins(avail, lo, end, feerate_per_kw, coins);
+
+		/* Ideally no change at all; otherwise enough that it's not
+		 * dust. */
+		memset(chosen, 0, n * sizeof(*chosen));
+		if (select_bnb(coins, coins, n, target, CHANGE_WINDOW, chosen)
+		    || select_knapsack(coins, n, target + CHANGE_WINDOW, chosen)
+		    || select_knapsack(coins, n, target, chosen))
+			break;
 
-	/* We assume two outputs for the weight. */
-	u64 satoshi_in = 0, weight = (4 + (8 + 22) * 2 + 4) * 4;
-	tal_add_destructor2(utxos, destroy_utxos, w);
+		if (lo == 0) {
+			tal_free(coins);
+			return NULL;
+		}
+		lo = 0;
+		tal_resize(&coins, end);
+		tal_resize(&chosen, end);
+	}
 
-	if (!db_begin_transaction(w->db)) {
-		fatal("Unable to begin transaction: %s", w->db->err);
+	utxos = tal_arr(ctx, const struct utxo *, 0);
+	first = num;
+	for (i = 0; i < n; i++) {
+		struct utxo *u;
+
+		if (!chosen[i])
+			continue;
+		if (coins[i].idx < first)
+			first = coins[i].idx;
+		u = avail[coins[i].idx];
+		/* Marks our place, for taking them out of avail below. */
+		avail[coins[i].idx] = NULL;
+		u->status = output_state_reserved;
+		weight += input_weight(u);
+		satoshi_in += u->amount;
+		tal_resize(&utxos, tal_count(utxos) + 1);
+		utxos[tal_count(utxos) - 1] = tal_steal(utxos, u);
 	}
-	available = wallet_get_utxos(ctx, w, output_state_available);
+	tal_free(coins);
 
-	for (i = 0; i < tal_count(available); i++) {
-		tal_resize(&utxos, i + 1);
-		utxos[i] = tal_steal(utxos, available[i]);
+	for (i = first, off = 0; i < num; i++) {
+		if (avail[i])
+			avail[i - off] = avail[i];
+		else
+			off++;
+	}
+	tal_resize(&w->available, num - off);
 
-		if (!wallet_update_output_status(
-			w, &available[i]->txid, available[i]->outnum,
-			output_state_available, output_state_reserved))
-			fatal("Unable to reserve output: %s", w->db->err);
+	if (!update_outputs_status(w, utxos, output_state_available,
+				   output_state_reserved))
+		fatal("Unable to reserve outputs: %s", w->db->err);
+	tal_add_destructor2(utxos, destroy_utxos, w);
 
-		weight += (32 + 4 + 4) * 4;
-		if (utxos[i]->is_p2sh)
-			weight += 22 * 4;
+	*fee_estimate = weight * feerate_per_kw / 1000;
+	assert(satoshi_in >= *fee_estimate + value);
+	*changesatoshi = satoshi_in - value - *fee_estimate;
+	return utxos;
+}
 
-		/* Account for witness (1 byte count + sig + key */
-		weight += 1 + (1 + 73 + 1 + 33);
-		*fee_estimate = weight * feerate_per_kw / 1000;
-		satoshi_in += utxos[i]->amount;
-		if (satoshi_in >= *fee_estimate + value)
-			break;
-	}
-	tal_free(available);
+static bool wallet_add_script(struct wallet *w, const u8 *script,
+			      u32 index, bool is_p2sh)
+{
+	sqlite3_stmt *stmt = db_prepare(
+	    w->db,
+	    "INSERT OR REPLACE INTO our_scripts (script, keyindex, is_p2sh)"
+	    " VALUES (?, ?, ?);");
 
-	if (satoshi_in < *fee_estimate + value) {
-		/* Could not collect enough inputs, cleanup and bail */
-		utxos = tal_free(utxos);
-		db_rollback_transaction(w->db);
-	} else {
-		/* Commit the db transaction to persist markings */
-		db_commit_transaction(w->db);
-		*changesatoshi = satoshi_in - value - *fee_estimate;
+	if (!stmt)
+		return false;
 
-	}
-	return utxos;
+	sqlite3_bind_blob(stmt, 1, script, tal_len(script), SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, index);
+	sqlite3_bind_int(stmt, 3, is_p2sh);
+	return db_exec_prepared(w->db, stmt);
 }
 
-bool wallet_can_spend(struct wallet *w, const u8 *script,
-		      u32 *index, bool *output_is_p2sh)
+/**
+ * wallet_add_scripts - Remember our scripts for every index handed out
+ *
+ * Each index has a p2wpkh script, and a p2sh one wrapping it.  We note
+ * how far we've got, so this catches up with anyone who's bumped
+ * bip32_max_index directly (and with databases from before we did it).
+ */
+static bool wallet_add_scripts(struct wallet *w)
 {
-	struct ext_key ext;
-	u64 bip32_max_index = db_get_intvar(w->db, "bip32_max_index", 0);
-	u32 i;
+	u64 max = db_get_intvar(w->db, "bip32_max_index", 0);
+	u64 next = db_get_intvar(w->db, "our_scripts_next", 0);
 
-	/* If not one of these, can't be for us. */
-	if (is_p2sh(script))
-		*output_is_p2sh = true;
-	else if (is_p2wpkh(script))
-		*output_is_p2sh = false;
-	else
+	if (next > max)
+		return true;
+
+	if (!db_begin_transaction(w->db))
 		return false;
 
-	for (i = 0; i <= bip32_max_index; i++) {
-		u8 *s;
+	for (; next <= max; next++) {
+		struct ext_key ext;
+		u8 *s, *p2sh;
+		bool ok;
 
-		if (bip32_key_from_parent(w->bip32_base, i,
+		if (bip32_key_from_parent(w->bip32_base, next,
 					  BIP32_FLAG_KEY_PUBLIC, &ext)
 		    != WALLY_OK) {
 			abort();
 		}
 		s = scriptpubkey_p2wpkh_derkey(w, ext.pub_key);
-		if (*output_is_p2sh) {
-			u8 *p2sh = scriptpubkey_p2sh(w, s);
-			tal_free(s);
-			s = p2sh;
-		}
-		if (scripteq(s, script)) {
-			tal_free(s);
-			*index = i;
-			return true;
-		}
+		p2sh = scriptpubkey_p2sh(w, s);
+		ok = wallet_add_script(w, s, next, false)
+			&& wallet_add_script(w, p2sh, next, true);
 		tal_free(s);
+		tal_free(p2sh);
+		if (!ok)
+			goto fail;
 	}
+
+	if (!db_set_intvar(w->db, "our_scripts_next", next))
+		goto fail;
+	return db_commit_transaction(w->db);
+
+fail:
+	db_rollback_transaction(w->db);
 	return false;
 }
 
+bool wallet_can_spend(struct wallet *w, const u8 *script,
+		      u32 *index, bool *output_is_p2sh)
+{
+	sqlite3_stmt *stmt;
+	bool found;
+
+	/* If not one of these, can't be for us. */
+	if (!is_p2sh(script) && !is_p2wpkh(script))
+		return false;
+
+	if (!wallet_add_scripts(w))
+		fatal("Could not add our scripts: %s", w->db->err);
+
+	stmt = db_prepare(w->db, "SELECT keyindex, is_p2sh FROM our_scripts"
+			  " WHERE script=?;");
+	if (!stmt)
+		fatal("Could not look up our scripts: %s", w->db->err);
+
+	sqlite3_bind_blob(stmt, 1, script, tal_len(script), SQLITE_STATIC);
+	found = (sqlite3_step(stmt) == SQLITE_ROW);
+	if (found) {
+		*index = sqlite3_column_int64(stmt, 0);
+		*output_is_p2sh = sqlite3_column_int(stmt, 1);
+	}
+	db_stmt_done(stmt);
+	return found;
+}
+
 s64 wallet_get_newindex(struct lightningd *ld)
 {
-	u64 newidx = db_get_intvar(ld->wallet->db, "bip32_max_index", 0) + 1;
+	struct wallet *w = ld->wallet;
+	u64 newidx = db_get_intvar(w->db, "bip32_max_index", 0) + 1;
 
 	if (newidx == BIP32_INITIAL_HARDENED_CHILD)
 		return -1;
 
-	db_set_intvar(ld->wallet->db, "bip32_max_index", newidx);
+	db_set_intvar(w->db, "bip32_max_index", newidx);
+
+	/* Without the HSM's key, wallet_can_spend will catch up. */
+	if (w->bip32_base && !wallet_add_scripts(w))
+		fatal("Could not add our scripts: %s", w->db->err);
 	return newidx;
 }
 
+/* How each of known[] is packed into the shachains row. */
+struct packed_known {
+	be64 index;
+	struct sha256 hash;
+};
+
 bool wallet_shachain_init(struct wallet *wallet, struct wallet_shachain *chain)
 {
+	sqlite3_stmt *stmt;
+
 	/* Create shachain */
 	shachain_init(&chain->chain);
-	if (!db_exec(
-		__func__, wallet->db,
-		"INSERT INTO shachains (min_index, num_valid) VALUES (%"PRIu64",0);",
-		chain->chain.min_index)) {
+	stmt = db_prepare(
+	    wallet->db,
+	    "INSERT INTO shachains (min_index, num_valid, known)"
+	    " VALUES (?, 0, x'');");
+	if (!stmt)
+		return false;
+	sqlite3_bind_int64(stmt, 1, chain->chain.min_index);
+	if (!db_exec_prepared(wallet->db, stmt))
 		return false;
-	}
 	chain->id = sqlite3_last_insert_rowid(wallet->db->sql);
 	return true;
 }
 
-/* TODO(cdecker) Stolen from shachain, move to some appropriate location */
-static unsigned int count_trailing_zeroes(uint64_t index)
-{
-#if HAVE_BUILTIN_CTZLL
-	return index ? (unsigned int)__builtin_ctzll(index) : SHACHAIN_BITS;
-#else
-	unsigned int i;
-
-	for (i = 0; i < SHACHAIN_BITS; i++) {
-		if (index & (1ULL << i))
-			break;
-	}
-	return i;
-#endif
-}
-
 bool wallet_shachain_add_hash(struct wallet *wallet,
 			      struct wallet_shachain *chain,
 			      uint64_t index,
 			      const struct sha256 *hash)
 {
-	tal_t *tmpctx = tal_tmpctx(wallet);
-	bool ok = true;
-	u32 pos = count_trailing_zeroes(index);
+	struct packed_known known[ARRAY_SIZE(chain->chain.known)];
+	sqlite3_stmt *stmt;
+	unsigned int i;
+
+	/* No padding, so the db is the same everywhere. */
+	BUILD_ASSERT(sizeof(struct packed_known) == 40);
+
 	assert(index < SQLITE_MAX_UINT);
-	char *hexhash = tal_hexstr(tmpctx, hash, sizeof(struct sha256));
-	if (!shachain_add_hash(&chain->chain, index, hash)) {
-		tal_free(tmpctx);
+	if (!shachain_add_hash(&chain->chain, index, hash))
 		return false;
-	}
 
-	db_begin_transaction(wallet->db);
+	/* It's only ~2k, so we simply rewrite the lot: one row, in
+	 * whatever batch we're in. */
+	for (i = 0; i < chain->chain.num_valid; i++) {
+		known[i].index = cpu_to_be64(chain->chain.known[i].index);
+		known[i].hash = chain->chain.known[i].hash;
+	}
 
-	ok &= db_exec(__func__, wallet->db,
-		      "UPDATE shachains SET num_valid=%d, min_index=%" PRIu64
-		      " WHERE id=%" PRIu64,
-		      chain->chain.num_valid, index, chain->id);
+	stmt = db_prepare(wallet->db,
+			  "UPDATE shachains SET num_valid=?, min_index=?, known=?"
+			  " WHERE id=?");
+	if (!stmt)
+		return false;
+	sqlite3_bind_int(stmt, 1, chain->chain.num_valid);
+	sqlite3_bind_int64(stmt, 2, chain->chain.min_index);
+	sqlite3_bind_blob(stmt, 3, known, i * sizeof(known[0]),
+			  SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 4, chain->id);
+	return db_exec_prepared(wallet->db, stmt);
+}
 
-	ok &= db_exec(__func__, wallet->db,
-		      "REPLACE INTO shachain_known "
-		      "(shachain_id, pos, idx, hash) VALUES "
-		      "(%" PRIu64 ", %d, %" PRIu64 ", '%s');",
-		      chain->id, pos, index, hexhash);
+/* Before we packed them, each of known[] was a row of its own. */
+static bool wallet_shachain_load_rows(struct wallet *wallet,
+				      struct wallet_shachain *chain)
+{
+	sqlite3_stmt *stmt = db_prepare(
+	    wallet->db,
+	    "SELECT idx, hash, pos FROM shachain_known WHERE shachain_id=?");
 
-	if (ok)
-		ok &= db_commit_transaction(wallet->db);
-	else
-		db_rollback_transaction(wallet->db);
-	tal_free(tmpctx);
-	return ok;
+	if (!stmt)
+		return false;
+	sqlite3_bind_int64(stmt, 1, chain->id);
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		int pos = sqlite3_column_int(stmt, 2);
+		chain->chain.known[pos].index = sqlite3_column_int64(stmt, 0);
+		sqlite3_column_blobval(stmt, 1, &chain->chain.known[pos].hash,
+				       sizeof(struct sha256));
+	}
+	db_stmt_done(stmt);
+	return true;
 }
 
-bool wallet_shachain_load(struct wallet *wallet, u64 id,
+/* min_index, num_valid and known from the shachains table, from @col. */
+static bool stmt2shachain(struct wallet *wallet, sqlite3_stmt *stmt, int col,
 			  struct wallet_shachain *chain)
 {
-	int err;
-	sqlite3_stmt *stmt;
-	chain->id = id;
-	shachain_init(&chain->chain);
+	const u8 *known;
+	unsigned int i;
 
-	/* Load shachain metadata */
-	stmt = db_query(
-	    __func__, wallet->db,
-	    "SELECT min_index, num_valid FROM shachains WHERE id=%" PRIu64, id);
-	if (!stmt)
+	shachain_init(&chain->chain);
+	chain->chain.min_index = sqlite3_column_int64(stmt, col);
+	chain->chain.num_valid = sqlite3_column_int64(stmt, col + 1);
+	if (chain->chain.num_valid > ARRAY_SIZE(chain->chain.known))
 		return false;
-	err = sqlite3_step(stmt);
-	if (err != SQLITE_ROW) {
-		sqlite3_finalize(stmt);
+
+	if (sqlite3_column_type(stmt, col + 2) == SQLITE_NULL)
+		return wallet_shachain_load_rows(wallet, chain);
+
+	known = sqlite3_column_blob(stmt, col + 2);
+	if (sqlite3_column_bytes(stmt, col + 2)
+	    != chain->chain.num_valid * sizeof(struct packed_known))
 		return false;
-	}
 
-	chain->chain.min_index = sqlite3_column_int64(stmt, 0);
-	chain->chain.num_valid = sqlite3_column_int64(stmt, 1);
-	sqlite3_finalize(stmt);
+	for (i = 0; i < chain->chain.num_valid; i++) {
+		struct packed_known k;
+
+		/* sqlite doesn't promise to align it. */
+		memcpy(&k, known + i * sizeof(k), sizeof(k));
+		chain->chain.known[i].index = be64_to_cpu(k.index);
+		chain->chain.known[i].hash = k.hash;
+	}
+	return true;
+}
 
-	/* Load shachain known entries */
-	stmt = db_query(
-	    __func__, wallet->db,
-	    "SELECT idx, hash, pos FROM shachain_known WHERE shachain_id=%" PRIu64,
-	    id);
+bool wallet_shachain_load(struct wallet *wallet, u64 id,
+			  struct wallet_shachain *chain)
+{
+	sqlite3_stmt *stmt;
+	bool ok;
 
+	chain->id = id;
+	stmt = db_prepare(
+	    wallet->db,
+	    "SELECT min_index, num_valid, known FROM shachains WHERE id=?");
 	if (!stmt)
 		return false;
-	while (sqlite3_step(stmt) == SQLITE_ROW) {
-		int pos = sqlite3_column_int(stmt, 2);
-		chain->chain.known[pos].index = sqlite3_column_int64(stmt, 0);
-		sqlite3_column_hexval(stmt, 1, &chain->chain.known[pos].hash,
-				      sizeof(struct sha256));
-	}
-	sqlite3_finalize(stmt);
-
-	return true;
+	sqlite3_bind_int64(stmt, 1, id);
+	ok = (sqlite3_step(stmt) == SQLITE_ROW)
+		&& stmt2shachain(wallet, stmt, 0, chain);
+	db_stmt_done(stmt);
+	return ok;
 }
 
 static bool sqlite3_column_short_channel_id(sqlite3_stmt *stmt, int col,
@@ -359,57 +853,70 @@ static bool sqlite3_column_short_channel_id(sqlite3_stmt *stmt, int col,
 static bool sqlite3_column_sig(sqlite3_stmt *stmt, int col, secp256k1_ecdsa_signature *sig)
 {
 	u8 buf[64];
-	if (!sqlite3_column_hexval(stmt, col, buf, sizeof(buf)))
+	if (!sqlite3_column_blobval(stmt, col, buf, sizeof(buf)))
 		return false;
 	return secp256k1_ecdsa_signature_parse_compact(secp256k1_ctx, sig, buf) == 1;
 }
 
+static void sqlite3_bind_sig(sqlite3_stmt *stmt, int col,
+			     const secp256k1_ecdsa_signature *sig)
+{
+	u8 buf[64];
+	if (!sig || secp256k1_ecdsa_signature_serialize_compact(secp256k1_ctx, buf, sig) != 1)
+		sqlite3_bind_null(stmt, col);
+	else
+		sqlite3_bind_blob(stmt, col, buf, sizeof(buf), SQLITE_TRANSIENT);
+}
+
 static bool sqlite3_column_pubkey(sqlite3_stmt *stmt, int col,  struct pubkey *dest)
 {
 	u8 buf[PUBKEY_DER_LEN];
-	if (!sqlite3_column_hexval(stmt, col, buf, sizeof(buf)))
+	if (!sqlite3_column_blobval(stmt, col, buf, sizeof(buf)))
 		return false;
 	return pubkey_from_der(buf, sizeof(buf), dest);
 }
 
-static u8 *sqlite3_column_varhexblob(tal_t *ctx, sqlite3_stmt *stmt, int col)
+static void sqlite3_bind_pubkey(sqlite3_stmt *stmt, int col,
+				const struct pubkey *pk)
+{
+	u8 der[PUBKEY_DER_LEN];
+	pubkey_to_der(der, pk);
+	sqlite3_bind_blob(stmt, col, der, sizeof(der), SQLITE_TRANSIENT);
+}
+
+static u8 *sqlite3_column_varblob(tal_t *ctx, sqlite3_stmt *stmt, int col)
 {
 	const u8 *source = sqlite3_column_blob(stmt, col);
 	size_t sourcelen = sqlite3_column_bytes(stmt, col);
-	return tal_hexdata(ctx, source, sourcelen);
+	return tal_dup_arr(ctx, u8, source, sourcelen, 0);
 }
 
-static struct bitcoin_tx *sqlite3_column_tx(const tal_t *ctx,
-					    sqlite3_stmt *stmt, int col)
+/* NULL binds as NULL; otherwise @ptr must last until the statement's done. */
+static void sqlite3_bind_varblob(sqlite3_stmt *stmt, int col, const u8 *ptr)
 {
-	return bitcoin_tx_from_hex(ctx,
-				   sqlite3_column_blob(stmt, col),
-				   sqlite3_column_bytes(stmt, col));
+	if (!ptr)
+		sqlite3_bind_null(stmt, col);
+	else
+		sqlite3_bind_blob(stmt, col, ptr, tal_len(ptr), SQLITE_STATIC);
 }
 
-static bool wallet_peer_load(struct wallet *w, const u64 id, struct peer *peer)
+static struct bitcoin_tx *sqlite3_column_tx(const tal_t *ctx,
+					    sqlite3_stmt *stmt, int col)
 {
-	bool ok = true;
-	sqlite3_stmt *stmt = db_query(__func__, w->db, "SELECT id, node_id FROM peers WHERE id=%"PRIu64";", id);
-	if (!stmt || sqlite3_step(stmt) != SQLITE_ROW) {
-		sqlite3_finalize(stmt);
-		return false;
-	}
-	peer->dbid = sqlite3_column_int64(stmt, 0);
-	ok &= sqlite3_column_pubkey(stmt, 1, &peer->id);
-	sqlite3_finalize(stmt);
-	return ok;
+	const u8 *source = sqlite3_column_blob(stmt, col);
+	size_t sourcelen = sqlite3_column_bytes(stmt, col);
+	return pull_bitcoin_tx(ctx, &source, &sourcelen);
 }
 
 bool wallet_peer_by_nodeid(struct wallet *w, const struct pubkey *nodeid,
 			   struct peer *peer)
 {
 	bool ok;
-	tal_t *tmpctx = tal_tmpctx(w);
-	sqlite3_stmt *stmt = db_query(
-	    __func__, w->db, "SELECT id, node_id FROM peers WHERE node_id='%s';",
-	    pubkey_to_hexstr(tmpctx, nodeid));
+	sqlite3_stmt *stmt = db_prepare(
+	    w->db, "SELECT id, node_id FROM peers WHERE node_id=?;");
 
+	if (stmt)
+		sqlite3_bind_pubkey(stmt, 1, nodeid);
 	ok = stmt != NULL && sqlite3_step(stmt) == SQLITE_ROW;
 	if (ok) {
 		peer->dbid = sqlite3_column_int64(stmt, 0);
@@ -418,11 +925,108 @@ bool wallet_peer_by_nodeid(struct wallet *w, const struct pubkey *nodeid,
 		/* Make sure we mark this as a new peer */
 		peer->dbid = 0;
 	}
-	sqlite3_finalize(stmt);
-	tal_free(tmpctx);
+	db_stmt_done(stmt);
 	return ok;
 }
 
+static void sha256_opt(struct sha256_ctx *shactx, const void *p, size_t len)
+{
+	sha256_u8(shactx, p != NULL);
+	if (p)
+		sha256_update(shactx, p, len);
+}
+
+/* Hash each group of columns, as wallet_channel_save would write them. */
+static void channel_cols_hash(const struct peer *p, const u8 *last_tx,
+			      struct sha256 h[CHANNEL_COLS_MAX])
+{
+	struct sha256_ctx shactx;
+
+	sha256_init(&shactx);
+	sha256_u64(&shactx, p->unique_id);
+	sha256_u64(&shactx, p->their_shachain.id);
+	sha256_u8(&shactx, p->scid != NULL);
+	if (p->scid) {
+		sha256_u32(&shactx, p->scid->blocknum);
+		sha256_u32(&shactx, p->scid->txnum);
+		sha256_u16(&shactx, p->scid->outnum);
+	}
+	sha256_u32(&shactx, p->state);
+	sha256_u32(&shactx, p->funder);
+	sha256_u8(&shactx, p->channel_flags);
+	sha256_u32(&shactx, p->minimum_depth);
+	sha256_opt(&shactx, p->funding_txid, sizeof(*p->funding_txid));
+	sha256_u32(&shactx, p->funding_outnum);
+	sha256_u64(&shactx, p->funding_satoshi);
+	sha256_u8(&shactx, p->remote_funding_locked);
+	sha256_u64(&shactx, p->push_msat);
+	sha256_opt(&shactx, p->remote_shutdown_scriptpubkey,
+		   tal_len(p->remote_shutdown_scriptpubkey));
+	sha256_u64(&shactx, p->local_shutdown_idx);
+	sha256_u64(&shactx, p->our_config.id);
+	sha256_done(&shactx, &h[CHANNEL_COLS_CORE]);
+
+	sha256_init(&shactx);
+	sha256_u64(&shactx, p->next_index[LOCAL]);
+	sha256_u64(&shactx, p->next_index[REMOTE]);
+	sha256_u64(&shactx, p->next_htlc_id);
+	sha256_opt(&shactx, p->our_msatoshi, sizeof(*p->our_msatoshi));
+	sha256_done(&shactx, &h[CHANNEL_COLS_INDEX]);
+
+	sha256_init(&shactx);
+	sha256_opt(&shactx, last_tx, tal_len(last_tx));
+	sha256_opt(&shactx, p->last_sig, sizeof(*p->last_sig));
+	sha256_done(&shactx, &h[CHANNEL_COLS_LAST_TX]);
+
+	sha256_init(&shactx);
+	sha256_u8(&shactx, p->channel_info != NULL);
+	if (p->channel_info) {
+		const struct channel_info *ci = p->channel_info;
+		sha256_update(&shactx, &ci->remote_fundingkey,
+			      sizeof(ci->remote_fundingkey));
+		sha256_update(&shactx, &ci->theirbase, sizeof(ci->theirbase));
+		sha256_u64(&shactx, ci->their_config.id);
+	}
+	sha256_done(&shactx, &h[CHANNEL_COLS_REMOTE_KEYS]);
+
+	sha256_init(&shactx);
+	sha256_u8(&shactx, p->channel_info != NULL);
+	if (p->channel_info) {
+		const struct channel_info *ci = p->channel_info;
+		sha256_update(&shactx, &ci->remote_per_commit,
+			      sizeof(ci->remote_per_commit));
+		sha256_update(&shactx, &ci->old_remote_per_commit,
+			      sizeof(ci->old_remote_per_commit));
+		sha256_u32(&shactx, ci->feerate_per_kw);
+	}
+	sha256_done(&shactx, &h[CHANNEL_COLS_REMOTE_COMMIT]);
+
+	sha256_init(&shactx);
+	sha256_u8(&shactx, p->last_sent_commit != NULL);
+	if (p->last_sent_commit) {
+		sha256_u32(&shactx, p->last_sent_commit->newstate);
+		sha256_u64(&shactx, p->last_sent_commit->id);
+	}
+	sha256_done(&shactx, &h[CHANNEL_COLS_LAST_SENT]);
+}
+
+static u8 *channel_last_tx(const tal_t *ctx, const struct peer *p)
+{
+	return p->last_tx ? linearize_tx(ctx, p->last_tx) : NULL;
+}
+
+/* The six columns of a channel_configs row after its id, from @col. */
+static void stmt2channel_config(sqlite3_stmt *stmt, int col,
+				struct channel_config *cc)
+{
+	cc->dust_limit_satoshis = sqlite3_column_int64(stmt, col++);
+	cc->max_htlc_value_in_flight_msat = sqlite3_column_int64(stmt, col++);
+	cc->channel_reserve_satoshis = sqlite3_column_int64(stmt, col++);
+	cc->htlc_minimum_msat = sqlite3_column_int64(stmt, col++);
+	cc->to_self_delay = sqlite3_column_int(stmt, col++);
+	cc->max_accepted_htlcs = sqlite3_column_int(stmt, col++);
+}
+
 /**
  * wallet_stmt2channel - Helper to populate a wallet_channel from a sqlite3_stmt
  *
@@ -437,6 +1041,7 @@ static bool wallet_stmt2channel(struct wallet *w, sqlite3_stmt *stmt,
 	struct sha256_double temphash;
 	struct short_channel_id scid;
 	u64 remote_config_id;
+	u8 *last_tx;
 
 	if (!chan->peer) {
 		chan->peer = talz(chan, struct peer);
@@ -444,7 +1049,6 @@ static bool wallet_stmt2channel(struct wallet *w, sqlite3_stmt *stmt,
 	chan->id = sqlite3_column_int64(stmt, col++);
 	chan->peer->unique_id = sqlite3_column_int64(stmt, col++);
 	chan->peer->dbid = sqlite3_column_int64(stmt, col++);
-	wallet_peer_load(w, chan->peer->dbid, chan->peer);
 
 	if (sqlite3_column_short_channel_id(stmt, col++, &scid)) {
 		chan->peer->scid = tal(chan->peer, struct short_channel_id);
@@ -454,7 +1058,6 @@ static bool wallet_stmt2channel(struct wallet *w, sqlite3_stmt *stmt,
 	}
 
 	chan->peer->our_config.id = sqlite3_column_int64(stmt, col++);
-	wallet_channel_config_load(w, chan->peer->our_config.id, &chan->peer->our_config);
 	remote_config_id = sqlite3_column_int64(stmt, col++);
 
 	chan->peer->state = sqlite3_column_int(stmt, col++);
@@ -465,7 +1068,7 @@ static bool wallet_stmt2channel(struct wallet *w, sqlite3_stmt *stmt,
 	chan->peer->next_index[REMOTE] = sqlite3_column_int64(stmt, col++);
 	chan->peer->next_htlc_id = sqlite3_column_int64(stmt, col++);
 
-	if (sqlite3_column_hexval(stmt, col++, &temphash, sizeof(temphash))) {
+	if (sqlite3_column_blobval(stmt, col++, &temphash, sizeof(temphash))) {
 		chan->peer->funding_txid = tal(chan->peer, struct sha256_double);
 		*chan->peer->funding_txid = temphash;
 	} else {
@@ -503,25 +1106,21 @@ static bool wallet_stmt2channel(struct wallet *w, sqlite3_stmt *stmt,
 		ok &= sqlite3_column_pubkey(stmt, col++, &channel_info->remote_per_commit);
 		ok &= sqlite3_column_pubkey(stmt, col++, &channel_info->old_remote_per_commit);
 		channel_info->feerate_per_kw = sqlite3_column_int64(stmt, col++);
-		wallet_channel_config_load(w, remote_config_id, &chan->peer->channel_info->their_config);
+		channel_info->their_config.id = remote_config_id;
 	} else {
 		/* No channel_info, skip positions in the result */
 		col += 7;
 	}
 
-	/* Load shachain */
-	u64 shachain_id = sqlite3_column_int64(stmt, col++);
-	ok &= wallet_shachain_load(w, shachain_id, &chan->peer->their_shachain);
+	chan->peer->their_shachain.id = sqlite3_column_int64(stmt, col++);
 
 	/* Do we have a non-null remote_shutdown_scriptpubkey? */
-	if (sqlite3_column_type(stmt, col) != SQLITE_NULL) {
-		chan->peer->remote_shutdown_scriptpubkey = sqlite3_column_varhexblob(chan->peer, stmt, col++);
-		chan->peer->local_shutdown_idx = sqlite3_column_int64(stmt, col++);
-	} else {
+	if (sqlite3_column_type(stmt, col) != SQLITE_NULL)
+		chan->peer->remote_shutdown_scriptpubkey = sqlite3_column_varblob(chan->peer, stmt, col);
+	else
 		chan->peer->remote_shutdown_scriptpubkey = tal_free(chan->peer->remote_shutdown_scriptpubkey);
-		chan->peer->local_shutdown_idx = -1;
-		col += 2;
-	}
+	col++;
+	chan->peer->local_shutdown_idx = sqlite3_column_int64(stmt, col++);
 
 	/* Do we have a last_sent_commit, if yes, populate */
 	if (sqlite3_column_type(stmt, col) != SQLITE_NULL) {
@@ -548,27 +1147,68 @@ static bool wallet_stmt2channel(struct wallet *w, sqlite3_stmt *stmt,
 
 	assert(col == 33);
 
+	/* Then what we joined from the other tables: a NULL id means the
+	 * row it refers to is missing. */
+	ok &= sqlite3_column_type(stmt, col++) != SQLITE_NULL;
+	ok &= sqlite3_column_pubkey(stmt, col++, &chan->peer->id);
+	ok &= sqlite3_column_type(stmt, col++) != SQLITE_NULL;
+	stmt2channel_config(stmt, col, &chan->peer->our_config);
+	col += 6;
+	if (chan->peer->channel_info) {
+		ok &= sqlite3_column_type(stmt, col) != SQLITE_NULL;
+		stmt2channel_config(stmt, col + 1,
+				    &chan->peer->channel_info->their_config);
+	}
+	col += 7;
+	ok &= sqlite3_column_type(stmt, col++) != SQLITE_NULL;
+	ok &= stmt2shachain(w, stmt, col, &chan->peer->their_shachain);
+	col += 3;
+	assert(col == 53);
+
 	chan->peer->channel = chan;
 
+	/* That's what's in the db, so no need to write it back. */
+	last_tx = channel_last_tx(chan, chan->peer);
+	channel_cols_hash(chan->peer, last_tx, chan->saved);
+	tal_free(last_tx);
+
 	return ok;
 }
 
-/* List of fields to retrieve from the channels DB table, in the order
- * that wallet_stmt2channel understands and will parse correctly */
-const char *channel_fields =
-    "id, unique_id, peer_id, short_channel_id, channel_config_local, "
-    "channel_config_remote, state, funder, channel_flags, "
-    "minimum_depth, "
-    "next_index_local, next_index_remote, "
-    "next_htlc_id, funding_tx_id, funding_tx_outnum, funding_satoshi, "
-    "funding_locked_remote, push_msatoshi, msatoshi_local, "
-    "fundingkey_remote, revocation_basepoint_remote, "
-    "payment_basepoint_remote, "
-    "delayed_payment_basepoint_remote, per_commit_remote, "
-    "old_per_commit_remote, feerate_per_kw, shachain_remote_id, "
-    "shutdown_scriptpubkey_remote, shutdown_keyidx_local, "
-    "last_sent_commit_state, last_sent_commit_id, "
-    "last_tx, last_sig";
+/* List of fields to retrieve from the channels DB table (and those we join
+ * it with), in the order that wallet_stmt2channel understands and will
+ * parse correctly */
+#define CHANNEL_FIELDS \
+    "c.id, c.unique_id, c.peer_id, c.short_channel_id, " \
+    "c.channel_config_local, c.channel_config_remote, c.state, c.funder, " \
+    "c.channel_flags, c.minimum_depth, " \
+    "c.next_index_local, c.next_index_remote, " \
+    "c.next_htlc_id, c.funding_tx_id, c.funding_tx_outnum, " \
+    "c.funding_satoshi, c.funding_locked_remote, c.push_msatoshi, " \
+    "c.msatoshi_local, " \
+    "c.fundingkey_remote, c.revocation_basepoint_remote, " \
+    "c.payment_basepoint_remote, " \
+    "c.delayed_payment_basepoint_remote, c.per_commit_remote, " \
+    "c.old_per_commit_remote, c.feerate_per_kw, c.shachain_remote_id, " \
+    "c.shutdown_scriptpubkey_remote, c.shutdown_keyidx_local, " \
+    "c.last_sent_commit_state, c.last_sent_commit_id, " \
+    "c.last_tx, c.last_sig, " \
+    "p.id, p.node_id, " \
+    "lc.id, lc.dust_limit_satoshis, lc.max_htlc_value_in_flight_msat, " \
+    "lc.channel_reserve_satoshis, lc.htlc_minimum_msat, " \
+    "lc.to_self_delay, lc.max_accepted_htlcs, " \
+    "rc.id, rc.dust_limit_satoshis, rc.max_htlc_value_in_flight_msat, " \
+    "rc.channel_reserve_satoshis, rc.htlc_minimum_msat, " \
+    "rc.to_self_delay, rc.max_accepted_htlcs, " \
+    "s.id, s.min_index, s.num_valid, s.known"
+
+/* So a channel, and everything it refers to, is a single row. */
+#define CHANNEL_TABLES \
+    "channels c" \
+    " LEFT JOIN peers p ON p.id = c.peer_id" \
+    " LEFT JOIN channel_configs lc ON lc.id = c.channel_config_local" \
+    " LEFT JOIN channel_configs rc ON rc.id = c.channel_config_remote" \
+    " LEFT JOIN shachains s ON s.id = c.shachain_remote_id"
 
 bool wallet_channel_load(struct wallet *w, const u64 id,
 			 struct wallet_channel *chan)
@@ -576,18 +1216,21 @@ bool wallet_channel_load(struct wallet *w, const u64 id,
 	bool ok;
 	/* The explicit query that matches the columns and their order in
 	 * wallet_stmt2channel. */
-	sqlite3_stmt *stmt = db_query(
-	    __func__, w->db, "SELECT %s FROM channels WHERE id=%" PRIu64 ";",
-	    channel_fields, id);
+	sqlite3_stmt *stmt = db_prepare(
+	    w->db, "SELECT " CHANNEL_FIELDS " FROM " CHANNEL_TABLES
+	    " WHERE c.id=?;");
 
-	if (!stmt || sqlite3_step(stmt) != SQLITE_ROW) {
-		sqlite3_finalize(stmt);
+	if (!stmt)
+		return false;
+	sqlite3_bind_int64(stmt, 1, id);
+	if (sqlite3_step(stmt) != SQLITE_ROW) {
+		db_stmt_done(stmt);
 		return false;
 	}
 
 	ok = wallet_stmt2channel(w, stmt, chan);
 
-	sqlite3_finalize(stmt);
+	db_stmt_done(stmt);
 	return ok;
 }
 
@@ -596,11 +1239,15 @@ bool wallet_channels_load_active(struct wallet *w, struct list_head *peers)
 	bool ok = true;
 	/* Channels are active if they have reached at least the
 	 * opening state and they are not marked as complete */
-	sqlite3_stmt *stmt = db_query(
-	    __func__, w->db, "SELECT %s FROM channels WHERE state >= %d AND state != %d;",
-	    channel_fields, OPENINGD, CLOSINGD_COMPLETE);
+	sqlite3_stmt *stmt = db_prepare(
+	    w->db, "SELECT " CHANNEL_FIELDS " FROM " CHANNEL_TABLES
+	    " WHERE c.state >= ? AND c.state != ?;");
 
 	int count = 0;
+	if (stmt) {
+		sqlite3_bind_int(stmt, 1, OPENINGD);
+		sqlite3_bind_int(stmt, 2, CLOSINGD_COMPLETE);
+	}
 	while (ok && stmt && sqlite3_step(stmt) == SQLITE_ROW) {
 		struct wallet_channel *c = talz(w, struct wallet_channel);
 		ok &= wallet_stmt2channel(w, stmt, c);
@@ -608,58 +1255,40 @@ bool wallet_channels_load_active(struct wallet *w, struct list_head *peers)
 		count++;
 	}
 	log_debug(w->log, "Loaded %d channels from DB", count);
-	sqlite3_finalize(stmt);
+	db_stmt_done(stmt);
 	return ok;
 }
 
-static char* db_serialize_signature(const tal_t *ctx, secp256k1_ecdsa_signature* sig)
-{
-	u8 buf[64];
-	if (!sig || secp256k1_ecdsa_signature_serialize_compact(secp256k1_ctx, buf, sig) != 1)
-		return "null";
-	return tal_fmt(ctx, "'%s'", tal_hexstr(ctx, buf, sizeof(buf)));
-}
-
-static char* db_serialize_pubkey(const tal_t *ctx, struct pubkey *pk)
-{
-	u8 *der;
-	if (!pk)
-		return "NULL";
-	der = tal_arr(ctx, u8, PUBKEY_DER_LEN);
-	pubkey_to_der(der, pk);
-	return tal_hex(ctx, der);
-}
-
-static char* db_serialize_tx(const tal_t *ctx, const struct bitcoin_tx *tx)
-{
-	if (!tx)
-		return "NULL";
-
-	return tal_fmt(ctx, "'%s'", tal_hex(ctx, linearize_tx(ctx, tx)));
-}
-
 bool wallet_channel_config_save(struct wallet *w, struct channel_config *cc)
 {
 	bool ok = true;
+	sqlite3_stmt *stmt;
+
 	/* Is this an update? If not insert a stub first */
 	if (!cc->id) {
-		ok &= db_exec(__func__, w->db,
-			      "INSERT INTO channel_configs DEFAULT VALUES;");
+		ok &= db_exec_prepared(
+		    w->db, db_prepare(w->db, "INSERT INTO channel_configs DEFAULT VALUES;"));
 		cc->id = sqlite3_last_insert_rowid(w->db->sql);
 	}
 
-	ok &= db_exec(
-	    __func__, w->db, "UPDATE channel_configs SET"
-			     "  dust_limit_satoshis=%" PRIu64 ","
-			     "  max_htlc_value_in_flight_msat=%" PRIu64 ","
-			     "  channel_reserve_satoshis=%" PRIu64 ","
-			     "  htlc_minimum_msat=%" PRIu64 ","
-			     "  to_self_delay=%d,"
-			     "  max_accepted_htlcs=%d"
-			     " WHERE id=%" PRIu64 ";",
-	    cc->dust_limit_satoshis, cc->max_htlc_value_in_flight_msat,
-	    cc->channel_reserve_satoshis, cc->htlc_minimum_msat,
-	    cc->to_self_delay, cc->max_accepted_htlcs, cc->id);
+	stmt = db_prepare(w->db, "UPDATE channel_configs SET"
+				 "  dust_limit_satoshis=?,"
+				 "  max_htlc_value_in_flight_msat=?,"
+				 "  channel_reserve_satoshis=?,"
+				 "  htlc_minimum_msat=?,"
+				 "  to_self_delay=?,"
+				 "  max_accepted_htlcs=?"
+				 " WHERE id=?;");
+	if (!stmt)
+		return false;
+	sqlite3_bind_int64(stmt, 1, cc->dust_limit_satoshis);
+	sqlite3_bind_int64(stmt, 2, cc->max_htlc_value_in_flight_msat);
+	sqlite3_bind_int64(stmt, 3, cc->channel_reserve_satoshis);
+	sqlite3_bind_int64(stmt, 4, cc->htlc_minimum_msat);
+	sqlite3_bind_int(stmt, 5, cc->to_self_delay);
+	sqlite3_bind_int(stmt, 6, cc->max_accepted_htlcs);
+	sqlite3_bind_int64(stmt, 7, cc->id);
+	ok &= db_exec_prepared(w->db, stmt);
 
 	return ok;
 }
@@ -668,25 +1297,21 @@ bool wallet_channel_config_load(struct wallet *w, const u64 id,
 				struct channel_config *cc)
 {
 	bool ok = true;
-	int col = 1;
 	const char *query =
 	    "SELECT id, dust_limit_satoshis, max_htlc_value_in_flight_msat, "
 	    "channel_reserve_satoshis, htlc_minimum_msat, to_self_delay, "
-	    "max_accepted_htlcs FROM channel_configs WHERE id=%" PRIu64 ";";
-	sqlite3_stmt *stmt = db_query(__func__, w->db, query, id);
-	if (!stmt || sqlite3_step(stmt) != SQLITE_ROW) {
-		sqlite3_finalize(stmt);
+	    "max_accepted_htlcs FROM channel_configs WHERE id=?;";
+	sqlite3_stmt *stmt = db_prepare(w->db, query);
+	if (!stmt)
+		return false;
+	sqlite3_bind_int64(stmt, 1, id);
+	if (sqlite3_step(stmt) != SQLITE_ROW) {
+		db_stmt_done(stmt);
 		return false;
 	}
 	cc->id = id;
-	cc->dust_limit_satoshis = sqlite3_column_int64(stmt, col++);
-	cc->max_htlc_value_in_flight_msat = sqlite3_column_int64(stmt, col++);
-	cc->channel_reserve_satoshis = sqlite3_column_int64(stmt, col++);
-	cc->htlc_minimum_msat = sqlite3_column_int64(stmt, col++);
-	cc->to_self_delay = sqlite3_column_int(stmt, col++);
-	cc->max_accepted_htlcs = sqlite3_column_int(stmt, col++);
-	assert(col == 7);
-	sqlite3_finalize(stmt);
+	stmt2channel_config(stmt, 1, cc);
+	db_stmt_done(stmt);
 	return ok;
 }
 
@@ -694,12 +1319,18 @@ bool wallet_channel_save(struct wallet *w, struct wallet_channel *chan){
 	bool ok = true;
 	struct peer *p = chan->peer;
 	tal_t *tmpctx = tal_tmpctx(w);
+	sqlite3_stmt *stmt;
+	struct sha256 h[CHANNEL_COLS_MAX];
+	bool changed[CHANNEL_COLS_MAX];
+	u8 *last_tx;
+	size_t i;
 
 	if (p->dbid == 0) {
 		/* Need to store the peer first */
-		ok &= db_exec(__func__, w->db,
-			      "INSERT INTO peers (node_id) VALUES ('%s');",
-			      db_serialize_pubkey(tmpctx, &chan->peer->id));
+		stmt = db_prepare(w->db, "INSERT INTO peers (node_id) VALUES (?);");
+		if (stmt)
+			sqlite3_bind_pubkey(stmt, 1, &chan->peer->id);
+		ok &= db_exec_prepared(w->db, stmt);
 		p->dbid = sqlite3_last_insert_rowid(w->db->sql);
 	}
 
@@ -707,8 +1338,12 @@ bool wallet_channel_save(struct wallet *w, struct wallet_channel *chan){
 
 	/* Insert a stub, that we can update, unifies INSERT and UPDATE paths */
 	if (chan->id == 0) {
-		ok &= db_exec(__func__, w->db, "INSERT INTO channels (peer_id) VALUES (%"PRIu64");", p->dbid);
+		stmt = db_prepare(w->db, "INSERT INTO channels (peer_id) VALUES (?);");
+		if (stmt)
+			sqlite3_bind_int64(stmt, 1, p->dbid);
+		ok &= db_exec_prepared(w->db, stmt);
 		chan->id = sqlite3_last_insert_rowid(w->db->sql);
+		memset(chan->saved, 0, sizeof(chan->saved));
 	}
 
 	/* Need to initialize the shachain first so we get an id */
@@ -716,97 +1351,421 @@ bool wallet_channel_save(struct wallet *w, struct wallet_channel *chan){
 		ok &= wallet_shachain_init(w, &p->their_shachain);
 	}
 
-	ok &= wallet_channel_config_save(w, &p->our_config);
-
-	/* Now do the real update */
-	ok &= db_exec(__func__, w->db, "UPDATE channels SET"
-		      "  unique_id=%"PRIu64","
-		      "  shachain_remote_id=%"PRIu64","
-		      "  short_channel_id=%s,"
-		      "  state=%d,"
-		      "  funder=%d,"
-		      "  channel_flags=%d,"
-		      "  minimum_depth=%d,"
-		      "  next_index_local=%"PRIu64","
-		      "  next_index_remote=%"PRIu64","
-		      "  next_htlc_id=%"PRIu64","
-		      "  funding_tx_id=%s,"
-		      "  funding_tx_outnum=%d,"
-		      "  funding_satoshi=%"PRIu64","
-		      "  funding_locked_remote=%d,"
-		      "  push_msatoshi=%"PRIu64","
-		      "  msatoshi_local=%s,"
-		      "  shutdown_scriptpubkey_remote='%s',"
-		      "  shutdown_keyidx_local=%"PRId64","
-		      "  channel_config_local=%"PRIu64","
-		      "  last_tx=%s, last_sig=%s"
-		      " WHERE id=%"PRIu64,
-		      p->unique_id,
-		      p->their_shachain.id,
-		      p->scid?tal_fmt(tmpctx,"'%s'", short_channel_id_to_str(tmpctx, p->scid)):"null",
-		      p->state,
-		      p->funder,
-		      p->channel_flags,
-		      p->minimum_depth,
-		      p->next_index[LOCAL],
-		      p->next_index[REMOTE],
-		      p->next_htlc_id,
-		      p->funding_txid?tal_fmt(tmpctx, "'%s'", tal_hexstr(tmpctx, p->funding_txid, sizeof(struct sha256_double))):"null",
-		      p->funding_outnum,
-		      p->funding_satoshi,
-		      p->remote_funding_locked,
-		      p->push_msat,
-		      p->our_msatoshi?tal_fmt(tmpctx, "%"PRIu64, *p->our_msatoshi):"NULL",
-		      p->remote_shutdown_scriptpubkey?tal_hex(tmpctx, p->remote_shutdown_scriptpubkey):"",
-		      p->local_shutdown_idx,
-		      p->our_config.id,
-		      db_serialize_tx(tmpctx, p->last_tx),
-		      db_serialize_signature(tmpctx, p->last_sig),
-		      chan->id);
+	/* Configs don't change once they're negotiated. */
+	if (!p->our_config.id)
+		ok &= wallet_channel_config_save(w, &p->our_config);
+	if (p->channel_info && !p->channel_info->their_config.id)
+		ok &= wallet_channel_config_save(w,
+						 &p->channel_info->their_config);
+
+	last_tx = channel_last_tx(tmpctx, p);
+	channel_cols_hash(p, last_tx, h);
+	for (i = 0; i < CHANNEL_COLS_MAX; i++)
+		changed[i] = !structeq(&h[i], &chan->saved[i]);
+
+	if (changed[CHANNEL_COLS_CORE]) {
+		stmt = db_prepare(w->db, "UPDATE channels SET"
+				  "  unique_id=?,"
+				  "  shachain_remote_id=?,"
+				  "  short_channel_id=?,"
+				  "  state=?,"
+				  "  funder=?,"
+				  "  channel_flags=?,"
+				  "  minimum_depth=?,"
+				  "  funding_tx_id=?,"
+				  "  funding_tx_outnum=?,"
+				  "  funding_satoshi=?,"
+				  "  funding_locked_remote=?,"
+				  "  push_msatoshi=?,"
+				  "  shutdown_scriptpubkey_remote=?,"
+				  "  shutdown_keyidx_local=?,"
+				  "  channel_config_local=?"
+				  " WHERE id=?");
+		if (stmt) {
+			sqlite3_bind_int64(stmt, 1, p->unique_id);
+			sqlite3_bind_int64(stmt, 2, p->their_shachain.id);
+			if (p->scid)
+				sqlite3_bind_text(stmt, 3,
+						  short_channel_id_to_str(tmpctx, p->scid),
+						  -1, SQLITE_STATIC);
+			else
+				sqlite3_bind_null(stmt, 3);
+			sqlite3_bind_int(stmt, 4, p->state);
+			sqlite3_bind_int(stmt, 5, p->funder);
+			sqlite3_bind_int(stmt, 6, p->channel_flags);
+			sqlite3_bind_int(stmt, 7, p->minimum_depth);
+			if (p->funding_txid)
+				sqlite3_bind_blob(stmt, 8, p->funding_txid,
+						  sizeof(*p->funding_txid),
+						  SQLITE_STATIC);
+			else
+				sqlite3_bind_null(stmt, 8);
+			sqlite3_bind_int(stmt, 9, p->funding_outnum);
+			sqlite3_bind_int64(stmt, 10, p->funding_satoshi);
+			sqlite3_bind_int(stmt, 11, p->remote_funding_locked);
+			sqlite3_bind_int64(stmt, 12, p->push_msat);
+			sqlite3_bind_varblob(stmt, 13,
+					     p->remote_shutdown_scriptpubkey);
+			sqlite3_bind_int64(stmt, 14, p->local_shutdown_idx);
+			sqlite3_bind_int64(stmt, 15, p->our_config.id);
+			sqlite3_bind_int64(stmt, 16, chan->id);
+		}
+		ok &= db_exec_prepared(w->db, stmt);
+	}
 
-	if (chan->peer->channel_info) {
-		ok &= wallet_channel_config_save(w, &p->channel_info->their_config);
-		ok &= db_exec(__func__, w->db,
-			      "UPDATE channels SET"
-			      "  fundingkey_remote='%s',"
-			      "  revocation_basepoint_remote='%s',"
-			      "  payment_basepoint_remote='%s',"
-			      "  delayed_payment_basepoint_remote='%s',"
-			      "  per_commit_remote='%s',"
-			      "  old_per_commit_remote='%s',"
-			      "  feerate_per_kw=%d,"
-			      "  channel_config_remote=%"PRIu64
-			      " WHERE id=%"PRIu64,
-			      db_serialize_pubkey(tmpctx, &p->channel_info->remote_fundingkey),
-			      db_serialize_pubkey(tmpctx, &p->channel_info->theirbase.revocation),
-			      db_serialize_pubkey(tmpctx, &p->channel_info->theirbase.payment),
-			      db_serialize_pubkey(tmpctx, &p->channel_info->theirbase.delayed_payment),
-			      db_serialize_pubkey(tmpctx, &p->channel_info->remote_per_commit),
-			      db_serialize_pubkey(tmpctx, &p->channel_info->old_remote_per_commit),
-			      p->channel_info->feerate_per_kw,
-			      p->channel_info->their_config.id,
-			      chan->id);
+	/* This is all that changes for most commitments. */
+	if (changed[CHANNEL_COLS_INDEX]) {
+		stmt = db_prepare(w->db, "UPDATE channels SET"
+				  "  next_index_local=?,"
+				  "  next_index_remote=?,"
+				  "  next_htlc_id=?,"
+				  "  msatoshi_local=?"
+				  " WHERE id=?");
+		if (stmt) {
+			sqlite3_bind_int64(stmt, 1, p->next_index[LOCAL]);
+			sqlite3_bind_int64(stmt, 2, p->next_index[REMOTE]);
+			sqlite3_bind_int64(stmt, 3, p->next_htlc_id);
+			if (p->our_msatoshi)
+				sqlite3_bind_int64(stmt, 4, *p->our_msatoshi);
+			else
+				sqlite3_bind_null(stmt, 4);
+			sqlite3_bind_int64(stmt, 5, chan->id);
+		}
+		ok &= db_exec_prepared(w->db, stmt);
+	}
+
+	if (changed[CHANNEL_COLS_LAST_TX]) {
+		stmt = db_prepare(w->db, "UPDATE channels SET"
+				  "  last_tx=?, last_sig=?"
+				  " WHERE id=?");
+		if (stmt) {
+			sqlite3_bind_varblob(stmt, 1, last_tx);
+			sqlite3_bind_sig(stmt, 2, p->last_sig);
+			sqlite3_bind_int64(stmt, 3, chan->id);
+		}
+		ok &= db_exec_prepared(w->db, stmt);
+	}
+
+	if (p->channel_info && changed[CHANNEL_COLS_REMOTE_KEYS]) {
+		stmt = db_prepare(w->db, "UPDATE channels SET"
+				  "  fundingkey_remote=?,"
+				  "  revocation_basepoint_remote=?,"
+				  "  payment_basepoint_remote=?,"
+				  "  delayed_payment_basepoint_remote=?,"
+				  "  channel_config_remote=?"
+				  " WHERE id=?");
+		if (stmt) {
+			sqlite3_bind_pubkey(stmt, 1, &p->channel_info->remote_fundingkey);
+			sqlite3_bind_pubkey(stmt, 2, &p->channel_info->theirbase.revocation);
+			sqlite3_bind_pubkey(stmt, 3, &p->channel_info->theirbase.payment);
+			sqlite3_bind_pubkey(stmt, 4, &p->channel_info->theirbase.delayed_payment);
+			sqlite3_bind_int64(stmt, 5, p->channel_info->their_config.id);
+			sqlite3_bind_int64(stmt, 6, chan->id);
+		}
+		ok &= db_exec_prepared(w->db, stmt);
+	}
+
+	if (p->channel_info && changed[CHANNEL_COLS_REMOTE_COMMIT]) {
+		stmt = db_prepare(w->db, "UPDATE channels SET"
+				  "  per_commit_remote=?,"
+				  "  old_per_commit_remote=?,"
+				  "  feerate_per_kw=?"
+				  " WHERE id=?");
+		if (stmt) {
+			sqlite3_bind_pubkey(stmt, 1, &p->channel_info->remote_per_commit);
+			sqlite3_bind_pubkey(stmt, 2, &p->channel_info->old_remote_per_commit);
+			sqlite3_bind_int(stmt, 3, p->channel_info->feerate_per_kw);
+			sqlite3_bind_int64(stmt, 4, chan->id);
+		}
+		ok &= db_exec_prepared(w->db, stmt);
 	}
 
 	/* If we have a last_sent_commit, store it */
-	if (chan->peer->last_sent_commit) {
-		ok &= db_exec(__func__, w->db,
-			      "UPDATE channels SET"
-			      "  last_sent_commit_state=%d,"
-			      "  last_sent_commit_id=%"PRIu64
-			      " WHERE id=%"PRIu64,
-			      p->last_sent_commit->newstate,
-			      p->last_sent_commit->id,
-			      chan->id);
+	if (p->last_sent_commit && changed[CHANNEL_COLS_LAST_SENT]) {
+		stmt = db_prepare(w->db, "UPDATE channels SET"
+				  "  last_sent_commit_state=?,"
+				  "  last_sent_commit_id=?"
+				  " WHERE id=?");
+		if (stmt) {
+			sqlite3_bind_int(stmt, 1, p->last_sent_commit->newstate);
+			sqlite3_bind_int64(stmt, 2, p->last_sent_commit->id);
+			sqlite3_bind_int64(stmt, 3, chan->id);
+		}
+		ok &= db_exec_prepared(w->db, stmt);
 	}
 
 	if (ok)
 		ok &= db_commit_transaction(w->db);
 	else
 		db_rollback_transaction(w->db);
+
+	/* Only once it's in, or we'd never retry. */
+	if (ok)
+		memcpy(chan->saved, h, sizeof(chan->saved));
 	tal_free(tmpctx);
       	return ok;
 }
+
+/* The direction column in channel_htlcs. */
+#define DIRECTION_INCOMING 0
+#define DIRECTION_OUTGOING 1
+
+static bool wallet_htlc_insert(struct wallet *w,
+			       const struct wallet_channel *chan,
+			       int direction, u64 id, u64 origin_dbid,
+			       u64 msatoshi, u32 cltv_expiry,
+			       const struct sha256 *payment_hash,
+			       enum htlc_state hstate,
+			       const struct secret *shared_secret,
+			       const u8 *onion_routing_packet,
+			       u64 *dbid)
+{
+	sqlite3_stmt *stmt = db_prepare(w->db,
+		"INSERT INTO channel_htlcs"
+		" (channel_id, direction, channel_htlc_id, origin_htlc,"
+		"  msatoshi, cltv_expiry, payment_hash, hstate,"
+		"  shared_secret, routing_onion)"
+		" VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?);");
+
+	if (!stmt)
+		return false;
+
+	sqlite3_bind_int64(stmt, 1, chan->id);
+	sqlite3_bind_int(stmt, 2, direction);
+	sqlite3_bind_int64(stmt, 3, id);
+	if (origin_dbid)
+		sqlite3_bind_int64(stmt, 4, origin_dbid);
+	else
+		sqlite3_bind_null(stmt, 4);
+	sqlite3_bind_int64(stmt, 5, msatoshi);
+	sqlite3_bind_int(stmt, 6, cltv_expiry);
+	sqlite3_bind_blob(stmt, 7, payment_hash, sizeof(*payment_hash),
+			  SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 8, hstate);
+	if (shared_secret)
+		sqlite3_bind_blob(stmt, 9, shared_secret,
+				  sizeof(*shared_secret), SQLITE_STATIC);
+	else
+		sqlite3_bind_null(stmt, 9);
+	sqlite3_bind_blob(stmt, 10, onion_routing_packet, TOTAL_PACKET_SIZE,
+			  SQLITE_STATIC);
+	if (!db_exec_prepared(w->db, stmt))
+		return false;
+
+	*dbid = sqlite3_last_insert_rowid(w->db->sql);
+	return true;
+}
+
+bool wallet_htlc_save_in(struct wallet *w, const struct wallet_channel *chan,
+			 struct htlc_in *in)
+{
+	return wallet_htlc_insert(w, chan, DIRECTION_INCOMING, in->key.id, 0,
+				  in->msatoshi, in->cltv_expiry,
+				  &in->payment_hash, in->hstate,
+				  &in->shared_secret,
+				  in->onion_routing_packet, &in->dbid);
+}
+
+bool wallet_htlc_save_out(struct wallet *w, const struct wallet_channel *chan,
+			  struct htlc_out *out)
+{
+	assert(!out->in || out->in->dbid);
+	return wallet_htlc_insert(w, chan, DIRECTION_OUTGOING, out->key.id,
+				  out->in ? out->in->dbid : 0,
+				  out->msatoshi, out->cltv_expiry,
+				  &out->payment_hash, out->hstate, NULL,
+				  out->onion_routing_packet, &out->dbid);
+}
+
+bool wallet_htlc_update(struct wallet *w, u64 htlc_dbid,
+			enum htlc_state new_state,
+			const struct preimage *payment_key,
+			enum onion_type malformed,
+			const u8 *failuremsg)
+{
+	sqlite3_stmt *stmt = db_prepare(w->db,
+		"UPDATE channel_htlcs SET"
+		"  hstate=?, payment_key=?, malformed_onion=?, failuremsg=?"
+		" WHERE id=?;");
+
+	assert(htlc_dbid);
+	if (!stmt)
+		return false;
+
+	sqlite3_bind_int(stmt, 1, new_state);
+	if (payment_key)
+		sqlite3_bind_blob(stmt, 2, payment_key, sizeof(*payment_key),
+				  SQLITE_STATIC);
+	else
+		sqlite3_bind_null(stmt, 2);
+	sqlite3_bind_int(stmt, 3, malformed);
+	sqlite3_bind_varblob(stmt, 4, failuremsg);
+	sqlite3_bind_int64(stmt, 5, htlc_dbid);
+	return db_exec_prepared(w->db, stmt);
+}
+
+/* Columns, in the order wallet_htlcs_load reads them. */
+#define HTLC_FIELDS \
+    "id, channel_id, direction, channel_htlc_id, origin_htlc, " \
+    "msatoshi, cltv_expiry, payment_hash, payment_key, hstate, " \
+    "shared_secret, routing_onion, malformed_onion, failuremsg"
+
+static void htlc_stub_add(struct peer *peer, enum side owner, u32 cltv_expiry,
+			  const struct sha256 *payment_hash)
+{
+	size_t n = tal_count(peer->htlcs);
+
+	tal_resize(&peer->htlcs, n+1);
+	peer->htlcs[n].owner = owner;
+	peer->htlcs[n].cltv_expiry = cltv_expiry;
+	ripemd160(&peer->htlcs[n].ripemd,
+		  payment_hash->u.u8, sizeof(payment_hash->u));
+}
+
+/* Fills in what's common to htlc_in and htlc_out. */
+static bool stmt2htlc(tal_t *ctx, sqlite3_stmt *stmt,
+		      u64 *dbid, u64 *id, u64 *msatoshi, u32 *cltv_expiry,
+		      struct sha256 *payment_hash, struct preimage **preimage,
+		      enum htlc_state *hstate, u8 *onion_routing_packet,
+		      enum onion_type *malformed, const u8 **failuremsg)
+{
+	bool ok = true;
+	struct preimage payment_key;
+
+	*dbid = sqlite3_column_int64(stmt, 0);
+	*id = sqlite3_column_int64(stmt, 3);
+	*msatoshi = sqlite3_column_int64(stmt, 5);
+	*cltv_expiry = sqlite3_column_int(stmt, 6);
+	ok &= sqlite3_column_blobval(stmt, 7, payment_hash,
+				     sizeof(*payment_hash));
+	if (sqlite3_column_blobval(stmt, 8, &payment_key, sizeof(payment_key)))
+		*preimage = tal_dup(ctx, struct preimage, &payment_key);
+	else
+		*preimage = NULL;
+	*hstate = sqlite3_column_int(stmt, 9);
+	ok &= sqlite3_column_blobval(stmt, 11, onion_routing_packet,
+				     TOTAL_PACKET_SIZE);
+	*malformed = sqlite3_column_int(stmt, 12);
+	if (sqlite3_column_type(stmt, 13) != SQLITE_NULL)
+		*failuremsg = sqlite3_column_varblob(ctx, stmt, 13);
+	else
+		*failuremsg = NULL;
+	return ok;
+}
+
+bool wallet_htlcs_load(struct wallet *w, struct list_head *peers,
+		       const tal_t *outctx,
+		       struct htlc_in_map *htlcs_in,
+		       struct htlc_out_map *htlcs_out)
+{
+	UINTMAP(struct peer *) chan_peers;
+	UINTMAP(struct htlc_in *) ins;
+	struct peer *peer;
+	bool ok = true;
+	size_t count = 0, live = 0;
+	/* Incoming first, so forwarded ones can find where they came from. */
+	sqlite3_stmt *stmt = db_prepare(w->db, "SELECT " HTLC_FIELDS
+					" FROM channel_htlcs"
+					" ORDER BY direction, id;");
+
+	if (!stmt)
+		return false;
+
+	uintmap_init(&chan_peers);
+	uintmap_init(&ins);
+	list_for_each(peers, peer, list)
+		uintmap_add(&chan_peers, peer->channel->id, peer);
+
+	while (ok && sqlite3_step(stmt) == SQLITE_ROW) {
+		struct htlc_in *hin;
+		struct htlc_out *hout;
+
+		peer = uintmap_get(&chan_peers, sqlite3_column_int64(stmt, 1));
+		/* Not active: channel's closed. */
+		if (!peer)
+			continue;
+		count++;
+
+		if (sqlite3_column_int(stmt, 2) == DIRECTION_INCOMING) {
+			hin = tal(peer, struct htlc_in);
+			hin->key.peer = peer;
+			ok &= stmt2htlc(hin, stmt, &hin->dbid, &hin->key.id,
+					&hin->msatoshi, &hin->cltv_expiry,
+					&hin->payment_hash, &hin->preimage,
+					&hin->hstate,
+					hin->onion_routing_packet,
+					&hin->malformed, &hin->failuremsg);
+			ok &= sqlite3_column_blobval(stmt, 10,
+						     &hin->shared_secret,
+						     sizeof(hin->shared_secret));
+			htlc_stub_add(peer, REMOTE, hin->cltv_expiry,
+				      &hin->payment_hash);
+			if (!ok || hin->hstate == SENT_REMOVE_ACK_REVOCATION) {
+				tal_free(hin);
+				continue;
+			}
+			htlc_in_check(hin, "wallet_htlcs_load");
+			connect_htlc_in(htlcs_in, hin);
+			uintmap_add(&ins, hin->dbid, hin);
+		} else {
+			hout = tal(outctx, struct htlc_out);
+			hout->key.peer = peer;
+			ok &= stmt2htlc(hout, stmt, &hout->dbid, &hout->key.id,
+					&hout->msatoshi, &hout->cltv_expiry,
+					&hout->payment_hash, &hout->preimage,
+					&hout->hstate,
+					hout->onion_routing_packet,
+					&hout->malformed, &hout->failuremsg);
+			htlc_stub_add(peer, LOCAL, hout->cltv_expiry,
+				      &hout->payment_hash);
+			if (!ok || hout->hstate == RCVD_REMOVE_ACK_REVOCATION) {
+				tal_free(hout);
+				continue;
+			}
+			/* If what it came from is finished, so be it. */
+			if (sqlite3_column_type(stmt, 4) != SQLITE_NULL)
+				hout->in = uintmap_get(&ins,
+						sqlite3_column_int64(stmt, 4));
+			else
+				hout->in = NULL;
+			hout->pay_command = NULL;
+			htlc_out_check(hout, "wallet_htlcs_load");
+			connect_htlc_out(htlcs_out, hout);
+		}
+		live++;
+	}
+	db_stmt_done(stmt);
+	uintmap_clear(&chan_peers);
+	uintmap_clear(&ins);
+
+	log_debug(w->log, "Loaded %zu HTLCs from DB, %zu live", count, live);
+	return ok;
+}
+
+u64 *wallet_htlc_out_ids_by_payment_hash(const tal_t *ctx, struct wallet *w,
+					 const struct wallet_channel *chan,
+					 const struct sha256 *payment_hash)
+{
+	u64 *ids = tal_arr(ctx, u64, 0);
+	size_t n = 0;
+	sqlite3_stmt *stmt = db_prepare(w->db,
+		"SELECT channel_htlc_id FROM channel_htlcs"
+		" WHERE payment_hash=? AND channel_id=? AND direction=?;");
+
+	if (!stmt)
+		return ids;
+	sqlite3_bind_blob(stmt, 1, payment_hash, sizeof(*payment_hash),
+			  SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, chan->id);
+	sqlite3_bind_int(stmt, 3, DIRECTION_OUTGOING);
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		tal_resize(&ids, n + 1);
+		ids[n++] = sqlite3_column_int64(stmt, 0);
+	}
+	db_stmt_done(stmt);
+	return ids;
+}
+
 /**
  * wallet_shachain_delete - Drop the shachain from the database
  *
@@ -3,19 +3,41 @@
 
 #include "config.h"
 #include "db.h"
+#include <ccan/crypto/sha256/sha256.h>
 #include <ccan/crypto/shachain/shachain.h>
 #include <ccan/list/list.h>
 #include <ccan/tal/tal.h>
+#include <ccan/time/time.h>
+#include <ccan/typesafe_cb/typesafe_cb.h>
 #include <lightningd/channel_config.h>
+#include <lightningd/htlc_end.h>
 #include <lightningd/utxo.h>
 #include <wally_bip32.h>
 
 struct lightningd;
+struct oneshot;
+struct timers;
 
 struct wallet {
 	struct db *db;
 	struct log *log;
 	struct ext_key *bip32_base;
+
+	/* Our available outputs, smallest first, so we don't go to the db
+	 * to choose coins.  Writes go through; NULL until we need it. */
+	struct utxo **available;
+
+	/* Group commit: how long a batch stays open, when it closes, and
+	 * who's waiting for that. */
+	struct timers *timers;
+	struct timerel commit_window;
+	struct oneshot *commit_timer;
+	struct list_head commit_waiters;
+
+	/* How often we checkpoint the write-ahead log, and how often we
+	 * log db_stats (never, if zero). */
+	struct timerel checkpoint_interval;
+	struct timerel stats_interval;
 };
 
 /* Possible states for tracked outputs in the database. Not sure yet
@@ -49,20 +71,66 @@ struct wallet_shachain {
 	struct shachain chain;
 };
 
+/* Groups of columns in the channels table, which we write separately. */
+enum channel_cols {
+	CHANNEL_COLS_CORE,
+	CHANNEL_COLS_INDEX,
+	CHANNEL_COLS_LAST_TX,
+	CHANNEL_COLS_REMOTE_KEYS,
+	CHANNEL_COLS_REMOTE_COMMIT,
+	CHANNEL_COLS_LAST_SENT,
+	CHANNEL_COLS_MAX
+};
+
 /* A database backed peer struct. Like wallet_shachain, it is writethrough. */
 /* TODO(cdecker) Separate peer from channel */
 struct wallet_channel {
 	u64 id;
 	struct peer *peer;
+
+	/* Hash of what's in the db for each group of columns, so we only
+	 * write those which have changed.  Zero if we've never saved. */
+	struct sha256 saved[CHANNEL_COLS_MAX];
 };
 
 /**
  * wallet_new - Constructor for a new sqlite3 based wallet
  *
  * This is guaranteed to either return a valid wallet, or abort with
- * `fatal` if it cannot be initialized.
+ * `fatal` if it cannot be initialized.  In WAL mode, it checkpoints
+ * every @checkpoint_interval, and logs how long the disk is taking.
+ * Unless @stats_interval is zero, it logs the slowest call sites in
+ * db_stats() that often.
  */
-struct wallet *wallet_new(const tal_t *ctx, struct log *log);
+struct wallet *wallet_new(const tal_t *ctx, struct log *log,
+			  struct timers *timers,
+			  const struct db_profile *profile,
+			  struct timerel commit_window,
+			  struct timerel checkpoint_interval,
+			  struct timerel stats_interval);
+
+/**
+ * wallet_batch_start - Group the following writes with other channels'
+ *
+ * Until wallet_batch_end(), writes go into a transaction shared with
+ * anyone else who does this within the commit_window, and we fsync
+ * once for all of them.  Nothing is durable until then, so anything
+ * which relies on it must wait (see wallet_after_commit).
+ */
+void wallet_batch_start(struct wallet *w);
+void wallet_batch_end(struct wallet *w);
+
+/**
+ * wallet_after_commit - Call @cb once everything written so far is durable
+ *
+ * If there's a batch open, that's when it's committed; otherwise it's
+ * now.  Freeing @ctx first cancels it.
+ */
+#define wallet_after_commit(w, ctx, cb, arg)				\
+	wallet_after_commit_((w), (ctx),				\
+			     typesafe_cb(void, void *, (cb), (arg)), (arg))
+void wallet_after_commit_(struct wallet *w, const tal_t *ctx,
+			  void (*cb)(void *arg), void *arg);
 
 /**
  * wallet_add_utxo - Register a UTXO which we (partially) own
@@ -81,6 +149,9 @@ bool wallet_add_utxo(struct wallet *w, struct utxo *utxo,
  * output does not exist, or it does not have the expected
  * @oldstatus. In case we don't care about the previous state use
  * `output_state_any` as @oldstatus.
+ *
+ * The wallet reloads its available outputs after this, so prefer
+ * wallet_select_coins and wallet_confirm_utxos.
  */
 bool wallet_update_output_status(struct wallet *w,
 				 const struct sha256_double *txid,
@@ -96,6 +167,14 @@ bool wallet_update_output_status(struct wallet *w,
 struct utxo **wallet_get_utxos(const tal_t *ctx, struct wallet *w,
 			      const enum output_status state);
 
+/**
+ * wallet_select_coins - Reserve outputs to pay @value plus fees
+ *
+ * Looks for outputs which cover it with no change left over (branch
+ * and bound), and otherwise for few, with change above dust.  Fees
+ * assume two outputs.  Returns NULL if we can't afford it; otherwise
+ * they're reserved until the array is freed, or confirmed.
+ */
 const struct utxo **wallet_select_coins(const tal_t *ctx, struct wallet *w,
 					const u64 value,
 					const u32 feerate_per_kw,
@@ -114,9 +193,10 @@ void wallet_confirm_utxos(struct wallet *w, const struct utxo **utxos);
 /**
  * wallet_can_spend - Do we have the private key matching this scriptpubkey?
  *
- * FIXME: This is very slow with lots of inputs!
+ * We keep the scripts for each key index we've handed out in the db,
+ * so this is a lookup, not a derivation for each key.
  *
- * @w: (in) allet holding the pubkeys to check against (privkeys are on HSM)
+ * @w: (in) wallet holding the pubkeys to check against (privkeys are on HSM)
  * @script: (in) the script to check
  * @index: (out) the bip32 derivation index that matched the script
  * @output_is_p2sh: (out) whether the script is a p2sh, or p2wpkh
@@ -128,6 +208,8 @@ bool wallet_can_spend(struct wallet *w, const u8 *script,
  * wallet_get_newindex - get a new index from the wallet.
  * @ld: (in) lightning daemon
  *
+ * Adds its scripts to the ones wallet_can_spend looks for.
+ *
  * Returns -1 on error (key exhaustion).
  */
 s64 wallet_get_newindex(struct lightningd *ld);
@@ -172,6 +254,9 @@ bool wallet_channel_load(struct wallet *w, const u64 id,
  * @wallet: the wallet to save into
  * @chan: the instance to store (not const so we can update the unique_id upon
  *   insert)
+ *
+ * Only writes the columns which changed since it was last saved or
+ * loaded; the channel configs never change, so they're written once.
  */
 bool wallet_channel_save(struct wallet *w, struct wallet_channel *chan);
 
@@ -206,8 +291,63 @@ bool wallet_peer_by_nodeid(struct wallet *w, const struct pubkey *nodeid,
  * @peers: list_head to load channels/peers into
  *
  * Be sure to call this only once on startup since it'll append peers
- * loaded from the database to the list without checking.
+ * loaded from the database to the list without checking.  It's a single
+ * query, joining each channel with its peer, configs and shachain.
  */
 bool wallet_channels_load_active(struct wallet *w, struct list_head *peers);
 
+/**
+ * wallet_htlc_save_in - Store an incoming HTLC, once it's committed
+ *
+ * Sets @in->dbid.  After this only its state and resolution change,
+ * and wallet_htlc_update() stores those.
+ */
+bool wallet_htlc_save_in(struct wallet *w, const struct wallet_channel *chan,
+			 struct htlc_in *in);
+
+/**
+ * wallet_htlc_save_out - Store an outgoing HTLC, once it's committed
+ *
+ * Sets @out->dbid.  If it's forwarded, @out->in must already be stored.
+ */
+bool wallet_htlc_save_out(struct wallet *w, const struct wallet_channel *chan,
+			  struct htlc_out *out);
+
+/**
+ * wallet_htlc_update - Store an HTLC's new state, and how it was resolved
+ *
+ * @payment_key and @failuremsg may be NULL, and @malformed 0.
+ */
+bool wallet_htlc_update(struct wallet *w, u64 htlc_dbid,
+			enum htlc_state new_state,
+			const struct preimage *payment_key,
+			enum onion_type malformed,
+			const u8 *failuremsg);
+
+/**
+ * wallet_htlcs_load - Load every loaded channel's HTLCs, in one query
+ *
+ * @w: wallet to load from
+ * @peers: the peers from wallet_channels_load_active()
+ * @outctx: what to allocate outgoing HTLCs from (incoming hang off the peer)
+ * @htlcs_in, @htlcs_out: where live HTLCs go
+ *
+ * Every HTLC which was ever committed also becomes a stub in peer->htlcs,
+ * for penalty transactions.  Our own payments don't survive a restart,
+ * so outgoing HTLCs which weren't forwarded have no pay_command.
+ */
+bool wallet_htlcs_load(struct wallet *w, struct list_head *peers,
+		       const tal_t *outctx,
+		       struct htlc_in_map *htlcs_in,
+		       struct htlc_out_map *htlcs_out);
+
+/**
+ * wallet_htlc_out_ids_by_payment_hash - Find our outgoing HTLCs with a hash
+ *
+ * Returns a tal_arr of their ids in @chan (not their dbids).
+ */
+u64 *wallet_htlc_out_ids_by_payment_hash(const tal_t *ctx, struct wallet *w,
+					 const struct wallet_channel *chan,
+					 const struct sha256 *payment_hash);
+
 #endif /* WALLET_WALLET_H */
@@ -1,13 +1,20 @@
 #include "wallet.c"
 
 #include <ccan/mem/mem.h>
+#include <ccan/time/time.h>
 #include "db.c"
 #include "wallet/test_utils.h"
 
 #include <stdio.h>
 #include <unistd.h>
 
-static struct wallet *create_test_wallet(const tal_t *ctx)
+/* Give it a count to benchmark, eg. "wallet_tests 10000". */
+
+/* Taken from BOLT #3 */
+static const char *bolt3_tx_hex = "02000000000101bef67e4e2fb9ddeeb3461973cd4c62abb35050b1add772995b820b584a488489000000000038b02b8003a00f0000000000002200208c48d15160397c9731df9bc3b236656efb6665fbfe92b4a6878e88a499f741c4c0c62d0000000000160014ccf1af2f2aabee14bb40fa3851ab2301de843110ae8f6a00000000002200204adb4e2f00643db396dd120d4e7dc17625f5f2c11a40d857accc862d6b7dd80e040047304402206a2679efa3c7aaffd2a447fd0df7aba8792858b589750f6a1203f9259173198a022008d52a0e77a99ab533c36206cb15ad7aeb2aa72b93d4b571e728cb5ec2f6fe260147304402206d6cb93969d39177a09d5d45b583f34966195b77c7e585cf47ac5cce0c90cefb022031d71ae4e33a4e80df7f981d696fbdee517337806a3c7138b7491e2cbb077a0e01475221023da092f6980e58d2c037173180e9a465476026ee50f96695963e8efe436f54eb21030e9f7b623d2ccc7c9bd44d66d5ce21ce504c0acf6385a132cec6d3c39fa711c152ae3e195220";
+
+static struct wallet *create_profile_wallet(const tal_t *ctx,
+					    const struct db_profile *profile)
 {
 	char filename[] = "/tmp/ldb-XXXXXX";
 	int fd = mkstemp(filename);
@@ -16,13 +23,28 @@ static struct wallet *create_test_wallet(const tal_t *ctx)
 	close(fd);
 
 	w->db = db_open(w, filename);
+	w->available = NULL;
+	w->log = new_log(w, new_log_book(w, 1024*1024, LOG_BROKEN),
+			 "wallet_tests:");
+	w->timers = tal(w, struct timers);
+	timers_init(w->timers, time_mono());
+	w->commit_window = time_from_msec(0);
+	w->commit_timer = NULL;
+	list_head_init(&w->commit_waiters);
 
 	CHECK_MSG(w->db, "Failed opening the db");
+	if (profile)
+		CHECK_MSG(db_set_profile(w->db, profile), "Setting profile");
 	CHECK_MSG(db_migrate(w->db), "DB migration failed");
 
 	return w;
 }
 
+static struct wallet *create_test_wallet(const tal_t *ctx)
+{
+	return create_profile_wallet(ctx, NULL);
+}
+
 static bool test_wallet_outputs(void)
 {
 	char filename[] = "/tmp/ldb-XXXXXX";
@@ -33,6 +55,7 @@ static bool test_wallet_outputs(void)
 	close(fd);
 
 	w->db = db_open(w, filename);
+	w->available = NULL;
 	CHECK_MSG(w->db, "Failed opening the db");
 	CHECK_MSG(db_migrate(w->db), "DB migration failed");
 
@@ -110,6 +133,24 @@ static bool test_shachain_crud(void)
 
 	CHECK(wallet_shachain_load(w, a.id, &b));
 	CHECK_MSG(memcmp(&a, &b, sizeof(a)) == 0, "Loading from database doesn't match");
+
+	/* Older databases have a row for each of known[]. */
+	memset(&b, 0, sizeof(b));
+	CHECK(db_exec(__func__, w->db, "UPDATE shachains SET known=NULL;"));
+	for (unsigned int i = 0; i < a.chain.num_valid; i++) {
+		sqlite3_stmt *stmt = db_prepare(w->db,
+			"INSERT INTO shachain_known (shachain_id, pos, idx, hash)"
+			" VALUES (?, ?, ?, ?);");
+		CHECK(stmt);
+		sqlite3_bind_int64(stmt, 1, a.id);
+		sqlite3_bind_int(stmt, 2, i);
+		sqlite3_bind_int64(stmt, 3, a.chain.known[i].index);
+		sqlite3_bind_blob(stmt, 4, &a.chain.known[i].hash,
+				  sizeof(a.chain.known[i].hash), SQLITE_STATIC);
+		CHECK(db_exec_prepared(w->db, stmt));
+	}
+	CHECK(wallet_shachain_load(w, a.id, &b));
+	CHECK_MSG(memcmp(&a, &b, sizeof(a)) == 0, "Loading old rows doesn't match");
 	tal_free(w);
 	return true;
 }
@@ -188,6 +229,7 @@ static bool test_channel_crud(const tal_t *ctx)
 	struct pubkey pk;
 	struct changed_htlc last_commit;
 	secp256k1_ecdsa_signature *sig = tal(w, secp256k1_ecdsa_signature);
+	int changes;
 
 	u64 msat = 12345;
 
@@ -260,12 +302,26 @@ static bool test_channel_crud(const tal_t *ctx)
 	CHECK_MSG(channelseq(&c1, c2), "Compare loaded with saved (v6)");
 
 	/* Variant 7: update with last_tx (taken from BOLT #3) */
-	p.last_tx = bitcoin_tx_from_hex(w, "02000000000101bef67e4e2fb9ddeeb3461973cd4c62abb35050b1add772995b820b584a488489000000000038b02b8003a00f0000000000002200208c48d15160397c9731df9bc3b236656efb6665fbfe92b4a6878e88a499f741c4c0c62d0000000000160014ccf1af2f2aabee14bb40fa3851ab2301de843110ae8f6a00000000002200204adb4e2f00643db396dd120d4e7dc17625f5f2c11a40d857accc862d6b7dd80e040047304402206a2679efa3c7aaffd2a447fd0df7aba8792858b589750f6a1203f9259173198a022008d52a0e77a99ab533c36206cb15ad7aeb2aa72b93d4b571e728cb5ec2f6fe260147304402206d6cb93969d39177a09d5d45b583f34966195b77c7e585cf47ac5cce0c90cefb022031d71ae4e33a4e80df7f981d696fbdee517337806a3c7138b7491e2cbb077a0e01475221023da092f6980e58d2c037173180e9a465476026ee50f96695963e8efe436f54eb21030e9f7b623d2ccc7c9bd44d66d5ce21ce504c0acf6385a132cec6d3c39fa711c152ae3e195220", strlen("02000000000101bef67e4e2fb9ddeeb3461973cd4c62abb35050b1add772995b820b584a488489000000000038b02b8003a00f0000000000002200208c48d15160397c9731df9bc3b236656efb6665fbfe92b4a6878e88a499f741c4c0c62d0000000000160014ccf1af2f2aabee14bb40fa3851ab2301de843110ae8f6a00000000002200204adb4e2f00643db396dd120d4e7dc17625f5f2c11a40d857accc862d6b7dd80e040047304402206a2679efa3c7aaffd2a447fd0df7aba8792858b589750f6a1203f9259173198a022008d52a0e77a99ab533c36206cb15ad7aeb2aa72b93d4b571e728cb5ec2f6fe260147304402206d6cb93969d39177a09d5d45b583f34966195b77c7e585cf47ac5cce0c90cefb022031d71ae4e33a4e80df7f981d696fbdee517337806a3c7138b7491e2cbb077a0e01475221023da092f6980e58d2c037173180e9a465476026ee50f96695963e8efe436f54eb21030e9f7b623d2ccc7c9bd44d66d5ce21ce504c0acf6385a132cec6d3c39fa711c152ae3e195220"));
+	p.last_tx = bitcoin_tx_from_hex(w, bolt3_tx_hex, strlen(bolt3_tx_hex));
 	p.last_sig = sig;
 	CHECK_MSG(wallet_channel_save(w, &c1), tal_fmt(w, "Insert into DB: %s", w->db->err));
 	CHECK_MSG(wallet_channel_load(w, c1.id, c2), tal_fmt(w, "Load from DB: %s", w->db->err));
 	CHECK_MSG(channelseq(&c1, c2), "Compare loaded with saved (v7)");
 
+	/* Only what's changed gets written: here, one small UPDATE. */
+	changes = sqlite3_total_changes(w->db->sql);
+	p.next_index[LOCAL]++;
+	CHECK(wallet_channel_save(w, &c1));
+	CHECK(sqlite3_total_changes(w->db->sql) == changes + 1);
+	CHECK(wallet_channel_save(w, &c1));
+	CHECK(sqlite3_total_changes(w->db->sql) == changes + 1);
+	CHECK_MSG(wallet_channel_load(w, c1.id, c2), tal_fmt(w, "Load from DB: %s", w->db->err));
+	CHECK_MSG(channelseq(&c1, c2), "Compare loaded with saved (v8)");
+
+	/* Nor does saving what we just loaded. */
+	CHECK(wallet_channel_save(w, c2));
+	CHECK(sqlite3_total_changes(w->db->sql) == changes + 1);
+
 	tal_free(w);
 	return true;
 }
@@ -294,7 +350,573 @@ static bool test_channel_config_crud(const tal_t *ctx)
        	return true;
 }
 
-int main(void)
+static void set_flag(bool *flag)
+{
+	*flag = true;
+}
+
+static void run_timers(struct wallet *w)
+{
+	struct timer *t;
+
+	while ((t = timers_expire(w->timers, time_mono())) != NULL)
+		timer_expired(w, t);
+}
+
+static bool test_group_commit(const tal_t *ctx)
+{
+	struct wallet *w = create_test_wallet(ctx);
+	bool first = false, second = false, third = false, gone = false;
+	tal_t *goner = tal(ctx, char);
+
+	/* Nothing pending: it's already committed. */
+	wallet_after_commit(w, ctx, set_flag, &first);
+	CHECK(first);
+	first = false;
+
+	wallet_batch_start(w);
+	CHECK(db_set_intvar(w->db, "a", 1));
+	wallet_batch_end(w);
+	wallet_after_commit(w, ctx, set_flag, &first);
+
+	/* Another writer joins the same commit. */
+	wallet_batch_start(w);
+	CHECK(db_set_intvar(w->db, "b", 2));
+	wallet_batch_end(w);
+	wallet_after_commit(w, ctx, set_flag, &second);
+	wallet_after_commit(w, goner, set_flag, &gone);
+	tal_free(goner);
+	CHECK(!first && !second);
+	CHECK(!sqlite3_get_autocommit(w->db->sql));
+
+	run_timers(w);
+	CHECK(first && second && !gone);
+	CHECK(sqlite3_get_autocommit(w->db->sql));
+	CHECK(!w->commit_timer);
+	CHECK(db_get_intvar(w->db, "a", 0) == 1);
+	CHECK(db_get_intvar(w->db, "b", 0) == 2);
+
+	/* If someone else writes meanwhile, it's on disk already, but the
+	 * waiter still hears at the timer. */
+	wallet_batch_start(w);
+	CHECK(db_set_intvar(w->db, "c", 3));
+	wallet_batch_end(w);
+	wallet_after_commit(w, ctx, set_flag, &third);
+	CHECK(db_set_intvar(w->db, "d", 4));
+	CHECK(sqlite3_get_autocommit(w->db->sql));
+	CHECK(!third);
+	run_timers(w);
+	CHECK(third);
+
+	tal_free(w);
+	return true;
+}
+
+/* A channel with everything filled in, as each commitment saves. */
+struct bench_channel {
+	struct wallet_channel c;
+	struct peer *p;
+	struct channel_info ci;
+	struct changed_htlc last_commit;
+	secp256k1_ecdsa_signature sig;
+	struct sha256_double txid;
+	u64 msat;
+};
+
+static struct bench_channel *new_bench_channel(struct wallet *w)
+{
+	struct bench_channel *b = talz(w, struct bench_channel);
+	struct pubkey pk;
+
+	b->p = talz(b, struct peer);
+	memset(&b->txid, 'B', sizeof(b->txid));
+	pubkey_from_der(tal_hexdata(w, "02a1633cafcc01ebfb6d78e39f687a1f0995c62fc95f51ead10a02ee0be551b5dc", 66), 33, &pk);
+	b->msat = 12345;
+	b->c.peer = b->p;
+	b->p->id = pk;
+	b->p->scid = talz(b, struct short_channel_id);
+	b->p->funding_txid = &b->txid;
+	b->p->our_msatoshi = &b->msat;
+	b->p->channel_info = &b->ci;
+	b->p->last_sent_commit = &b->last_commit;
+	b->p->last_tx = bitcoin_tx_from_hex(b, bolt3_tx_hex,
+					   strlen(bolt3_tx_hex));
+	b->p->last_sig = &b->sig;
+	b->ci.remote_fundingkey = pk;
+	b->ci.theirbase.revocation = pk;
+	b->ci.theirbase.payment = pk;
+	b->ci.theirbase.delayed_payment = pk;
+	b->ci.remote_per_commit = pk;
+	b->ci.old_remote_per_commit = pk;
+	return b;
+}
+
+static void bench_commit_step(struct bench_channel *b)
+{
+	b->p->next_index[LOCAL]++;
+	b->msat++;
+}
+
+static bool test_channels_load_active(const tal_t *ctx)
+{
+	struct wallet *w = create_test_wallet(ctx);
+	struct bench_channel *b[3];
+	struct wallet_channel *chan;
+	struct list_head peers;
+	struct peer *p;
+	struct sha256 hash;
+	size_t i, n = 0;
+
+	memset(&hash, 'S', sizeof(hash));
+	for (i = 0; i < 3; i++) {
+		b[i] = new_bench_channel(w);
+		b[i]->p->state = (i == 2 ? CLOSINGD_COMPLETE : CHANNELD_NORMAL);
+		b[i]->p->our_config.to_self_delay = 100 + i;
+		b[i]->ci.their_config.to_self_delay = 200 + i;
+		if (i)
+			b[i]->p->dbid = b[0]->p->dbid;
+		CHECK(wallet_channel_save(w, &b[i]->c));
+		CHECK(wallet_shachain_add_hash(w, &b[i]->p->their_shachain,
+			shachain_next_index(&b[i]->p->their_shachain.chain),
+			&hash));
+	}
+
+	/* Everything but the closed one, with all it refers to. */
+	list_head_init(&peers);
+	CHECK(wallet_channels_load_active(w, &peers));
+	list_for_each(&peers, p, list) {
+		struct bench_channel *orig = NULL;
+
+		for (i = 0; i < 2; i++)
+			if (b[i]->c.id == p->channel->id)
+				orig = b[i];
+		CHECK(orig);
+		CHECK(channelseq(&orig->c, p->channel));
+		CHECK(p->our_config.to_self_delay == 100 + (orig != b[0]));
+		CHECK(p->channel_info->their_config.to_self_delay
+		      == 200 + (orig != b[0]));
+		CHECK(memcmp(&p->their_shachain, &orig->p->their_shachain,
+			     sizeof(p->their_shachain)) == 0);
+		n++;
+	}
+	CHECK(n == 2);
+
+	/* A channel whose config has gone missing doesn't load. */
+	chan = talz(w, struct wallet_channel);
+	CHECK(wallet_channel_load(w, b[1]->c.id, chan));
+	CHECK(db_exec(__func__, w->db,
+		      "DELETE FROM channel_configs WHERE id=%"PRIu64";",
+		      b[1]->p->our_config.id));
+	chan = talz(w, struct wallet_channel);
+	CHECK(!wallet_channel_load(w, b[1]->c.id, chan));
+	tal_free(w);
+	return true;
+}
+
+static bool test_htlc_crud(const tal_t *ctx)
+{
+	struct wallet *w = create_test_wallet(ctx);
+	struct bench_channel *b = new_bench_channel(w);
+	struct htlc_in *in, *finished, *loaded_in;
+	struct htlc_out *out, *loaded_out;
+	struct htlc_in_map htlcs_in;
+	struct htlc_out_map htlcs_out;
+	struct list_head peers;
+	struct sha256 payment_hash;
+	struct secret secret;
+	struct preimage preimage;
+	u8 onion[TOTAL_PACKET_SIZE];
+	u64 *ids;
+
+	memset(&payment_hash, 'H', sizeof(payment_hash));
+	memset(&secret, 'S', sizeof(secret));
+	memset(&preimage, 'P', sizeof(preimage));
+	memset(onion, 'O', sizeof(onion));
+	CHECK(wallet_channel_save(w, &b->c));
+	b->p->channel = &b->c;
+	b->p->htlcs = tal_arr(b->p, struct htlc_stub, 0);
+	list_head_init(&peers);
+	list_add(&peers, &b->p->list);
+
+	in = new_htlc_in(w, b->p, 5, 1000, 500, &payment_hash, &secret, onion);
+	CHECK(wallet_htlc_save_in(w, &b->c, in));
+	CHECK(in->dbid);
+	CHECK(wallet_htlc_update(w, in->dbid, RCVD_ADD_ACK_REVOCATION,
+				 &preimage, 0, NULL));
+
+	/* (channel, direction, id) is unique. */
+	CHECK(!wallet_htlc_save_in(w, &b->c, in));
+
+	finished = new_htlc_in(w, b->p, 6, 1000, 500, &payment_hash, &secret,
+			       onion);
+	CHECK(wallet_htlc_save_in(w, &b->c, finished));
+	CHECK(wallet_htlc_update(w, finished->dbid, SENT_REMOVE_ACK_REVOCATION,
+				 NULL, 0, tal_arrz(w, u8, 10)));
+
+	out = new_htlc_out(w, b->p, 900, 490, &payment_hash, onion, in, NULL);
+	out->key.id = 5;
+	out->hstate = SENT_ADD_COMMIT;
+	CHECK(wallet_htlc_save_out(w, &b->c, out));
+	CHECK(out->dbid);
+
+	ids = wallet_htlc_out_ids_by_payment_hash(w, w, &b->c, &payment_hash);
+	CHECK(tal_count(ids) == 1 && ids[0] == 5);
+
+	/* Finished ones only come back as stubs. */
+	htlc_in_map_init(&htlcs_in);
+	htlc_out_map_init(&htlcs_out);
+	CHECK(wallet_htlcs_load(w, &peers, w, &htlcs_in, &htlcs_out));
+	CHECK(tal_count(b->p->htlcs) == 3);
+	CHECK(!find_htlc_in(&htlcs_in, b->p, 6));
+
+	loaded_in = find_htlc_in(&htlcs_in, b->p, 5);
+	CHECK(loaded_in);
+	CHECK(loaded_in->dbid == in->dbid);
+	CHECK(loaded_in->hstate == RCVD_ADD_ACK_REVOCATION);
+	CHECK(loaded_in->msatoshi == 1000 && loaded_in->cltv_expiry == 500);
+	CHECK(structeq(&loaded_in->payment_hash, &payment_hash));
+	CHECK(structeq(&loaded_in->shared_secret, &secret));
+	CHECK(loaded_in->preimage && structeq(loaded_in->preimage, &preimage));
+	CHECK(!loaded_in->failuremsg);
+	CHECK(memeq(loaded_in->onion_routing_packet, TOTAL_PACKET_SIZE,
+		    onion, sizeof(onion)));
+
+	loaded_out = find_htlc_out(&htlcs_out, b->p, 5);
+	CHECK(loaded_out);
+	CHECK(loaded_out->in == loaded_in);
+	CHECK(loaded_out->hstate == SENT_ADD_COMMIT);
+	CHECK(!loaded_out->pay_command);
+
+	tal_free(w);
+	htlc_in_map_clear(&htlcs_in);
+	htlc_out_map_clear(&htlcs_out);
+	return true;
+}
+
+static void add_test_utxo(struct wallet *w, u32 outnum, u64 amount)
+{
+	struct utxo u;
+
+	memset(&u, 0, sizeof(u));
+	u.outnum = outnum;
+	u.amount = amount;
+	if (!wallet_add_utxo(w, &u, p2sh_wpkh))
+		abort();
+}
+
+static size_t num_utxos(struct wallet *w, enum output_status state)
+{
+	struct utxo **u = wallet_get_utxos(w, w, state);
+	size_t n = tal_count(u);
+
+	tal_free(u);
+	return n;
+}
+
+static bool test_coin_selection(const tal_t *ctx)
+{
+	struct wallet *w = create_test_wallet(ctx);
+	const struct utxo **utxos;
+	u64 fee, change, in;
+	size_t i;
+
+	add_test_utxo(w, 0, 1000);
+	add_test_utxo(w, 1, 50000);
+	add_test_utxo(w, 2, 5000);
+	add_test_utxo(w, 3, 2000);
+	add_test_utxo(w, 4, 10000);
+
+	/* Exactly 5000 + 2000, so no change. */
+	utxos = wallet_select_coins(ctx, w, 7000, 0, &fee, &change);
+	CHECK(utxos && tal_count(utxos) == 2);
+	CHECK(utxos[0]->amount + utxos[1]->amount == 7000);
+	CHECK(fee == 0 && change == 0);
+	CHECK(num_utxos(w, output_state_reserved) == 2);
+	CHECK(tal_count(w->available) == 3);
+
+	/* Freeing them makes them available again. */
+	tal_free(utxos);
+	CHECK(num_utxos(w, output_state_available) == 5);
+	CHECK(tal_count(w->available) == 5);
+	for (i = 1; i < tal_count(w->available); i++)
+		CHECK(w->available[i-1]->amount <= w->available[i]->amount);
+
+	/* The small ones aren't enough: the big one alone, with change. */
+	utxos = wallet_select_coins(ctx, w, 30000, 0, &fee, &change);
+	CHECK(utxos && tal_count(utxos) == 1);
+	CHECK(utxos[0]->amount == 50000 && change == 20000);
+	wallet_confirm_utxos(w, utxos);
+	tal_free(utxos);
+	CHECK(num_utxos(w, output_state_spent) == 1);
+	CHECK(num_utxos(w, output_state_available) == 4);
+	CHECK(tal_count(w->available) == 4);
+
+	/* Too much: nothing reserved. */
+	CHECK(!wallet_select_coins(ctx, w, 30000, 0, &fee, &change));
+	CHECK(num_utxos(w, output_state_reserved) == 0);
+
+	/* Fees come out of what we select. */
+	utxos = wallet_select_coins(ctx, w, 3000, 2000, &fee, &change);
+	CHECK(utxos);
+	for (i = in = 0; i < tal_count(utxos); i++)
+		in += utxos[i]->amount;
+	CHECK(fee > 0 && in == 3000 + fee + change);
+	tal_free(utxos);
+
+	/* Changed behind its back: it notices. */
+	CHECK(wallet_update_output_status(w, &w->available[0]->txid,
+					  w->available[0]->outnum,
+					  output_state_available,
+					  output_state_spent));
+	CHECK(!w->available);
+	CHECK(wallet_select_coins(ctx, w, 17001, 0, &fee, &change) == NULL);
+	CHECK(tal_count(w->available) == 3);
+	tal_free(w);
+
+	/* More than one statement's worth. */
+	w = create_test_wallet(ctx);
+	for (i = 0; i < 20; i++)
+		add_test_utxo(w, i, 100);
+	utxos = wallet_select_coins(ctx, w, 1500, 0, &fee, &change);
+	CHECK(utxos && tal_count(utxos) == 15 && change == 0);
+	CHECK(num_utxos(w, output_state_reserved) == 15);
+	tal_free(utxos);
+	CHECK(num_utxos(w, output_state_available) == 20);
+	tal_free(w);
+	return true;
+}
+
+static u8 *our_script(const tal_t *ctx, const struct ext_key *base,
+		      u32 index, bool p2sh)
+{
+	struct ext_key ext;
+	u8 *s;
+
+	if (bip32_key_from_parent(base, index, BIP32_FLAG_KEY_PUBLIC, &ext)
+	    != WALLY_OK)
+		abort();
+	s = scriptpubkey_p2wpkh_derkey(ctx, ext.pub_key);
+	if (p2sh)
+		s = scriptpubkey_p2sh(ctx, take(s));
+	return s;
+}
+
+static bool test_can_spend(const tal_t *ctx)
+{
+	struct wallet *w = create_test_wallet(ctx);
+	struct lightningd *ld = talz(ctx, struct lightningd);
+	u8 seed[BIP32_ENTROPY_LEN_256], op_true[] = { 0x51 };
+	u32 index;
+	bool is_p2sh;
+
+	memset(seed, 7, sizeof(seed));
+	w->bip32_base = tal(w, struct ext_key);
+	CHECK(bip32_key_from_seed(seed, sizeof(seed), BIP32_VER_TEST_PRIVATE,
+				  0, w->bip32_base) == WALLY_OK);
+	ld->wallet = w;
+
+	CHECK(wallet_can_spend(w, our_script(w, w->bip32_base, 0, false),
+			       &index, &is_p2sh));
+	CHECK(index == 0 && !is_p2sh);
+	CHECK(!wallet_can_spend(w, our_script(w, w->bip32_base, 1, true),
+				&index, &is_p2sh));
+
+	/* New indices are added as they're handed out. */
+	CHECK(wallet_get_newindex(ld) == 1);
+	CHECK(wallet_get_newindex(ld) == 2);
+	CHECK(wallet_can_spend(w, our_script(w, w->bip32_base, 1, true),
+			       &index, &is_p2sh));
+	CHECK(index == 1 && is_p2sh);
+	CHECK(wallet_can_spend(w, our_script(w, w->bip32_base, 2, false),
+			       &index, &is_p2sh));
+	CHECK(index == 2 && !is_p2sh);
+	CHECK(!wallet_can_spend(w, our_script(w, w->bip32_base, 3, false),
+				&index, &is_p2sh));
+
+	/* Bumped behind our back: we catch up. */
+	CHECK(db_set_intvar(w->db, "bip32_max_index", 10));
+	CHECK(wallet_can_spend(w, our_script(w, w->bip32_base, 10, true),
+			       &index, &is_p2sh));
+	CHECK(index == 10 && is_p2sh);
+
+	/* Not even a type we could own. */
+	CHECK(!wallet_can_spend(w, tal_dup_arr(w, u8, op_true, 1, 0),
+				&index, &is_p2sh));
+
+	tal_free(w);
+	return true;
+}
+
+static double per_sec(size_t n, struct timerel elapsed)
+{
+	return n / (time_to_nsec(elapsed) / 1000000000.0);
+}
+
+/* n saves of a channel, as each commitment does. */
+static bool benchmark_channel_save(const tal_t *ctx, size_t n)
+{
+	struct wallet *w = create_test_wallet(ctx);
+	struct bench_channel *b = new_bench_channel(w);
+	struct timeabs start;
+	size_t i;
+
+	CHECK(wallet_channel_save(w, &b->c));
+
+	start = time_now();
+	for (i = 0; i < n; i++) {
+		bench_commit_step(b);
+		CHECK(wallet_channel_save(w, &b->c));
+	}
+	printf("%zu channel saves: %.0f per second\n",
+	       n, per_sec(n, time_between(time_now(), start)));
+
+	/* As if 10 channels' commitments arrived together each time. */
+	start = time_now();
+	for (i = 0; i < n; i++) {
+		wallet_batch_start(w);
+		bench_commit_step(b);
+		CHECK(wallet_channel_save(w, &b->c));
+		wallet_batch_end(w);
+		if (i % 10 == 9)
+			run_timers(w);
+	}
+	run_timers(w);
+	printf("%zu channel saves, 10 per commit: %.0f per second\n",
+	       n, per_sec(n, time_between(time_now(), start)));
+	tal_free(w);
+	return true;
+}
+
+/* Choosing coins for a payment, from n outputs. */
+static bool benchmark_coin_selection(const tal_t *ctx, size_t n)
+{
+	struct wallet *w = create_test_wallet(ctx);
+	const struct utxo **utxos;
+	struct timeabs start;
+	u64 fee, change;
+	size_t i;
+
+	CHECK(db_begin_transaction(w->db));
+	for (i = 0; i < n; i++)
+		add_test_utxo(w, i, 1000 + (i * 7919) % 1000000);
+	CHECK(db_commit_transaction(w->db));
+
+	/* The first one loads them all. */
+	tal_free(wallet_select_coins(ctx, w, 10000, 1000, &fee, &change));
+
+	start = time_now();
+	for (i = 0; i < 100; i++) {
+		utxos = wallet_select_coins(ctx, w, 10000 + i * 12345, 1000,
+					    &fee, &change);
+		CHECK(utxos);
+		tal_free(utxos);
+	}
+	printf("%zu outputs: %.0f coin selections per second\n",
+	       n, per_sec(100, time_between(time_now(), start)));
+	tal_free(w);
+	return true;
+}
+
+/* Restarting with n channels. */
+static bool benchmark_channels_load(const tal_t *ctx, size_t n)
+{
+	struct wallet *w = create_test_wallet(ctx);
+	struct list_head peers;
+	struct timeabs start;
+	u64 dbid = 0;
+	size_t i;
+
+	wallet_batch_start(w);
+	for (i = 0; i < n; i++) {
+		struct bench_channel *b = new_bench_channel(w);
+
+		b->p->state = CHANNELD_NORMAL;
+		b->p->dbid = dbid;
+		CHECK(wallet_channel_save(w, &b->c));
+		dbid = b->p->dbid;
+		tal_free(b);
+	}
+	wallet_batch_end(w);
+	run_timers(w);
+
+	list_head_init(&peers);
+	start = time_now();
+	CHECK(wallet_channels_load_active(w, &peers));
+	printf("%zu channels: loaded in %"PRIu64"msec\n",
+	       n, time_to_msec(time_between(time_now(), start)));
+	tal_free(w);
+	return true;
+}
+
+#define BENCH_CHANNELS 20
+
+/* n payments across our channels: each is three saves (sending_commitsig,
+ * got_revoke, got_commitsig), a few channels' worth per commit, with a
+ * checkpoint every thousand commits as the timer would do. */
+static bool benchmark_profile(const tal_t *ctx, const char *name,
+			      const struct db_profile *profile, size_t n)
+{
+	struct wallet *w = create_profile_wallet(ctx, profile);
+	struct bench_channel *b[BENCH_CHANNELS];
+	const struct db_timings *t = &w->db->timings;
+	struct timeabs start;
+	size_t i, j;
+
+	for (i = 0; i < BENCH_CHANNELS; i++) {
+		b[i] = new_bench_channel(w);
+		/* They're all with the same peer. */
+		b[i]->p->dbid = i ? b[0]->p->dbid : 0;
+		CHECK(wallet_channel_save(w, &b[i]->c));
+	}
+	memset(&w->db->timings, 0, sizeof(w->db->timings));
+
+	start = time_now();
+	for (i = 0; i < n; i++) {
+		struct bench_channel *bc = b[i % BENCH_CHANNELS];
+
+		for (j = 0; j < 3; j++) {
+			wallet_batch_start(w);
+			bench_commit_step(bc);
+			CHECK(wallet_channel_save(w, &bc->c));
+			wallet_batch_end(w);
+		}
+		if (i % 4 == 3)
+			run_timers(w);
+		if (i % 4000 == 3999)
+			CHECK(db_checkpoint(w->db));
+	}
+	run_timers(w);
+	CHECK(db_checkpoint(w->db));
+
+	printf("%s: %zu payments: %.0f per second;"
+	       " commit avg %"PRIu64"usec (max %"PRIu64"),"
+	       " checkpoint avg %"PRIu64"usec (max %"PRIu64")\n",
+	       name, n, per_sec(n, time_between(time_now(), start)),
+	       avg_usec(t->commit_time, t->commits),
+	       time_to_usec(t->commit_max),
+	       avg_usec(t->checkpoint_time, t->checkpoints),
+	       time_to_usec(t->checkpoint_max));
+	tal_free(w);
+	return true;
+}
+
+static bool benchmark_profiles(const tal_t *ctx, size_t n)
+{
+	struct db_profile journal = db_profile_default;
+	struct db_profile wal_normal = db_profile_default;
+	bool ok = true;
+
+	journal.wal = false;
+	wal_normal.synchronous = 1;
+
+	ok &= benchmark_profile(ctx, "journal, full", &journal, n);
+	ok &= benchmark_profile(ctx, "wal, full (default)",
+				&db_profile_default, n);
+	ok &= benchmark_profile(ctx, "wal, normal", &wal_normal, n);
+	return ok;
+}
+
+int main(int argc, char *argv[])
 {
 	bool ok = true;
 	tal_t *tmpctx = tal_tmpctx(NULL);
@@ -303,6 +925,16 @@ int main(void)
 	ok &= test_shachain_crud();
 	ok &= test_channel_crud(tmpctx);
 	ok &= test_channel_config_crud(tmpctx);
+	ok &= test_group_commit(tmpctx);
+	ok &= test_channels_load_active(tmpctx);
+	ok &= test_htlc_crud(tmpctx);
+	ok &= test_coin_selection(tmpctx);
+	ok &= test_can_spend(tmpctx);
+	if (argc > 1)
+		ok &= benchmark_channel_save(tmpctx, atol(argv[1]))
+			&& benchmark_coin_selection(tmpctx, atol(argv[1]))
+			&& benchmark_channels_load(tmpctx, atol(argv[1]))
+			&& benchmark_profiles(tmpctx, atol(argv[1]));
 
 	tal_free(tmpctx);
 	return !ok;
@@ -324,3 +324,49 @@ static const struct json_command addfunds_command = {
 	"Returns how many {outputs} it can use and total {satoshis}"
 };
 AUTODATA(json_command, &addfunds_command);
+
+static void json_dev_dbstats(struct command *cmd,
+			     const char *buffer, const jsmntok_t *params)
+{
+	struct lightningd *ld = ld_from_dstate(cmd->dstate);
+	struct json_result *response = new_json_result(cmd);
+	const struct db_timings *t = &ld->wallet->db->timings;
+	const struct db_stat **stats = db_stats(cmd, ld->wallet->db);
+
+	json_object_start(response, NULL);
+	json_add_u64(response, "commits", t->commits);
+	json_add_u64(response, "commit_usec", time_to_usec(t->commit_time));
+	json_add_u64(response, "commit_max_usec",
+		     time_to_usec(t->commit_max));
+	json_add_u64(response, "checkpoints", t->checkpoints);
+	json_add_u64(response, "checkpoint_usec",
+		     time_to_usec(t->checkpoint_time));
+	json_add_u64(response, "checkpoint_max_usec",
+		     time_to_usec(t->checkpoint_max));
+	json_array_start(response, "sites");
+	for (size_t i = 0; i < tal_count(stats); i++) {
+		json_object_start(response, NULL);
+		json_add_string(response, "caller", stats[i]->caller);
+		if (stats[i]->query)
+			json_add_string(response, "query", stats[i]->query);
+		json_add_u64(response, "calls", stats[i]->calls);
+		json_add_u64(response, "usec", time_to_usec(stats[i]->total));
+		json_add_u64(response, "max_usec",
+			     time_to_usec(stats[i]->max));
+		json_add_u64(response, "rows", stats[i]->rows);
+		json_add_u64(response, "bytes", stats[i]->bytes);
+		json_add_u64(response, "pages_written", stats[i]->pages);
+		json_object_end(response);
+	}
+	json_array_end(response);
+	json_object_end(response);
+	command_success(cmd, response);
+}
+
+static const struct json_command dev_dbstats_command = {
+	"dev-dbstats",
+	json_dev_dbstats,
+	"Show how long the database has taken, from each call site",
+	"Returns {commits} and {checkpoints} with their times, and {sites}, slowest first"
+};
+AUTODATA(json_command, &dev_dbstats_command);
@@ -919,6 +919,31 @@ int main(void)
 	assert(update_fail_htlc_eq(&ufh, ufh2));
 	test_corruption(&ufh, ufh2, update_fail_htlc);
 
+	/* View points into msg itself, rather than copying. */
+	{
+		struct channel_id channel_id;
+		u64 id;
+		u16 reasonlen;
+		const u8 *reason;
+
+		len = tal_count(msg);
+		assert(fromwire_update_fail_htlc_view(msg, &len, &channel_id,
+						      &id, &reasonlen,
+						      &reason));
+		assert(len == 0);
+		assert(structeq(&channel_id, &ufh.channel_id));
+		assert(id == ufh.id);
+		assert(reasonlen == tal_count(ufh.reason));
+		assert(reason == msg + tal_count(msg) - reasonlen);
+		assert(memcmp(reason, ufh.reason, reasonlen) == 0);
+
+		/* Truncated message must fail. */
+		len = tal_count(msg) - 1;
+		assert(!fromwire_update_fail_htlc_view(msg, &len, &channel_id,
+						       &id, &reasonlen,
+						       &reason));
+	}
+
 	memset(&cs, 2, sizeof(cs));
 	cs.htlc_signature = tal_arr(ctx, secp256k1_ecdsa_signature, 2);
 	memset(cs.htlc_signature, 2, sizeof(secp256k1_ecdsa_signature)*2);
@@ -930,6 +955,30 @@ int main(void)
 	assert(commitment_signed_eq(&cs, cs2));
 	test_corruption(&cs, cs2, commitment_signed);
 
+	/* Struct arrays are viewed as raw wire bytes. */
+	{
+		struct channel_id channel_id;
+		secp256k1_ecdsa_signature sig;
+		u16 num_htlcs;
+		const u8 *htlc_sigs;
+		size_t sigslen;
+
+		len = tal_count(msg);
+		assert(fromwire_commitment_signed_view(msg, &len, &channel_id,
+						       &sig, &num_htlcs,
+						       &htlc_sigs));
+		assert(len == 0);
+		assert(num_htlcs == tal_count(cs.htlc_signature));
+		sigslen = num_htlcs * 64;
+		for (i = 0; i < num_htlcs; i++) {
+			fromwire_secp256k1_ecdsa_signature(&htlc_sigs,
+							   &sigslen, &sig);
+			assert(memcmp(&sig, &cs.htlc_signature[i],
+				      sizeof(sig)) == 0);
+		}
+		assert(sigslen == 0);
+	}
+
 	memset(&fs, 2, sizeof(fs));
 	
 	msg = towire_struct_funding_signed(ctx, &fs);